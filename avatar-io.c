@@ -8,49 +8,189 @@
 #include "exec/address-spaces.h"
 #include "exec/cputlb.h"
 
-QemuAvatarMessageQueue ioRequestMQ;
-QemuAvatarMessageQueue ioResponseMQ;
-QemuAvatarMessageQueue IrqMQ;
+QEMU_BUILD_BUG_ON(sizeof(AvatarIORequestMessage) != 32);
+QEMU_BUILD_BUG_ON(sizeof(AvatarIOSegment) != 16);
+QEMU_BUILD_BUG_ON(sizeof(AvatarIOResponseMessage) != 24);
+
+AvatarChannel ioRequestMQ;
+AvatarChannel ioResponseMQ;
+AvatarChannel IrqMQ;
+AvatarChannel IrqInjectMQ;
+
+/* Requests and bulk responses are too large for the stack */
+static uint8_t io_request_buf[AVATAR_IO_MAX_MSG_SIZE] QEMU_ALIGNED(8);
+static uint8_t io_response_buf[sizeof(AvatarIOResponseMessage) +
+                               AVATAR_IO_BULK_MAX_DATA] QEMU_ALIGNED(8);
+
+static unsigned avatar_access_size(AvatarIORequestMessage *req)
+{
+    switch (req->size) {
+    case 0:
+        return 4;
+    case 1:
+    case 2:
+    case 4:
+    case 8:
+        return req->size;
+    default:
+        return 0;
+    }
+}
+
+static void avatar_send_response(AvatarIORequestMessage *req, bool success,
+                                 uint64_t value)
+{
+    AvatarIOResponseMessage res = {
+        .id = req->id,
+        .value = value,
+        .success = success,
+    };
+
+    avatar_channel_send(&ioResponseMQ, &res, sizeof(res));
+}
 
 static void avatar_serve_read(AvatarIORequestMessage *req)
-{  
-    uint64_t value;
-    MemTxResult memres = address_space_read(&address_space_memory, req->hwaddr,
-                                            MEMTXATTRS_UNSPECIFIED, (uint8_t *) &value, 4);
-    AvatarIOResponseMessage res;
-    res.success= (memres == MEMTX_OK);
-    res.value = value;
-    res.id = req->id;
-
-    qemu_avatar_mq_send(&ioResponseMQ, &res, sizeof(res));
+{
+    uint8_t buf[8];
+    uint64_t value = 0;
+    unsigned size = avatar_access_size(req);
+    MemTxResult memres;
+
+    if (!size) {
+        avatar_send_response(req, false, 0);
+        return;
+    }
+
+    memres = address_space_read(&address_space_memory, req->hwaddr,
+                                MEMTXATTRS_UNSPECIFIED, buf, size);
+    switch (size) {
+    case 1:
+        value = ldub_p(buf);
+        break;
+    case 2:
+        value = lduw_he_p(buf);
+        break;
+    case 4:
+        value = ldl_he_p(buf);
+        break;
+    case 8:
+        value = ldq_he_p(buf);
+        break;
+    }
+
+    avatar_send_response(req, memres == MEMTX_OK, value);
 }
 
 static void avatar_serve_write(AvatarIORequestMessage *req)
 {
-    MemTxResult memres = address_space_write(&address_space_memory, req->hwaddr,
-                                             MEMTXATTRS_UNSPECIFIED, (uint8_t *) &req->value, 4);
-    AvatarIOResponseMessage res;
-    res.success = (memres == MEMTX_OK);
-    res.id = req->id;
-    qemu_avatar_mq_send(&ioResponseMQ, &res, sizeof(res));
+    uint8_t buf[8];
+    unsigned size = avatar_access_size(req);
+    MemTxResult memres;
+
+    switch (size) {
+    case 1:
+        stb_p(buf, req->value);
+        break;
+    case 2:
+        stw_he_p(buf, req->value);
+        break;
+    case 4:
+        stl_he_p(buf, req->value);
+        break;
+    case 8:
+        stq_he_p(buf, req->value);
+        break;
+    default:
+        if (!(req->flags & AVATAR_IO_POSTED)) {
+            avatar_send_response(req, false, 0);
+        }
+        return;
+    }
+
+    memres = address_space_write(&address_space_memory, req->hwaddr,
+                                 MEMTXATTRS_UNSPECIFIED, buf, size);
+    if (!(req->flags & AVATAR_IO_POSTED)) {
+        avatar_send_response(req, memres == MEMTX_OK, 0);
+    }
+}
+
+/*
+ * Serve a scatter-gather request with a single response, so that dumping
+ * or patching a whole buffer costs one round trip instead of one per word.
+ */
+static void avatar_serve_bulk(AvatarIORequestMessage *req, size_t len)
+{
+    AvatarIOSegment *seg = (AvatarIOSegment *)(req + 1);
+    AvatarIOResponseMessage *res = (AvatarIOResponseMessage *)io_response_buf;
+    uint8_t *data = (uint8_t *)(seg + req->nr_segments);
+    uint8_t *out = (uint8_t *)(res + 1);
+    size_t hdr_len = sizeof(*req) + req->nr_segments * sizeof(*seg);
+    size_t total = 0;
+    MemTxResult memres = MEMTX_OK;
+    int i;
+
+    memset(res, 0, sizeof(*res));
+    res->id = req->id;
+
+    if (req->nr_segments > AVATAR_IO_MAX_SEGMENTS || len < hdr_len) {
+        goto reply;
+    }
+    for (i = 0; i < req->nr_segments; i++) {
+        if (seg[i].len > AVATAR_IO_BULK_MAX_DATA - total) {
+            goto reply;
+        }
+        total += seg[i].len;
+    }
+    if (req->write && len != hdr_len + total) {
+        goto reply;
+    }
+    if (!req->write && sizeof(*res) + total >
+        avatar_channel_max_msg_size(&ioResponseMQ)) {
+        goto reply;
+    }
+
+    total = 0;
+    for (i = 0; i < req->nr_segments; i++) {
+        if (req->write) {
+            memres |= address_space_write(&address_space_memory,
+                                          seg[i].hwaddr,
+                                          MEMTXATTRS_UNSPECIFIED,
+                                          data + total, seg[i].len);
+        } else {
+            memres |= address_space_read(&address_space_memory,
+                                         seg[i].hwaddr,
+                                         MEMTXATTRS_UNSPECIFIED,
+                                         out + total, seg[i].len);
+        }
+        total += seg[i].len;
+    }
+
+    res->success = (memres == MEMTX_OK);
+    res->len = req->write ? 0 : total;
+
+reply:
+    avatar_channel_send(&ioResponseMQ, res, sizeof(*res) + res->len);
 }
 
 void avatar_serve_io(void *opaque)
 {
-    AvatarIORequestMessage req;
+    AvatarIORequestMessage *req = (AvatarIORequestMessage *)io_request_buf;
     int ret;
 
-    if(!qemu_avatar_mq_is_valid(&ioRequestMQ)) return;
+    if(!avatar_channel_is_valid(&ioRequestMQ)) return;
 
-    ret = qemu_avatar_mq_receive(&ioRequestMQ, &req, sizeof(req));
+    ret = avatar_channel_receive(&ioRequestMQ, io_request_buf,
+                                 sizeof(io_request_buf));
 
-    if(ret != sizeof(req))
+    if(ret < (int)sizeof(*req) ||
+       (!(req->flags & AVATAR_IO_BULK) && ret != sizeof(*req)))
     {
         fprintf(stderr, "Received message of the wrong size. Skipping\n");
         return;
     }
 
-    if(req.write) avatar_serve_write(&req);
-    else          avatar_serve_read(&req);
+    if(req->flags & AVATAR_IO_BULK) avatar_serve_bulk(req, ret);
+    else if(req->write)            avatar_serve_write(req);
+    else                           avatar_serve_read(req);
 
 }
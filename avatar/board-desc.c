@@ -0,0 +1,337 @@
+/*
+ * Compiled board descriptions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qapi/qmp/types.h"
+#include "avatar/board-desc.h"
+
+QEMU_BUILD_BUG_ON(sizeof(AvatarBoardDescHeader) != 32);
+
+/* Deeper trees are certainly not board descriptions */
+#define AVATAR_BOARD_DESC_MAX_DEPTH 64
+
+typedef struct AvatarBoardDescReader {
+    const uint8_t *p;
+    const uint8_t *end;
+} AvatarBoardDescReader;
+
+static bool board_desc_source_stat(const char *source, struct stat *st,
+                                   Error **errp)
+{
+    if (stat(source, st) < 0) {
+        error_setg_errno(errp, errno, "cannot stat '%s'", source);
+        return false;
+    }
+    return true;
+}
+
+static int64_t board_desc_mtime(const struct stat *st)
+{
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static bool board_desc_need(AvatarBoardDescReader *r, size_t len)
+{
+    return r->end - r->p >= len;
+}
+
+static const char *board_desc_read_string(AvatarBoardDescReader *r)
+{
+    const char *str;
+    uint32_t len;
+
+    if (!board_desc_need(r, 4)) {
+        return NULL;
+    }
+    len = ldl_le_p(r->p);
+    r->p += 4;
+    if (!board_desc_need(r, (size_t)len + 1) || r->p[len] != '\0') {
+        return NULL;
+    }
+    str = (const char *)r->p;
+    r->p += len + 1;
+    return str;
+}
+
+static QObject *board_desc_read(AvatarBoardDescReader *r, int depth)
+{
+    QObject *obj = NULL;
+    const char *str;
+    uint32_t count, i;
+    uint8_t tag;
+
+    if (depth > AVATAR_BOARD_DESC_MAX_DEPTH || !board_desc_need(r, 1)) {
+        return NULL;
+    }
+    tag = *r->p++;
+
+    switch (tag) {
+    case AVATAR_BOARD_DESC_NULL:
+        return qnull();
+    case AVATAR_BOARD_DESC_BOOL:
+        if (!board_desc_need(r, 1)) {
+            return NULL;
+        }
+        return QOBJECT(qbool_from_bool(*r->p++));
+    case AVATAR_BOARD_DESC_INT:
+        if (!board_desc_need(r, 8)) {
+            return NULL;
+        }
+        obj = QOBJECT(qint_from_int(ldq_le_p(r->p)));
+        r->p += 8;
+        return obj;
+    case AVATAR_BOARD_DESC_FLOAT: {
+        CPU_DoubleU u;
+
+        if (!board_desc_need(r, 8)) {
+            return NULL;
+        }
+        u.ll = ldq_le_p(r->p);
+        r->p += 8;
+        return QOBJECT(qfloat_from_double(u.d));
+    }
+    case AVATAR_BOARD_DESC_STRING:
+        str = board_desc_read_string(r);
+        return str ? QOBJECT(qstring_from_str(str)) : NULL;
+    case AVATAR_BOARD_DESC_LIST: {
+        QList *list = qlist_new();
+
+        if (!board_desc_need(r, 4)) {
+            QDECREF(list);
+            return NULL;
+        }
+        count = ldl_le_p(r->p);
+        r->p += 4;
+        for (i = 0; i < count; i++) {
+            QObject *elem = board_desc_read(r, depth + 1);
+
+            if (!elem) {
+                QDECREF(list);
+                return NULL;
+            }
+            qlist_append_obj(list, elem);
+        }
+        return QOBJECT(list);
+    }
+    case AVATAR_BOARD_DESC_DICT: {
+        QDict *dict = qdict_new();
+
+        if (!board_desc_need(r, 4)) {
+            QDECREF(dict);
+            return NULL;
+        }
+        count = ldl_le_p(r->p);
+        r->p += 4;
+        for (i = 0; i < count; i++) {
+            const char *key = board_desc_read_string(r);
+            QObject *value = key ? board_desc_read(r, depth + 1) : NULL;
+
+            if (!value) {
+                QDECREF(dict);
+                return NULL;
+            }
+            qdict_put_obj(dict, key, value);
+        }
+        return QOBJECT(dict);
+    }
+    }
+
+    return NULL;
+}
+
+QObject *avatar_board_desc_load(const char *path, const char *source,
+                                Error **errp)
+{
+    AvatarBoardDescHeader *hdr;
+    AvatarBoardDescReader r;
+    QObject *obj = NULL;
+    struct stat st, src;
+    void *ptr;
+    int fd;
+
+    if (source && !board_desc_source_stat(source, &src, errp)) {
+        return NULL;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot open '%s'", path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+        error_setg(errp, "'%s' is not a compiled board description", path);
+        close(fd);
+        return NULL;
+    }
+    ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "cannot map '%s'", path);
+        return NULL;
+    }
+
+    hdr = ptr;
+    if (le32_to_cpu(hdr->magic) != AVATAR_BOARD_DESC_MAGIC ||
+        le32_to_cpu(hdr->version) != AVATAR_BOARD_DESC_VERSION ||
+        le64_to_cpu(hdr->size) != st.st_size - sizeof(*hdr)) {
+        error_setg(errp, "'%s' is not a compiled board description", path);
+        goto out;
+    }
+    if (source && (le64_to_cpu(hdr->source_size) != src.st_size ||
+                   le64_to_cpu(hdr->source_mtime) != board_desc_mtime(&src))) {
+        error_setg(errp, "'%s' is out of date", path);
+        goto out;
+    }
+
+    r.p = (const uint8_t *)(hdr + 1);
+    r.end = (const uint8_t *)ptr + st.st_size;
+    obj = board_desc_read(&r, 0);
+    if (!obj || r.p != r.end) {
+        qobject_decref(obj);
+        obj = NULL;
+        error_setg(errp, "compiled board description '%s' is corrupted",
+                   path);
+    }
+
+out:
+    munmap(ptr, st.st_size);
+    return obj;
+}
+
+static void board_desc_put(GByteArray *buf, const void *data, size_t len)
+{
+    g_byte_array_append(buf, data, len);
+}
+
+static void board_desc_put_u32(GByteArray *buf, uint32_t value)
+{
+    uint8_t le[4];
+
+    stl_le_p(le, value);
+    board_desc_put(buf, le, sizeof(le));
+}
+
+static void board_desc_put_u64(GByteArray *buf, uint64_t value)
+{
+    uint8_t le[8];
+
+    stq_le_p(le, value);
+    board_desc_put(buf, le, sizeof(le));
+}
+
+static void board_desc_put_string(GByteArray *buf, const char *str)
+{
+    size_t len = strlen(str);
+
+    board_desc_put_u32(buf, len);
+    board_desc_put(buf, str, len + 1);
+}
+
+static void board_desc_write(GByteArray *buf, QObject *obj)
+{
+    const QDictEntry *ent;
+    QListEntry *entry;
+    CPU_DoubleU u;
+    uint8_t tag;
+    uint32_t count;
+
+    switch (qobject_type(obj)) {
+    case QTYPE_QNULL:
+        tag = AVATAR_BOARD_DESC_NULL;
+        board_desc_put(buf, &tag, 1);
+        break;
+    case QTYPE_QBOOL:
+        tag = AVATAR_BOARD_DESC_BOOL;
+        board_desc_put(buf, &tag, 1);
+        tag = qbool_get_bool(qobject_to_qbool(obj));
+        board_desc_put(buf, &tag, 1);
+        break;
+    case QTYPE_QINT:
+        tag = AVATAR_BOARD_DESC_INT;
+        board_desc_put(buf, &tag, 1);
+        board_desc_put_u64(buf, qint_get_int(qobject_to_qint(obj)));
+        break;
+    case QTYPE_QFLOAT:
+        tag = AVATAR_BOARD_DESC_FLOAT;
+        board_desc_put(buf, &tag, 1);
+        u.d = qfloat_get_double(qobject_to_qfloat(obj));
+        board_desc_put_u64(buf, u.ll);
+        break;
+    case QTYPE_QSTRING:
+        tag = AVATAR_BOARD_DESC_STRING;
+        board_desc_put(buf, &tag, 1);
+        board_desc_put_string(buf, qstring_get_str(qobject_to_qstring(obj)));
+        break;
+    case QTYPE_QLIST:
+        tag = AVATAR_BOARD_DESC_LIST;
+        board_desc_put(buf, &tag, 1);
+        count = 0;
+        QLIST_FOREACH_ENTRY(qobject_to_qlist(obj), entry) {
+            count++;
+        }
+        board_desc_put_u32(buf, count);
+        QLIST_FOREACH_ENTRY(qobject_to_qlist(obj), entry) {
+            board_desc_write(buf, entry->value);
+        }
+        break;
+    case QTYPE_QDICT:
+        tag = AVATAR_BOARD_DESC_DICT;
+        board_desc_put(buf, &tag, 1);
+        board_desc_put_u32(buf, qdict_size(qobject_to_qdict(obj)));
+        for (ent = qdict_first(qobject_to_qdict(obj)); ent;
+             ent = qdict_next(qobject_to_qdict(obj), ent)) {
+            board_desc_put_string(buf, qdict_entry_key(ent));
+            board_desc_write(buf, qdict_entry_value(ent));
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+void avatar_board_desc_save(const char *path, const struct stat *src,
+                            QObject *obj, Error **errp)
+{
+    AvatarBoardDescHeader hdr;
+    GByteArray *buf = g_byte_array_new();
+    GError *gerr = NULL;
+
+    board_desc_put(buf, &hdr, sizeof(hdr));
+    board_desc_write(buf, obj);
+
+    hdr.magic = cpu_to_le32(AVATAR_BOARD_DESC_MAGIC);
+    hdr.version = cpu_to_le32(AVATAR_BOARD_DESC_VERSION);
+    hdr.source_size = cpu_to_le64(src->st_size);
+    hdr.source_mtime = cpu_to_le64(board_desc_mtime(src));
+    hdr.size = cpu_to_le64(buf->len - sizeof(hdr));
+    memcpy(buf->data, &hdr, sizeof(hdr));
+
+    /* Writes a temporary file and renames it over @path */
+    if (!g_file_set_contents(path, (gchar *)buf->data, buf->len, &gerr)) {
+        error_setg(errp, "cannot write '%s': %s", path, gerr->message);
+        g_error_free(gerr);
+    }
+    g_byte_array_free(buf, true);
+}
+
+bool avatar_board_desc_probe(const char *path)
+{
+    uint8_t magic[4];
+    bool ret;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    ret = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+          ldl_le_p(magic) == AVATAR_BOARD_DESC_MAGIC;
+    close(fd);
+    return ret;
+}
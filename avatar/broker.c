@@ -0,0 +1,406 @@
+/*
+ * Avatar broker connection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/cutils.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "avatar/broker.h"
+
+/* Give credits back in batches rather than one frame per message */
+#define AVATAR_BROKER_CREDIT_BATCH  (AVATAR_BROKER_WINDOW / 2)
+
+typedef struct AvatarBrokerMessage {
+    size_t len;
+    QSIMPLEQ_ENTRY(AvatarBrokerMessage) next;
+    uint8_t data[];
+} AvatarBrokerMessage;
+
+struct AvatarBrokerChannel {
+    uint32_t id;
+    char *name;
+    bool write;
+    size_t msg_size;
+
+    /* Write side: messages the broker still accepts */
+    uint32_t credits;
+
+    /* Read side: received messages, and consumed ones not credited yet */
+    QSIMPLEQ_HEAD(, AvatarBrokerMessage) queue;
+    uint32_t consumed;
+    EventNotifier *notifier;
+};
+
+typedef struct AvatarBroker {
+    char *path;
+    int fd;
+    GPtrArray *channels;
+
+    /* Serializes frames on the socket */
+    QemuMutex send_lock;
+    /* Protects the queues and credits; @cond signals any change */
+    QemuMutex lock;
+    QemuCond cond;
+    QemuThread thread;
+} AvatarBroker;
+
+static AvatarBroker *broker;
+
+static void broker_write(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len) {
+        ret = write(broker->fd, p, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            error_report("avatar broker: connection lost: %s",
+                         strerror(errno));
+            exit(1);
+        }
+        p += ret;
+        len -= ret;
+    }
+}
+
+static void broker_send_frame(uint32_t type, uint32_t channel,
+                              const void *payload, size_t len)
+{
+    AvatarBrokerFrame frame = {
+        .type = type,
+        .channel = channel,
+        .len = len,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &frame, .iov_len = sizeof(frame) },
+        { .iov_base = (void *)payload, .iov_len = len },
+    };
+    ssize_t ret;
+
+    qemu_mutex_lock(&broker->send_lock);
+    do {
+        ret = writev(broker->fd, iov, len ? 2 : 1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        ret = 0;
+    }
+    /* Finish short writes piecewise, the lock keeps the frame in one piece */
+    if (ret < sizeof(frame)) {
+        broker_write((uint8_t *)&frame + ret, sizeof(frame) - ret);
+        ret = 0;
+    } else {
+        ret -= sizeof(frame);
+    }
+    if (ret < len) {
+        broker_write((const uint8_t *)payload + ret, len - ret);
+    }
+    qemu_mutex_unlock(&broker->send_lock);
+}
+
+static bool broker_read(void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len) {
+        ret = read(broker->fd, p, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static void *broker_thread(void *opaque)
+{
+    AvatarBrokerFrame frame;
+    AvatarBrokerChannel *c;
+    AvatarBrokerMessage *msg;
+    uint32_t credits;
+
+    while (broker_read(&frame, sizeof(frame))) {
+        qemu_mutex_lock(&broker->lock);
+        c = frame.channel < broker->channels->len ?
+            g_ptr_array_index(broker->channels, frame.channel) : NULL;
+        qemu_mutex_unlock(&broker->lock);
+
+        /* Anything else leaves the stream out of sync */
+        if (!c || frame.len > MAX(c->msg_size, sizeof(credits))) {
+            error_report("avatar broker: bad frame for channel %u",
+                         frame.channel);
+            break;
+        }
+
+        msg = g_malloc(sizeof(*msg) + frame.len);
+        msg->len = frame.len;
+        if (!broker_read(msg->data, frame.len)) {
+            g_free(msg);
+            break;
+        }
+
+        switch (frame.type) {
+        case AVATAR_BROKER_CREDIT:
+            if (!c->write || frame.len != sizeof(credits)) {
+                break;
+            }
+            memcpy(&credits, msg->data, sizeof(credits));
+            qemu_mutex_lock(&broker->lock);
+            c->credits += credits;
+            qemu_cond_broadcast(&broker->cond);
+            qemu_mutex_unlock(&broker->lock);
+            break;
+        case AVATAR_BROKER_DATA:
+            if (c->write) {
+                break;
+            }
+            qemu_mutex_lock(&broker->lock);
+            QSIMPLEQ_INSERT_TAIL(&c->queue, msg, next);
+            msg = NULL;
+            qemu_cond_broadcast(&broker->cond);
+            qemu_mutex_unlock(&broker->lock);
+            if (c->notifier) {
+                event_notifier_set(c->notifier);
+            }
+            break;
+        default:
+            error_report("avatar broker: unexpected frame type %u",
+                         frame.type);
+            break;
+        }
+        g_free(msg);
+    }
+
+    error_report("avatar broker: connection to %s lost", broker->path);
+    exit(1);
+    return NULL;
+}
+
+static bool broker_open_socket(Error **errp)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    AvatarBrokerHello hello = {
+        .version = AVATAR_BROKER_VERSION,
+        .pid = getpid(),
+    };
+
+    if (strlen(broker->path) >= sizeof(addr.sun_path)) {
+        error_setg(errp, "avatar broker path '%s' is too long", broker->path);
+        return false;
+    }
+    pstrcpy(addr.sun_path, sizeof(addr.sun_path), broker->path);
+
+    broker->fd = qemu_socket(AF_UNIX, SOCK_STREAM, 0);
+    if (broker->fd < 0) {
+        error_setg_errno(errp, errno, "cannot create avatar broker socket");
+        return false;
+    }
+    if (connect(broker->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        error_setg_errno(errp, errno, "cannot connect to avatar broker '%s'",
+                         broker->path);
+        close(broker->fd);
+        broker->fd = -1;
+        return false;
+    }
+
+    broker_send_frame(AVATAR_BROKER_HELLO, 0, &hello, sizeof(hello));
+    return true;
+}
+
+static void broker_announce(AvatarBrokerChannel *c)
+{
+    size_t len = sizeof(AvatarBrokerOpen) + strlen(c->name) + 1;
+    AvatarBrokerOpen *open = g_malloc0(len);
+
+    open->direction = c->write ? AVATAR_BROKER_WRITE : AVATAR_BROKER_READ;
+    open->msg_size = c->msg_size;
+    open->credits = c->write ? 0 : AVATAR_BROKER_WINDOW;
+    strcpy(open->name, c->name);
+
+    broker_send_frame(AVATAR_BROKER_OPEN, c->id, open, len);
+    g_free(open);
+}
+
+bool avatar_broker_connect(const char *path, Error **errp)
+{
+    if (broker) {
+        if (path && strcmp(path, broker->path)) {
+            error_setg(errp, "already connected to avatar broker '%s'",
+                       broker->path);
+            return false;
+        }
+        return true;
+    }
+    if (!path) {
+        error_setg(errp, "no avatar broker connection");
+        return false;
+    }
+
+    broker = g_new0(AvatarBroker, 1);
+    broker->path = g_strdup(path);
+    broker->channels = g_ptr_array_new();
+    qemu_mutex_init(&broker->send_lock);
+    qemu_mutex_init(&broker->lock);
+    qemu_cond_init(&broker->cond);
+
+    if (!broker_open_socket(errp)) {
+        g_ptr_array_free(broker->channels, true);
+        g_free(broker->path);
+        g_free(broker);
+        broker = NULL;
+        return false;
+    }
+
+    qemu_thread_create(&broker->thread, "avatar-broker", broker_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+    return true;
+}
+
+AvatarBrokerChannel *avatar_broker_open(const char *name, bool write,
+                                        size_t msg_size, Error **errp)
+{
+    AvatarBrokerChannel *c;
+
+    if (!avatar_broker_connect(NULL, errp)) {
+        return NULL;
+    }
+
+    c = g_new0(AvatarBrokerChannel, 1);
+    c->name = g_strdup(name);
+    c->write = write;
+    c->msg_size = msg_size;
+    QSIMPLEQ_INIT(&c->queue);
+
+    /* Published before the OPEN frame, credits may follow right away */
+    qemu_mutex_lock(&broker->lock);
+    c->id = broker->channels->len;
+    g_ptr_array_add(broker->channels, c);
+    qemu_mutex_unlock(&broker->lock);
+
+    broker_announce(c);
+    return c;
+}
+
+void avatar_broker_send(AvatarBrokerChannel *c, const void *msg, size_t len)
+{
+    assert(c->write && len <= c->msg_size);
+
+    qemu_mutex_lock(&broker->lock);
+    while (!c->credits) {
+        qemu_cond_wait(&broker->cond, &broker->lock);
+    }
+    c->credits--;
+    qemu_mutex_unlock(&broker->lock);
+
+    broker_send_frame(AVATAR_BROKER_DATA, c->id, msg, len);
+}
+
+ssize_t avatar_broker_receive(AvatarBrokerChannel *c, void *buf, size_t len)
+{
+    AvatarBrokerMessage *msg;
+    uint32_t credits = 0;
+    ssize_t ret;
+
+    qemu_mutex_lock(&broker->lock);
+    msg = QSIMPLEQ_FIRST(&c->queue);
+    if (!msg) {
+        qemu_mutex_unlock(&broker->lock);
+        return -EAGAIN;
+    }
+    QSIMPLEQ_REMOVE_HEAD(&c->queue, next);
+    if (++c->consumed == AVATAR_BROKER_CREDIT_BATCH) {
+        credits = c->consumed;
+        c->consumed = 0;
+    }
+    qemu_mutex_unlock(&broker->lock);
+
+    if (msg->len > len || msg->len > c->msg_size) {
+        ret = -EMSGSIZE;
+    } else {
+        memcpy(buf, msg->data, msg->len);
+        ret = msg->len;
+    }
+    g_free(msg);
+
+    if (credits) {
+        broker_send_frame(AVATAR_BROKER_CREDIT, c->id, &credits,
+                          sizeof(credits));
+    }
+    return ret;
+}
+
+bool avatar_broker_is_empty(AvatarBrokerChannel *c)
+{
+    bool empty;
+
+    qemu_mutex_lock(&broker->lock);
+    empty = QSIMPLEQ_EMPTY(&c->queue);
+    qemu_mutex_unlock(&broker->lock);
+    return empty;
+}
+
+void avatar_broker_wait(AvatarBrokerChannel *c)
+{
+    qemu_mutex_lock(&broker->lock);
+    while (QSIMPLEQ_EMPTY(&c->queue)) {
+        qemu_cond_wait(&broker->cond, &broker->lock);
+    }
+    qemu_mutex_unlock(&broker->lock);
+}
+
+void avatar_broker_set_notifier(AvatarBrokerChannel *c, EventNotifier *e)
+{
+    c->notifier = e;
+    if (!avatar_broker_is_empty(c)) {
+        event_notifier_set(e);
+    }
+}
+
+void avatar_broker_after_fork(void)
+{
+    AvatarBrokerMessage *msg;
+    int i;
+
+    if (!broker) {
+        return;
+    }
+
+    /* The reader thread is gone and may have died holding the locks */
+    qemu_mutex_init(&broker->send_lock);
+    qemu_mutex_init(&broker->lock);
+    qemu_cond_init(&broker->cond);
+
+    close(broker->fd);
+    if (!broker_open_socket(&error_fatal)) {
+        return;
+    }
+    for (i = 0; i < broker->channels->len; i++) {
+        AvatarBrokerChannel *c = g_ptr_array_index(broker->channels, i);
+
+        while ((msg = QSIMPLEQ_FIRST(&c->queue))) {
+            QSIMPLEQ_REMOVE_HEAD(&c->queue, next);
+            g_free(msg);
+        }
+        c->credits = 0;
+        c->consumed = 0;
+        broker_announce(c);
+    }
+
+    qemu_thread_create(&broker->thread, "avatar-broker", broker_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+}
@@ -0,0 +1,335 @@
+/*
+ * Avatar message channels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <poll.h>
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "avatar/channel.h"
+
+static QLIST_HEAD(, AvatarChannel) ring_channels =
+    QLIST_HEAD_INITIALIZER(ring_channels);
+
+bool avatar_transport_parse(const char *name, AvatarTransport *type)
+{
+    if (!strcmp(name, "mq")) {
+        *type = AVATAR_TRANSPORT_MQ;
+    } else if (!strcmp(name, "ring")) {
+        *type = AVATAR_TRANSPORT_RING;
+    } else if (!strcmp(name, "broker")) {
+        *type = AVATAR_TRANSPORT_BROKER;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static size_t avatar_channel_ring_size(const AvatarTransportOptions *opts,
+                                       size_t msg_size)
+{
+    size_t size = opts->ring_size ? opts->ring_size : AVATAR_RING_DEFAULT_SIZE;
+
+    /* Leave room for the record header and a wrap-around skip */
+    return MAX(size, 4 * (msg_size + AVATAR_RING_ALIGN));
+}
+
+static void avatar_channel_open_ring(AvatarChannel *ch,
+                                     const AvatarTransportOptions *opts,
+                                     const char *name, size_t msg_size,
+                                     Error **errp)
+{
+    Error *local_err = NULL;
+
+    ch->ring = avatar_ring_create(name,
+                                  avatar_channel_ring_size(opts, msg_size),
+                                  &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    ch->type = AVATAR_TRANSPORT_RING;
+    ch->msg_size = msg_size;
+    ch->valid = true;
+    QLIST_INSERT_HEAD(&ring_channels, ch, next);
+}
+
+static void avatar_channel_open_broker(AvatarChannel *ch,
+                                       const AvatarTransportOptions *opts,
+                                       const char *name, size_t msg_size,
+                                       bool write, Error **errp)
+{
+    if (!avatar_broker_connect(opts->broker_path, errp)) {
+        return;
+    }
+    ch->broker = avatar_broker_open(name, write, msg_size, errp);
+    if (!ch->broker) {
+        return;
+    }
+    ch->type = AVATAR_TRANSPORT_BROKER;
+    ch->msg_size = msg_size;
+    ch->valid = true;
+}
+
+void avatar_channel_open_read(AvatarChannel *ch,
+                              const AvatarTransportOptions *opts,
+                              const char *name, size_t msg_size,
+                              Error **errp)
+{
+    switch (opts->type) {
+    case AVATAR_TRANSPORT_MQ:
+        qemu_avatar_mq_open_read(&ch->mq, name, msg_size);
+        ch->type = AVATAR_TRANSPORT_MQ;
+        ch->msg_size = msg_size;
+        ch->valid = true;
+        break;
+    case AVATAR_TRANSPORT_RING:
+        avatar_channel_open_ring(ch, opts, name, msg_size, errp);
+        break;
+    case AVATAR_TRANSPORT_BROKER:
+        avatar_channel_open_broker(ch, opts, name, msg_size, false, errp);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+void avatar_channel_open_write(AvatarChannel *ch,
+                               const AvatarTransportOptions *opts,
+                               const char *name, size_t msg_size,
+                               Error **errp)
+{
+    switch (opts->type) {
+    case AVATAR_TRANSPORT_MQ:
+        qemu_avatar_mq_open_write(&ch->mq, name, msg_size);
+        ch->type = AVATAR_TRANSPORT_MQ;
+        ch->msg_size = msg_size;
+        ch->valid = true;
+        break;
+    case AVATAR_TRANSPORT_RING:
+        avatar_channel_open_ring(ch, opts, name, msg_size, errp);
+        break;
+    case AVATAR_TRANSPORT_BROKER:
+        avatar_channel_open_broker(ch, opts, name, msg_size, true, errp);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+bool avatar_channel_is_valid(AvatarChannel *ch)
+{
+    return ch->valid;
+}
+
+size_t avatar_channel_max_msg_size(AvatarChannel *ch)
+{
+    return ch->msg_size;
+}
+
+void avatar_channel_send(AvatarChannel *ch, const void *msg, size_t len)
+{
+    assert(ch->valid && len <= ch->msg_size);
+
+    switch (ch->type) {
+    case AVATAR_TRANSPORT_MQ:
+        qemu_avatar_mq_send(&ch->mq, (void *)msg, len);
+        break;
+    case AVATAR_TRANSPORT_RING:
+        avatar_ring_push(ch->ring, msg, len);
+        break;
+    case AVATAR_TRANSPORT_BROKER:
+        avatar_broker_send(ch->broker, msg, len);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+int avatar_channel_receive(AvatarChannel *ch, void *buf, size_t len)
+{
+    assert(ch->valid);
+
+    switch (ch->type) {
+    case AVATAR_TRANSPORT_MQ:
+        return qemu_avatar_mq_receive(&ch->mq, buf, len);
+    case AVATAR_TRANSPORT_RING:
+        return avatar_ring_pop(ch->ring, buf, len);
+    case AVATAR_TRANSPORT_BROKER:
+        return avatar_broker_receive(ch->broker, buf, len);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+int avatar_channel_receive_wait(AvatarChannel *ch, void *buf, size_t len)
+{
+    struct pollfd pfd;
+    int ret;
+
+    for (;;) {
+        ret = avatar_channel_receive(ch, buf, len);
+        if (ret >= 0) {
+            return ret;
+        }
+
+        switch (ch->type) {
+        case AVATAR_TRANSPORT_MQ:
+            pfd.fd = qemu_avatar_mq_get_fd(&ch->mq);
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                return -1;
+            }
+            break;
+        case AVATAR_TRANSPORT_RING:
+            /*
+             * Only the result of the pop tells an empty ring from an
+             * oversized message; the peer may have pushed since then.
+             */
+            if (ret != -EAGAIN) {
+                return ret;
+            }
+            avatar_ring_wait(ch->ring);
+            break;
+        case AVATAR_TRANSPORT_BROKER:
+            if (ret != -EAGAIN) {
+                return ret;
+            }
+            avatar_broker_wait(ch->broker);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+    }
+}
+
+/*
+ * The ring has no file descriptor the main loop could poll, so a helper
+ * thread sleeps on the ring's futex and kicks an EventNotifier when the
+ * peer publishes a message.  Once woken, the main loop drains the ring
+ * completely before letting the thread go back to sleep, so a busy peer
+ * never pays for a wakeup.
+ */
+static void *avatar_channel_ring_thread(void *opaque)
+{
+    AvatarChannel *ch = opaque;
+
+    for (;;) {
+        qemu_event_wait(&ch->drained);
+        qemu_event_reset(&ch->drained);
+        if (atomic_read(&ch->parking)) {
+            break;
+        }
+        avatar_ring_wait(ch->ring);
+        if (atomic_read(&ch->parking)) {
+            break;
+        }
+        event_notifier_set(&ch->notifier);
+    }
+
+    return NULL;
+}
+
+static void avatar_channel_ring_read(void *opaque)
+{
+    AvatarChannel *ch = opaque;
+
+    event_notifier_test_and_clear(&ch->notifier);
+    while (!avatar_ring_is_empty(ch->ring)) {
+        ch->fd_read(ch->opaque);
+    }
+    qemu_event_set(&ch->drained);
+}
+
+/* The broker's reader thread kicks the notifier for us */
+static void avatar_channel_broker_read(void *opaque)
+{
+    AvatarChannel *ch = opaque;
+
+    event_notifier_test_and_clear(&ch->notifier);
+    while (!avatar_broker_is_empty(ch->broker)) {
+        ch->fd_read(ch->opaque);
+    }
+}
+
+void avatar_channel_set_read_handler(AvatarChannel *ch, IOHandler *fd_read,
+                                     void *opaque)
+{
+    assert(ch->valid);
+
+    switch (ch->type) {
+    case AVATAR_TRANSPORT_MQ:
+        qemu_set_fd_handler(qemu_avatar_mq_get_fd(&ch->mq), fd_read, NULL,
+                            opaque);
+        break;
+    case AVATAR_TRANSPORT_RING:
+        ch->fd_read = fd_read;
+        ch->opaque = opaque;
+        event_notifier_init(&ch->notifier, false);
+        qemu_event_init(&ch->drained, true);
+        qemu_set_fd_handler(event_notifier_get_fd(&ch->notifier),
+                            avatar_channel_ring_read, NULL, ch);
+        qemu_thread_create(&ch->thread, "avatar-ring",
+                           avatar_channel_ring_thread, ch,
+                           QEMU_THREAD_JOINABLE);
+        break;
+    case AVATAR_TRANSPORT_BROKER:
+        ch->fd_read = fd_read;
+        ch->opaque = opaque;
+        event_notifier_init(&ch->notifier, false);
+        qemu_set_fd_handler(event_notifier_get_fd(&ch->notifier),
+                            avatar_channel_broker_read, NULL, ch);
+        avatar_broker_set_notifier(ch->broker, &ch->notifier);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/*
+ * The helper threads of all processes sharing a ring sleep on the same
+ * futex word, and the peer only wakes one of them.  A process that forks
+ * must therefore stop its threads first, so that only the process that
+ * owns the ring at any one time waits on it.
+ */
+void avatar_channel_park(void)
+{
+    AvatarChannel *ch;
+
+    QLIST_FOREACH(ch, &ring_channels, next) {
+        if (!ch->fd_read) {
+            continue;
+        }
+        atomic_set(&ch->parking, true);
+        avatar_ring_interrupt(ch->ring);
+        qemu_event_set(&ch->drained);
+        qemu_thread_join(&ch->thread);
+    }
+}
+
+void avatar_channel_resume(void)
+{
+    AvatarChannel *ch;
+
+    QLIST_FOREACH(ch, &ring_channels, next) {
+        avatar_ring_after_fork(ch->ring);
+        if (ch->fd_read) {
+            ch->parking = false;
+            /* Let the new thread check the ring straight away */
+            qemu_event_init(&ch->drained, true);
+            qemu_thread_create(&ch->thread, "avatar-ring",
+                               avatar_channel_ring_thread, ch,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+}
+
+void avatar_channel_after_fork(void)
+{
+    avatar_broker_after_fork();
+    avatar_channel_resume();
+}
@@ -0,0 +1,67 @@
+/*
+ * Coverage map for the inline TCG instrumentation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <sys/shm.h>
+#include "qapi/error.h"
+#include "avatar/coverage.h"
+
+/* Environment variable through which AFL passes its shared memory */
+#define AFL_SHM_ENV_VAR "__AFL_SHM_ID"
+
+AvatarCoverage avatar_coverage;
+
+const char *const AvatarCoverageMode_lookup[] = {
+    [AVATAR_COVERAGE_OFF] = "off",
+    [AVATAR_COVERAGE_EDGE] = "edge",
+    [AVATAR_COVERAGE_BLOCK] = "block",
+    [AVATAR_COVERAGE__MAX] = NULL,
+};
+
+void avatar_coverage_init(AvatarCoverageMode mode, Error **errp)
+{
+    AvatarCoverage *cov = &avatar_coverage;
+    const char *shm_id = getenv(AFL_SHM_ENV_VAR);
+    void *map;
+
+    assert(cov->mode == AVATAR_COVERAGE_OFF);
+
+    if (mode == AVATAR_COVERAGE_OFF) {
+        return;
+    }
+
+    if (shm_id) {
+        map = shmat(atoi(shm_id), NULL, 0);
+        if (map == (void *)-1) {
+            error_setg_errno(errp, errno, "cannot attach the coverage map %s",
+                             shm_id);
+            return;
+        }
+    } else {
+        map = g_malloc0(AVATAR_COVERAGE_MAP_SIZE);
+    }
+
+    cov->map = map;
+    cov->prev_loc = 0;
+    cov->mode = mode;
+}
+
+void avatar_coverage_info(fprintf_function func_fprintf, void *f)
+{
+    AvatarCoverage *cov = &avatar_coverage;
+    unsigned used = 0;
+    int i;
+
+    if (cov->mode == AVATAR_COVERAGE_OFF) {
+        return;
+    }
+
+    for (i = 0; i < AVATAR_COVERAGE_MAP_SIZE; i++) {
+        used += cov->map[i] != 0;
+    }
+    func_fprintf(f, "coverage (%s): %u of %u map entries hit\n",
+                 AvatarCoverageMode_lookup[cov->mode], used, AVATAR_COVERAGE_MAP_SIZE);
+}
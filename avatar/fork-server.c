@@ -0,0 +1,189 @@
+/*
+ * AFL-compatible fork server
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <sys/wait.h>
+#include "qom/cpu.h"
+#include "exec/memory.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
+#include "avatar/channel.h"
+#include "avatar/irq.h"
+#include "avatar/fork-server.h"
+#include "trace.h"
+
+#define CTL_FD  AVATAR_FORK_SERVER_FD
+#define ST_FD   (AVATAR_FORK_SERVER_FD + 1)
+
+typedef struct AvatarForkServer {
+    QEMUBH *bh;
+    MemoryRegion marker;
+
+    /* Breakpoint trigger, removed once hit */
+    CPUState *cpu;
+    vaddr pc;
+    bool pc_armed;
+
+    /* Set by the marker before it stops the VM */
+    bool requested;
+    bool started;
+} AvatarForkServer;
+
+static AvatarForkServer fork_server;
+
+static bool fork_server_read(void)
+{
+    uint32_t buf;
+
+    return read(CTL_FD, &buf, sizeof(buf)) == sizeof(buf);
+}
+
+static bool fork_server_write(uint32_t val)
+{
+    return write(ST_FD, &val, sizeof(val)) == sizeof(val);
+}
+
+/* Runs in the child, which is left with this thread only */
+static void fork_server_child(void)
+{
+    close(CTL_FD);
+    close(ST_FD);
+
+    rcu_after_fork();
+    qemu_tcg_restart_after_fork();
+    avatar_channel_after_fork();
+    avatar_irq_after_fork();
+    vm_start();
+}
+
+/*
+ * Called from the main loop with the VM stopped.  The parent never
+ * returns, it keeps forking children until the fuzzer goes away.
+ */
+static void fork_server_run(void *opaque)
+{
+    int status;
+    pid_t pid;
+
+    /* The hello message; nobody listening means we are not fuzzed */
+    if (!fork_server_write(0)) {
+        trace_avatar_fork_server_disabled();
+        vm_start();
+        return;
+    }
+
+    for (;;) {
+        if (!fork_server_read()) {
+            exit(0);
+        }
+
+        /*
+         * The child must be the only process waiting on the rings or
+         * forwarding interrupts
+         */
+        avatar_channel_park();
+        avatar_irq_park();
+        pid = fork();
+        if (pid < 0) {
+            perror("avatar fork server: fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            fork_server_child();
+            return;
+        }
+
+        trace_avatar_fork_server_child(pid);
+        if (!fork_server_write(pid)) {
+            exit(1);
+        }
+        while (waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR) {
+                exit(1);
+            }
+        }
+        avatar_channel_resume();
+        avatar_irq_resume();
+        if (!fork_server_write(status)) {
+            exit(1);
+        }
+    }
+}
+
+static void fork_server_vm_state_change(void *opaque, int running,
+                                        RunState state)
+{
+    AvatarForkServer *s = opaque;
+
+    if (running || s->started) {
+        return;
+    }
+
+    if (s->pc_armed && state == RUN_STATE_DEBUG) {
+        cpu_breakpoint_remove(s->cpu, s->pc, BP_GDB);
+        s->pc_armed = false;
+        s->requested = true;
+    }
+    if (s->requested) {
+        s->requested = false;
+        s->started = true;
+        trace_avatar_fork_server_start();
+        qemu_bh_schedule(s->bh);
+    }
+}
+
+static uint64_t fork_server_marker_read(void *opaque, hwaddr addr,
+                                        unsigned size)
+{
+    return 0;
+}
+
+static void fork_server_marker_write(void *opaque, hwaddr addr, uint64_t val,
+                                     unsigned size)
+{
+    AvatarForkServer *s = opaque;
+
+    if (s->started) {
+        return;
+    }
+    s->requested = true;
+    vm_stop(RUN_STATE_PAUSED);
+}
+
+static const MemoryRegionOps fork_server_marker_ops = {
+    .read = fork_server_marker_read,
+    .write = fork_server_marker_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+void avatar_fork_server_init(void)
+{
+    AvatarForkServer *s = &fork_server;
+
+    s->bh = qemu_bh_new(fork_server_run, s);
+    qemu_add_vm_change_state_handler(fork_server_vm_state_change, s);
+}
+
+void avatar_fork_server_set_pc(CPUState *cpu, vaddr pc)
+{
+    AvatarForkServer *s = &fork_server;
+
+    s->cpu = cpu;
+    s->pc = pc;
+    s->pc_armed = true;
+    cpu_breakpoint_insert(cpu, pc, BP_GDB, NULL);
+}
+
+void avatar_fork_server_add_marker(MemoryRegion *sysmem, hwaddr addr)
+{
+    AvatarForkServer *s = &fork_server;
+
+    memory_region_init_io(&s->marker, NULL, &fork_server_marker_ops, s,
+                          "avatar-fork-server", 4);
+    memory_region_add_subregion(sysmem, addr, &s->marker);
+}
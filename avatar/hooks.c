@@ -0,0 +1,234 @@
+/*
+ * PC hooks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qapi-event.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "avatar/hooks.h"
+#include "trace.h"
+
+typedef struct AvatarHook {
+    int id;
+    uint64_t pc;
+    AvatarHookFn *fn;
+    void *opaque;
+    uint64_t hits;
+    bool event;                 /* QMP hooks only */
+    bool dead;                  /* removed while avatar_hook_run walked */
+    QTAILQ_ENTRY(AvatarHook) next;
+} AvatarHook;
+
+int avatar_hook_count;
+
+static QTAILQ_HEAD(, AvatarHook) avatar_hooks =
+    QTAILQ_HEAD_INITIALIZER(avatar_hooks);
+static int avatar_hook_next_id;
+/* Nonzero while callbacks run; removed hooks are then only marked dead */
+static int avatar_hook_running;
+
+/* pc -> number of hooks at pc */
+static GHashTable *avatar_hook_sites;
+
+static guint avatar_hook_pc_hash(gconstpointer v)
+{
+    uint64_t pc = *(const uint64_t *)v;
+
+    return pc ^ (pc >> 32);
+}
+
+static gboolean avatar_hook_pc_equal(gconstpointer a, gconstpointer b)
+{
+    return *(const uint64_t *)a == *(const uint64_t *)b;
+}
+
+/* Same as the invalidation done for breakpoints */
+static void avatar_hook_invalidate(uint64_t pc)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        MemTxAttrs attrs;
+        hwaddr phys = cpu_get_phys_page_attrs_debug(cpu, pc, &attrs);
+        int asidx = cpu_asidx_from_attrs(cpu, attrs);
+
+        if (phys != -1) {
+            tb_invalidate_phys_addr(cpu_get_address_space(cpu, asidx),
+                                    phys | (pc & ~TARGET_PAGE_MASK));
+        }
+    }
+}
+
+static AvatarHook *avatar_hook_insert(uint64_t pc, AvatarHookFn *fn,
+                                      void *opaque)
+{
+    AvatarHook *hook = g_new0(AvatarHook, 1);
+    uint64_t *key;
+    guint n;
+
+    if (!avatar_hook_sites) {
+        avatar_hook_sites = g_hash_table_new_full(avatar_hook_pc_hash,
+                                                  avatar_hook_pc_equal,
+                                                  g_free, NULL);
+    }
+
+    hook->id = avatar_hook_next_id++;
+    hook->pc = pc;
+    hook->fn = fn;
+    hook->opaque = opaque;
+    QTAILQ_INSERT_TAIL(&avatar_hooks, hook, next);
+
+    n = GPOINTER_TO_UINT(g_hash_table_lookup(avatar_hook_sites, &pc));
+    key = g_new(uint64_t, 1);
+    *key = pc;
+    g_hash_table_insert(avatar_hook_sites, key, GUINT_TO_POINTER(n + 1));
+    avatar_hook_count++;
+
+    /* Only the first hook at @pc changes the translation */
+    if (!n) {
+        avatar_hook_invalidate(pc);
+    }
+    return hook;
+}
+
+int avatar_hook_add(uint64_t pc, AvatarHookFn *fn, void *opaque)
+{
+    return avatar_hook_insert(pc, fn, opaque)->id;
+}
+
+static AvatarHook *avatar_hook_find(int id)
+{
+    AvatarHook *hook;
+
+    QTAILQ_FOREACH(hook, &avatar_hooks, next) {
+        if (hook->id == id && !hook->dead) {
+            return hook;
+        }
+    }
+    return NULL;
+}
+
+void avatar_hook_remove(int id)
+{
+    AvatarHook *hook = avatar_hook_find(id);
+    uint64_t pc;
+    guint n;
+
+    if (!hook) {
+        return;
+    }
+
+    pc = hook->pc;
+    if (avatar_hook_running) {
+        hook->dead = true;
+    } else {
+        QTAILQ_REMOVE(&avatar_hooks, hook, next);
+        g_free(hook);
+    }
+    avatar_hook_count--;
+
+    n = GPOINTER_TO_UINT(g_hash_table_lookup(avatar_hook_sites, &pc));
+    if (n > 1) {
+        uint64_t *key = g_new(uint64_t, 1);
+
+        *key = pc;
+        g_hash_table_insert(avatar_hook_sites, key, GUINT_TO_POINTER(n - 1));
+    } else {
+        g_hash_table_remove(avatar_hook_sites, &pc);
+        avatar_hook_invalidate(pc);
+    }
+}
+
+bool avatar_hook_at(uint64_t pc)
+{
+    return avatar_hook_count &&
+           g_hash_table_lookup(avatar_hook_sites, &pc);
+}
+
+void avatar_hook_run(CPUState *cpu, uint64_t pc)
+{
+    AvatarHook *hook, *next;
+
+    /* Callbacks may remove any hook, so nothing is freed during the walk */
+    avatar_hook_running++;
+    QTAILQ_FOREACH(hook, &avatar_hooks, next) {
+        if (hook->pc == pc && !hook->dead) {
+            trace_avatar_hook_run(hook->id, pc);
+            hook->hits++;
+            hook->fn(cpu, pc, hook->opaque);
+        }
+    }
+    if (--avatar_hook_running) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(hook, &avatar_hooks, next, next) {
+        if (hook->dead) {
+            QTAILQ_REMOVE(&avatar_hooks, hook, next);
+            g_free(hook);
+        }
+    }
+}
+
+static void avatar_hook_qmp_fn(CPUState *cpu, uint64_t pc, void *opaque)
+{
+    AvatarHook *hook = opaque;
+
+    if (hook->event) {
+        qapi_event_send_avatar_hook(hook->id, pc, &error_abort);
+    }
+}
+
+static AvatarHookInfo *avatar_hook_info(AvatarHook *hook)
+{
+    AvatarHookInfo *info = g_new0(AvatarHookInfo, 1);
+
+    info->id = hook->id;
+    info->pc = hook->pc;
+    info->hits = hook->hits;
+    return info;
+}
+
+AvatarHookInfo *qmp_avatar_hook_add(uint64_t pc, bool has_event, bool event,
+                                    Error **errp)
+{
+    AvatarHook *hook = avatar_hook_insert(pc, avatar_hook_qmp_fn, NULL);
+
+    hook->opaque = hook;
+    hook->event = has_event && event;
+    return avatar_hook_info(hook);
+}
+
+void qmp_avatar_hook_remove(int64_t id, Error **errp)
+{
+    if (!avatar_hook_find(id)) {
+        error_setg(errp, "no avatar hook with id %" PRId64, id);
+        return;
+    }
+    avatar_hook_remove(id);
+}
+
+AvatarHookInfoList *qmp_query_avatar_hooks(Error **errp)
+{
+    AvatarHookInfoList *head = NULL, **tail = &head;
+    AvatarHook *hook;
+
+    QTAILQ_FOREACH(hook, &avatar_hooks, next) {
+        AvatarHookInfoList *entry;
+
+        if (hook->dead) {
+            continue;
+        }
+        entry = g_new0(AvatarHookInfoList, 1);
+
+        entry->value = avatar_hook_info(hook);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
@@ -0,0 +1,195 @@
+/*
+ * Record and replay of forwarded MMIO transactions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/notify.h"
+#include "sysemu/sysemu.h"
+#include "avatar/io-log.h"
+
+QEMU_BUILD_BUG_ON(sizeof(AvatarIOLogRecord) != 32);
+
+typedef struct AvatarIOLogKey {
+    uint64_t addr;
+    uint64_t pc;
+} AvatarIOLogKey;
+
+/* The recorded values of one key, handed out in order */
+typedef struct AvatarIOLogEntry {
+    GArray *values;
+    guint next;
+} AvatarIOLogEntry;
+
+struct AvatarIOLog {
+    bool replay;
+    bool use_pc;
+
+    /* Recording */
+    FILE *f;
+    Notifier exit_notifier;
+
+    /* Replay: AvatarIOLogKey -> AvatarIOLogEntry */
+    GHashTable *index;
+};
+
+static guint avatar_io_log_key_hash(gconstpointer v)
+{
+    const AvatarIOLogKey *key = v;
+    uint64_t h = key->addr * 0x9e3779b97f4a7c15ULL ^ key->pc;
+
+    return h ^ (h >> 32);
+}
+
+static gboolean avatar_io_log_key_equal(gconstpointer v1, gconstpointer v2)
+{
+    const AvatarIOLogKey *k1 = v1, *k2 = v2;
+
+    return k1->addr == k2->addr && k1->pc == k2->pc;
+}
+
+static void avatar_io_log_entry_free(gpointer data)
+{
+    AvatarIOLogEntry *entry = data;
+
+    g_array_free(entry->values, true);
+    g_free(entry);
+}
+
+static void avatar_io_log_exit(Notifier *n, void *data)
+{
+    AvatarIOLog *log = container_of(n, AvatarIOLog, exit_notifier);
+
+    fclose(log->f);
+    log->f = NULL;
+}
+
+AvatarIOLog *avatar_io_log_open_record(const char *path, Error **errp)
+{
+    AvatarIOLogHeader hdr = {
+        .magic = AVATAR_IO_LOG_MAGIC,
+        .version = AVATAR_IO_LOG_VERSION,
+        .record_size = sizeof(AvatarIOLogRecord),
+    };
+    AvatarIOLog *log;
+    FILE *f;
+
+    f = fopen(path, "wb");
+    if (!f) {
+        error_setg_errno(errp, errno, "cannot create IO log '%s'", path);
+        return NULL;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+        error_setg_errno(errp, errno, "cannot write IO log '%s'", path);
+        fclose(f);
+        return NULL;
+    }
+
+    log = g_new0(AvatarIOLog, 1);
+    log->f = f;
+    /* Records are buffered, make sure they reach the file */
+    log->exit_notifier.notify = avatar_io_log_exit;
+    qemu_add_exit_notifier(&log->exit_notifier);
+    return log;
+}
+
+AvatarIOLog *avatar_io_log_open_replay(const char *path, bool use_pc,
+                                       Error **errp)
+{
+    AvatarIOLogHeader hdr;
+    AvatarIOLogRecord rec;
+    AvatarIOLog *log;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        error_setg_errno(errp, errno, "cannot open IO log '%s'", path);
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        hdr.magic != AVATAR_IO_LOG_MAGIC ||
+        hdr.version != AVATAR_IO_LOG_VERSION ||
+        hdr.record_size != sizeof(AvatarIOLogRecord)) {
+        error_setg(errp, "'%s' is not a valid IO log", path);
+        fclose(f);
+        return NULL;
+    }
+
+    log = g_new0(AvatarIOLog, 1);
+    log->replay = true;
+    log->use_pc = use_pc;
+    log->index = g_hash_table_new_full(avatar_io_log_key_hash,
+                                       avatar_io_log_key_equal,
+                                       g_free, avatar_io_log_entry_free);
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        AvatarIOLogKey key = { .addr = rec.addr };
+        AvatarIOLogEntry *entry;
+
+        if (rec.flags & AVATAR_IO_LOG_WRITE) {
+            continue;
+        }
+        if (use_pc && (rec.flags & AVATAR_IO_LOG_PC)) {
+            key.pc = rec.pc;
+        }
+
+        entry = g_hash_table_lookup(log->index, &key);
+        if (!entry) {
+            entry = g_new0(AvatarIOLogEntry, 1);
+            entry->values = g_array_new(false, false, sizeof(uint64_t));
+            g_hash_table_insert(log->index, g_memdup(&key, sizeof(key)),
+                                entry);
+        }
+        g_array_append_val(entry->values, rec.value);
+    }
+
+    fclose(f);
+    return log;
+}
+
+void avatar_io_log_record(AvatarIOLog *log, uint64_t addr, unsigned size,
+                          uint64_t value, bool is_write, bool has_pc,
+                          uint64_t pc)
+{
+    AvatarIOLogRecord rec = {
+        .addr = addr,
+        .value = value,
+        .pc = has_pc ? pc : 0,
+        .size = size,
+        .flags = (is_write ? AVATAR_IO_LOG_WRITE : 0) |
+                 (has_pc ? AVATAR_IO_LOG_PC : 0),
+    };
+
+    assert(!log->replay);
+    if (log->f) {
+        fwrite(&rec, sizeof(rec), 1, log->f);
+    }
+}
+
+bool avatar_io_log_replay_read(AvatarIOLog *log, uint64_t addr,
+                               unsigned size, bool has_pc, uint64_t pc,
+                               uint64_t *value)
+{
+    AvatarIOLogKey key = { .addr = addr };
+    AvatarIOLogEntry *entry;
+    guint i;
+
+    assert(log->replay);
+
+    if (log->use_pc && has_pc) {
+        key.pc = pc;
+    }
+    entry = g_hash_table_lookup(log->index, &key);
+    if (!entry) {
+        return false;
+    }
+
+    i = MIN(entry->next, entry->values->len - 1);
+    if (entry->next < entry->values->len) {
+        entry->next++;
+    }
+    *value = g_array_index(entry->values, uint64_t, i);
+    return true;
+}
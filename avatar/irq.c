@@ -0,0 +1,285 @@
+/*
+ * Avatar IRQ forwarding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/bitmap.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "avatar/irq.h"
+#include "trace.h"
+
+#define AVATAR_IRQ_QUEUE_SIZE 1024
+#define AVATAR_IRQ_INJECT_BATCH 64
+
+typedef struct AvatarIrqForwarder {
+    bool enabled;
+    AvatarChannel *ch;
+
+    /* Only touched with the iothread lock held */
+    DECLARE_BITMAP(subscribed, AVATAR_IRQ_MAX_LINES);
+    DECLARE_BITMAP(levels, AVATAR_IRQ_MAX_LINES);
+    DECLARE_BITMAP(sourced, AVATAR_IRQ_MAX_LINES);
+    /* Lines driven by several sources, whose events are never merged */
+    DECLARE_BITMAP(shared, AVATAR_IRQ_MAX_LINES);
+
+    /* Lines whose event did not fit in the queue, set atomically */
+    DECLARE_BITMAP(overflow, AVATAR_IRQ_MAX_LINES);
+
+    /* Single producer (iothread lock holder), single consumer (thread) */
+    IRQ_MSG queue[AVATAR_IRQ_QUEUE_SIZE];
+    unsigned head;
+    unsigned tail;
+
+    QemuEvent event;
+    QemuThread thread;
+    /* Makes the thread exit once the queue is drained */
+    bool parking;
+
+    uint64_t forwarded;
+    uint64_t overflows;
+} AvatarIrqForwarder;
+
+typedef struct AvatarIrqInjector {
+    AvatarChannel *ch;
+    AvatarIrqInjectFunc *deliver;
+    void *opaque;
+
+    uint64_t injected;
+    uint64_t batches;
+    uint64_t timed;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+} AvatarIrqInjector;
+
+static AvatarIrqForwarder forwarder;
+static AvatarIrqInjector injector;
+
+static void avatar_irq_resync(AvatarIrqForwarder *f)
+{
+    int i;
+
+    for (i = 0; i < BITS_TO_LONGS(AVATAR_IRQ_MAX_LINES); i++) {
+        unsigned long word = atomic_xchg(&f->overflow[i], 0);
+
+        while (word) {
+            int bit = ctzl(word);
+            IRQ_MSG msg;
+
+            word &= word - 1;
+            msg.irq_num = i * BITS_PER_LONG + bit;
+            msg.level = test_bit(msg.irq_num, f->levels);
+            avatar_channel_send(f->ch, &msg, sizeof(msg));
+        }
+    }
+}
+
+static void *avatar_irq_thread(void *opaque)
+{
+    AvatarIrqForwarder *f = opaque;
+
+    for (;;) {
+        unsigned tail = f->tail;
+
+        qemu_event_reset(&f->event);
+        while (tail != atomic_load_acquire(&f->head)) {
+            avatar_channel_send(f->ch, &f->queue[tail % AVATAR_IRQ_QUEUE_SIZE],
+                                sizeof(IRQ_MSG));
+            tail++;
+            atomic_store_release(&f->tail, tail);
+        }
+        avatar_irq_resync(f);
+        if (atomic_read(&f->parking)) {
+            break;
+        }
+        qemu_event_wait(&f->event);
+    }
+
+    return NULL;
+}
+
+void avatar_irq_forward_init(AvatarChannel *ch)
+{
+    AvatarIrqForwarder *f = &forwarder;
+
+    assert(!f->enabled);
+
+    f->ch = ch;
+    bitmap_fill(f->subscribed, AVATAR_IRQ_MAX_LINES);
+    qemu_event_init(&f->event, false);
+    qemu_thread_create(&f->thread, "avatar-irq", avatar_irq_thread, f,
+                       QEMU_THREAD_JOINABLE);
+    f->enabled = true;
+}
+
+void avatar_irq_park(void)
+{
+    AvatarIrqForwarder *f = &forwarder;
+
+    if (!f->enabled) {
+        return;
+    }
+    atomic_set(&f->parking, true);
+    qemu_event_set(&f->event);
+    qemu_thread_join(&f->thread);
+}
+
+void avatar_irq_resume(void)
+{
+    AvatarIrqForwarder *f = &forwarder;
+
+    if (!f->enabled) {
+        return;
+    }
+    f->parking = false;
+    /* Start out awake, in case events were queued while parked */
+    qemu_event_init(&f->event, true);
+    qemu_thread_create(&f->thread, "avatar-irq", avatar_irq_thread, f,
+                       QEMU_THREAD_JOINABLE);
+}
+
+void avatar_irq_after_fork(void)
+{
+    avatar_irq_resume();
+}
+
+void avatar_irq_subscribe(unsigned line, bool enable)
+{
+    if (line >= AVATAR_IRQ_MAX_LINES) {
+        return;
+    }
+    if (enable) {
+        set_bit(line, forwarder.subscribed);
+    } else {
+        clear_bit(line, forwarder.subscribed);
+    }
+}
+
+void avatar_irq_add_source(unsigned line)
+{
+    if (line >= AVATAR_IRQ_MAX_LINES) {
+        return;
+    }
+    if (test_and_set_bit(line, forwarder.sourced)) {
+        set_bit(line, forwarder.shared);
+    }
+}
+
+void avatar_irq_subscribe_all(bool enable)
+{
+    if (enable) {
+        bitmap_fill(forwarder.subscribed, AVATAR_IRQ_MAX_LINES);
+    } else {
+        bitmap_zero(forwarder.subscribed, AVATAR_IRQ_MAX_LINES);
+    }
+}
+
+void avatar_irq_forward(unsigned line, int level)
+{
+    AvatarIrqForwarder *f = &forwarder;
+    unsigned head;
+
+    if (!f->enabled || line >= AVATAR_IRQ_MAX_LINES ||
+        !test_bit(line, f->subscribed)) {
+        return;
+    }
+
+    level = !!level;
+    if (test_bit(line, f->levels) == level && !test_bit(line, f->shared)) {
+        return;
+    }
+    if (level) {
+        set_bit(line, f->levels);
+    } else {
+        clear_bit(line, f->levels);
+    }
+
+    head = f->head;
+    if (head - atomic_load_acquire(&f->tail) == AVATAR_IRQ_QUEUE_SIZE) {
+        /* The thread will send the line's latest level when it catches up */
+        set_bit_atomic(line, f->overflow);
+        f->overflows++;
+    } else {
+        f->queue[head % AVATAR_IRQ_QUEUE_SIZE] = (IRQ_MSG) {
+            .irq_num = line,
+            .level = level,
+        };
+        atomic_store_release(&f->head, head + 1);
+    }
+    f->forwarded++;
+    qemu_event_set(&f->event);
+}
+
+static void avatar_irq_inject_read(void *opaque)
+{
+    AvatarIrqInjector *inj = opaque;
+    AvatarIrqInjectMessage msg;
+    int64_t now = 0;
+    int n;
+
+    /* Drain whatever is queued so that bursts are handled in one wakeup */
+    for (n = 0; n < AVATAR_IRQ_INJECT_BATCH; n++) {
+        if (avatar_channel_receive(inj->ch, &msg, sizeof(msg)) !=
+            sizeof(msg)) {
+            break;
+        }
+
+        if (msg.timestamp) {
+            uint64_t latency;
+
+            if (!now) {
+                now = get_clock();
+            }
+            latency = now > msg.timestamp ? now - msg.timestamp : 0;
+            inj->timed++;
+            inj->latency_total_ns += latency;
+            inj->latency_max_ns = MAX(inj->latency_max_ns, latency);
+        }
+
+        inj->deliver(inj->opaque, &msg);
+        inj->injected++;
+    }
+
+    if (n) {
+        inj->batches++;
+        trace_avatar_irq_inject_batch(n);
+    }
+}
+
+void avatar_irq_inject_init(AvatarChannel *ch, AvatarIrqInjectFunc *deliver,
+                            void *opaque)
+{
+    AvatarIrqInjector *inj = &injector;
+
+    assert(!inj->ch);
+
+    inj->ch = ch;
+    inj->deliver = deliver;
+    inj->opaque = opaque;
+    avatar_channel_set_read_handler(ch, avatar_irq_inject_read, inj);
+}
+
+void avatar_irq_info(fprintf_function func_fprintf, void *f)
+{
+    AvatarIrqForwarder *fwd = &forwarder;
+    AvatarIrqInjector *inj = &injector;
+
+    if (fwd->enabled) {
+        func_fprintf(f, "irq forwarding: %" PRIu64 " events, "
+                     "%" PRIu64 " queue overflows\n",
+                     fwd->forwarded, fwd->overflows);
+    }
+    if (inj->ch) {
+        func_fprintf(f, "irq injection: %" PRIu64 " interrupts in "
+                     "%" PRIu64 " batches\n", inj->injected, inj->batches);
+        if (inj->timed) {
+            func_fprintf(f, "irq injection latency: avg %" PRIu64 " ns, "
+                         "max %" PRIu64 " ns\n",
+                         inj->latency_total_ns / inj->timed,
+                         inj->latency_max_ns);
+        }
+    }
+}
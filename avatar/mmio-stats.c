@@ -0,0 +1,164 @@
+/*
+ * Per-region MMIO statistics
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qemu/host-utils.h"
+#include "avatar/mmio-trace.h"
+#include "avatar/mmio-stats.h"
+
+static QLIST_HEAD(, AvatarMmioStats) mmio_stats =
+    QLIST_HEAD_INITIALIZER(mmio_stats);
+
+void avatar_mmio_stats_set(MemoryRegion *mr, bool enable)
+{
+    AvatarMmioStats *stats = mr->avatar_stats;
+    unsigned size_bits;
+
+    if (stats) {
+        mr->avatar_stats = NULL;
+        QLIST_REMOVE(stats, next);
+        g_free(stats);
+    }
+    if (!enable) {
+        return;
+    }
+
+    stats = g_new0(AvatarMmioStats, 1);
+    stats->mr = mr;
+    /* Spread the region over the buckets, one register each at best */
+    size_bits = 64 - clz64(pow2ceil(MAX(memory_region_size(mr), 1)) - 1);
+    stats->bucket_shift = MAX(size_bits, 8) - 6;
+    QLIST_INSERT_HEAD(&mmio_stats, stats, next);
+    mr->avatar_stats = stats;
+}
+
+void avatar_mmio_stats_account(AvatarMmioStats *stats, hwaddr addr,
+                               bool is_write, int64_t ns)
+{
+    unsigned bucket = MIN(addr >> stats->bucket_shift,
+                          AVATAR_MMIO_STATS_BUCKETS - 1);
+    unsigned hist = 0;
+
+    if (ns >= (1 << AVATAR_MMIO_STATS_HIST_SHIFT)) {
+        hist = MIN(63 - clz64(ns) - AVATAR_MMIO_STATS_HIST_SHIFT + 1,
+                   AVATAR_MMIO_STATS_HIST - 1);
+    }
+    stats->hist[hist]++;
+    stats->max_ns = MAX(stats->max_ns, ns);
+
+    if (is_write) {
+        stats->writes++;
+        stats->write_ns += ns;
+        stats->bucket_writes[bucket]++;
+    } else {
+        stats->reads++;
+        stats->read_ns += ns;
+        stats->bucket_reads[bucket]++;
+    }
+}
+
+void avatar_mmio_stats_info(fprintf_function func_fprintf, void *f)
+{
+    AvatarMmioStats *stats;
+    int i;
+
+    if (QLIST_EMPTY(&mmio_stats)) {
+        func_fprintf(f, "no region has MMIO statistics enabled\n");
+        return;
+    }
+
+    QLIST_FOREACH(stats, &mmio_stats, next) {
+        uint64_t total = stats->reads + stats->writes;
+
+        func_fprintf(f, "%s: %" PRIu64 " reads, %" PRIu64 " writes, %" PRIu64
+                     " forwarded\n", memory_region_name(stats->mr),
+                     stats->reads, stats->writes, stats->forwarded);
+        if (!total) {
+            continue;
+        }
+        func_fprintf(f, "  latency: avg %" PRIu64 " ns, max %" PRIu64
+                     " ns, lock wait %" PRIu64 " ns\n",
+                     (stats->read_ns + stats->write_ns) / total,
+                     stats->max_ns, stats->lock_wait_ns);
+        func_fprintf(f, "  histogram:");
+        for (i = 0; i < AVATAR_MMIO_STATS_HIST; i++) {
+            func_fprintf(f, " %" PRIu64, stats->hist[i]);
+        }
+        func_fprintf(f, "\n");
+        for (i = 0; i < AVATAR_MMIO_STATS_BUCKETS; i++) {
+            if (!stats->bucket_reads[i] && !stats->bucket_writes[i]) {
+                continue;
+            }
+            func_fprintf(f, "  +0x%" PRIx64 ": %" PRIu64 " reads, %" PRIu64
+                         " writes\n", (uint64_t)i << stats->bucket_shift,
+                         stats->bucket_reads[i], stats->bucket_writes[i]);
+        }
+    }
+}
+
+AvatarMmioStatsInfoList *qmp_query_avatar_mmio_stats(Error **errp)
+{
+    AvatarMmioStatsInfoList *head = NULL, **tail = &head;
+    AvatarMmioStats *stats;
+
+    QLIST_FOREACH(stats, &mmio_stats, next) {
+        AvatarMmioStatsInfoList *entry = g_new0(AvatarMmioStatsInfoList, 1);
+        AvatarMmioStatsInfo *info = g_new0(AvatarMmioStatsInfo, 1);
+        uint64List **hist = &info->histogram;
+        AvatarMmioBucketList **buckets = &info->buckets;
+        int i;
+
+        info->region = g_strdup(memory_region_name(stats->mr));
+        info->reads = stats->reads;
+        info->writes = stats->writes;
+        info->forwarded = stats->forwarded;
+        info->read_ns = stats->read_ns;
+        info->write_ns = stats->write_ns;
+        info->max_ns = stats->max_ns;
+        info->lock_wait_ns = stats->lock_wait_ns;
+
+        for (i = 0; i < AVATAR_MMIO_STATS_HIST; i++) {
+            *hist = g_new0(uint64List, 1);
+            (*hist)->value = stats->hist[i];
+            hist = &(*hist)->next;
+        }
+
+        for (i = 0; i < AVATAR_MMIO_STATS_BUCKETS; i++) {
+            AvatarMmioBucket *bucket;
+
+            if (!stats->bucket_reads[i] && !stats->bucket_writes[i]) {
+                continue;
+            }
+            bucket = g_new0(AvatarMmioBucket, 1);
+            bucket->offset = (uint64_t)i << stats->bucket_shift;
+            bucket->reads = stats->bucket_reads[i];
+            bucket->writes = stats->bucket_writes[i];
+
+            *buckets = g_new0(AvatarMmioBucketList, 1);
+            (*buckets)->value = bucket;
+            buckets = &(*buckets)->next;
+        }
+
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
+void qmp_avatar_mmio_stats_set(const char *region, bool enable, Error **errp)
+{
+    MemoryRegion *mr = avatar_mmio_find_region(region);
+
+    if (!mr) {
+        error_setg(errp, "no memory region named '%s'", region);
+        return;
+    }
+    avatar_mmio_stats_set(mr, enable);
+}
@@ -0,0 +1,239 @@
+/*
+ * Binary trace of MMIO accesses
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include <sys/mman.h>
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qemu/cutils.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "exec/address-spaces.h"
+#include "exec/exec-all.h"
+#include "sysemu/cpus.h"
+#include "avatar/shm.h"
+#include "avatar/mmio-trace.h"
+
+QEMU_BUILD_BUG_ON(sizeof(AvatarMmioTraceHeader) >
+                  AVATAR_MMIO_TRACE_HEADER_SIZE);
+QEMU_BUILD_BUG_ON(sizeof(AvatarMmioTraceRecord) != 48);
+
+typedef struct AvatarMmioTrace {
+    AvatarMmioTraceHeader *header;
+    AvatarMmioTraceRecord *records;
+    size_t map_size;
+    uint32_t mask;
+    /* Private copy of header->head, only the producer moves it */
+    uint64_t head;
+    /* The region behind each id; names are not unique */
+    MemoryRegion *regions[AVATAR_MMIO_TRACE_MAX_REGIONS];
+} AvatarMmioTrace;
+
+static AvatarMmioTrace mmio_trace;
+
+void avatar_mmio_trace_open(const char *path, uint32_t nr_records,
+                            Error **errp)
+{
+    AvatarMmioTrace *t = &mmio_trace;
+    AvatarMmioTraceHeader *h;
+    size_t map_size;
+    void *ptr;
+    int fd;
+
+    if (t->header) {
+        error_setg(errp, "an MMIO trace file is already open");
+        return;
+    }
+    if (!nr_records) {
+        nr_records = AVATAR_MMIO_TRACE_DEFAULT_RECORDS;
+    }
+    if (nr_records > (1U << 24)) {
+        error_setg(errp, "MMIO trace rings hold at most %u records",
+                   1U << 24);
+        return;
+    }
+    nr_records = pow2ceil(nr_records);
+    map_size = AVATAR_MMIO_TRACE_HEADER_SIZE +
+               (size_t)nr_records * sizeof(AvatarMmioTraceRecord);
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot create MMIO trace '%s'", path);
+        return;
+    }
+    if (ftruncate(fd, map_size) < 0) {
+        error_setg_errno(errp, errno, "cannot size MMIO trace '%s'", path);
+        close(fd);
+        return;
+    }
+    ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "cannot map MMIO trace '%s'", path);
+        return;
+    }
+
+    h = ptr;
+    h->version = AVATAR_MMIO_TRACE_VERSION;
+    h->record_size = sizeof(AvatarMmioTraceRecord);
+    h->nr_records = nr_records;
+    h->head = 0;
+    h->nr_regions = 0;
+    avatar_shm_publish(&h->magic, AVATAR_MMIO_TRACE_MAGIC);
+
+    t->header = h;
+    t->records = ptr + AVATAR_MMIO_TRACE_HEADER_SIZE;
+    t->map_size = map_size;
+    t->mask = nr_records - 1;
+    t->head = 0;
+}
+
+static int avatar_mmio_trace_region_id(AvatarMmioTrace *t,
+                                       MemoryRegion *mr, Error **errp)
+{
+    AvatarMmioTraceHeader *h = t->header;
+    AvatarMmioTraceRegion *r;
+    uint32_t id = h->nr_regions;
+
+    if (id == AVATAR_MMIO_TRACE_MAX_REGIONS) {
+        error_setg(errp, "at most %d regions can be traced",
+                   AVATAR_MMIO_TRACE_MAX_REGIONS);
+        return -1;
+    }
+
+    r = &h->regions[id];
+    pstrcpy(r->name, sizeof(r->name), memory_region_name(mr));
+    r->base = memory_region_to_absolute_addr(mr, 0);
+    r->size = memory_region_size(mr);
+    t->regions[id] = mr;
+    atomic_store_release(&h->nr_regions, id + 1);
+    return id;
+}
+
+void avatar_mmio_trace_set(MemoryRegion *mr, bool enable, Error **errp)
+{
+    AvatarMmioTrace *t = &mmio_trace;
+    int id;
+
+    if (!enable) {
+        mr->avatar_trace = false;
+        return;
+    }
+    if (!t->header) {
+        error_setg(errp, "no MMIO trace file is open");
+        return;
+    }
+    if (memory_region_is_ram(mr)) {
+        error_setg(errp, "'%s' is RAM, only MMIO can be traced",
+                   memory_region_name(mr));
+        return;
+    }
+
+    /* Regions keep their id when tracing is toggled */
+    for (id = 0; id < t->header->nr_regions; id++) {
+        if (t->regions[id] == mr) {
+            break;
+        }
+    }
+    if (id == t->header->nr_regions) {
+        id = avatar_mmio_trace_region_id(t, mr, errp);
+        if (id < 0) {
+            return;
+        }
+    }
+
+    mr->avatar_trace_id = id;
+    mr->avatar_trace = true;
+}
+
+bool avatar_mmio_pc(uint64_t *pc)
+{
+    CPUState *cpu = current_cpu;
+    target_ulong insn_pc;
+
+    /* Accesses by the CPU went through io_readx/io_writex */
+    if (!cpu || !cpu_get_insn_pc(cpu->mem_io_pc, &insn_pc)) {
+        return false;
+    }
+    *pc = insn_pc;
+    return true;
+}
+
+void avatar_mmio_trace_record(MemoryRegion *mr, hwaddr addr, uint64_t value,
+                              unsigned size, bool is_write)
+{
+    AvatarMmioTrace *t = &mmio_trace;
+    AvatarMmioTraceRecord *r = &t->records[t->head & t->mask];
+    CPUState *cpu = current_cpu;
+    uint64_t pc;
+    uint8_t flags = is_write ? AVATAR_MMIO_TRACE_WRITE : 0;
+
+    atomic_set(&r->seq, UINT64_MAX);
+    smp_wmb();
+
+    r->addr = addr;
+    r->value = value;
+    r->size = size;
+    r->region = mr->avatar_trace_id;
+    r->pc = 0;
+    r->icount = 0;
+
+    if (avatar_mmio_pc(&pc)) {
+        r->pc = pc;
+        flags |= AVATAR_MMIO_TRACE_PC;
+    }
+    if (use_icount && (!cpu || cpu->can_do_io)) {
+        r->icount = cpu_get_icount_raw();
+        flags |= AVATAR_MMIO_TRACE_ICOUNT;
+    }
+    r->flags = flags;
+
+    smp_wmb();
+    atomic_set(&r->seq, t->head);
+    t->head++;
+    atomic_store_release(&t->header->head, t->head);
+}
+
+static MemoryRegion *avatar_mmio_find_subregion(MemoryRegion *mr,
+                                                const char *name)
+{
+    MemoryRegion *sub, *found;
+
+    if (mr->name && !strcmp(mr->name, name)) {
+        return mr;
+    }
+    QTAILQ_FOREACH(sub, &mr->subregions, subregions_link) {
+        found = avatar_mmio_find_subregion(sub, name);
+        if (found) {
+            return found;
+        }
+    }
+    return NULL;
+}
+
+MemoryRegion *avatar_mmio_find_region(const char *name)
+{
+    return avatar_mmio_find_subregion(get_system_memory(), name);
+}
+
+void qmp_avatar_mmio_trace_open(const char *file, bool has_records,
+                                uint32_t records, Error **errp)
+{
+    avatar_mmio_trace_open(file, has_records ? records : 0, errp);
+}
+
+void qmp_avatar_mmio_trace_set(const char *region, bool enable, Error **errp)
+{
+    MemoryRegion *mr = avatar_mmio_find_region(region);
+
+    if (!mr) {
+        error_setg(errp, "no memory region named '%s'", region);
+        return;
+    }
+    avatar_mmio_trace_set(mr, enable, errp);
+}
@@ -0,0 +1,115 @@
+/*
+ * Polling-loop detection and virtual time fast-forward
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "qemu/timer.h"
+#include "qom/cpu.h"
+#include "sysemu/cpus.h"
+#include "avatar/poll.h"
+#include "trace.h"
+
+typedef struct AvatarPoll {
+    /* The read being repeated */
+    CPUState *cpu;
+    hwaddr addr;
+    uint64_t value;
+    uintptr_t retaddr;
+    /* Instruction count at that read and distance to the previous one */
+    int64_t icount;
+    int64_t period;
+    unsigned repeats;
+
+    /* Statistics */
+    uint64_t detected;
+    uint64_t skipped_ns;
+} AvatarPoll;
+
+static AvatarPoll avatar_poll;
+bool avatar_poll_enabled;
+
+void avatar_poll_init(Error **errp)
+{
+    if (!use_icount) {
+        error_setg(errp, "polling-loop fast-forward requires -icount");
+        return;
+    }
+    avatar_poll_enabled = true;
+}
+
+static void avatar_poll_skip(AvatarPoll *p)
+{
+    CPUState *cpu = p->cpu;
+    int64_t ns;
+
+    /* The loop is about to be interrupted anyway */
+    if (cpu->interrupt_request & CPU_INTERRUPT_HARD) {
+        return;
+    }
+    if (!tb_loop_is_side_effect_free(p->retaddr, p->period)) {
+        return;
+    }
+
+    p->detected++;
+    ns = qemu_icount_skip_to_deadline();
+    trace_avatar_poll_skip(p->addr, p->value, ns);
+    if (ns) {
+        p->skipped_ns += ns;
+        /* Leave the loop so that the expired timers can run */
+        cpu_exit(cpu);
+    }
+}
+
+void avatar_poll_mmio_read(CPUState *cpu, hwaddr addr, uint64_t value,
+                           uintptr_t retaddr)
+{
+    AvatarPoll *p = &avatar_poll;
+    int64_t icount, period;
+
+    /* cpu_get_icount_raw() aborts unless the access may do I/O */
+    if (!cpu->can_do_io) {
+        return;
+    }
+    icount = cpu_get_icount_raw();
+    period = icount - p->icount;
+
+    if (cpu != p->cpu || addr != p->addr || value != p->value ||
+        retaddr != p->retaddr || period <= 0 ||
+        period > AVATAR_POLL_MAX_PERIOD ||
+        (p->repeats && period != p->period)) {
+        p->cpu = cpu;
+        p->addr = addr;
+        p->value = value;
+        p->retaddr = retaddr;
+        p->repeats = 0;
+    } else if (++p->repeats >= AVATAR_POLL_THRESHOLD) {
+        p->repeats = 0;
+        avatar_poll_skip(p);
+    }
+
+    p->icount = icount;
+    p->period = period;
+}
+
+void avatar_poll_mmio_write(void)
+{
+    avatar_poll.repeats = 0;
+    avatar_poll.cpu = NULL;
+}
+
+void avatar_poll_info(fprintf_function func_fprintf, void *f)
+{
+    AvatarPoll *p = &avatar_poll;
+
+    if (!avatar_poll_enabled) {
+        return;
+    }
+
+    func_fprintf(f, "polling loops: %" PRIu64 " detected, %" PRIu64
+                 " ns of virtual time skipped\n", p->detected, p->skipped_ns);
+}
@@ -0,0 +1,296 @@
+/*
+ * Avatar shared-memory message ring
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/processor.h"
+#include "qemu/host-utils.h"
+#include "avatar/futex.h"
+#include "avatar/shm.h"
+#include "avatar/ring.h"
+
+/* Busy-wait iterations before falling back to sleeping in the kernel */
+#define AVATAR_RING_SPIN 1000
+
+struct AvatarRing {
+    AvatarRingShared *shared;
+    size_t map_size;
+    uint32_t size;
+    /* Private copies of the index owned by this side of the ring */
+    uint32_t head;
+    uint32_t tail;
+    /* Set by avatar_ring_interrupt to make avatar_ring_wait give up */
+    bool interrupted;
+};
+
+static inline uint32_t avatar_ring_record_size(size_t len)
+{
+    return ROUND_UP(sizeof(uint32_t) + len, AVATAR_RING_ALIGN);
+}
+
+static inline void avatar_ring_kick(uint32_t *waiting)
+{
+    /* Pairs with the smp_mb() in the sleeping side before it rechecks */
+    smp_mb();
+    if (atomic_read(waiting)) {
+        atomic_set(waiting, 0);
+        avatar_futex_wake(waiting, 1);
+    }
+}
+
+AvatarRing *avatar_ring_create(const char *name, size_t size, Error **errp)
+{
+    AvatarRing *ring;
+    AvatarRingShared *sh;
+    size_t map_size;
+    void *ptr;
+    int fd;
+
+    size = pow2ceil(MAX(size, 4096));
+    if (size > (1U << 30)) {
+        error_setg(errp, "avatar ring '%s' is too large", name);
+        return NULL;
+    }
+    map_size = sizeof(AvatarRingShared) + size;
+
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot create avatar ring '%s'", name);
+        return NULL;
+    }
+    if (ftruncate(fd, map_size) < 0) {
+        error_setg_errno(errp, errno, "cannot size avatar ring '%s'", name);
+        close(fd);
+        return NULL;
+    }
+    ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "cannot map avatar ring '%s'", name);
+        return NULL;
+    }
+
+    sh = ptr;
+    sh->version = AVATAR_RING_VERSION;
+    sh->size = size;
+    /* Any message must fit even after a maximal wrap-around skip */
+    sh->max_msg_size = size / 2 - sizeof(uint32_t);
+    sh->head = 0;
+    sh->tail = 0;
+    sh->producer_waiting = 0;
+    sh->consumer_waiting = 0;
+    avatar_shm_publish(&sh->magic, AVATAR_RING_MAGIC);
+
+    ring = g_new0(AvatarRing, 1);
+    ring->shared = sh;
+    ring->map_size = map_size;
+    ring->size = size;
+    return ring;
+}
+
+AvatarRing *avatar_ring_open(const char *name, Error **errp)
+{
+    AvatarRing *ring;
+    AvatarRingShared *sh;
+    struct stat st;
+    void *ptr;
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot open avatar ring '%s'", name);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(AvatarRingShared)) {
+        error_setg(errp, "avatar ring '%s' is not initialized", name);
+        close(fd);
+        return NULL;
+    }
+    ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "cannot map avatar ring '%s'", name);
+        return NULL;
+    }
+
+    sh = ptr;
+    if (!avatar_shm_ready(&sh->magic, AVATAR_RING_MAGIC) ||
+        sh->version != AVATAR_RING_VERSION ||
+        st.st_size < sizeof(AvatarRingShared) + sh->size) {
+        error_setg(errp, "avatar ring '%s' is not initialized", name);
+        munmap(ptr, st.st_size);
+        return NULL;
+    }
+
+    ring = g_new0(AvatarRing, 1);
+    ring->shared = sh;
+    ring->map_size = st.st_size;
+    ring->size = sh->size;
+    ring->head = atomic_read(&sh->head);
+    ring->tail = atomic_read(&sh->tail);
+    return ring;
+}
+
+void avatar_ring_destroy(AvatarRing *ring)
+{
+    if (!ring) {
+        return;
+    }
+    munmap(ring->shared, ring->map_size);
+    g_free(ring);
+}
+
+size_t avatar_ring_max_msg_size(AvatarRing *ring)
+{
+    return ring->shared->max_msg_size;
+}
+
+bool avatar_ring_is_empty(AvatarRing *ring)
+{
+    return atomic_read(&ring->shared->head) == ring->tail;
+}
+
+bool avatar_ring_try_push(AvatarRing *ring, const void *msg, size_t len)
+{
+    AvatarRingShared *sh = ring->shared;
+    uint32_t head = ring->head;
+    uint32_t tail = atomic_load_acquire(&sh->tail);
+    uint32_t off = head & (ring->size - 1);
+    uint32_t need = avatar_ring_record_size(len);
+    uint32_t skip = 0;
+
+    assert(len <= sh->max_msg_size);
+
+    if (off + need > ring->size) {
+        skip = ring->size - off;
+    }
+    if (ring->size - (head - tail) < skip + need) {
+        return false;
+    }
+
+    if (skip) {
+        *(uint32_t *)&sh->data[off] = AVATAR_RING_WRAP;
+        head += skip;
+        off = 0;
+    }
+    *(uint32_t *)&sh->data[off] = len;
+    memcpy(&sh->data[off + sizeof(uint32_t)], msg, len);
+
+    head += need;
+    ring->head = head;
+    atomic_store_release(&sh->head, head);
+
+    avatar_ring_kick(&sh->consumer_waiting);
+    return true;
+}
+
+void avatar_ring_push(AvatarRing *ring, const void *msg, size_t len)
+{
+    AvatarRingShared *sh = ring->shared;
+    int spin = 0;
+
+    while (!avatar_ring_try_push(ring, msg, len)) {
+        if (spin < AVATAR_RING_SPIN) {
+            spin++;
+            cpu_relax();
+            continue;
+        }
+        atomic_set(&sh->producer_waiting, 1);
+        smp_mb();
+        if (avatar_ring_try_push(ring, msg, len)) {
+            atomic_set(&sh->producer_waiting, 0);
+            return;
+        }
+        avatar_futex_wait(&sh->producer_waiting, 1);
+    }
+}
+
+ssize_t avatar_ring_pop(AvatarRing *ring, void *buf, size_t len)
+{
+    AvatarRingShared *sh = ring->shared;
+    uint32_t tail = ring->tail;
+    uint32_t head = atomic_load_acquire(&sh->head);
+    uint32_t off;
+    uint32_t msg_len;
+    ssize_t ret;
+
+    if (head == tail) {
+        return -EAGAIN;
+    }
+
+    off = tail & (ring->size - 1);
+    msg_len = *(uint32_t *)&sh->data[off];
+    if (msg_len == AVATAR_RING_WRAP) {
+        /* The producer publishes the skip and the next record together */
+        tail += ring->size - off;
+        off = 0;
+        msg_len = *(uint32_t *)&sh->data[off];
+    }
+
+    if (msg_len > sh->max_msg_size) {
+        /* Corrupted ring, resynchronise with the producer */
+        tail = head;
+        ret = -EMSGSIZE;
+    } else if (msg_len > len) {
+        tail += avatar_ring_record_size(msg_len);
+        ret = -EMSGSIZE;
+    } else {
+        memcpy(buf, &sh->data[off + sizeof(uint32_t)], msg_len);
+        tail += avatar_ring_record_size(msg_len);
+        ret = msg_len;
+    }
+
+    ring->tail = tail;
+    atomic_store_release(&sh->tail, tail);
+
+    avatar_ring_kick(&sh->producer_waiting);
+    return ret;
+}
+
+void avatar_ring_after_fork(AvatarRing *ring)
+{
+    /* Each side only ever moves its own index, so both copies are exact */
+    ring->head = atomic_read(&ring->shared->head);
+    ring->tail = atomic_read(&ring->shared->tail);
+    atomic_set(&ring->interrupted, false);
+}
+
+void avatar_ring_interrupt(AvatarRing *ring)
+{
+    uint32_t *waiting = &ring->shared->consumer_waiting;
+
+    atomic_set(&ring->interrupted, true);
+    /* Pairs with the smp_mb() in avatar_ring_wait before it rechecks */
+    smp_mb();
+    atomic_set(waiting, 0);
+    avatar_futex_wake(waiting, INT_MAX);
+}
+
+void avatar_ring_wait(AvatarRing *ring)
+{
+    AvatarRingShared *sh = ring->shared;
+    int spin;
+
+    for (spin = 0; spin < AVATAR_RING_SPIN; spin++) {
+        if (!avatar_ring_is_empty(ring) || atomic_read(&ring->interrupted)) {
+            return;
+        }
+        cpu_relax();
+    }
+
+    while (avatar_ring_is_empty(ring)) {
+        atomic_set(&sh->consumer_waiting, 1);
+        smp_mb();
+        if (!avatar_ring_is_empty(ring) || atomic_read(&ring->interrupted)) {
+            atomic_set(&sh->consumer_waiting, 0);
+            break;
+        }
+        avatar_futex_wait(&sh->consumer_waiting, 1);
+    }
+}
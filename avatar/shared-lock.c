@@ -0,0 +1,233 @@
+/*
+ * Locks for peripherals shared with an avatar peer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/processor.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "avatar/futex.h"
+#include "avatar/shm.h"
+#include "avatar/shared-lock.h"
+
+/* Busy-wait iterations before sleeping on a contended mutex */
+#define AVATAR_SHARED_LOCK_SPIN 1000
+
+struct AvatarSharedLock {
+    char *name;
+    AvatarSharedLockMode mode;
+    QemuAvatarSemaphore sem;
+    AvatarSharedLockShared *shared;
+
+    /* Statistics of this process' side, updated under the iothread lock */
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t sleeps;
+    uint64_t reads;
+    uint64_t read_retries;
+
+    QLIST_ENTRY(AvatarSharedLock) next;
+};
+
+static QLIST_HEAD(, AvatarSharedLock) shared_locks =
+    QLIST_HEAD_INITIALIZER(shared_locks);
+
+const char *const AvatarSharedLockMode_lookup[] = {
+    [AVATAR_SHARED_LOCK_SEMAPHORE] = "semaphore",
+    [AVATAR_SHARED_LOCK_MUTEX] = "mutex",
+    [AVATAR_SHARED_LOCK_SEQLOCK] = "seqlock",
+    [AVATAR_SHARED_LOCK__MAX] = NULL,
+};
+
+static AvatarSharedLockShared *avatar_shared_lock_map(const char *name,
+                                                      Error **errp)
+{
+    AvatarSharedLockShared *sh;
+    void *ptr;
+    int fd;
+
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot create shared lock '%s'", name);
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(*sh)) < 0) {
+        error_setg_errno(errp, errno, "cannot size shared lock '%s'", name);
+        close(fd);
+        return NULL;
+    }
+    ptr = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "cannot map shared lock '%s'", name);
+        return NULL;
+    }
+
+    sh = ptr;
+    sh->version = AVATAR_SHARED_LOCK_VERSION;
+    sh->lock = AVATAR_SHARED_LOCK_FREE;
+    sh->sequence = 0;
+    avatar_shm_publish(&sh->magic, AVATAR_SHARED_LOCK_MAGIC);
+    return sh;
+}
+
+AvatarSharedLock *avatar_shared_lock_open(const char *name,
+                                          AvatarSharedLockMode mode,
+                                          Error **errp)
+{
+    AvatarSharedLock *lock = g_new0(AvatarSharedLock, 1);
+
+    lock->mode = mode;
+    if (mode == AVATAR_SHARED_LOCK_SEMAPHORE) {
+        qemu_avatar_sem_open(&lock->sem, name);
+    } else {
+        lock->shared = avatar_shared_lock_map(name, errp);
+        if (!lock->shared) {
+            g_free(lock);
+            return NULL;
+        }
+    }
+
+    lock->name = g_strdup(name);
+    QLIST_INSERT_HEAD(&shared_locks, lock, next);
+    return lock;
+}
+
+AvatarSharedLockMode avatar_shared_lock_mode(AvatarSharedLock *lock)
+{
+    return lock->mode;
+}
+
+static void avatar_shared_mutex_lock(AvatarSharedLock *lock)
+{
+    uint32_t *word = &lock->shared->lock;
+    uint32_t c;
+    int spin;
+
+    c = atomic_cmpxchg(word, AVATAR_SHARED_LOCK_FREE,
+                       AVATAR_SHARED_LOCK_LOCKED);
+    if (c == AVATAR_SHARED_LOCK_FREE) {
+        return;
+    }
+    lock->contended++;
+
+    /* The peer usually holds the lock for a single register access */
+    for (spin = 0; spin < AVATAR_SHARED_LOCK_SPIN; spin++) {
+        cpu_relax();
+        if (atomic_read(word) == AVATAR_SHARED_LOCK_FREE) {
+            c = atomic_cmpxchg(word, AVATAR_SHARED_LOCK_FREE,
+                               AVATAR_SHARED_LOCK_LOCKED);
+            if (c == AVATAR_SHARED_LOCK_FREE) {
+                return;
+            }
+        }
+    }
+
+    /*
+     * From now on the lock is taken as CONTENDED, because we cannot know
+     * whether somebody else is sleeping on it.
+     */
+    c = atomic_xchg(word, AVATAR_SHARED_LOCK_CONTENDED);
+    while (c != AVATAR_SHARED_LOCK_FREE) {
+        lock->sleeps++;
+        avatar_futex_wait(word, AVATAR_SHARED_LOCK_CONTENDED);
+        c = atomic_xchg(word, AVATAR_SHARED_LOCK_CONTENDED);
+    }
+}
+
+static void avatar_shared_mutex_unlock(AvatarSharedLock *lock)
+{
+    uint32_t *word = &lock->shared->lock;
+
+    if (atomic_fetch_dec(word) != AVATAR_SHARED_LOCK_LOCKED) {
+        atomic_set(word, AVATAR_SHARED_LOCK_FREE);
+        avatar_futex_wake(word, 1);
+    }
+}
+
+void avatar_shared_lock_acquire(AvatarSharedLock *lock)
+{
+    switch (lock->mode) {
+    case AVATAR_SHARED_LOCK_SEMAPHORE:
+        qemu_avatar_sem_wait(&lock->sem);
+        break;
+    case AVATAR_SHARED_LOCK_MUTEX:
+        avatar_shared_mutex_lock(lock);
+        break;
+    case AVATAR_SHARED_LOCK_SEQLOCK:
+        avatar_shared_mutex_lock(lock);
+        atomic_set(&lock->shared->sequence, lock->shared->sequence + 1);
+        smp_wmb();
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    lock->acquired++;
+}
+
+void avatar_shared_lock_release(AvatarSharedLock *lock)
+{
+    switch (lock->mode) {
+    case AVATAR_SHARED_LOCK_SEMAPHORE:
+        qemu_avatar_sem_post(&lock->sem);
+        break;
+    case AVATAR_SHARED_LOCK_MUTEX:
+        avatar_shared_mutex_unlock(lock);
+        break;
+    case AVATAR_SHARED_LOCK_SEQLOCK:
+        smp_wmb();
+        atomic_set(&lock->shared->sequence, lock->shared->sequence + 1);
+        avatar_shared_mutex_unlock(lock);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+unsigned avatar_shared_lock_read_begin(AvatarSharedLock *lock)
+{
+    unsigned seq;
+
+    assert(lock->mode == AVATAR_SHARED_LOCK_SEQLOCK);
+
+    lock->reads++;
+    while ((seq = atomic_read(&lock->shared->sequence)) & 1) {
+        cpu_relax();
+    }
+    smp_rmb();
+    return seq;
+}
+
+bool avatar_shared_lock_read_retry(AvatarSharedLock *lock, unsigned start)
+{
+    smp_rmb();
+    if (atomic_read(&lock->shared->sequence) != start) {
+        lock->read_retries++;
+        return true;
+    }
+    return false;
+}
+
+void avatar_shared_lock_info(fprintf_function func_fprintf, void *f)
+{
+    AvatarSharedLock *lock;
+
+    QLIST_FOREACH(lock, &shared_locks, next) {
+        func_fprintf(f, "shared lock %s (%s): %" PRIu64 " acquisitions, "
+                     "%" PRIu64 " contended, %" PRIu64 " sleeps",
+                     lock->name, AvatarSharedLockMode_lookup[lock->mode], lock->acquired,
+                     lock->contended, lock->sleeps);
+        if (lock->mode == AVATAR_SHARED_LOCK_SEQLOCK) {
+            func_fprintf(f, ", %" PRIu64 " lockless reads, "
+                         "%" PRIu64 " retries", lock->reads,
+                         lock->read_retries);
+        }
+        func_fprintf(f, "\n");
+    }
+}
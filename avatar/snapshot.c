@@ -0,0 +1,319 @@
+/*
+ * In-process snapshot and restore of the whole machine
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qom/cpu.h"
+#include "exec/memory.h"
+#include "exec/ram_addr.h"
+#include "qemu/rcu_queue.h"
+#include "io/channel-buffer.h"
+#include "migration/qemu-file.h"
+#include "qemu/bitops.h"
+#include "qemu/error-report.h"
+#include "qemu/log.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+#include "tcg/tcg.h"
+#include "translate-all.h"
+#include "avatar/snapshot.h"
+#include "trace.h"
+
+typedef struct AvatarSnapshotBlock {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    ram_addr_t length;
+    uint8_t *data;
+} AvatarSnapshotBlock;
+
+typedef struct AvatarSnapshot {
+    bool valid;
+    bool dirty_log;
+    AvatarSnapshotBlock *blocks;
+    int nr_blocks;
+    uint8_t *device_state;
+    size_t device_state_len;
+
+    MemoryRegion marker;
+
+    uint64_t restores;
+    uint64_t pages_restored;
+    uint64_t last_pages;
+    uint64_t last_ns;
+} AvatarSnapshot;
+
+static AvatarSnapshot snapshot;
+
+static void avatar_snapshot_clear(AvatarSnapshot *s)
+{
+    int i;
+
+    for (i = 0; i < s->nr_blocks; i++) {
+        g_free(s->blocks[i].data);
+    }
+    g_free(s->blocks);
+    g_free(s->device_state);
+    s->blocks = NULL;
+    s->nr_blocks = 0;
+    s->device_state = NULL;
+    s->valid = false;
+}
+
+/* Called with the iothread lock held and no CPU running */
+static int avatar_snapshot_save(AvatarSnapshot *s)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    RAMBlock *block;
+    int ret, i;
+
+    avatar_snapshot_clear(s);
+
+    bioc = qio_channel_buffer_new(4096);
+    f = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    ret = qemu_save_device_state(f);
+    qemu_fflush(f);
+    s->device_state_len = bioc->usage;
+    s->device_state = g_memdup(bioc->data, bioc->usage);
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+    if (ret < 0) {
+        g_free(s->device_state);
+        s->device_state = NULL;
+        return ret;
+    }
+
+    /* Without it, DMA writes would not be tracked in the bitmap */
+    if (!s->dirty_log) {
+        memory_global_dirty_log_start();
+        s->dirty_log = true;
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        s->nr_blocks++;
+    }
+    s->blocks = g_new0(AvatarSnapshotBlock, s->nr_blocks);
+    i = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        AvatarSnapshotBlock *sb = &s->blocks[i++];
+
+        sb->rb = block;
+        sb->offset = block->offset;
+        sb->length = block->used_length;
+        sb->data = g_memdup(block->host, block->used_length);
+        cpu_physical_memory_test_and_clear_dirty(sb->offset, sb->length,
+                                                 DIRTY_MEMORY_MIGRATION);
+    }
+    rcu_read_unlock();
+
+    s->valid = true;
+    trace_avatar_snapshot_save(s->nr_blocks, s->device_state_len);
+    return 0;
+}
+
+/*
+ * Copy back the dirty pages of @sb.  The bitmap walk follows
+ * cpu_physical_memory_get_dirty(); pages that hold translated code get
+ * their TBs invalidated, since the guest may have rewritten them.
+ */
+static uint64_t avatar_snapshot_restore_block(AvatarSnapshotBlock *sb)
+{
+    DirtyMemoryBlocks *blocks;
+    unsigned long page, end, idx, offset, base;
+    uint64_t restored = 0;
+
+    page = sb->offset >> TARGET_PAGE_BITS;
+    end = TARGET_PAGE_ALIGN(sb->offset + sb->length) >> TARGET_PAGE_BITS;
+
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
+
+    idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+    offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+    base = page - offset;
+    while (page < end) {
+        unsigned long next = MIN(end, base + DIRTY_MEMORY_BLOCK_SIZE);
+        unsigned long num = next - base;
+        unsigned long found;
+
+        for (found = find_next_bit(blocks->blocks[idx], num, offset);
+             found < num;
+             found = find_next_bit(blocks->blocks[idx], num, found + 1)) {
+            ram_addr_t addr = (base + found) << TARGET_PAGE_BITS;
+            ram_addr_t off = addr - sb->offset;
+            size_t len = MIN(TARGET_PAGE_SIZE, sb->length - off);
+
+            memcpy(sb->rb->host + off, sb->data + off, len);
+            if (!cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE)) {
+                tb_invalidate_phys_range(addr, addr + len);
+            }
+            restored++;
+        }
+
+        page = next;
+        idx++;
+        offset = 0;
+        base += DIRTY_MEMORY_BLOCK_SIZE;
+    }
+
+    /* Re-arm dirty tracking, including the TLB notdirty slow path */
+    cpu_physical_memory_test_and_clear_dirty(sb->offset, sb->length,
+                                             DIRTY_MEMORY_MIGRATION);
+    return restored;
+}
+
+/* Called with the iothread lock held and no CPU running */
+static int avatar_snapshot_restore(AvatarSnapshot *s)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    CPUState *cpu;
+    int64_t start = get_clock();
+    uint64_t pages = 0;
+    int ret, i;
+
+    if (!s->valid) {
+        return -ENOENT;
+    }
+
+    rcu_read_lock();
+    tb_lock();
+    for (i = 0; i < s->nr_blocks; i++) {
+        pages += avatar_snapshot_restore_block(&s->blocks[i]);
+    }
+    tb_unlock();
+    rcu_read_unlock();
+
+    /* The channel frees its buffer when closed, so hand it a copy */
+    bioc = qio_channel_buffer_new(0);
+    bioc->data = g_memdup(s->device_state, s->device_state_len);
+    bioc->capacity = bioc->usage = s->device_state_len;
+    f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+    ret = qemu_load_device_state(f);
+    qemu_fclose(f);
+
+    CPU_FOREACH(cpu) {
+        tlb_flush(cpu, 1);
+    }
+
+    s->restores++;
+    s->pages_restored += pages;
+    s->last_pages = pages;
+    s->last_ns = get_clock() - start;
+    trace_avatar_snapshot_restore(pages, s->last_ns, ret);
+    return ret;
+}
+
+static void avatar_snapshot_save_work(CPUState *cpu, run_on_cpu_data data)
+{
+    int *ret = data.host_ptr;
+
+    *ret = avatar_snapshot_save(&snapshot);
+}
+
+static void avatar_snapshot_restore_work(CPUState *cpu, run_on_cpu_data data)
+{
+    int *ret = data.host_ptr;
+
+    *ret = avatar_snapshot_restore(&snapshot);
+}
+
+void qmp_avatar_snapshot_save(Error **errp)
+{
+    int ret;
+
+    run_on_cpu(first_cpu, avatar_snapshot_save_work, RUN_ON_CPU_HOST_PTR(&ret));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "cannot save the device state");
+    }
+}
+
+void qmp_avatar_snapshot_restore(Error **errp)
+{
+    int ret;
+
+    run_on_cpu(first_cpu, avatar_snapshot_restore_work,
+               RUN_ON_CPU_HOST_PTR(&ret));
+    if (ret == -ENOENT) {
+        error_setg(errp, "no snapshot has been taken");
+    } else if (ret < 0) {
+        error_setg_errno(errp, -ret, "cannot restore the device state");
+    }
+}
+
+/* Guest-triggered requests have nobody to report errors to */
+static void avatar_snapshot_marker_work(CPUState *cpu, run_on_cpu_data data)
+{
+    int ret;
+
+    if (data.host_int == AVATAR_SNAPSHOT_SAVE) {
+        ret = avatar_snapshot_save(&snapshot);
+    } else {
+        ret = avatar_snapshot_restore(&snapshot);
+    }
+    if (ret < 0) {
+        error_report("avatar snapshot %s failed: %s",
+                     data.host_int == AVATAR_SNAPSHOT_SAVE ? "save" : "restore",
+                     strerror(-ret));
+    }
+}
+
+static uint64_t avatar_snapshot_marker_read(void *opaque, hwaddr addr,
+                                            unsigned size)
+{
+    AvatarSnapshot *s = opaque;
+
+    return s->restores;
+}
+
+static void avatar_snapshot_marker_write(void *opaque, hwaddr addr,
+                                         uint64_t val, unsigned size)
+{
+    if (val != AVATAR_SNAPSHOT_SAVE && val != AVATAR_SNAPSHOT_RESTORE) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: unknown request %" PRIu64 "\n",
+                      __func__, val);
+        return;
+    }
+
+    /* The CPU state can only be replaced once the current TB is left */
+    async_run_on_cpu(current_cpu, avatar_snapshot_marker_work,
+                     RUN_ON_CPU_HOST_INT(val));
+}
+
+static const MemoryRegionOps avatar_snapshot_marker_ops = {
+    .read = avatar_snapshot_marker_read,
+    .write = avatar_snapshot_marker_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+void avatar_snapshot_add_marker(MemoryRegion *sysmem, hwaddr addr)
+{
+    AvatarSnapshot *s = &snapshot;
+
+    memory_region_init_io(&s->marker, NULL, &avatar_snapshot_marker_ops, s,
+                          "avatar-snapshot", 4);
+    memory_region_add_subregion(sysmem, addr, &s->marker);
+}
+
+void avatar_snapshot_info(fprintf_function func_fprintf, void *f)
+{
+    AvatarSnapshot *s = &snapshot;
+
+    if (!s->valid) {
+        return;
+    }
+    func_fprintf(f, "snapshot: %d RAM blocks, %zu bytes of device state, "
+                 "%" PRIu64 " restores\n", s->nr_blocks, s->device_state_len,
+                 s->restores);
+    if (s->restores) {
+        func_fprintf(f, "snapshot restore: %" PRIu64 " pages in total, "
+                     "last %" PRIu64 " pages in %" PRIu64 " ns\n",
+                     s->pages_restored, s->last_pages, s->last_ns);
+    }
+}
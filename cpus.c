@@ -415,6 +415,32 @@ void qtest_clock_warp(int64_t dest)
     qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
 }
 
+/*
+ * Advance QEMU_CLOCK_VIRTUAL straight to its next deadline, as if the
+ * vCPUs had been idle until then.  Callers must know that executing the
+ * instructions in between would not change anything but the clock.
+ * Returns the number of nanoseconds skipped.
+ */
+int64_t qemu_icount_skip_to_deadline(void)
+{
+    int64_t deadline;
+
+    if (!use_icount || replay_mode != REPLAY_MODE_NONE || qtest_enabled()) {
+        return 0;
+    }
+
+    deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL);
+    if (deadline <= 0) {
+        return 0;
+    }
+
+    seqlock_write_begin(&timers_state.vm_clock_seqlock);
+    timers_state.qemu_icount_bias += deadline;
+    seqlock_write_end(&timers_state.vm_clock_seqlock);
+    qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+    return deadline;
+}
+
 void qemu_start_warp_timer(void)
 {
     int64_t clock;
@@ -632,6 +658,24 @@ void cpu_ticks_init(void)
                                            cpu_throttle_timer_tick, NULL);
 }
 
+/*
+ * Equivalent to -icount sleep=off for boards that want idle periods
+ * skipped: whenever all vCPUs are halted, QEMU_CLOCK_VIRTUAL jumps to the
+ * next deadline instead of following the host clock.
+ */
+void icount_enable_idle_skip(Error **errp)
+{
+    if (!use_icount) {
+        error_setg(errp, "idle skipping requires -icount");
+    } else if (use_icount == 2) {
+        error_setg(errp, "shift=auto and idle skipping are incompatible");
+    } else if (icount_align_option) {
+        error_setg(errp, "align=on and idle skipping are incompatible");
+    } else {
+        icount_sleep = false;
+    }
+}
+
 void configure_icount(QemuOpts *opts, Error **errp)
 {
     const char *option;
@@ -946,6 +990,12 @@ static void qemu_wait_io_event_common(CPUState *cpu)
 static void qemu_tcg_wait_io_event(CPUState *cpu)
 {
     while (all_cpu_threads_idle()) {
+        if (use_icount && !icount_sleep) {
+            /* Jump to the timer that will wake us rather than waiting
+             * for the main loop to notice that all vCPUs are halted.
+             */
+            qemu_start_warp_timer();
+        }
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
     }
 
@@ -1418,6 +1468,36 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
     }
 }
 
+/*
+ * Only the forking thread survives fork(), so a child forked while the
+ * VM is stopped must recreate the TCG thread before it can run again.
+ * The translated code, guest RAM and device state are all inherited.
+ */
+void qemu_tcg_restart_after_fork(void)
+{
+    CPUState *cpu;
+    char thread_name[VCPU_THREAD_NAME_SIZE];
+
+    assert(tcg_enabled() && first_cpu && !runstate_is_running());
+
+    /* The old thread may have been sleeping on these */
+    qemu_cond_init(first_cpu->halt_cond);
+    qemu_cond_init(&qemu_cpu_cond);
+    qemu_cond_init(&qemu_pause_cond);
+    CPU_FOREACH(cpu) {
+        cpu->created = false;
+        cpu->thread_kicked = false;
+    }
+
+    snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+             first_cpu->cpu_index);
+    qemu_thread_create(first_cpu->thread, thread_name, qemu_tcg_cpu_thread_fn,
+                       first_cpu, QEMU_THREAD_JOINABLE);
+    while (!first_cpu->created) {
+        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+    }
+}
+
 static void qemu_kvm_start_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
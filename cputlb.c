@@ -28,6 +28,7 @@
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
 #include "qemu/error-report.h"
+#include "avatar/poll.h"
 #include "exec/log.h"
 #include "exec/helper-proto.h"
 #include "qemu/atomic.h"
@@ -513,6 +514,9 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 
     cpu->mem_io_vaddr = addr;
     memory_region_dispatch_read(mr, physaddr, &val, size, iotlbentry->attrs);
+    if (unlikely(avatar_poll_enabled)) {
+        avatar_poll_mmio_read(cpu, physaddr, val, retaddr);
+    }
     return val;
 }
 
@@ -531,6 +535,9 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
+    if (unlikely(avatar_poll_enabled)) {
+        avatar_poll_mmio_write();
+    }
     memory_region_dispatch_write(mr, physaddr, val, size, iotlbentry->attrs);
 }
 
@@ -88,6 +88,7 @@ CONFIG_STM32F2XX_USART=y
 CONFIG_STM32F2XX_SYSCFG=y
 CONFIG_STM32F2XX_ADC=y
 CONFIG_STM32F2XX_SPI=y
+CONFIG_STM32F2XX_DMA=y
 CONFIG_STM32F205_SOC=y
 CONFIG_STM32=y
 
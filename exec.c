@@ -630,11 +630,18 @@ AddressSpace *cpu_get_address_space(CPUState *cpu, int asidx)
 }
 #endif
 
+#ifndef CONFIG_USER_ONLY
+static void cpu_watchpoint_index_free(CPUState *cpu);
+#endif
+
 void cpu_exec_unrealizefn(CPUState *cpu)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
 
     cpu_list_remove(cpu);
+#ifndef CONFIG_USER_ONLY
+    cpu_watchpoint_index_free(cpu);
+#endif
 
     if (cc->vmsd != NULL) {
         vmstate_unregister(NULL, cc->vmsd, cpu);
@@ -729,6 +736,216 @@ int cpu_watchpoint_insert(CPUState *cpu, vaddr addr, vaddr len,
     return -ENOSYS;
 }
 #else
+/*
+ * Watchpoint index
+ *
+ * Both TLB fills and accesses to pages holding a watchpoint used to walk
+ * the whole watchpoint list, which does not scale to thousands of
+ * watchpoints.  The index keeps the watchpoints sorted by start address
+ * along with the running maximum of their last bytes, so the ones
+ * overlapping a range are found by a binary search and a short walk back.
+ * It also caches, per watched page, bitmaps of the bytes watched for
+ * reads and for writes; accesses to the unwatched part of a watched page
+ * then only cost a bit test.  Changing the watchpoints marks the index
+ * stale, it is rebuilt on next use.
+ */
+typedef struct CPUWatchpointPage {
+    vaddr addr;
+    bool any_read;
+    unsigned long *read;
+    unsigned long *write;
+    unsigned long bits[];       /* storage for both bitmaps */
+} CPUWatchpointPage;
+
+typedef struct CPUWatchpointIndex {
+    bool stale;
+    bool hit_flags;             /* some watchpoint may carry a HIT flag */
+
+    unsigned nr;
+    CPUWatchpoint **wps;        /* sorted by vaddr */
+    vaddr *max_end;             /* last byte, maximum over wps[0..i] */
+
+    GHashTable *pages;          /* page address -> CPUWatchpointPage */
+    GPtrArray *found;           /* scratch for check_watchpoint */
+} CPUWatchpointIndex;
+
+/* Beyond this many pages, flush the whole TLB instead of page by page */
+#define WATCHPOINT_FLUSH_PAGES 16
+
+static inline vaddr watchpoint_end(CPUWatchpoint *wp)
+{
+    return wp->vaddr + wp->len - 1;
+}
+
+static guint watchpoint_page_hash(gconstpointer v)
+{
+    return *(const vaddr *)v >> TARGET_PAGE_BITS;
+}
+
+static gboolean watchpoint_page_equal(gconstpointer a, gconstpointer b)
+{
+    return *(const vaddr *)a == *(const vaddr *)b;
+}
+
+static CPUWatchpointIndex *watchpoint_index(CPUState *cpu)
+{
+    CPUWatchpointIndex *idx = cpu->watchpoint_index;
+
+    if (!idx) {
+        idx = g_new0(CPUWatchpointIndex, 1);
+        idx->pages = g_hash_table_new_full(watchpoint_page_hash,
+                                           watchpoint_page_equal,
+                                           NULL, g_free);
+        idx->found = g_ptr_array_new();
+        idx->stale = true;
+        cpu->watchpoint_index = idx;
+    }
+    return idx;
+}
+
+static void cpu_watchpoint_index_free(CPUState *cpu)
+{
+    CPUWatchpointIndex *idx = cpu->watchpoint_index;
+
+    if (!idx) {
+        return;
+    }
+    g_hash_table_destroy(idx->pages);
+    g_ptr_array_free(idx->found, true);
+    g_free(idx->wps);
+    g_free(idx->max_end);
+    g_free(idx);
+    cpu->watchpoint_index = NULL;
+}
+
+static int watchpoint_cmp_vaddr(const void *a, const void *b)
+{
+    CPUWatchpoint *x = *(CPUWatchpoint **)a, *y = *(CPUWatchpoint **)b;
+
+    return x->vaddr < y->vaddr ? -1 : x->vaddr > y->vaddr;
+}
+
+static CPUWatchpointIndex *watchpoint_index_get(CPUState *cpu)
+{
+    CPUWatchpointIndex *idx = watchpoint_index(cpu);
+    CPUWatchpoint *wp;
+    unsigned i;
+
+    if (!idx->stale) {
+        return idx;
+    }
+
+    idx->nr = 0;
+    QTAILQ_FOREACH(wp, &cpu->watchpoints, entry) {
+        idx->nr++;
+    }
+    idx->wps = g_renew(CPUWatchpoint *, idx->wps, idx->nr);
+    idx->max_end = g_renew(vaddr, idx->max_end, idx->nr);
+
+    i = 0;
+    QTAILQ_FOREACH(wp, &cpu->watchpoints, entry) {
+        idx->wps[i++] = wp;
+    }
+    qsort(idx->wps, idx->nr, sizeof(*idx->wps), watchpoint_cmp_vaddr);
+    for (i = 0; i < idx->nr; i++) {
+        idx->max_end[i] = watchpoint_end(idx->wps[i]);
+        if (i && idx->max_end[i - 1] > idx->max_end[i]) {
+            idx->max_end[i] = idx->max_end[i - 1];
+        }
+    }
+
+    g_hash_table_remove_all(idx->pages);
+    idx->stale = false;
+    return idx;
+}
+
+/* Append the watchpoints overlapping [addr, addr + len) to @found */
+static void watchpoint_index_find(CPUWatchpointIndex *idx, vaddr addr,
+                                  vaddr len, GPtrArray *found)
+{
+    vaddr end = addr + len - 1;
+    int lo = 0, hi = idx->nr, i;
+
+    /* The first watchpoint starting after @end */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (idx->wps[mid]->vaddr <= end) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (i = lo - 1; i >= 0 && idx->max_end[i] >= addr; i--) {
+        if (watchpoint_end(idx->wps[i]) >= addr) {
+            g_ptr_array_add(found, idx->wps[i]);
+        }
+    }
+}
+
+/* The watched bytes of the page at @addr, NULL if there are none */
+static CPUWatchpointPage *watchpoint_page(CPUState *cpu, vaddr addr)
+{
+    CPUWatchpointIndex *idx = watchpoint_index_get(cpu);
+    CPUWatchpointPage *page;
+    unsigned i, n;
+
+    addr &= TARGET_PAGE_MASK;
+    page = g_hash_table_lookup(idx->pages, &addr);
+    if (page) {
+        return page;
+    }
+
+    g_ptr_array_set_size(idx->found, 0);
+    watchpoint_index_find(idx, addr, TARGET_PAGE_SIZE, idx->found);
+    if (!idx->found->len) {
+        return NULL;
+    }
+
+    n = BITS_TO_LONGS(TARGET_PAGE_SIZE);
+    page = g_malloc0(sizeof(*page) + 2 * n * sizeof(unsigned long));
+    page->addr = addr;
+    page->read = page->bits;
+    page->write = page->bits + n;
+    for (i = 0; i < idx->found->len; i++) {
+        CPUWatchpoint *wp = g_ptr_array_index(idx->found, i);
+        vaddr start = MAX(wp->vaddr, addr) - addr;
+        vaddr last = MIN(watchpoint_end(wp), addr + TARGET_PAGE_SIZE - 1) - addr;
+
+        if (wp->flags & BP_MEM_READ) {
+            bitmap_set(page->read, start, last - start + 1);
+            page->any_read = true;
+        }
+        if (wp->flags & BP_MEM_WRITE) {
+            bitmap_set(page->write, start, last - start + 1);
+        }
+    }
+    g_hash_table_insert(idx->pages, &page->addr, page);
+    return page;
+}
+
+static void watchpoint_changed(CPUState *cpu, CPUWatchpoint *wp)
+{
+    vaddr page = wp->vaddr & TARGET_PAGE_MASK;
+    vaddr last = watchpoint_end(wp) & TARGET_PAGE_MASK;
+
+    watchpoint_index(cpu)->stale = true;
+
+    /* Every page of the watchpoint needs a new TLB entry */
+    if ((last - page) >> TARGET_PAGE_BITS >= WATCHPOINT_FLUSH_PAGES) {
+        tlb_flush(cpu, 1);
+        return;
+    }
+    for (;;) {
+        tlb_flush_page(cpu, page);
+        if (page == last) {
+            break;
+        }
+        page += TARGET_PAGE_SIZE;
+    }
+}
+
 /* Add a watchpoint.  */
 int cpu_watchpoint_insert(CPUState *cpu, vaddr addr, vaddr len,
                           int flags, CPUWatchpoint **watchpoint)
@@ -754,7 +971,7 @@ int cpu_watchpoint_insert(CPUState *cpu, vaddr addr, vaddr len,
         QTAILQ_INSERT_TAIL(&cpu->watchpoints, wp, entry);
     }
 
-    tlb_flush_page(cpu, addr);
+    watchpoint_changed(cpu, wp);
 
     if (watchpoint)
         *watchpoint = wp;
@@ -782,7 +999,7 @@ void cpu_watchpoint_remove_by_ref(CPUState *cpu, CPUWatchpoint *watchpoint)
 {
     QTAILQ_REMOVE(&cpu->watchpoints, watchpoint, entry);
 
-    tlb_flush_page(cpu, watchpoint->vaddr);
+    watchpoint_changed(cpu, watchpoint);
 
     g_free(watchpoint);
 }
@@ -1042,7 +1259,7 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
                                        target_ulong *address)
 {
     hwaddr iotlb;
-    CPUWatchpoint *wp;
+    CPUWatchpointPage *page;
 
     if (memory_region_is_ram(section->mr)) {
         /* Normal RAM.  */
@@ -1062,14 +1279,12 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
 
     /* Make accesses to pages with watchpoints go via the
        watchpoint trap routines.  */
-    QTAILQ_FOREACH(wp, &cpu->watchpoints, entry) {
-        if (cpu_watchpoint_address_matches(wp, vaddr, TARGET_PAGE_SIZE)) {
-            /* Avoid trapping reads of pages with a write breakpoint. */
-            if ((prot & PAGE_WRITE) || (wp->flags & BP_MEM_READ)) {
-                iotlb = PHYS_SECTION_WATCH + paddr;
-                *address |= TLB_MMIO;
-                break;
-            }
+    if (!QTAILQ_EMPTY(&cpu->watchpoints)) {
+        page = watchpoint_page(cpu, vaddr);
+        /* Avoid trapping reads of pages with a write breakpoint. */
+        if (page && ((prot & PAGE_WRITE) || page->any_read)) {
+            iotlb = PHYS_SECTION_WATCH + paddr;
+            *address |= TLB_MMIO;
         }
     }
 
@@ -2071,6 +2286,21 @@ static const MemoryRegionOps notdirty_mem_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+/* Whether an access touches a byte watched for it, see watchpoint_page */
+static bool watchpoint_page_hit(CPUState *cpu, vaddr addr, int len, int flags)
+{
+    CPUWatchpointPage *page = watchpoint_page(cpu, addr);
+    unsigned long *watched;
+    unsigned long offset = addr & ~TARGET_PAGE_MASK;
+    unsigned long end = MIN(offset + len, TARGET_PAGE_SIZE);
+
+    if (!page) {
+        return false;
+    }
+    watched = flags == BP_MEM_READ ? page->read : page->write;
+    return find_next_bit(watched, end, offset) < end;
+}
+
 /* Generate a debug exception if a watchpoint has been hit.  */
 static void check_watchpoint(int offset, int len, MemTxAttrs attrs, int flags)
 {
@@ -2079,6 +2309,7 @@ static void check_watchpoint(int offset, int len, MemTxAttrs attrs, int flags)
     CPUArchState *env = cpu->env_ptr;
     target_ulong pc, cs_base;
     target_ulong vaddr;
+    CPUWatchpointIndex *idx;
     CPUWatchpoint *wp;
     uint32_t cpu_flags;
 
@@ -2090,6 +2321,19 @@ static void check_watchpoint(int offset, int len, MemTxAttrs attrs, int flags)
         return;
     }
     vaddr = (cpu->mem_io_vaddr & TARGET_PAGE_MASK) + offset;
+    idx = watchpoint_index(cpu);
+    if (!watchpoint_page_hit(cpu, vaddr, len, flags)) {
+        /* No watchpoint matches, so none may keep a hit from before */
+        if (idx->hit_flags) {
+            QTAILQ_FOREACH(wp, &cpu->watchpoints, entry) {
+                wp->flags &= ~BP_WATCHPOINT_HIT;
+            }
+            idx->hit_flags = false;
+        }
+        return;
+    }
+
+    idx->hit_flags = true;
     QTAILQ_FOREACH(wp, &cpu->watchpoints, entry) {
         if (cpu_watchpoint_address_matches(wp, vaddr, len)
             && (wp->flags & flags)) {
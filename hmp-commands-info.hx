@@ -259,6 +259,35 @@ STEXI
 @item info mtree
 @findex mtree
 Show memory tree.
+ETEXI
+
+    {
+        .name       = "avatar",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show avatar forwarding statistics",
+        .cmd        = hmp_info_avatar,
+    },
+
+STEXI
+@item info avatar
+@findex avatar
+Show statistics of the avatar interrupt forwarding and injection channels.
+ETEXI
+
+    {
+        .name       = "mmio-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show per-region MMIO access statistics",
+        .cmd        = hmp_info_mmio_stats,
+    },
+
+STEXI
+@item info mmio-stats
+@findex mmio-stats
+Show the access counts and latencies of the memory regions with MMIO
+statistics enabled (see the @code{avatar-mmio-stats-set} QMP command).
 ETEXI
 
     {
@@ -0,0 +1,177 @@
+/*
+ * STM32 ADC sample source
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "hw/adc/stm32_adc_samples.h"
+
+/* Frames buffered from a pipe */
+#define STM32_ADC_SAMPLES_PIPE_FRAMES 256
+
+struct STM32ADCSamples {
+    unsigned int channels;
+    uint32_t rate;
+    size_t stride;              /* bytes per frame */
+    int64_t start_ns;
+
+    /* Mapped file */
+    uint8_t *map;
+    size_t map_size;
+    uint64_t frames;
+
+    /*
+     * Pipe: buf holds the frames starting at buf_index, followed by the
+     * part of a frame that has been read so far.
+     */
+    int fd;
+    uint8_t *buf;
+    size_t buf_size;
+    size_t fill;
+    uint64_t buf_index;
+};
+
+STM32ADCSamples *stm32_adc_samples_open(const char *path,
+                                        unsigned int channels,
+                                        uint32_t rate, Error **errp)
+{
+    STM32ADCSamples *s;
+    struct stat st;
+    int fd;
+
+    if (!channels || !rate) {
+        error_setg(errp, "ADC samples need a channel count and a rate");
+        return NULL;
+    }
+
+    fd = qemu_open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "cannot open ADC samples '%s'", path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "cannot stat ADC samples '%s'", path);
+        qemu_close(fd);
+        return NULL;
+    }
+
+    s = g_new0(STM32ADCSamples, 1);
+    s->channels = channels;
+    s->rate = rate;
+    s->stride = channels * sizeof(uint16_t);
+    s->start_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    s->fd = -1;
+
+    if (S_ISREG(st.st_mode)) {
+        s->frames = st.st_size / s->stride;
+        if (!s->frames) {
+            error_setg(errp, "ADC samples '%s' hold no complete frame", path);
+            goto fail;
+        }
+        s->map_size = s->frames * s->stride;
+        s->map = mmap(NULL, s->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (s->map == MAP_FAILED) {
+            error_setg_errno(errp, errno, "cannot map ADC samples '%s'",
+                             path);
+            goto fail;
+        }
+        qemu_close(fd);
+    } else {
+        s->fd = fd;
+        s->buf_size = STM32_ADC_SAMPLES_PIPE_FRAMES * s->stride;
+        s->buf = g_malloc(s->buf_size);
+    }
+    return s;
+
+fail:
+    qemu_close(fd);
+    g_free(s);
+    return NULL;
+}
+
+void stm32_adc_samples_close(STM32ADCSamples *s)
+{
+    if (!s) {
+        return;
+    }
+    if (s->map) {
+        munmap(s->map, s->map_size);
+    }
+    if (s->fd >= 0) {
+        qemu_close(s->fd);
+    }
+    g_free(s->buf);
+    g_free(s);
+}
+
+/* Frame @index of a pipe, or the newest one if the writer is behind */
+static const uint8_t *stm32_adc_samples_pipe_frame(STM32ADCSamples *s,
+                                                   uint64_t index)
+{
+    uint64_t avail, drop;
+    ssize_t n;
+
+    for (;;) {
+        avail = s->fill / s->stride;
+
+        /* Frames before @index are never needed again */
+        if (avail > 1 && index > s->buf_index) {
+            drop = MIN(index - s->buf_index, avail - 1);
+            memmove(s->buf, s->buf + drop * s->stride,
+                    s->fill - drop * s->stride);
+            s->fill -= drop * s->stride;
+            s->buf_index += drop;
+            avail -= drop;
+        }
+        if (avail && s->buf_index + avail > index) {
+            break;
+        }
+
+        n = read(s->fd, s->buf + s->fill, s->buf_size - s->fill);
+        if (n <= 0) {
+            /* Nothing more for now, or the writer is gone */
+            break;
+        }
+        s->fill += n;
+    }
+
+    if (!avail) {
+        return NULL;
+    }
+    if (index < s->buf_index) {
+        return s->buf;
+    }
+    return s->buf + MIN(index - s->buf_index, avail - 1) * s->stride;
+}
+
+bool stm32_adc_samples_get(STM32ADCSamples *s, unsigned int channel,
+                           uint16_t *value)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint64_t index = muldiv64(MAX(now - s->start_ns, 0), s->rate,
+                              NANOSECONDS_PER_SECOND);
+    const uint8_t *frame;
+
+    if (channel >= s->channels) {
+        return false;
+    }
+
+    if (s->map) {
+        frame = s->map + (index % s->frames) * s->stride;
+    } else {
+        frame = stm32_adc_samples_pipe_frame(s, index);
+        if (!frame) {
+            return false;
+        }
+    }
+
+    *value = lduw_le_p(frame + channel * sizeof(uint16_t));
+    return true;
+}
@@ -41,6 +41,14 @@
 
 #define DB_PRINT(fmt, args...) DB_PRINT_L(1, fmt, ## args)
 
+/* A regular conversion result is ready whenever a conversion was started */
+static void stm32f2xx_adc_update_dma(STM32F2XXADCState *s)
+{
+    qemu_set_irq(s->dma, (s->adc_cr2 & ADC_CR2_ADON) &&
+                         (s->adc_cr2 & ADC_CR2_DMA) &&
+                         (s->adc_cr2 & ADC_CR2_SWSTART));
+}
+
 static void stm32f2xx_adc_reset(DeviceState *dev)
 {
     STM32F2XXADCState *s = STM32F2XX_ADC(dev);
@@ -65,12 +73,24 @@ static void stm32f2xx_adc_reset(DeviceState *dev)
     s->adc_jdr[2] = 0x00000000;
     s->adc_jdr[3] = 0x00000000;
     s->adc_dr = 0x00000000;
+
+    stm32f2xx_adc_update_dma(s);
 }
 
 static uint32_t stm32f2xx_adc_generate_value(STM32F2XXADCState *s)
 {
-    /* Attempts to fake some ADC values */
-    s->adc_dr = s->adc_dr + 7;
+    uint16_t sample;
+
+    if (s->samples &&
+        stm32_adc_samples_get(s->samples, s->adc_sqr3 & ADC_SQR3_SQ1,
+                              &sample)) {
+        /* Traces are recorded at the full 12-bit resolution */
+        s->adc_dr = (sample & 0xFFF) >>
+                    (2 * ((s->adc_cr1 & ADC_CR1_RES) >> 24));
+    } else {
+        /* Attempts to fake some ADC values */
+        s->adc_dr = s->adc_dr + 7;
+    }
 
     switch ((s->adc_cr1 & ADC_CR1_RES) >> 24) {
     case 0:
@@ -154,7 +174,11 @@ static uint64_t stm32f2xx_adc_read(void *opaque, hwaddr addr,
                s->adc_jofr[(addr - ADC_JDR1) / 4];
     case ADC_DR:
         if ((s->adc_cr2 & ADC_CR2_ADON) && (s->adc_cr2 & ADC_CR2_SWSTART)) {
-            s->adc_cr2 ^= ADC_CR2_SWSTART;
+            /* In continuous mode the next conversion starts right away */
+            if (!(s->adc_cr2 & ADC_CR2_CONT)) {
+                s->adc_cr2 ^= ADC_CR2_SWSTART;
+                stm32f2xx_adc_update_dma(s);
+            }
             return stm32f2xx_adc_generate_value(s);
         } else {
             return 0;
@@ -190,6 +214,7 @@ static void stm32f2xx_adc_write(void *opaque, hwaddr addr,
         break;
     case ADC_CR2:
         s->adc_cr2 = value;
+        stm32f2xx_adc_update_dma(s);
         break;
     case ADC_SMPR1:
         s->adc_smpr1 = value;
@@ -276,18 +301,38 @@ static void stm32f2xx_adc_init(Object *obj)
     STM32F2XXADCState *s = STM32F2XX_ADC(obj);
 
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+    qdev_init_gpio_out_named(DEVICE(obj), &s->dma, "dma", 1);
 
     memory_region_init_io(&s->mmio, obj, &stm32f2xx_adc_ops, s,
                           TYPE_STM32F2XX_ADC, 0xFF);
     sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
 }
 
+static void stm32f2xx_adc_realize(DeviceState *dev, Error **errp)
+{
+    STM32F2XXADCState *s = STM32F2XX_ADC(dev);
+
+    if (s->samples_path) {
+        /* One sample per channel (0 to 18) in each frame */
+        s->samples = stm32_adc_samples_open(s->samples_path, 19,
+                                            s->sample_rate, errp);
+    }
+}
+
+static Property stm32f2xx_adc_properties[] = {
+    DEFINE_PROP_STRING("samples", STM32F2XXADCState, samples_path),
+    DEFINE_PROP_UINT32("sample-rate", STM32F2XXADCState, sample_rate, 1000000),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void stm32f2xx_adc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->reset = stm32f2xx_adc_reset;
     dc->vmsd = &vmstate_stm32f2xx_adc;
+    dc->props = stm32f2xx_adc_properties;
+    dc->realize = stm32f2xx_adc_realize;
 }
 
 static const TypeInfo stm32f2xx_adc_info = {
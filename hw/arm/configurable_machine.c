@@ -9,6 +9,8 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qapi/util.h"
 #include "hw/hw.h"
 #include "sysemu/sysemu.h"
 #include "hw/arm/arm.h"
@@ -23,16 +25,29 @@
 #include "exec/memory.h"
 #include "target-arm/cpu.h"
 #include "qemu/thread.h"
+#include "sysemu/cpus.h"
 #include "exec/ram_addr.h"
 #include "avatar/irq.h"
 #include "avatar/avatar-io.h"
+#include "avatar/shared-lock.h"
+#include "avatar/fork-server.h"
+#include "avatar/snapshot.h"
+#include "avatar/coverage.h"
+#include "avatar/poll.h"
+#include "avatar/mmio-trace.h"
+#include "avatar/mmio-stats.h"
+#include "avatar/board-desc.h"
+#include "trace.h"
 
 #define QDICT_ASSERT_KEY_TYPE(_dict, _key, _type) \
     g_assert(qdict_haskey(_dict, _key) && qobject_type(qdict_get(_dict, _key)) == _type)
 
 /* Board init.  */
 
-static QDict * load_configuration(const char * filename)
+/* The board-cache machine property, NULL for the default */
+static char *board_cache;
+
+static QDict * parse_configuration(const char * filename)
 {
     int file = open(filename, O_RDONLY);
     off_t filesize = lseek(file, 0, SEEK_END);
@@ -74,33 +89,133 @@ static QDict * load_configuration(const char * filename)
     return qobject_to_qdict(obj);
 }
 
+/*
+ * The configuration is either JSON or a compiled description (see
+ * avatar/board-desc.h).  JSON is compiled on first use, and later
+ * instances load the compiled form as long as the JSON is unchanged.
+ * The cache goes to the machine's board-cache property, by default
+ * <filename>.avbd next to the JSON; board-cache=off disables it.
+ */
+static QDict * load_configuration(const char * filename,
+                                  const char * cache_path)
+{
+    char *cache = NULL;
+    int64_t start = get_clock();
+    const char *source = "compiled description";
+    Error *err = NULL;
+    struct stat st;
+    QObject *obj;
+
+    if(!cache_path)
+    {
+        cache = g_strconcat(filename, ".avbd", NULL);
+    }
+    else if(strcmp(cache_path, "off"))
+    {
+        cache = g_strdup(cache_path);
+    }
+
+    if(avatar_board_desc_probe(filename))
+    {
+        obj = avatar_board_desc_load(filename, NULL, &error_fatal);
+    }
+    else
+    {
+        source = "cache";
+        obj = NULL;
+        if(cache)
+        {
+            obj = avatar_board_desc_load(cache, filename, &err);
+            error_free(err);
+            err = NULL;
+        }
+        if(!obj)
+        {
+            source = "JSON";
+            /*
+             * Stamp the cache with the JSON as it was before parsing, so
+             * that an edit while we parse makes it stale rather than
+             * stamping the old contents with the new size and mtime.
+             */
+            if(cache && stat(filename, &st) < 0)
+            {
+                error_report("warning: cannot stat '%s', not caching it: %s",
+                             filename, strerror(errno));
+                g_free(cache);
+                cache = NULL;
+            }
+            obj = QOBJECT(parse_configuration(filename));
+            if(cache)
+            {
+                /* Only a cache, carry on without it */
+                avatar_board_desc_save(cache, &st, obj, &err);
+                if(err)
+                {
+                    error_report("warning: %s; set board-cache to a writable "
+                                 "path or to off", error_get_pretty(err));
+                    error_free(err);
+                }
+            }
+        }
+    }
+    g_free(cache);
+
+    if (qobject_type(obj) != QTYPE_QDICT)
+    {
+        fprintf(stderr, "Configuration is not a JSON object\n");
+        exit(1);
+    }
+
+    trace_configurable_load_configuration(filename, source,
+                                          (get_clock() - start) / 1000);
+    return qobject_to_qdict(obj);
+}
+
 static void dispatch_interrupt(void *opaque, int irq, int level)
 {
     if(opaque == NULL)
         return;
 
-    //SysBusDevice *sb = SYS_BUS_DEVICE(opaque);
-    //MemoryRegion *mr;
-    IRQ_MSG msg = {
-        .irq_num = irq,
-        .level = level
-    };
+    avatar_irq_forward(irq, level);
+}
+
+static void thread_safe_acquire(MemoryRegion *mr)
+{
+    int64_t start;
 
-    //mr = sysbus_mmio_get_region(sb, 0);
+    if(!mr->avatar_stats)
+    {
+        avatar_shared_lock_acquire(mr->shared_lock);
+        return;
+    }
 
-    qemu_avatar_mq_send(&IrqMQ, &msg, sizeof(msg));
+    start = get_clock();
+    avatar_shared_lock_acquire(mr->shared_lock);
+    avatar_mmio_stats_lock_wait(mr, get_clock() - start);
 }
 
 static uint64_t thread_safe_read(void *opaque, hwaddr addr, unsigned size)
 {
     MemoryRegion *mr = (MemoryRegion *) opaque;
+    AvatarSharedLock *lock = mr->shared_lock;
+    void *op = mr->real_opaque;
+    uint64_t ret;
 
-    qemu_avatar_sem_wait(&(mr->semaphore));
+    if(avatar_shared_lock_mode(lock) == AVATAR_SHARED_LOCK_SEQLOCK)
+    {
+        unsigned seq;
 
-    void *op = mr->real_opaque;
-    uint64_t ret = mr->real_ops->read(op, addr, size);
+        do {
+            seq = avatar_shared_lock_read_begin(lock);
+            ret = mr->real_ops->read(op, addr, size);
+        } while(avatar_shared_lock_read_retry(lock, seq));
+
+        return ret;
+    }
 
-    qemu_avatar_sem_post(&(mr->semaphore));
+    thread_safe_acquire(mr);
+    ret = mr->real_ops->read(op, addr, size);
+    avatar_shared_lock_release(lock);
 
     return ret;
 }
@@ -109,12 +224,12 @@ static void thread_safe_write(void *opaque, hwaddr addr, uint64_t data, unsigned
 {
     MemoryRegion *mr = (MemoryRegion *) opaque;
 
-    qemu_avatar_sem_wait(&(mr->semaphore));
+    thread_safe_acquire(mr);
 
     void *op = mr->real_opaque;
     mr->real_ops->write(op, addr, data, size);
 
-    qemu_avatar_sem_post(&(mr->semaphore));
+    avatar_shared_lock_release(mr->shared_lock);
 
 }
 
@@ -126,7 +241,8 @@ static const MemoryRegionOps thared_safe_ops = {
 
 static void load_program(QDict *conf, ARMCPU *cpu);
 
-static void make_device_shareble(SysBusDevice *sb, const char *sem_name)
+static void make_device_shareble(SysBusDevice *sb, const char *sem_name,
+                                 AvatarSharedLockMode mode)
 {
     MemoryRegion *mr;
 
@@ -138,11 +254,128 @@ static void make_device_shareble(SysBusDevice *sb, const char *sem_name)
     mr->real_opaque = mr->opaque;
     mr->opaque = mr;
     mr->ops = &thared_safe_ops;
-    qemu_avatar_sem_open(&(mr->semaphore), sem_name);
+    mr->shared_lock = avatar_shared_lock_open(sem_name, mode, &error_fatal);
 }
 
 static QDict *peripherals;
 
+/*
+ * "fork_server": { "pc": <address> } and/or { "marker": <address> } boots
+ * once up to the trigger and then serves forks to an AFL-style fuzzer.
+ */
+static void make_fork_server(QDict *conf, ARMCPU *cpu)
+{
+    QDict *fs;
+
+    if(!qdict_haskey(conf, "fork_server"))
+        return;
+
+    QDICT_ASSERT_KEY_TYPE(conf, "fork_server", QTYPE_QDICT);
+    fs = qdict_get_qdict(conf, "fork_server");
+
+    avatar_fork_server_init();
+    if(qdict_haskey(fs, "pc"))
+    {
+        QDICT_ASSERT_KEY_TYPE(fs, "pc", QTYPE_QINT);
+        avatar_fork_server_set_pc(CPU(cpu), qdict_get_int(fs, "pc"));
+    }
+    if(qdict_haskey(fs, "marker"))
+    {
+        QDICT_ASSERT_KEY_TYPE(fs, "marker", QTYPE_QINT);
+        avatar_fork_server_add_marker(get_system_memory(),
+                                      qdict_get_int(fs, "marker"));
+    }
+}
+
+static DeviceState *nvic;
+static uint32_t nvic_num_irq;
+
+/*
+ * M-profile CPUs get an NVIC when "num_irq" is given or when the peer
+ * wants to inject interrupts.
+ */
+static void make_nvic(QDict *conf, ARMCPU *cpu)
+{
+    if(!arm_feature(&cpu->env, ARM_FEATURE_M) ||
+       (!qdict_haskey(conf, "num_irq") && !qdict_haskey(conf, "irq_inject_mq")))
+    {
+        return;
+    }
+
+    nvic_num_irq = 64;
+    if(qdict_haskey(conf, "num_irq"))
+    {
+        QDICT_ASSERT_KEY_TYPE(conf, "num_irq", QTYPE_QINT);
+        nvic_num_irq = qdict_get_int(conf, "num_irq");
+    }
+
+    nvic = qdev_create(NULL, "armv7m_nvic");
+    qdev_prop_set_uint32(nvic, "num-irq", nvic_num_irq);
+    cpu->env.nvic = nvic;
+    qdev_init_nofail(nvic);
+    sysbus_connect_irq(SYS_BUS_DEVICE(nvic), 0,
+                       qdev_get_gpio_in(DEVICE(cpu), ARM_CPU_IRQ));
+}
+
+static void inject_interrupt(void *opaque, const AvatarIrqInjectMessage *msg)
+{
+    if(msg->irq_num >= nvic_num_irq)
+    {
+        return;
+    }
+
+    if(msg->mode == AVATAR_IRQ_INJECT_PEND)
+    {
+        /* The NVIC uses exception numbers, external interrupts start at 16 */
+        armv7m_nvic_set_pending(nvic, 16 + msg->irq_num);
+    }
+    else
+    {
+        qemu_set_irq(qdev_get_gpio_in(nvic, msg->irq_num), msg->level);
+    }
+}
+
+/*
+ * "avatar_transport" selects how the irq/io queues are carried: "mq" (POSIX
+ * message queues, the default) or "ring" (shared-memory rings, in which case
+ * the queue names are used as shared memory object names).
+ */
+static void parse_transport(QDict *conf, AvatarTransportOptions *transport)
+{
+    transport->type = AVATAR_TRANSPORT_MQ;
+    transport->ring_size = 0;
+    transport->broker_path = NULL;
+
+    if(qdict_haskey(conf, "avatar_transport"))
+    {
+        QDICT_ASSERT_KEY_TYPE(conf, "avatar_transport", QTYPE_QSTRING);
+        const char *name = qdict_get_str(conf, "avatar_transport");
+        if(!avatar_transport_parse(name, &transport->type))
+        {
+            fprintf(stderr, "Unknown avatar transport %s\n", name);
+            exit(1);
+        }
+    }
+
+    if(qdict_haskey(conf, "avatar_ring_size"))
+    {
+        QDICT_ASSERT_KEY_TYPE(conf, "avatar_ring_size", QTYPE_QINT);
+        transport->ring_size = qdict_get_int(conf, "avatar_ring_size");
+    }
+
+    /* Unix socket of the broker multiplexing all channels, see avatar/broker.h */
+    if(transport->type == AVATAR_TRANSPORT_BROKER)
+    {
+        if(!qdict_haskey(conf, "avatar_broker"))
+        {
+            fprintf(stderr, "The broker transport requires avatar_broker\n");
+            exit(1);
+        }
+        QDICT_ASSERT_KEY_TYPE(conf, "avatar_broker", QTYPE_QSTRING);
+        transport->broker_path = qdict_get_str(conf, "avatar_broker");
+    }
+}
+
 static void set_properties(DeviceState *dev, QList *properties)
 {
     QListEntry *entry;
@@ -185,6 +418,18 @@ static void set_properties(DeviceState *dev, QList *properties)
             const int value = qdict_get_int(property, "value");
             qdev_prop_set_uint32(dev, name, value);
         }
+        else if(!strcmp(type, "uint64"))
+        {
+            QDICT_ASSERT_KEY_TYPE(property, "value", QTYPE_QINT);
+            const uint64_t value = qdict_get_int(property, "value");
+            qdev_prop_set_uint64(dev, name, value);
+        }
+        else if(!strcmp(type, "bool"))
+        {
+            QDICT_ASSERT_KEY_TYPE(property, "value", QTYPE_QBOOL);
+            const bool value = qdict_get_bool(property, "value");
+            qdev_prop_set_bit(dev, name, value);
+        }
         else if(!strcmp(type, "device"))
         {
             QDICT_ASSERT_KEY_TYPE(property, "value", QTYPE_QSTRING);
@@ -195,7 +440,8 @@ static void set_properties(DeviceState *dev, QList *properties)
     }
 }
 
-static SysBusDevice *make_configurable_device(const char *qemu_name, uint64_t address, QList *properties)
+static SysBusDevice *make_configurable_device(const char *qemu_name, uint64_t address,
+                                              QList *properties, int irq_line)
 {
     DeviceState *dev;
     SysBusDevice *s;
@@ -209,9 +455,10 @@ static SysBusDevice *make_configurable_device(const char *qemu_name, uint64_t ad
 
     s = SYS_BUS_DEVICE(dev);
     sysbus_mmio_map(s, 0, address);
-    if(qemu_avatar_mq_get_fd(&IrqMQ))
+    if(avatar_channel_is_valid(&IrqMQ) && sysbus_has_irq(s, 0))
     {
-        irq = qemu_allocate_irq(dispatch_interrupt, dev, 1);
+        irq = qemu_allocate_irq(dispatch_interrupt, dev, irq_line);
+        avatar_irq_add_source(irq_line);
         sysbus_connect_irq(s, 0, irq);
     }
 
@@ -228,11 +475,12 @@ static void board_init(MachineState * ms)
     ARMCPU *cpuu;
     CPUState *cpu;
     QDict * conf = NULL;
+    AvatarTransportOptions transport;
 
     //Load configuration file
     if (kernel_filename)
     {
-        conf = load_configuration(kernel_filename);
+        conf = load_configuration(kernel_filename, board_cache);
     }
     else
     {
@@ -269,12 +517,61 @@ static void board_init(MachineState * ms)
     }
 
     load_program(conf, cpuu);
+    make_nvic(conf, cpuu);
+
+    parse_transport(conf, &transport);
+
+    if(qdict_haskey(conf, "mmio_trace_file"))
+    {
+        uint32_t records = 0;
+
+        QDICT_ASSERT_KEY_TYPE(conf, "mmio_trace_file", QTYPE_QSTRING);
+        if(qdict_haskey(conf, "mmio_trace_records"))
+        {
+            QDICT_ASSERT_KEY_TYPE(conf, "mmio_trace_records", QTYPE_QINT);
+            records = qdict_get_int(conf, "mmio_trace_records");
+        }
+        avatar_mmio_trace_open(qdict_get_str(conf, "mmio_trace_file"),
+                               records, &error_fatal);
+    }
 
     if(qdict_haskey(conf, "irq_mq"))
     {
         QDICT_ASSERT_KEY_TYPE(conf, "irq_mq", QTYPE_QSTRING);
         const char *mq_name = qdict_get_str(conf, "irq_mq");
-        qemu_avatar_mq_open_write(&IrqMQ, mq_name, sizeof(IRQ_MSG));
+        avatar_channel_open_write(&IrqMQ, &transport, mq_name,
+                                  sizeof(IRQ_MSG), &error_fatal);
+        avatar_irq_forward_init(&IrqMQ);
+
+        /* Optional list of the only interrupt lines the peer wants */
+        if(qdict_haskey(conf, "irq_forward"))
+        {
+            QListEntry *entry;
+            QList *lines = qobject_to_qlist(qdict_get(conf, "irq_forward"));
+            g_assert(lines);
+
+            avatar_irq_subscribe_all(false);
+            QLIST_FOREACH_ENTRY(lines, entry)
+            {
+                g_assert(qobject_type(entry->value) == QTYPE_QINT);
+                avatar_irq_subscribe(qint_get_int(qobject_to_qint(entry->value)), true);
+            }
+        }
+    }
+
+    if(qdict_haskey(conf, "irq_inject_mq"))
+    {
+        QDICT_ASSERT_KEY_TYPE(conf, "irq_inject_mq", QTYPE_QSTRING);
+        const char *mq_name = qdict_get_str(conf, "irq_inject_mq");
+
+        if(!nvic)
+        {
+            fprintf(stderr, "IRQ injection requires an M-profile CPU\n");
+            exit(1);
+        }
+        avatar_channel_open_read(&IrqInjectMQ, &transport, mq_name,
+                                 sizeof(AvatarIrqInjectMessage), &error_fatal);
+        avatar_irq_inject_init(&IrqInjectMQ, inject_interrupt, NULL);
     }
 
     if(qdict_haskey(conf, "io_request_mq"))
@@ -288,15 +585,35 @@ static void board_init(MachineState * ms)
         QDICT_ASSERT_KEY_TYPE(conf, "io_request_mq", QTYPE_QSTRING);
         QDICT_ASSERT_KEY_TYPE(conf, "io_response_mq", QTYPE_QSTRING);
         const char *mq_name = qdict_get_str(conf, "io_request_mq");
-        int fd;
-        qemu_avatar_mq_open_read(&ioRequestMQ, mq_name,
-                                 sizeof(AvatarIORequestMessage));
-        fd = qemu_avatar_mq_get_fd(&ioRequestMQ);
-        qemu_set_fd_handler(fd, avatar_serve_io, NULL, NULL);
+        size_t max_msg_size = 0;
+
+        /*
+         * Bulk requests need large messages.  Rings can always carry them,
+         * message queues only when "io_max_msg_size" is raised (and the
+         * host's fs.mqueue.msgsize_max allows it).
+         */
+        if(transport.type == AVATAR_TRANSPORT_RING)
+        {
+            max_msg_size = AVATAR_IO_MAX_MSG_SIZE;
+        }
+        if(qdict_haskey(conf, "io_max_msg_size"))
+        {
+            QDICT_ASSERT_KEY_TYPE(conf, "io_max_msg_size", QTYPE_QINT);
+            max_msg_size = MIN(qdict_get_int(conf, "io_max_msg_size"),
+                               AVATAR_IO_MAX_MSG_SIZE);
+        }
+
+        avatar_channel_open_read(&ioRequestMQ, &transport, mq_name,
+                                 MAX(max_msg_size,
+                                     sizeof(AvatarIORequestMessage)),
+                                 &error_fatal);
+        avatar_channel_set_read_handler(&ioRequestMQ, avatar_serve_io, NULL);
 
         mq_name = qdict_get_str(conf, "io_response_mq");
-        qemu_avatar_mq_open_write(&ioResponseMQ, mq_name,
-                                  sizeof(AvatarIOResponseMessage));
+        avatar_channel_open_write(&ioResponseMQ, &transport, mq_name,
+                                  MAX(max_msg_size,
+                                      sizeof(AvatarIOResponseMessage)),
+                                  &error_fatal);
     }
     /*
      * The devices stuff is just considered a hack, I want to replace everything here with a device tree parser as soon as I have the time ...
@@ -341,17 +658,59 @@ static void board_init(MachineState * ms)
                     properties = qobject_to_qlist(qdict_get(device, "properties"));
                 }
 
-                sb = make_configurable_device(qemu_name, address, properties);
+                /* Interrupt number reported to the peer, 1 by default */
+                int irq_line = 1;
+                if(qdict_haskey(device, "irq"))
+                {
+                    QDICT_ASSERT_KEY_TYPE(device, "irq", QTYPE_QINT);
+                    irq_line = qdict_get_int(device, "irq");
+                }
+
+                sb = make_configurable_device(qemu_name, address, properties, irq_line);
                 qdict_put_obj(peripherals, name, (QObject *)sb);
+                if(qdict_haskey(device, "trace_mmio"))
+                {
+                    int i;
+
+                    QDICT_ASSERT_KEY_TYPE(device, "trace_mmio", QTYPE_QBOOL);
+                    for(i = 0; i < sb->num_mmio; i++)
+                    {
+                        avatar_mmio_trace_set(sysbus_mmio_get_region(sb, i),
+                                              qdict_get_bool(device, "trace_mmio"),
+                                              &error_fatal);
+                    }
+                }
+                if(qdict_haskey(device, "mmio_stats"))
+                {
+                    int i;
+
+                    QDICT_ASSERT_KEY_TYPE(device, "mmio_stats", QTYPE_QBOOL);
+                    for(i = 0; i < sb->num_mmio; i++)
+                    {
+                        avatar_mmio_stats_set(sysbus_mmio_get_region(sb, i),
+                                              qdict_get_bool(device, "mmio_stats"));
+                    }
+                }
                 if(qdict_haskey(device, "semaphore_name"))
                 {
                     QDICT_ASSERT_KEY_TYPE(device, "semaphore_name", QTYPE_QSTRING);
 
                     const char *semaphore_name = qdict_get_str(device, "semaphore_name");
 
+                    /* The named semaphore stays the default for old peers */
+                    AvatarSharedLockMode mode = AVATAR_SHARED_LOCK_SEMAPHORE;
+                    if(qdict_haskey(device, "sharing_mode"))
+                    {
+                        QDICT_ASSERT_KEY_TYPE(device, "sharing_mode", QTYPE_QSTRING);
+                        mode = qapi_enum_parse(AvatarSharedLockMode_lookup,
+                                               qdict_get_str(device, "sharing_mode"),
+                                               AVATAR_SHARED_LOCK__MAX, mode,
+                                               &error_fatal);
+                    }
+
                     g_assert(sb->num_mmio == 1);
 
-                    make_device_shareble(sb, semaphore_name);
+                    make_device_shareble(sb, semaphore_name, mode);
                 }
             }
             else
@@ -360,27 +719,263 @@ static void board_init(MachineState * ms)
             }
         }
     }
+
+    if(qdict_haskey(conf, "coverage"))
+    {
+        AvatarCoverageMode mode;
+
+        QDICT_ASSERT_KEY_TYPE(conf, "coverage", QTYPE_QSTRING);
+        mode = qapi_enum_parse(AvatarCoverageMode_lookup,
+                               qdict_get_str(conf, "coverage"),
+                               AVATAR_COVERAGE__MAX, AVATAR_COVERAGE_OFF,
+                               &error_fatal);
+        avatar_coverage_init(mode, &error_fatal);
+    }
+
+    /* Skip the time the guest spends halted in WFI */
+    if(qdict_haskey(conf, "idle_skip"))
+    {
+        QDICT_ASSERT_KEY_TYPE(conf, "idle_skip", QTYPE_QBOOL);
+        if(qdict_get_bool(conf, "idle_skip"))
+        {
+            icount_enable_idle_skip(&error_fatal);
+        }
+    }
+
+    /* Fast-forward status-register polling loops, see avatar/poll.h */
+    if(qdict_haskey(conf, "poll_skip"))
+    {
+        QDICT_ASSERT_KEY_TYPE(conf, "poll_skip", QTYPE_QBOOL);
+        if(qdict_get_bool(conf, "poll_skip"))
+        {
+            avatar_poll_init(&error_fatal);
+        }
+    }
+
+    make_fork_server(conf, cpuu);
+
+    /* Guest-controlled in-process snapshots, see avatar/snapshot.h */
+    if(qdict_haskey(conf, "snapshot_marker"))
+    {
+        QDICT_ASSERT_KEY_TYPE(conf, "snapshot_marker", QTYPE_QINT);
+        avatar_snapshot_add_marker(get_system_memory(),
+                                   qdict_get_int(conf, "snapshot_marker"));
+    }
 }
 
 static struct arm_boot_info boot_info;
 
+/*
+ * Map @size bytes of @path starting at @offset copy-on-write, so that
+ * instances running the same image share its page-cache pages until they
+ * write to them.  Anything past the end of the file reads as zeroes.
+ */
+static void *map_image(const char *path, uint64_t offset, uint64_t size)
+{
+    uint64_t map_size = HOST_PAGE_ALIGN(size);
+    uint64_t file_len = 0;
+    struct stat st;
+    void *ptr;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "Cannot open image %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if(offset & (qemu_real_host_page_size - 1))
+    {
+        fprintf(stderr, "Image offset 0x%" PRIx64 " of %s is not page aligned\n",
+                offset, path);
+        exit(1);
+    }
+    if(st.st_size > offset)
+    {
+        file_len = MIN(st.st_size - offset, size);
+    }
+
+    ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr != MAP_FAILED && file_len &&
+       mmap(ptr, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+            fd, offset) == MAP_FAILED)
+    {
+        munmap(ptr, map_size);
+        ptr = MAP_FAILED;
+    }
+    close(fd);
+
+    if(ptr == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map image %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return ptr;
+}
+
+/*
+ * "memory_map": [ { "name": <str>, "address": <int>, ... } ] replaces the
+ * single RAM region at address 0 with a list of regions, each one of
+ *
+ * - "type": "ram" (the default), zero-filled unless "file" is given;
+ * - "type": "rom", read-only for the guest;
+ * - "type": "flash", like "rom" but guest writes go to a private copy;
+ * - "alias": <name of an earlier region>, with an optional "alias_offset",
+ *   maps "size" bytes of that region a second time.
+ *
+ * "file" (and optionally "file_offset", page aligned) initializes a region
+ * from an image, which is mapped copy-on-write instead of being copied.
+ * "size" defaults to the size of the image.
+ */
+static void make_memory_map(QDict *conf)
+{
+    MemoryRegion *sysmem = get_system_memory();
+    GHashTable *regions = g_hash_table_new(g_str_hash, g_str_equal);
+    QListEntry *entry;
+    QList *map;
+
+    map = qobject_to_qlist(qdict_get(conf, "memory_map"));
+    g_assert(map);
+
+    QLIST_FOREACH_ENTRY(map, entry)
+    {
+        MemoryRegion *mr = g_new(MemoryRegion, 1);
+        const char *name, *type = "ram", *file = NULL;
+        uint64_t address, size = 0, file_offset = 0;
+        QDict *region;
+
+        g_assert(qobject_type(entry->value) == QTYPE_QDICT);
+        region = qobject_to_qdict(entry->value);
+
+        QDICT_ASSERT_KEY_TYPE(region, "name", QTYPE_QSTRING);
+        QDICT_ASSERT_KEY_TYPE(region, "address", QTYPE_QINT);
+        name = qdict_get_str(region, "name");
+        address = qdict_get_int(region, "address");
+
+        if(qdict_haskey(region, "type"))
+        {
+            QDICT_ASSERT_KEY_TYPE(region, "type", QTYPE_QSTRING);
+            type = qdict_get_str(region, "type");
+        }
+        if(qdict_haskey(region, "file"))
+        {
+            QDICT_ASSERT_KEY_TYPE(region, "file", QTYPE_QSTRING);
+            file = qdict_get_str(region, "file");
+        }
+        if(qdict_haskey(region, "file_offset"))
+        {
+            QDICT_ASSERT_KEY_TYPE(region, "file_offset", QTYPE_QINT);
+            file_offset = qdict_get_int(region, "file_offset");
+        }
+        if(qdict_haskey(region, "size"))
+        {
+            QDICT_ASSERT_KEY_TYPE(region, "size", QTYPE_QINT);
+            size = qdict_get_int(region, "size");
+        }
+        else if(file)
+        {
+            struct stat st;
+
+            if(stat(file, &st) < 0 || st.st_size <= file_offset)
+            {
+                fprintf(stderr, "Cannot size memory region %s from %s\n",
+                        name, file);
+                exit(1);
+            }
+            size = st.st_size - file_offset;
+        }
+
+        if(qdict_haskey(region, "alias"))
+        {
+            MemoryRegion *orig;
+            uint64_t alias_offset = 0;
+
+            QDICT_ASSERT_KEY_TYPE(region, "alias", QTYPE_QSTRING);
+            orig = g_hash_table_lookup(regions, qdict_get_str(region, "alias"));
+            if(!orig)
+            {
+                fprintf(stderr, "Memory region %s aliases unknown region %s\n",
+                        name, qdict_get_str(region, "alias"));
+                exit(1);
+            }
+            if(qdict_haskey(region, "alias_offset"))
+            {
+                QDICT_ASSERT_KEY_TYPE(region, "alias_offset", QTYPE_QINT);
+                alias_offset = qdict_get_int(region, "alias_offset");
+            }
+            if(!size)
+            {
+                size = memory_region_size(orig) - alias_offset;
+            }
+            memory_region_init_alias(mr, NULL, name, orig, alias_offset, size);
+        }
+        else if(!size)
+        {
+            fprintf(stderr, "Memory region %s has no size\n", name);
+            exit(1);
+        }
+        else if(strcmp(type, "ram") && strcmp(type, "rom") &&
+                strcmp(type, "flash"))
+        {
+            fprintf(stderr, "Unknown memory region type %s\n", type);
+            exit(1);
+        }
+        else if(file)
+        {
+            memory_region_init_ram_ptr(mr, NULL, name, size,
+                                       map_image(file, file_offset, size));
+            vmstate_register_ram_global(mr);
+        }
+        else
+        {
+            memory_region_init_ram(mr, NULL, name, size, &error_fatal);
+            vmstate_register_ram_global(mr);
+        }
+
+        if(!strcmp(type, "rom"))
+        {
+            memory_region_set_readonly(mr, true);
+        }
+
+        printf("Configurable: Adding %s region %s at 0x%" PRIx64 " size 0x%" PRIx64 "\n",
+               type, name, address, size);
+        memory_region_add_subregion(sysmem, address, mr);
+        g_hash_table_insert(regions, (gpointer)name, mr);
+    }
+
+    g_hash_table_destroy(regions);
+}
+
 static void load_program(QDict *conf, ARMCPU *cpu)
 {
-    const char *program;
+    const char *program = NULL;
     MemoryRegion *sysmem = get_system_memory();
-    MemoryRegion *ram = g_new(MemoryRegion, 1);
     size_t ram_size = 1024 * 1024;
 
-    g_assert(qdict_haskey(conf, "kernel"));
-    program = qdict_get_str(conf, "kernel");
-
     if(qdict_haskey(conf, "ram_size"))
     {
         ram_size = qdict_get_int(conf, "ram_size");
     }
 
-    memory_region_allocate_system_memory(ram, NULL, "configurable.ram", ram_size);
-    memory_region_add_subregion(sysmem, 0, ram);
+    if(qdict_haskey(conf, "memory_map"))
+    {
+        /* The firmware may live in the map already, then boot from it */
+        make_memory_map(conf);
+    }
+    else
+    {
+        MemoryRegion *ram = g_new(MemoryRegion, 1);
+
+        g_assert(qdict_haskey(conf, "kernel"));
+        memory_region_allocate_system_memory(ram, NULL, "configurable.ram", ram_size);
+        memory_region_add_subregion(sysmem, 0, ram);
+    }
+
+    if(qdict_haskey(conf, "kernel"))
+    {
+        program = qdict_get_str(conf, "kernel");
+    }
 
     boot_info.ram_size = ram_size;
     boot_info.kernel_filename = program;
@@ -391,6 +986,18 @@ static void load_program(QDict *conf, ARMCPU *cpu)
 
 }
 
+static char *configurable_get_board_cache(Object *obj, Error **errp)
+{
+    return g_strdup(board_cache);
+}
+
+static void configurable_set_board_cache(Object *obj, const char *value,
+                                         Error **errp)
+{
+    g_free(board_cache);
+    board_cache = g_strdup(value);
+}
+
 static void configurable_machine_class_init(ObjectClass *oc, void *data)
 {
     MachineClass *mc = MACHINE_CLASS(oc);
@@ -398,6 +1005,14 @@ static void configurable_machine_class_init(ObjectClass *oc, void *data)
     mc->desc = "Machine that can be configured to be whatever you want";
     mc->init = board_init;
     mc->block_default_type = IF_SCSI;
+
+    object_class_property_add_str(oc, "board-cache",
+                                  configurable_get_board_cache,
+                                  configurable_set_board_cache,
+                                  &error_abort);
+    object_class_property_set_description(oc, "board-cache",
+        "Where to cache the compiled JSON configuration "
+        "(default <kernel>.avbd, off to disable)", &error_abort);
 }
 
 static const TypeInfo configurable_machine_type = {
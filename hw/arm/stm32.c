@@ -24,6 +24,8 @@
 #include "exec/gdbstub.h"
 #include "sysemu/sysemu.h"
 #include "qapi/error.h"
+#include "hw/or-irq.h"
+#include "hw/gpio/stm32_gpio_monitor.h"
 #include "avatar/irq.h"
 #include "avatar/avatar-io.h"
 /* DEFINITIONS */
@@ -122,7 +124,7 @@ static DeviceState *stm32_init_periph(DeviceState *dev, stm32_periph_t periph,
     return dev;
 }
 
-static void stm32_create_uart_dev(
+static DeviceState *stm32_create_uart_dev(
         Object *stm32_container,
         stm32_periph_t periph,
         int uart_num,
@@ -142,7 +144,7 @@ static void stm32_create_uart_dev(
     qdev_prop_set_chr(uart_dev, "chardev", serial);
     snprintf(child_name, sizeof(child_name), "uart[%i]", uart_num);
     object_property_add_child(stm32_container, child_name, OBJECT(uart_dev), NULL);
-    stm32_init_periph(uart_dev, periph, addr, irq);
+    return stm32_init_periph(uart_dev, periph, addr, irq);
 }
 
 static void stm32_create_timer_dev(
@@ -166,7 +168,7 @@ static void stm32_create_timer_dev(
     stm32_init_periph(timer_dev, periph, addr, irq);
 }
 
-static void stm32_create_adc_dev(
+static DeviceState *stm32_create_adc_dev(
         Object *stm32_container,
         stm32_periph_t periph,
         int adc_num,
@@ -182,8 +184,31 @@ static void stm32_create_adc_dev(
     qdev_prop_set_ptr(adc_dev, "stm32_gpio", gpio_dev);
     snprintf(child_name, sizeof(child_name), "adc[%i]", adc_num);
     object_property_add_child(stm32_container, child_name, OBJECT(adc_dev), NULL);
-    stm32_init_periph(adc_dev, periph, addr, irq);
-    
+    return stm32_init_periph(adc_dev, periph, addr, irq);
+}
+
+static DeviceState *stm32_create_dma_dev(
+        Object *stm32_container,
+        stm32_periph_t periph,
+        int dma_num,
+        int num_channels,
+        hwaddr addr)
+{
+    char child_name[8];
+    DeviceState *dma_dev = qdev_create(NULL, TYPE_STM32_DMA);
+    qdev_prop_set_uint32(dma_dev, "num-channels", num_channels);
+    snprintf(child_name, sizeof(child_name), "dma[%i]", dma_num);
+    object_property_add_child(stm32_container, child_name, OBJECT(dma_dev), NULL);
+    return stm32_init_periph(dma_dev, periph, addr, NULL);
+}
+
+/* Connect a peripheral's DMA request line to a DMA channel (counting
+ * from 1, as in RM0008 tables 78 and 79). */
+static void stm32_connect_dma_request(DeviceState *dev, const char *name,
+                                      DeviceState *dma_dev, int channel)
+{
+    qdev_connect_gpio_out_named(dev, name, 0,
+                                qdev_get_gpio_in(dma_dev, channel - 1));
 }
 
 static void stm32_create_rtc_dev(
@@ -225,17 +250,20 @@ static void stm32_create_dac_dev(
 
 static void init_mqs(void)
 {
+    const AvatarTransportOptions transport = {
+        .type = AVATAR_TRANSPORT_MQ,
+    };
     const char *mq_irq = "/qemu_irq";
     const char *mq_in = "/qemu_in";
     const char *mq_out = "/qemu_out";
-    int fd;
-    qemu_avatar_mq_open_write(&IrqMQ, mq_irq, sizeof(IRQ_MSG));
-    qemu_avatar_mq_open_write(&ioResponseMQ, mq_out,
-                              sizeof(AvatarIOResponseMessage));
-    qemu_avatar_mq_open_read(&ioRequestMQ, mq_in,
-                             sizeof(AvatarIORequestMessage));
-    fd = qemu_avatar_mq_get_fd(&ioRequestMQ);
-    qemu_set_fd_handler(fd, avatar_serve_io, NULL, NULL);
+    avatar_channel_open_write(&IrqMQ, &transport, mq_irq, sizeof(IRQ_MSG),
+                              &error_fatal);
+    avatar_channel_open_write(&ioResponseMQ, &transport, mq_out,
+                              sizeof(AvatarIOResponseMessage), &error_fatal);
+    avatar_channel_open_read(&ioRequestMQ, &transport, mq_in,
+                             sizeof(AvatarIORequestMessage), &error_fatal);
+    avatar_channel_set_read_handler(&ioRequestMQ, avatar_serve_io, NULL);
+    avatar_irq_forward_init(&IrqMQ);
 }
 
 void stm32_init(
@@ -261,6 +289,11 @@ void stm32_init(
               64,
               kernel_filename,
               "cortex-m3");
+
+    /* Only the NVIC inputs are of interest to the avatar peer */
+    for (i = 0; i < 64; i++) {
+        qemu_irq_set_avatar_forward(qdev_get_gpio_in(nvic, i), true);
+    }
     
     /* The STM32 family stores its Flash memory at some base address in memory
      * (0x08000000 for medium density devices), and then aliases it to the
@@ -306,6 +339,12 @@ void stm32_init(
         stm32_init_periph(gpio_dev[i], periph, 0x40010800 + (i * 0x400), NULL);
     }
 
+    /* Inactive unless a file is given with -global stm32-gpio-monitor.path */
+    DeviceState *gpio_monitor_dev = qdev_create(NULL, TYPE_STM32_GPIO_MONITOR);
+    qdev_prop_set_ptr(gpio_monitor_dev, "stm32_gpio", gpio_dev);
+    object_property_add_child(stm32_container, "gpio-monitor", OBJECT(gpio_monitor_dev), NULL);
+    qdev_init_nofail(gpio_monitor_dev);
+
     DeviceState *exti_dev = qdev_create(NULL, TYPE_STM32_EXTI);
     object_property_add_child(stm32_container, "exti", OBJECT(exti_dev), NULL);
     stm32_init_periph(exti_dev, STM32_EXTI_PERIPH, 0x40010400, NULL);
@@ -334,10 +373,37 @@ void stm32_init(
     object_property_add_child(stm32_container, "afio", OBJECT(afio_dev), NULL);
     stm32_init_periph(afio_dev, STM32_AFIO_PERIPH, 0x40010000, NULL);
 
-    stm32_create_uart_dev(stm32_container, STM32_UART1, 1, rcc_dev, gpio_dev, afio_dev, 0x40013800, qdev_get_gpio_in(nvic, STM32_UART1_IRQ), serial_hds[0]);
-    stm32_create_uart_dev(stm32_container, STM32_UART2, 2, rcc_dev, gpio_dev, afio_dev, 0x40004400, qdev_get_gpio_in(nvic, STM32_UART2_IRQ), serial_hds[1]);
-    stm32_create_uart_dev(stm32_container, STM32_UART3, 3, rcc_dev, gpio_dev, afio_dev, 0x40004800, qdev_get_gpio_in(nvic, STM32_UART3_IRQ), serial_hds[2]);
-    stm32_create_uart_dev(stm32_container, STM32_UART4, 4, rcc_dev, gpio_dev, afio_dev, 0x40004c00, qdev_get_gpio_in(nvic, STM32_UART4_IRQ), serial_hds[3]);
+    /* DMA1 has 7 channels and DMA2 has 5, channels 4 and 5 of DMA2 share
+     * an interrupt. */
+    DeviceState *dma1_dev = stm32_create_dma_dev(stm32_container, STM32_DMA1, 1, 7, 0x40020000);
+    for(i = 0; i < 7; i++) {
+        sysbus_connect_irq(SYS_BUS_DEVICE(dma1_dev), i, qdev_get_gpio_in(nvic, STM32_DMA1_CHANNEL1_IRQ + i));
+    }
+    DeviceState *dma2_dev = stm32_create_dma_dev(stm32_container, STM32_DMA2, 2, 5, 0x40020400);
+    for(i = 0; i < 3; i++) {
+        sysbus_connect_irq(SYS_BUS_DEVICE(dma2_dev), i, qdev_get_gpio_in(nvic, STM32_DMA2_CHANNEL1_IRQ + i));
+    }
+    Object *dma2_irq45 = object_new(TYPE_OR_IRQ);
+    object_property_add_child(stm32_container, "dma2-irq45", dma2_irq45, NULL);
+    object_property_set_int(dma2_irq45, 2, "num-lines", &error_fatal);
+    object_property_set_bool(dma2_irq45, true, "realized", &error_fatal);
+    qdev_connect_gpio_out(DEVICE(dma2_irq45), 0, qdev_get_gpio_in(nvic, STM32_DMA2_CHANNEL4_5_IRQ));
+    sysbus_connect_irq(SYS_BUS_DEVICE(dma2_dev), 3, qdev_get_gpio_in(DEVICE(dma2_irq45), 0));
+    sysbus_connect_irq(SYS_BUS_DEVICE(dma2_dev), 4, qdev_get_gpio_in(DEVICE(dma2_irq45), 1));
+
+    DeviceState *uart_dev;
+    uart_dev = stm32_create_uart_dev(stm32_container, STM32_UART1, 1, rcc_dev, gpio_dev, afio_dev, 0x40013800, qdev_get_gpio_in(nvic, STM32_UART1_IRQ), serial_hds[0]);
+    stm32_connect_dma_request(uart_dev, "dma-tx", dma1_dev, 4);
+    stm32_connect_dma_request(uart_dev, "dma-rx", dma1_dev, 5);
+    uart_dev = stm32_create_uart_dev(stm32_container, STM32_UART2, 2, rcc_dev, gpio_dev, afio_dev, 0x40004400, qdev_get_gpio_in(nvic, STM32_UART2_IRQ), serial_hds[1]);
+    stm32_connect_dma_request(uart_dev, "dma-tx", dma1_dev, 7);
+    stm32_connect_dma_request(uart_dev, "dma-rx", dma1_dev, 6);
+    uart_dev = stm32_create_uart_dev(stm32_container, STM32_UART3, 3, rcc_dev, gpio_dev, afio_dev, 0x40004800, qdev_get_gpio_in(nvic, STM32_UART3_IRQ), serial_hds[2]);
+    stm32_connect_dma_request(uart_dev, "dma-tx", dma1_dev, 2);
+    stm32_connect_dma_request(uart_dev, "dma-rx", dma1_dev, 3);
+    uart_dev = stm32_create_uart_dev(stm32_container, STM32_UART4, 4, rcc_dev, gpio_dev, afio_dev, 0x40004c00, qdev_get_gpio_in(nvic, STM32_UART4_IRQ), serial_hds[3]);
+    stm32_connect_dma_request(uart_dev, "dma-tx", dma2_dev, 5);
+    stm32_connect_dma_request(uart_dev, "dma-rx", dma2_dev, 3);
     stm32_create_uart_dev(stm32_container, STM32_UART5, 5, rcc_dev, gpio_dev, afio_dev, 0x40005000, qdev_get_gpio_in(nvic, STM32_UART5_IRQ), serial_hds[4]);
 
     /* Timer 1 has four interrupts but only the TIM1 Update interrupt is implemented. */
@@ -348,7 +414,8 @@ void stm32_init(
     stm32_create_timer_dev(stm32_container, STM32_TIM3, 1, rcc_dev, gpio_dev, afio_dev, 0x40000400, qdev_get_gpio_in(nvic, TIM3_IRQn));
     stm32_create_timer_dev(stm32_container, STM32_TIM4, 1, rcc_dev, gpio_dev, afio_dev, 0x40000800, qdev_get_gpio_in(nvic, TIM4_IRQn));
     stm32_create_timer_dev(stm32_container, STM32_TIM5, 1, rcc_dev, gpio_dev, afio_dev, 0x40000C00, qdev_get_gpio_in(nvic, TIM5_IRQn));
-    stm32_create_adc_dev(stm32_container, STM32_ADC1, 1, rcc_dev, gpio_dev, 0x40012400,0 );
+    DeviceState *adc_dev = stm32_create_adc_dev(stm32_container, STM32_ADC1, 1, rcc_dev, gpio_dev, 0x40012400,0 );
+    stm32_connect_dma_request(adc_dev, "dma", dma1_dev, 1);
     stm32_create_rtc_dev(stm32_container,STM32_RTC, 1, rcc_dev, 0x40002800,qdev_get_gpio_in(nvic, STM32_RTC_IRQ));
     stm32_create_dac_dev(stm32_container,STM32_DAC, rcc_dev,gpio_dev, 0x40007400,0);
     
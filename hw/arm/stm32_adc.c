@@ -25,6 +25,9 @@
 #include "hw/arm/stm32.h"
 #include "sysemu/char.h"
 #include "qemu/bitops.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "hw/adc/stm32_adc_samples.h"
 #include <math.h>       // for the sine wave generation
 #include <inttypes.h>
 
@@ -591,11 +594,14 @@ struct Stm32Adc {
     void *stm32_rcc_prop;
     void *stm32_gpio_prop;
     void *stm32_afio_prop;
+    char *samples_path;
+    uint32_t sample_rate;
 
     /* Private */
     MemoryRegion iomem;
 
     Stm32Rcc *stm32_rcc;
+    STM32ADCSamples *samples; /* recorded inputs, NULL for the sine wave */
     Stm32Gpio **stm32_gpio;
     uint64_t ns_per_sample[8]; /*8 possibility of numbers cycles for each conversion 
                                 (recover from: time register 1 (SMPR1),time register 2 (SMPR2))*/
@@ -636,6 +642,11 @@ struct Stm32Adc {
 
     qemu_irq irq;
     int curr_irq_level;
+
+    /* DMA request line, raised while a regular conversion result waits in
+     * ADC_DR and CR2_DMA is set. */
+    qemu_irq dma;
+    int curr_dma_level;
     int Vref; //mv
     int Vdda; //mv
 };
@@ -650,7 +661,7 @@ static void stm32_ADC_CR2_write(Stm32Adc *s,uint32_t new_value);
 static uint32_t stm32_ADC_DR_read(Stm32Adc *s);
 
 /* functions modified in adc*/ 
-static void stm32_adc_clk_irq_handler(void *opaque, int n, int level);
+static void stm32_adc_clk_update(void *opaque, Clk clk);
 static void stm32_ADC_update_irq(Stm32Adc *s);
 static void stm32_adc_start_conv(Stm32Adc *s);
 static void stm32_adc_reset(DeviceState *dev);
@@ -658,17 +669,11 @@ static void stm32_adc_reset(DeviceState *dev);
 /* HELPER FUNCTIONS */
 
 /* Handle a change in the peripheral clock. */
-static void stm32_adc_clk_irq_handler(void *opaque, int n, int level)
+static void stm32_adc_clk_update(void *opaque, Clk clk)
 {
-
     Stm32Adc *s = (Stm32Adc *)opaque;
-    assert(n == 0);
-
-    /* Only update the ns per sample if the IRQ is being set. */
-    if(level) {
-        stm32_ADC_update_ns_per_sample(s);
-    }
 
+    stm32_ADC_update_ns_per_sample(s);
 }
 
 
@@ -685,10 +690,19 @@ static void stm32_ADC_update_irq(Stm32Adc *s) {
      * set the level regardless, but we will just check for good measure.
      */
      
+    int new_dma_level = (s->ADC_CR2 & ADC_CR2_DMA) && (s->ADC_SR & ADC_SR_EOC);
+
     if((new_irq_level & 1) ^ s->curr_irq_level ) {
         qemu_set_irq(s->irq, new_irq_level);
         s->curr_irq_level = new_irq_level;
     }
+
+    /* The DMA controller reads ADC_DR from inside qemu_set_irq, so record
+     * the new level first. */
+    if(new_dma_level ^ s->curr_dma_level) {
+        s->curr_dma_level = new_dma_level;
+        qemu_set_irq(s->dma, new_dma_level);
+    }
 }
 
 static void stm32_adc_conv_complete(Stm32Adc *s)
@@ -702,6 +716,7 @@ static void stm32_adc_start_conv(Stm32Adc *s)
 {
     uint64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
     int channel_number=stm32_ADC_get_channel_number(s,1);
+    uint16_t sample;
     // Write result of conversion
       if(channel_number==16){
       s->Vdda=rand()%(1200+1) + 2400; //Vdda belongs to the interval [2400 3600] mv
@@ -711,6 +726,9 @@ static void stm32_adc_start_conv(Stm32Adc *s)
       else if(channel_number==17){
       s->ADC_DR= (s->Vref=rand()%(s->Vdda-2400+1) + 2400); //Vref [2400 Vdda] mv
       }
+      else if(s->samples && stm32_adc_samples_get(s->samples, channel_number, &sample)){
+      s->ADC_DR=sample & 0xfff;
+      }
       else{
       s->ADC_DR=((int)(1024.*(sin(2*M_PI*qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)/1e9)+1.))&0xfff);
       }
@@ -831,7 +849,8 @@ static void stm32_ADC_CR2_write(Stm32Adc *s,uint32_t new_value)
       stm32_ADC_GPIO_check(s,stm32_ADC_get_channel_number(s,1)); // check GPIO (Mode and config)  ANALOG INTPUT?  
       stm32_adc_start_conv(s); // jmf : software conv
     }
-   
+
+    stm32_ADC_update_irq(s); // CR2_DMA gates the DMA request
 }
 
 static uint32_t stm32_ADC_DR_read(Stm32Adc *s)
@@ -843,10 +862,17 @@ static uint32_t stm32_ADC_DR_read(Stm32Adc *s)
   
    /* check conversion complete*/
    if(s->ADC_SR & ADC_SR_EOC)
-     {           
-       s->ADC_SR &=~((uint32_t)ADC_SR_EOC); //cleared SR_EOC flag by reading ADC_DR   
+     {
+       uint32_t value = s->ADC_DR;
+
+       s->ADC_SR &=~((uint32_t)ADC_SR_EOC); //cleared SR_EOC flag by reading ADC_DR
+       /* In continuous mode the next conversion starts once the result
+        * has been taken, which keeps a DMA transfer going. */
+       if(s->ADC_CR2 & ADC_CR2_CONT) {
+         stm32_adc_start_conv(s);
+       }
        stm32_ADC_update_irq(s); // (SR_EOC=0) requiere interrupt update
-       return s->ADC_DR;
+       return value;
      }
    else
      {
@@ -978,20 +1004,31 @@ static const MemoryRegionOps stm32_adc_ops = {
 
 static int stm32_adc_init(SysBusDevice *dev)
 {
-    qemu_irq *clk_irq;
     Stm32Adc *s = STM32_ADC(dev);
+    Error *err = NULL;
+
+    if(s->samples_path) {
+        /* One sample per external input channel (0 to 15) in each frame */
+        s->samples = stm32_adc_samples_open(s->samples_path, 16,
+                                            s->sample_rate, &err);
+        if(!s->samples) {
+            error_report_err(err);
+            return -1;
+        }
+    }
+
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
     s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
     memory_region_init_io(&s->iomem, OBJECT(s), &stm32_adc_ops, s, "adc", 0x03ff);  
         // jmf : 3FF = length, cf RM0008 p.52
     sysbus_init_mmio(dev, &s->iomem);
     sysbus_init_irq(dev, &s->irq);
+    qdev_init_gpio_out_named(DEVICE(dev), &s->dma, "dma", 1);
     s->conv_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, (QEMUTimerCB *)stm32_adc_conv_timer_expire, s);
 
     /* Register handlers to handle updates to the ADC's peripheral clock. */
-    clk_irq = qemu_allocate_irqs(stm32_adc_clk_irq_handler, (void *)s, 1);   // jmf : segfault
-    
-    stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
+    stm32_rcc_add_periph_clk_notifier(s->stm32_rcc, s->periph,
+                                      stm32_adc_clk_update, s);
     stm32_adc_reset((DeviceState *)s);
     s->Vdda=rand()%(1200+1) +2400; //Vdda belongs to the interval [2400 3600] mv
     s->Vref=rand()%(s->Vdda-2400+1) +2400; //Vref belongs to the interval [2400 Vdda] mv
@@ -1002,6 +1039,8 @@ static Property stm32_adc_properties[] = {
     DEFINE_PROP_PERIPH_T("periph", Stm32Adc, periph, STM32_PERIPH_UNDEFINED),
     DEFINE_PROP_PTR("stm32_rcc", Stm32Adc, stm32_rcc_prop),
     DEFINE_PROP_PTR("stm32_gpio", Stm32Adc, stm32_gpio_prop),
+    DEFINE_PROP_STRING("samples", Stm32Adc, samples_path),
+    DEFINE_PROP_UINT32("sample-rate", Stm32Adc, sample_rate, 1000000),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -41,6 +41,11 @@
             assert((count) <= (array_size));
 
 
+typedef struct ClkUser {
+    ClktreeNotifyFunc *func;
+    void *opaque;
+} ClkUser;
+
 struct Clk {
     const char *name;
 
@@ -51,7 +56,12 @@ struct Clk {
     uint16_t multiplier, divisor;
 
     unsigned user_count;
-    qemu_irq user[CLKTREE_MAX_IRQ]; /* Who to notify on change */
+    ClkUser user[CLKTREE_MAX_USER]; /* Who to notify on change */
+
+    /* Frequency the users were last notified of */
+    uint32_t notified_freq;
+    bool notify_pending;
+    QSIMPLEQ_ENTRY(Clk) pending_next;
 
     unsigned output_count;
     struct Clk *output[CLKTREE_MAX_OUTPUT];
@@ -63,6 +73,11 @@ struct Clk {
 
 static void clktree_recalc_output_freq(Clk clk);
 
+/* Clocks whose users have not been told about a change yet */
+static QSIMPLEQ_HEAD(, Clk) clktree_pending =
+    QSIMPLEQ_HEAD_INITIALIZER(clktree_pending);
+static unsigned clktree_update_depth;
+
 
 
 
@@ -90,6 +105,42 @@ static void clktree_print_state(Clk clk)
 }
 #endif
 
+/* Notify the users of every clock that changed since the last flush.  A
+ * frequency that changed and changed back does not generate a notification.
+ */
+static void clktree_flush_notify(void)
+{
+    Clk clk;
+    int i;
+
+    while(!QSIMPLEQ_EMPTY(&clktree_pending)) {
+        clk = QSIMPLEQ_FIRST(&clktree_pending);
+        QSIMPLEQ_REMOVE_HEAD(&clktree_pending, pending_next);
+        clk->notify_pending = false;
+
+        if(clk->output_freq == clk->notified_freq) {
+            continue;
+        }
+        clk->notified_freq = clk->output_freq;
+
+        /* Check the new frequency against the max frequency.  Firmware may
+         * go through out-of-range settings while reprogramming the tree, so
+         * only the settled frequency is checked.
+         */
+        if(clk->output_freq > clk->max_output_freq) {
+            fprintf(stderr, "%s: Clock %s output frequency (%d Hz) exceeds max frequency (%d Hz).\n",
+                    __FUNCTION__,
+                    clk->name,
+                    clk->output_freq,
+                    clk->max_output_freq);
+        }
+
+        for(i=0; i < clk->user_count; i++) {
+            clk->user[i].func(clk->user[i].opaque, clk);
+        }
+    }
+}
+
 static void clktree_set_input_freq(Clk clk, uint32_t input_freq)
 {
     clk->input_freq = input_freq;
@@ -119,18 +170,12 @@ static void clktree_recalc_output_freq(Clk clk) {
         clktree_print_state(clk);
 #endif
 
-        /* Check the new frequency against the max frequency. */
-        if(new_output_freq > clk->max_output_freq) {
-            fprintf(stderr, "%s: Clock %s output frequency (%d Hz) exceeds max frequency (%d Hz).\n",
-                    __FUNCTION__,
-                    clk->name,
-                    new_output_freq,
-                    clk->max_output_freq);
-        }
-
-        /* Notify users of change. */
-        for(i=0; i < clk->user_count; i++) {
-            qemu_set_irq(clk->user[i], 1);
+        /* Queue the users' notification, it is sent once the current
+         * batch of changes is complete.
+         */
+        if(!clk->notify_pending) {
+            clk->notify_pending = true;
+            QSIMPLEQ_INSERT_TAIL(&clktree_pending, clk, pending_next);
         }
 
         /* Propagate the frequency change to the child clocks */
@@ -174,6 +219,8 @@ static Clk clktree_create_generic(
     clk->enabled = enabled;
 
     clk->user_count = 0;
+    clk->notified_freq = 0;
+    clk->notify_pending = false;
 
     clk->output_count = 0;
 
@@ -203,13 +250,29 @@ uint32_t clktree_get_output_freq(Clk clk)
     return clk->output_freq;
 }
 
-void clktree_adduser(Clk clk, qemu_irq user)
+void clktree_add_notifier(Clk clk, ClktreeNotifyFunc *func, void *opaque)
 {
+    ClkUser user = { .func = func, .opaque = opaque };
+
     CLKTREE_ADD_LINK(
             clk->user,
             clk->user_count,
             user,
-            CLKTREE_MAX_IRQ);
+            CLKTREE_MAX_USER);
+}
+
+void clktree_begin_update(void)
+{
+    clktree_update_depth++;
+}
+
+void clktree_end_update(void)
+{
+    assert(clktree_update_depth > 0);
+
+    if(--clktree_update_depth == 0) {
+        clktree_flush_notify();
+    }
 }
 
 
@@ -222,7 +285,9 @@ Clk clktree_create_src_clk(
 
     clk = clktree_create_generic(name, 1, 1, enabled);
 
+    clktree_begin_update();
     clktree_set_input_freq(clk, src_freq);
+    clktree_end_update();
 
     return clk;
 }
@@ -266,18 +331,26 @@ Clk clktree_create_clk(
 
 void clktree_set_scale(Clk clk, uint16_t multiplier, uint16_t divisor)
 {
+    clktree_begin_update();
+
     clk->multiplier = multiplier;
     clk->divisor = divisor;
 
     clktree_recalc_output_freq(clk);
+
+    clktree_end_update();
 }
 
 
 void clktree_set_enabled(Clk clk, bool enabled)
 {
+    clktree_begin_update();
+
     clk->enabled = enabled;
 
     clktree_recalc_output_freq(clk);
+
+    clktree_end_update();
 }
 
 
@@ -297,5 +370,7 @@ void clktree_set_selected_input(Clk clk, int selected_input)
         input_freq = 0;
     }
 
+    clktree_begin_update();
     clktree_set_input_freq(clk, input_freq);
+    clktree_end_update();
 }
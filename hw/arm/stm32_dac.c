@@ -124,7 +124,7 @@ struct Stm32Dac {
 
 
 /* Handle a change in the peripheral clock. */
-static void stm32_dac_clk_irq_handler(void *opaque, int n, int level)
+static void stm32_dac_clk_update(void *opaque, Clk clk)
 {
    Stm32Dac *s=(Stm32Dac *)opaque;    
 
@@ -524,7 +524,6 @@ static const MemoryRegionOps stm32_dac_ops = {
 static int stm32_dac_init(SysBusDevice *dev)
 {
 
-    qemu_irq *clk_irq;
     Stm32Dac *s = STM32_Dac(dev);
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
     s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
@@ -550,9 +549,8 @@ static int stm32_dac_init(SysBusDevice *dev)
                     (QEMUTimerCB *) stm32_dac_LFSR_update, s);
    
     /* Register handlers to handle updates to the RTC's peripheral clock. */
-    clk_irq =
-          qemu_allocate_irqs(stm32_dac_clk_irq_handler, (void *)s, 1);
-    stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
+    stm32_rcc_add_periph_clk_notifier(s->stm32_rcc, s->periph,
+                                      stm32_dac_clk_update, s);
     
     stm32_dac_reset((DeviceState *)s);
 
@@ -629,6 +629,12 @@ static void stm32_rcc_writew(void *opaque, hwaddr offset,
 {
     Stm32Rcc *s = (Stm32Rcc *)opaque;
 
+    /* A single register write can touch several clocks (e.g. the PLL and
+     * all the bus prescalers for CFGR); let the peripherals see only the
+     * final frequencies.
+     */
+    clktree_begin_update();
+
     switch(offset) {
         case RCC_CR_OFFSET:
             stm32_rcc_RCC_CR_write(s, value, false);
@@ -670,6 +676,8 @@ static void stm32_rcc_writew(void *opaque, hwaddr offset,
             STM32_BAD_REG(offset, 4);
             break;
     }
+
+    clktree_end_update();
 }
 
 static uint64_t stm32_rcc_read(void *opaque, hwaddr offset,
@@ -708,17 +716,19 @@ static void stm32_rcc_reset(DeviceState *dev)
 {
     Stm32Rcc *s = STM32_RCC(dev);
 
+    clktree_begin_update();
     stm32_rcc_RCC_CR_write(s, 0x00000083, true);
     stm32_rcc_RCC_CFGR_write(s, 0x00000000, true);
     stm32_rcc_RCC_APB2ENR_write(s, 0x00000000, true);
     stm32_rcc_RCC_APB1ENR_write(s, 0x00000000, true);
     stm32_rcc_RCC_BDCR_write(s, 0x00000000, true);
     stm32_rcc_RCC_CSR_write(s, 0x0c000000, true);
+    clktree_end_update();
 }
 
-/* IRQ handler to handle updates to the HCLK frequency.
+/* Clock notifier to handle updates to the HCLK frequency.
  * This updates the SysTick scales. */
-static void stm32_rcc_hclk_upd_irq_handler(void *opaque, int n, int level)
+static void stm32_rcc_hclk_update(void *opaque, Clk clk)
 {
     Stm32Rcc *s = (Stm32Rcc *)opaque;
 
@@ -771,14 +781,15 @@ void stm32_rcc_check_periph_clk(Stm32Rcc *s, stm32_periph_t periph)
     }
 }
 
-void stm32_rcc_set_periph_clk_irq(
+void stm32_rcc_add_periph_clk_notifier(
         Stm32Rcc *s,
         stm32_periph_t periph,
-        qemu_irq periph_irq)
+        ClktreeNotifyFunc *func,
+        void *opaque)
 {
     Clk clk = s->PERIPHCLK[periph];
     assert(clk != NULL);
-    clktree_adduser(clk, periph_irq);
+    clktree_add_notifier(clk, func, opaque);
 }
 
 uint32_t stm32_rcc_get_periph_freq(
@@ -807,8 +818,6 @@ void stm32_RCC_CSR_write(Stm32Rcc *s, uint32_t new_value, bool init)
 static void stm32_rcc_init_clk(Stm32Rcc *s)
 {
     int i;
-    qemu_irq *hclk_upd_irq =
-            qemu_allocate_irqs(stm32_rcc_hclk_upd_irq_handler, s, 1);
     Clk HSI_DIV2, HSE_DIV2;
 
     /* Make sure all the peripheral clocks are null initially.
@@ -852,7 +861,7 @@ static void stm32_rcc_init_clk(Stm32Rcc *s)
 
     s->HCLK = clktree_create_clk("HCLK", 0, 1, true, 72000000, 0,
                         s->SYSCLK, NULL);
-    clktree_adduser(s->HCLK, hclk_upd_irq[0]);
+    clktree_add_notifier(s->HCLK, stm32_rcc_hclk_update, s);
 
     s->PCLK1 = clktree_create_clk("PCLK1", 0, 1, true, 36000000, 0,
                         s->HCLK, NULL);
@@ -38,11 +38,44 @@ static const uint32_t adc_addr[STM_NUM_ADCS] = { 0x40012000, 0x40012100,
     0x40012200 };
 static const uint32_t spi_addr[STM_NUM_SPIS] = { 0x40013000, 0x40003800,
     0x40003C00 };
+static const uint32_t dma_addr[STM_NUM_DMAS] = { 0x40026000, 0x40026400 };
 
 static const int timer_irq[STM_NUM_TIMERS] = {28, 29, 30, 50};
 static const int usart_irq[STM_NUM_USARTS] = {37, 38, 39, 52, 53, 71};
 #define ADC_IRQ 18
 static const int spi_irq[STM_NUM_SPIS] = {35, 36, 51};
+static const int dma_irq[STM_NUM_DMAS][STM_DMA_NUM_STREAMS] = {
+    {11, 12, 13, 14, 15, 16, 17, 47},
+    {56, 57, 58, 59, 60, 68, 69, 70},
+};
+
+/*
+ * DMA request mapping (RM0033 tables 22 and 23).  Some requests can be
+ * served by either of two streams, software enables the one it uses.
+ */
+typedef struct {
+    int dma;
+    int stream[2];
+    int channel;
+} STM32F205DmaRequest;
+
+static const STM32F205DmaRequest usart_rx_dma[STM_NUM_USARTS] = {
+    {1, {2, 5}, 4}, {0, {5, -1}, 4}, {0, {1, -1}, 4},
+    {0, {2, -1}, 4}, {0, {0, -1}, 4}, {1, {1, 2}, 5},
+};
+static const STM32F205DmaRequest usart_tx_dma[STM_NUM_USARTS] = {
+    {1, {7, -1}, 4}, {0, {6, -1}, 4}, {0, {3, -1}, 4},
+    {0, {4, -1}, 4}, {0, {7, -1}, 4}, {1, {6, 7}, 5},
+};
+static const STM32F205DmaRequest adc_dma[STM_NUM_ADCS] = {
+    {1, {0, 4}, 0}, {1, {2, 3}, 1}, {1, {0, 1}, 2},
+};
+static const STM32F205DmaRequest spi_rx_dma[STM_NUM_SPIS] = {
+    {1, {0, 2}, 3}, {0, {3, -1}, 0}, {0, {0, 2}, 0},
+};
+static const STM32F205DmaRequest spi_tx_dma[STM_NUM_SPIS] = {
+    {1, {3, 5}, 3}, {0, {4, -1}, 0}, {0, {5, 7}, 0},
+};
 
 static void stm32f205_soc_initfn(Object *obj)
 {
@@ -77,6 +110,30 @@ static void stm32f205_soc_initfn(Object *obj)
                           TYPE_STM32F2XX_SPI);
         qdev_set_parent_bus(DEVICE(&s->spi[i]), sysbus_get_default());
     }
+
+    for (i = 0; i < STM_NUM_DMAS; i++) {
+        object_initialize(&s->dma[i], sizeof(s->dma[i]),
+                          TYPE_STM32F2XX_DMA);
+        qdev_set_parent_bus(DEVICE(&s->dma[i]), sysbus_get_default());
+    }
+}
+
+static void stm32f205_soc_connect_dma(STM32F205State *s, DeviceState *dev,
+                                      const char *name,
+                                      const STM32F205DmaRequest *req)
+{
+    DeviceState *dma = DEVICE(&s->dma[req->dma]);
+    qemu_irq irq;
+
+    irq = qdev_get_gpio_in(dma, req->stream[0] * STM_DMA_NUM_CHANNELS +
+                                req->channel);
+    if (req->stream[1] >= 0) {
+        irq = qemu_irq_split(irq,
+                             qdev_get_gpio_in(dma, req->stream[1] *
+                                                   STM_DMA_NUM_CHANNELS +
+                                                   req->channel));
+    }
+    qdev_connect_gpio_out_named(dev, name, 0, irq);
 }
 
 static void stm32f205_soc_realize(DeviceState *dev_soc, Error **errp)
@@ -124,6 +181,24 @@ static void stm32f205_soc_realize(DeviceState *dev_soc, Error **errp)
     sysbus_mmio_map(busdev, 0, 0x40013800);
     sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(nvic, 71));
 
+    /* DMA 1 and 2 */
+    for (i = 0; i < STM_NUM_DMAS; i++) {
+        int j;
+
+        dev = DEVICE(&(s->dma[i]));
+        object_property_set_bool(OBJECT(&s->dma[i]), true, "realized", &err);
+        if (err != NULL) {
+            error_propagate(errp, err);
+            return;
+        }
+        busdev = SYS_BUS_DEVICE(dev);
+        sysbus_mmio_map(busdev, 0, dma_addr[i]);
+        for (j = 0; j < STM_DMA_NUM_STREAMS; j++) {
+            sysbus_connect_irq(busdev, j,
+                               qdev_get_gpio_in(nvic, dma_irq[i][j]));
+        }
+    }
+
     /* Attach UART (uses USART registers) and USART controllers */
     for (i = 0; i < STM_NUM_USARTS; i++) {
         dev = DEVICE(&(s->usart[i]));
@@ -137,6 +212,8 @@ static void stm32f205_soc_realize(DeviceState *dev_soc, Error **errp)
         busdev = SYS_BUS_DEVICE(dev);
         sysbus_mmio_map(busdev, 0, usart_addr[i]);
         sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(nvic, usart_irq[i]));
+        stm32f205_soc_connect_dma(s, dev, "dma-rx", &usart_rx_dma[i]);
+        stm32f205_soc_connect_dma(s, dev, "dma-tx", &usart_tx_dma[i]);
     }
 
     /* Timer 2 to 5 */
@@ -175,6 +252,7 @@ static void stm32f205_soc_realize(DeviceState *dev_soc, Error **errp)
         sysbus_mmio_map(busdev, 0, adc_addr[i]);
         sysbus_connect_irq(busdev, 0,
                            qdev_get_gpio_in(DEVICE(s->adc_irqs), i));
+        stm32f205_soc_connect_dma(s, dev, "dma", &adc_dma[i]);
     }
 
     /* SPI 1 and 2 */
@@ -188,6 +266,8 @@ static void stm32f205_soc_realize(DeviceState *dev_soc, Error **errp)
         busdev = SYS_BUS_DEVICE(dev);
         sysbus_mmio_map(busdev, 0, spi_addr[i]);
         sysbus_connect_irq(busdev, 0, qdev_get_gpio_in(nvic, spi_irq[i]));
+        stm32f205_soc_connect_dma(s, dev, "dma-rx", &spi_rx_dma[i]);
+        stm32f205_soc_connect_dma(s, dev, "dma-tx", &spi_tx_dma[i]);
     }
 }
 
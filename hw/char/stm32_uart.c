@@ -71,9 +71,14 @@
 #define USART_CR3_OFFSET 0x14
 #define USART_CR3_CTSE_BIT 9
 #define USART_CR3_RTSE_BIT 8
+#define USART_CR3_DMAT_BIT 7
+#define USART_CR3_DMAR_BIT 6
 
 #define USART_GTPR_OFFSET 0x18
 
+/* Characters accepted from the chardev but not yet seen by the guest */
+#define STM32_UART_RX_FIFO_SIZE 256
+
 
 struct Stm32Uart {
     /* Inherited */
@@ -120,8 +125,17 @@ struct Stm32Uart {
 
     bool sr_read_since_ore_set;
 
-    /* Indicates whether the USART is currently receiving a byte. */
-    bool receiving;
+    /* Received characters waiting to be moved to the data register.  They
+     * are released at the programmed baud rate, or as soon as the data
+     * register is free when rx_fast is set.
+     */
+    uint8_t rx_fifo[STM32_UART_RX_FIFO_SIZE];
+    uint32_t rx_fifo_pos;
+    uint32_t rx_fifo_count;
+    bool rx_fast;
+
+    /* Virtual time at which the line delivers the next character. */
+    int64_t rx_next_ns;
 
     /* Timers used to simulate a delay corresponding to the baud rate. */
     struct QEMUTimer *rx_timer;
@@ -137,6 +151,13 @@ struct Stm32Uart {
 
     qemu_irq irq;
     int curr_irq_level;
+
+    /* DMA request lines, raised while CR3 enables DMA and the receive
+     * buffer is full or the transmit buffer is empty. */
+    qemu_irq dma_rx;
+    qemu_irq dma_tx;
+    int curr_dma_rx_level;
+    int curr_dma_tx_level;
 };
 
 
@@ -177,15 +198,33 @@ static void stm32_uart_baud_update(Stm32Uart *s)
 }
 
 /* Handle a change in the peripheral clock. */
-static void stm32_uart_clk_irq_handler(void *opaque, int n, int level)
+static void stm32_uart_clk_update(void *opaque, Clk clk)
 {
     Stm32Uart *s = (Stm32Uart *)opaque;
 
-    assert(n == 0);
+    stm32_uart_baud_update(s);
+}
+
+/* Update the DMA request lines.  The DMA controller serves a request by
+ * accessing DR, which comes back here, so the new level is recorded before
+ * it is signalled.
+ */
+static void stm32_uart_update_dma(Stm32Uart *s)
+{
+    int rx_level = s->USART_CR1_UE && s->USART_CR1_RE && s->USART_SR_RXNE &&
+                   extract32(s->USART_CR3, USART_CR3_DMAR_BIT, 1);
+    int tx_level;
+
+    if(rx_level != s->curr_dma_rx_level) {
+        s->curr_dma_rx_level = rx_level;
+        qemu_set_irq(s->dma_rx, rx_level);
+    }
 
-    /* Only update the BAUD rate if the IRQ is being set. */
-    if(level) {
-        stm32_uart_baud_update(s);
+    tx_level = s->USART_CR1_UE && s->USART_CR1_TE && s->USART_SR_TXE &&
+               extract32(s->USART_CR3, USART_CR3_DMAT_BIT, 1);
+    if(tx_level != s->curr_dma_tx_level) {
+        s->curr_dma_tx_level = tx_level;
+        qemu_set_irq(s->dma_tx, tx_level);
     }
 }
 
@@ -207,6 +246,8 @@ static void stm32_uart_update_irq(Stm32Uart *s) {
         qemu_set_irq(s->irq, new_irq_level);
         s->curr_irq_level = new_irq_level;
     }
+
+    stm32_uart_update_dma(s);
 }
 
 
@@ -339,15 +380,108 @@ static void stm32_uart_check_tx_pin(Stm32Uart *s)
 
 
 
-/* TIMER HANDLERS */
-/* Once the receive delay is finished, indicate the USART is finished receiving.
- * This will allow it to receive the next character.  The current character was
- * already received before starting the delay.
+/* RECEIVE FIFO */
+
+static bool stm32_uart_rx_enabled(Stm32Uart *s)
+{
+    return s->USART_CR1_UE && s->USART_CR1_RE;
+}
+
+/* Whether a character arriving while the data register is full overwrites it
+ * and sets the Overrun flag, as on real hardware.  Otherwise it waits in the
+ * FIFO until software has read the previous one.
  */
+static bool stm32_uart_rx_overrun(Stm32Uart *s)
+{
+#ifdef STM32_UART_ENABLE_OVERRUN
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Move the character at the head of the FIFO to the data register. */
+static void stm32_uart_rx_pop(Stm32Uart *s)
+{
+    if(s->USART_SR_RXNE) {
+        s->USART_SR_ORE = 1;
+        s->sr_read_since_ore_set = false;
+    }
+
+    s->USART_RDR = s->rx_fifo[s->rx_fifo_pos];
+    s->USART_SR_RXNE = 1;
+    s->rx_fifo_pos = (s->rx_fifo_pos + 1) % STM32_UART_RX_FIFO_SIZE;
+    s->rx_fifo_count--;
+}
+
+/* Release every character the line has delivered by now.  This is called
+ * lazily from register accesses as well as from rx_timer, so the timer is
+ * only armed when the receive interrupt is enabled; a guest polling the
+ * status register catches up on a whole batch of characters at once.
+ */
+static void stm32_uart_rx_release(Stm32Uart *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t old_count = s->rx_fifo_count;
+
+    if(!stm32_uart_rx_enabled(s)) {
+        return;
+    }
+
+    if(s->rx_fast || s->bits_per_sec == 0) {
+        /* Hand over the next character as soon as the register is free. */
+        if(s->rx_fifo_count && !s->USART_SR_RXNE) {
+            stm32_uart_rx_pop(s);
+        }
+    } else if(stm32_uart_rx_overrun(s)) {
+        /* Characters keep arriving on time whether or not software reads
+         * them; all but the last of a late batch are lost to overrun.
+         */
+        while(s->rx_fifo_count && s->rx_next_ns <= now) {
+            stm32_uart_rx_pop(s);
+            s->rx_next_ns += s->ns_per_char;
+        }
+    } else if(s->rx_fifo_count && !s->USART_SR_RXNE &&
+              s->rx_next_ns <= now) {
+        /* The line stalls while the data register is full, so the next
+         * character takes a full character time from now.
+         */
+        stm32_uart_rx_pop(s);
+        s->rx_next_ns = now + s->ns_per_char;
+    }
+
+    if(s->rx_fifo_count != old_count) {
+        stm32_uart_update_irq(s);
+        qemu_chr_fe_accept_input(&s->chr);
+    }
+
+    if(s->rx_fifo_count && !s->rx_fast &&
+       (s->USART_CR1_RXNEIE ||
+        extract32(s->USART_CR3, USART_CR3_DMAR_BIT, 1)) &&
+       s->bits_per_sec != 0 &&
+       (!s->USART_SR_RXNE || stm32_uart_rx_overrun(s))) {
+        timer_mod(s->rx_timer, s->rx_next_ns);
+    } else {
+        timer_del(s->rx_timer);
+    }
+}
+
+static void stm32_uart_rx_flush(Stm32Uart *s)
+{
+    s->rx_fifo_pos = 0;
+    s->rx_fifo_count = 0;
+    timer_del(s->rx_timer);
+}
+
+
+
+
+/* TIMER HANDLERS */
+/* Once the next character is due, move it to the data register. */
 static void stm32_uart_rx_timer_expire(void *opaque) {
     Stm32Uart *s = (Stm32Uart *)opaque;
 
-    s->receiving = false;
+    stm32_uart_rx_release(s);
 }
 
 /* When the transmit delay is complete, mark the transmit as complete
@@ -368,35 +502,16 @@ static int stm32_uart_can_receive(void *opaque)
 {
     Stm32Uart *s = (Stm32Uart *)opaque;
 
-    if(s->USART_CR1_UE && s->USART_CR1_RE) {
-        /* The USART can only receive if it is enabled. */
-        if(s->receiving) {
-            /* If the USART is already receiving, then it cannot receive another
-             * character yet.
-             */
-            return 0;
-        } else {
-#ifdef STM32_UART_ENABLE_OVERRUN
-            /* If overrun is enabled, then always allow the next character to be
-             * received even if the buffer already has a value.  This is how
-             * real hardware behaves.*/
-            return 1;
-#else
-            /* Otherwise, do not allow the next character to be received until
-             * software has read the previous one.
-             */
-            if(s->USART_SR_RXNE) {
-                return 0;
-            } else {
-                return 1;
-            }
-#endif
-        }
+    if(stm32_uart_rx_enabled(s)) {
+        /* Take as much as the FIFO can hold; the baud rate is applied when
+         * the characters are released to the data register.
+         */
+        return STM32_UART_RX_FIFO_SIZE - s->rx_fifo_count;
     } else {
-        /* Always allow a character to be received if the module is disabled.
-         * However, the character will just be ignored (just like on real
+        /* Always allow characters to be received if the module is disabled.
+         * However, they will just be ignored (just like on real
          * hardware). */
-        return 1;
+        return STM32_UART_RX_FIFO_SIZE;
     }
 }
 
@@ -408,36 +523,30 @@ static void stm32_uart_event(void *opaque, int event)
 static void stm32_uart_receive(void *opaque, const uint8_t *buf, int size)
 {
     Stm32Uart *s = (Stm32Uart *)opaque;
-    uint64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t curr_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t tail;
+    int i;
 
     assert(size > 0);
 
-    /* Only handle the received character if the module is enabled, */
-    if(s->USART_CR1_UE && s->USART_CR1_RE) {
-        /* If there is already a character in the receive buffer, then
-         * set the overflow flag.
-         */
-        if(s->USART_SR_RXNE) {
-            s->USART_SR_ORE = 1;
-            s->sr_read_since_ore_set = false;
-            stm32_uart_update_irq(s);
-        }
+    /* Only handle the received characters if the module is enabled, */
+    if(!stm32_uart_rx_enabled(s)) {
+        return;
+    }
 
-        /* Receive the character and mark the buffer as not empty. */
-        s->USART_RDR = *buf;
-        s->USART_SR_RXNE = 1;
-        stm32_uart_update_irq(s);
+    /* If the line was idle, the first character is delivered right away. */
+    if(s->rx_fifo_count == 0 && s->rx_next_ns < curr_time) {
+        s->rx_next_ns = curr_time;
     }
 
-#ifdef STM32_UART_NO_BAUD_DELAY
-    /* Do nothing - there is no delay before the module reports it can receive
-     * the next character. */
-    curr_time = curr_time; //Avoid "variable unused" compiler error
-#else
-    /* Indicate the module is receiving and start the delay. */
-    s->receiving = true;
-    timer_mod(s->rx_timer,  curr_time + s->ns_per_char);
-#endif
+    assert(size <= STM32_UART_RX_FIFO_SIZE - s->rx_fifo_count);
+    for(i = 0; i < size; i++) {
+        tail = (s->rx_fifo_pos + s->rx_fifo_count) % STM32_UART_RX_FIFO_SIZE;
+        s->rx_fifo[tail] = buf[i];
+        s->rx_fifo_count++;
+    }
+
+    stm32_uart_rx_release(s);
 }
 
 
@@ -447,6 +556,9 @@ static void stm32_uart_receive(void *opaque, const uint8_t *buf, int size)
 
 static uint32_t stm32_uart_USART_SR_read(Stm32Uart *s)
 {
+    /* Pick up any characters that arrived since the last access. */
+    stm32_uart_rx_release(s);
+
     /* If the Overflow flag is set, reading the SR register is the first step
      * to resetting the flag.
      */
@@ -488,6 +600,8 @@ static void stm32_uart_USART_SR_write(Stm32Uart *s, uint32_t new_value)
 
 static void stm32_uart_USART_DR_read(Stm32Uart *s, uint32_t *read_value)
 {
+    stm32_uart_rx_release(s);
+
     /* If the Overflow flag is set, then it should be cleared if the software
      * performs an SR read followed by a DR read.
      */
@@ -518,6 +632,9 @@ static void stm32_uart_USART_DR_read(Stm32Uart *s, uint32_t *read_value)
     }
 
     stm32_uart_update_irq(s);
+
+    /* The data register is free again, let the next character in. */
+    stm32_uart_rx_release(s);
 }
 
 
@@ -590,7 +707,13 @@ static void stm32_uart_USART_CR1_write(Stm32Uart *s, uint32_t new_value,
 
     s->USART_CR1 = new_value & 0x00003fff;
 
+    /* Characters still on the line are lost when the receiver is disabled. */
+    if(!stm32_uart_rx_enabled(s)) {
+        stm32_uart_rx_flush(s);
+    }
+
     stm32_uart_update_irq(s);
+    stm32_uart_rx_release(s);
 }
 
 static void stm32_uart_USART_CR2_write(Stm32Uart *s, uint32_t new_value,
@@ -603,6 +726,9 @@ static void stm32_uart_USART_CR3_write(Stm32Uart *s, uint32_t new_value,
                                         bool init)
 {
     s->USART_CR3 = new_value & 0x000007ff;
+
+    stm32_uart_update_irq(s);
+    stm32_uart_rx_release(s);
 }
 
 static void stm32_uart_reset(DeviceState *dev)
@@ -618,6 +744,9 @@ static void stm32_uart_reset(DeviceState *dev)
     s->USART_SR_RXNE = 0;
     s->USART_SR_ORE = 0;
 
+    stm32_uart_rx_flush(s);
+    s->rx_next_ns = 0;
+
     // Do not initialize USART_DR - it is documented as undefined at reset
     // and does not behave like normal registers.
     stm32_uart_USART_BRR_write(s, 0x00000000, true);
@@ -705,7 +834,8 @@ static void stm32_uart_write(void *opaque, hwaddr offset,
 static const MemoryRegionOps stm32_uart_ops = {
     .read = stm32_uart_read,
     .write = stm32_uart_write,
-    .valid.min_access_size = 2,
+    /* Byte accesses to DR are common from the DMA controller */
+    .valid.min_access_size = 1,
     .valid.max_access_size = 4,
     .endianness = DEVICE_NATIVE_ENDIAN
 };
@@ -713,15 +843,17 @@ static const MemoryRegionOps stm32_uart_ops = {
 static void stm32_uart_realize(DeviceState *dev, Error **errp)
 {
     Stm32Uart *s = (Stm32Uart *)(dev);
-    qemu_irq *clk_irq;
-    
+
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
     s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
     s->stm32_afio = (Stm32Afio *)s->stm32_afio_prop;
 
-    clk_irq =
-        qemu_allocate_irqs(stm32_uart_clk_irq_handler, (void *)s, 1);
-    stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
+    stm32_rcc_add_periph_clk_notifier(s->stm32_rcc, s->periph,
+                                      stm32_uart_clk_update, s);
+
+#ifdef STM32_UART_NO_BAUD_DELAY
+    s->rx_fast = true;
+#endif
 
     qemu_chr_fe_set_handlers(&s->chr, stm32_uart_can_receive, stm32_uart_receive,
                              stm32_uart_event, s, NULL, true);
@@ -760,6 +892,8 @@ static void stm32_uart_init(Object *obj)
     sysbus_init_mmio(dev, &s->iomem);
 
     sysbus_init_irq(dev, &s->irq);
+    qdev_init_gpio_out_named(DEVICE(dev), &s->dma_rx, "dma-rx", 1);
+    qdev_init_gpio_out_named(DEVICE(dev), &s->dma_tx, "dma-tx", 1);
 
     s->rx_timer =
         timer_new_ns(QEMU_CLOCK_VIRTUAL,
@@ -776,6 +910,7 @@ static Property stm32_uart_properties[] = {
     DEFINE_PROP_PTR("stm32_gpio", Stm32Uart, stm32_gpio_prop),
     DEFINE_PROP_PTR("stm32_afio", Stm32Uart, stm32_afio_prop),
     DEFINE_PROP_CHR("chardev", Stm32Uart, chr),
+    DEFINE_PROP_BOOL("rx-fast", Stm32Uart, rx_fast, false),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -38,6 +38,18 @@
 
 #define DB_PRINT(fmt, args...) DB_PRINT_L(1, fmt, ## args)
 
+static void stm32f2xx_usart_update_dma(STM32F2XXUsartState *s)
+{
+    bool enabled = s->usart_cr1 & USART_CR1_UE;
+
+    qemu_set_irq(s->dma_rx, enabled && (s->usart_cr1 & USART_CR1_RE) &&
+                 (s->usart_cr3 & USART_CR3_DMAR) &&
+                 (s->usart_sr & USART_SR_RXNE));
+    qemu_set_irq(s->dma_tx, enabled && (s->usart_cr1 & USART_CR1_TE) &&
+                 (s->usart_cr3 & USART_CR3_DMAT) &&
+                 (s->usart_sr & USART_SR_TXE));
+}
+
 static int stm32f2xx_usart_can_receive(void *opaque)
 {
     STM32F2XXUsartState *s = opaque;
@@ -66,6 +78,7 @@ static void stm32f2xx_usart_receive(void *opaque, const uint8_t *buf, int size)
     if (s->usart_cr1 & USART_CR1_RXNEIE) {
         qemu_set_irq(s->irq, 1);
     }
+    stm32f2xx_usart_update_dma(s);
 
     DB_PRINT("Receiving: %c\n", s->usart_dr);
 }
@@ -83,6 +96,7 @@ static void stm32f2xx_usart_reset(DeviceState *dev)
     s->usart_gtpr = 0x00000000;
 
     qemu_set_irq(s->irq, 0);
+    stm32f2xx_usart_update_dma(s);
 }
 
 static uint64_t stm32f2xx_usart_read(void *opaque, hwaddr addr,
@@ -103,8 +117,9 @@ static uint64_t stm32f2xx_usart_read(void *opaque, hwaddr addr,
         DB_PRINT("Value: 0x%" PRIx32 ", %c\n", s->usart_dr, (char) s->usart_dr);
         s->usart_sr |= USART_SR_TXE;
         s->usart_sr &= ~USART_SR_RXNE;
-        qemu_chr_fe_accept_input(&s->chr);
         qemu_set_irq(s->irq, 0);
+        stm32f2xx_usart_update_dma(s);
+        qemu_chr_fe_accept_input(&s->chr);
         return s->usart_dr & 0x3FF;
     case USART_BRR:
         return s->usart_brr;
@@ -144,6 +159,7 @@ static void stm32f2xx_usart_write(void *opaque, hwaddr addr,
         if (!(s->usart_sr & USART_SR_RXNE)) {
             qemu_set_irq(s->irq, 0);
         }
+        stm32f2xx_usart_update_dma(s);
         return;
     case USART_DR:
         if (value < 0xF000) {
@@ -151,8 +167,10 @@ static void stm32f2xx_usart_write(void *opaque, hwaddr addr,
             /* XXX this blocks entire thread. Rewrite to use
              * qemu_chr_fe_write and background I/O callbacks */
             qemu_chr_fe_write_all(&s->chr, &ch, 1);
-            s->usart_sr |= USART_SR_TC;
-            s->usart_sr &= ~USART_SR_TXE;
+            /* The character has gone out by now, so the data register is
+             * free again straight away.
+             */
+            s->usart_sr |= USART_SR_TC | USART_SR_TXE;
         }
         return;
     case USART_BRR:
@@ -164,12 +182,14 @@ static void stm32f2xx_usart_write(void *opaque, hwaddr addr,
                 s->usart_sr & USART_SR_RXNE) {
                 qemu_set_irq(s->irq, 1);
             }
+        stm32f2xx_usart_update_dma(s);
         return;
     case USART_CR2:
         s->usart_cr2 = value;
         return;
     case USART_CR3:
         s->usart_cr3 = value;
+        stm32f2xx_usart_update_dma(s);
         return;
     case USART_GTPR:
         s->usart_gtpr = value;
@@ -196,6 +216,8 @@ static void stm32f2xx_usart_init(Object *obj)
     STM32F2XXUsartState *s = STM32F2XX_USART(obj);
 
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+    qdev_init_gpio_out_named(DEVICE(obj), &s->dma_rx, "dma-rx", 1);
+    qdev_init_gpio_out_named(DEVICE(obj), &s->dma_tx, "dma-tx", 1);
 
     memory_region_init_io(&s->mmio, obj, &stm32f2xx_usart_ops, s,
                           TYPE_STM32F2XX_USART, 0x2000);
@@ -27,7 +27,6 @@
 #include "qom/object.h"
 #include "qemu/thread.h"
 #include "avatar/irq.h"
-#include "avatar/avatar-io.h"
 
 #define IRQ(obj) OBJECT_CHECK(struct IRQState, (obj), TYPE_IRQ)
 
@@ -37,6 +36,7 @@ struct IRQState {
     qemu_irq_handler handler;
     void *opaque;
     int n;
+    bool avatar_forward;
 };
 
 void qemu_set_irq(qemu_irq irq, int level)
@@ -44,15 +44,20 @@ void qemu_set_irq(qemu_irq irq, int level)
     if (!irq)
         return;
 
-    IRQ_MSG msg = {
-        .irq_num = irq->n,
-        .level = level
-    };
-    qemu_avatar_mq_send(&IrqMQ, &msg, sizeof(msg));
-    printf("Sending IRQ %d\n", irq->n);
+    if (unlikely(irq->avatar_forward)) {
+        avatar_irq_forward(irq->n, level);
+    }
     irq->handler(irq->opaque, irq->n, level);
 }
 
+void qemu_irq_set_avatar_forward(qemu_irq irq, bool forward)
+{
+    if (forward && !irq->avatar_forward) {
+        avatar_irq_add_source(irq->n);
+    }
+    irq->avatar_forward = forward;
+}
+
 qemu_irq *qemu_extend_irqs(qemu_irq *old, int n_old, qemu_irq_handler handler,
                            void *opaque, int n)
 {
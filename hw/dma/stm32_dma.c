@@ -0,0 +1,612 @@
+/*
+ * STM32 Microcontroller DMA controller
+ *
+ * Implementation based on ST Microelectronics "RM0008 Reference Manual Rev 10"
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "qemu/osdep.h"
+#include "hw/hw.h"
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "qapi/error.h"
+#include "exec/address-spaces.h"
+#include "qemu/bitops.h"
+#include "qemu/timer.h"
+
+
+
+/* DEFINITIONS*/
+
+//#define DEBUG_STM32_DMA
+
+#ifdef DEBUG_STM32_DMA
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("STM32_DMA: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define DMA_ISR_OFFSET 0x00
+#define DMA_IFCR_OFFSET 0x04
+
+/* Per-channel registers, channel n (counting from 0) is at
+ * DMA_CHANNEL_OFFSET + n * DMA_CHANNEL_SIZE */
+#define DMA_CHANNEL_OFFSET 0x08
+#define DMA_CHANNEL_SIZE 0x14
+#define DMA_CCR_OFFSET 0x00
+#define DMA_CNDTR_OFFSET 0x04
+#define DMA_CPAR_OFFSET 0x08
+#define DMA_CMAR_OFFSET 0x0c
+
+/* Flags of a channel in ISR/IFCR, shifted by 4 * channel */
+#define DMA_ISR_GIF 0x1
+#define DMA_ISR_TCIF 0x2
+#define DMA_ISR_HTIF 0x4
+#define DMA_ISR_TEIF 0x8
+
+#define DMA_CCR_EN_BIT 0
+#define DMA_CCR_TCIE_BIT 1
+#define DMA_CCR_HTIE_BIT 2
+#define DMA_CCR_TEIE_BIT 3
+#define DMA_CCR_DIR_BIT 4
+#define DMA_CCR_CIRC_BIT 5
+#define DMA_CCR_PINC_BIT 6
+#define DMA_CCR_MINC_BIT 7
+#define DMA_CCR_PSIZE_START 8
+#define DMA_CCR_MSIZE_START 10
+#define DMA_CCR_MEM2MEM_BIT 14
+
+#define STM32_DMA_MAX_CHANNELS 7
+
+/* Virtual time a circular transfer is charged per item moved */
+#define STM32_DMA_ITEM_NS 1000
+
+typedef struct Stm32DmaChannel {
+    /* Register Values */
+    uint32_t
+        DMA_CCR,
+        DMA_CNDTR,
+        DMA_CPAR,
+        DMA_CMAR;
+
+    /* The channel's ISR flags (DMA_ISR_*), not shifted. */
+    uint32_t isr;
+
+    /* Number of items programmed when the channel was enabled, and the
+     * current addresses.  CPAR and CMAR keep reading back the programmed
+     * values while the transfer progresses. */
+    uint32_t count;
+    uint32_t par;
+    uint32_t mar;
+
+    /* Level of the peripheral's DMA request line. */
+    bool request;
+
+    /* Virtual time before which a circular transfer that moved a whole
+     * buffer in its last run is not served again. */
+    int64_t resume_ns;
+
+    qemu_irq irq;
+    int curr_irq_level;
+} Stm32DmaChannel;
+
+struct Stm32Dma {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    uint32_t num_channels;
+
+    /* Private */
+    MemoryRegion iomem;
+
+    Stm32DmaChannel channel[STM32_DMA_MAX_CHANNELS];
+
+    /* Set while transfers are running.  Peripherals raise and lower their
+     * request lines from inside the register accesses we make, which must
+     * not start a nested run. */
+    bool busy;
+
+    /* Continues circular transfers whose peripheral never stops requesting
+     * once the virtual time for their buffer has passed, so that a single
+     * request cannot keep the CPU from running.  Armed for the earliest
+     * resume_ns of all channels. */
+    QEMUTimer *timer;
+};
+
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_dma_update_irq(Stm32DmaChannel *ch)
+{
+    int new_irq_level =
+        ((ch->isr & DMA_ISR_TCIF) &&
+                extract32(ch->DMA_CCR, DMA_CCR_TCIE_BIT, 1)) ||
+        ((ch->isr & DMA_ISR_HTIF) &&
+                extract32(ch->DMA_CCR, DMA_CCR_HTIE_BIT, 1)) ||
+        ((ch->isr & DMA_ISR_TEIF) &&
+                extract32(ch->DMA_CCR, DMA_CCR_TEIE_BIT, 1));
+
+    if(new_irq_level ^ ch->curr_irq_level) {
+        qemu_set_irq(ch->irq, new_irq_level);
+        ch->curr_irq_level = new_irq_level;
+    }
+}
+
+static void stm32_dma_set_flags(Stm32DmaChannel *ch, uint32_t flags)
+{
+    ch->isr |= flags | DMA_ISR_GIF;
+    stm32_dma_update_irq(ch);
+}
+
+/* Item size in bytes of a PSIZE or MSIZE field.  The reserved encoding is
+ * treated as 32 bits. */
+static unsigned stm32_dma_size(Stm32DmaChannel *ch, int start)
+{
+    return MIN(1 << extract32(ch->DMA_CCR, start, 2), 4);
+}
+
+static bool stm32_dma_channel_ready(Stm32DmaChannel *ch)
+{
+    return extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1) && ch->DMA_CNDTR &&
+           (ch->request || extract32(ch->DMA_CCR, DMA_CCR_MEM2MEM_BIT, 1));
+}
+
+/* Account for items that were just transferred. */
+static void stm32_dma_advance(Stm32DmaChannel *ch, uint32_t items)
+{
+    uint32_t done_before = ch->count - ch->DMA_CNDTR;
+    uint32_t flags = 0;
+
+    ch->DMA_CNDTR -= items;
+
+    if(done_before < ch->count / 2 &&
+       ch->count - ch->DMA_CNDTR >= ch->count / 2) {
+        flags |= DMA_ISR_HTIF;
+    }
+
+    if(ch->DMA_CNDTR == 0) {
+        flags |= DMA_ISR_TCIF;
+
+        if(extract32(ch->DMA_CCR, DMA_CCR_CIRC_BIT, 1)) {
+            ch->DMA_CNDTR = ch->count;
+            ch->par = ch->DMA_CPAR;
+            ch->mar = ch->DMA_CMAR;
+        }
+    }
+
+    if(flags) {
+        stm32_dma_set_flags(ch, flags);
+    }
+}
+
+static void stm32_dma_error(Stm32DmaChannel *ch)
+{
+    /* The channel is disabled by hardware on a bus error. */
+    ch->DMA_CCR &= ~BIT(DMA_CCR_EN_BIT);
+    stm32_dma_set_flags(ch, DMA_ISR_TEIF);
+}
+
+/* Memory-to-memory transfer between two incrementing buffers of the same
+ * item size: move everything that is left in a single copy. */
+static uint32_t stm32_dma_copy_block(Stm32DmaChannel *ch, unsigned size)
+{
+    bool from_mem = extract32(ch->DMA_CCR, DMA_CCR_DIR_BIT, 1);
+    uint32_t items = ch->DMA_CNDTR;
+    size_t len = (size_t)items * size;
+    uint8_t *buf = g_malloc(len);
+    MemTxResult res;
+
+    res = address_space_read(&address_space_memory,
+                             from_mem ? ch->mar : ch->par,
+                             MEMTXATTRS_UNSPECIFIED, buf, len);
+    res |= address_space_write(&address_space_memory,
+                               from_mem ? ch->par : ch->mar,
+                               MEMTXATTRS_UNSPECIFIED, buf, len);
+    g_free(buf);
+
+    if(res != MEMTX_OK) {
+        stm32_dma_error(ch);
+        return 0;
+    }
+
+    ch->par += len;
+    ch->mar += len;
+    stm32_dma_advance(ch, items);
+    return items;
+}
+
+/* Move the next item of a channel.  When the two sizes differ the data is
+ * zero-extended or truncated, as on real hardware (RM0008 table 76).
+ * Returns the number of items moved. */
+static uint32_t stm32_dma_transfer(Stm32DmaChannel *ch)
+{
+    unsigned psize = stm32_dma_size(ch, DMA_CCR_PSIZE_START);
+    unsigned msize = stm32_dma_size(ch, DMA_CCR_MSIZE_START);
+    bool from_mem = extract32(ch->DMA_CCR, DMA_CCR_DIR_BIT, 1);
+    bool pinc = extract32(ch->DMA_CCR, DMA_CCR_PINC_BIT, 1);
+    bool minc = extract32(ch->DMA_CCR, DMA_CCR_MINC_BIT, 1);
+    uint8_t buf[4] = { 0 };
+    MemTxResult res;
+
+    if(extract32(ch->DMA_CCR, DMA_CCR_MEM2MEM_BIT, 1) && pinc && minc &&
+       psize == msize) {
+        return stm32_dma_copy_block(ch, psize);
+    }
+
+    if(from_mem) {
+        res = address_space_read(&address_space_memory, ch->mar,
+                                 MEMTXATTRS_UNSPECIFIED, buf, msize);
+        res |= address_space_write(&address_space_memory, ch->par,
+                                   MEMTXATTRS_UNSPECIFIED, buf, psize);
+    } else {
+        res = address_space_read(&address_space_memory, ch->par,
+                                 MEMTXATTRS_UNSPECIFIED, buf, psize);
+        res |= address_space_write(&address_space_memory, ch->mar,
+                                   MEMTXATTRS_UNSPECIFIED, buf, msize);
+    }
+
+    if(res != MEMTX_OK) {
+        DPRINTF("Transfer error, CPAR 0x%x CMAR 0x%x\n",
+                ch->par, ch->mar);
+        stm32_dma_error(ch);
+        return 0;
+    }
+
+    if(pinc) {
+        ch->par += psize;
+    }
+    if(minc) {
+        ch->mar += msize;
+    }
+    stm32_dma_advance(ch, 1);
+    return 1;
+}
+
+/* Serve every channel that is ready, one item per channel in turn so that
+ * e.g. the receive and transmit channels of a full-duplex peripheral stay in
+ * step.  A run moves at most one buffer's worth per channel; circular
+ * transfers that are still requesting after that continue from the timer,
+ * STM32_DMA_ITEM_NS of virtual time per item of their own buffer later. */
+static void stm32_dma_run(Stm32Dma *s)
+{
+    uint32_t budget[STM32_DMA_MAX_CHANNELS];
+    Stm32DmaChannel *ch;
+    uint32_t items;
+    bool progress;
+    int64_t now;
+    int i;
+
+    if(s->busy) {
+        return;
+    }
+    s->busy = true;
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    for(i = 0; i < s->num_channels; i++) {
+        ch = &s->channel[i];
+        budget[i] = ch->resume_ns > now ? 0 : MAX(ch->count, 1);
+    }
+
+    do {
+        progress = false;
+        for(i = 0; i < s->num_channels; i++) {
+            ch = &s->channel[i];
+            if(!stm32_dma_channel_ready(ch)) {
+                continue;
+            }
+            if(budget[i] == 0) {
+                if(ch->resume_ns <= now) {
+                    ch->resume_ns = now +
+                        (int64_t)MAX(ch->count, 1) * STM32_DMA_ITEM_NS;
+                }
+                timer_mod_anticipate(s->timer, ch->resume_ns);
+                continue;
+            }
+            items = stm32_dma_transfer(ch);
+            if(items) {
+                budget[i] -= MIN(budget[i], items);
+                progress = true;
+            }
+        }
+    } while(progress);
+
+    s->busy = false;
+}
+
+static void stm32_dma_timer_expire(void *opaque)
+{
+    stm32_dma_run((Stm32Dma *)opaque);
+}
+
+
+
+
+
+/* REQUEST LINES */
+
+static void stm32_dma_request(void *opaque, int n, int level)
+{
+    Stm32Dma *s = (Stm32Dma *)opaque;
+
+    assert(n < s->num_channels);
+
+    s->channel[n].request = level;
+    if(level) {
+        stm32_dma_run(s);
+    }
+}
+
+
+
+
+
+/* REGISTER IMPLEMENTATION */
+
+static uint32_t stm32_dma_ISR_read(Stm32Dma *s)
+{
+    uint32_t value = 0;
+    int i;
+
+    for(i = 0; i < s->num_channels; i++) {
+        value |= s->channel[i].isr << (i * 4);
+    }
+    return value;
+}
+
+static void stm32_dma_IFCR_write(Stm32Dma *s, uint32_t new_value)
+{
+    Stm32DmaChannel *ch;
+    uint32_t clear;
+    int i;
+
+    for(i = 0; i < s->num_channels; i++) {
+        ch = &s->channel[i];
+        clear = extract32(new_value, i * 4, 4);
+        /* Clearing the global flag clears all the others. */
+        if(clear & DMA_ISR_GIF) {
+            clear = 0xf;
+        }
+        ch->isr &= ~clear;
+        stm32_dma_update_irq(ch);
+    }
+}
+
+/* Whether any channel may still need the pacing timer */
+static bool stm32_dma_circular(Stm32Dma *s)
+{
+    Stm32DmaChannel *ch;
+    int i;
+
+    for(i = 0; i < s->num_channels; i++) {
+        ch = &s->channel[i];
+        if(extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1) &&
+           extract32(ch->DMA_CCR, DMA_CCR_CIRC_BIT, 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void stm32_dma_CCR_write(Stm32Dma *s, Stm32DmaChannel *ch,
+                                uint32_t new_value)
+{
+    bool was_enabled = extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1);
+
+    ch->DMA_CCR = new_value & 0x00007fff;
+
+    if(!was_enabled && extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1)) {
+        ch->count = ch->DMA_CNDTR;
+        ch->par = ch->DMA_CPAR;
+        ch->mar = ch->DMA_CMAR;
+        ch->resume_ns = 0;
+        DPRINTF("Channel enabled, CCR 0x%x CNDTR %u CPAR 0x%x CMAR 0x%x\n",
+                ch->DMA_CCR, ch->DMA_CNDTR, ch->DMA_CPAR, ch->DMA_CMAR);
+    }
+
+    stm32_dma_update_irq(ch);
+    if(!stm32_dma_circular(s)) {
+        timer_del(s->timer);
+    }
+    stm32_dma_run(s);
+}
+
+static uint64_t stm32_dma_read(void *opaque, hwaddr offset,
+                          unsigned size)
+{
+    Stm32Dma *s = (Stm32Dma *)opaque;
+    Stm32DmaChannel *ch;
+    int n;
+
+    if(offset == DMA_ISR_OFFSET) {
+        return stm32_dma_ISR_read(s);
+    } else if(offset == DMA_IFCR_OFFSET) {
+        STM32_WO_REG(offset);
+        return 0;
+    }
+
+    n = (offset - DMA_CHANNEL_OFFSET) / DMA_CHANNEL_SIZE;
+    if(n >= s->num_channels) {
+        STM32_BAD_REG(offset, size);
+        return 0;
+    }
+    ch = &s->channel[n];
+
+    switch((offset - DMA_CHANNEL_OFFSET) % DMA_CHANNEL_SIZE) {
+        case DMA_CCR_OFFSET:
+            return ch->DMA_CCR;
+        case DMA_CNDTR_OFFSET:
+            return ch->DMA_CNDTR;
+        case DMA_CPAR_OFFSET:
+            return ch->DMA_CPAR;
+        case DMA_CMAR_OFFSET:
+            return ch->DMA_CMAR;
+        default:
+            STM32_BAD_REG(offset, size);
+            return 0;
+    }
+}
+
+static void stm32_dma_write(void *opaque, hwaddr offset,
+                       uint64_t value, unsigned size)
+{
+    Stm32Dma *s = (Stm32Dma *)opaque;
+    Stm32DmaChannel *ch;
+    int n;
+
+    if(offset == DMA_ISR_OFFSET) {
+        STM32_RO_REG(offset);
+        return;
+    } else if(offset == DMA_IFCR_OFFSET) {
+        stm32_dma_IFCR_write(s, value);
+        return;
+    }
+
+    n = (offset - DMA_CHANNEL_OFFSET) / DMA_CHANNEL_SIZE;
+    if(n >= s->num_channels) {
+        STM32_BAD_REG(offset, size);
+        return;
+    }
+    ch = &s->channel[n];
+
+    switch((offset - DMA_CHANNEL_OFFSET) % DMA_CHANNEL_SIZE) {
+        case DMA_CCR_OFFSET:
+            stm32_dma_CCR_write(s, ch, value);
+            break;
+        case DMA_CNDTR_OFFSET:
+        case DMA_CPAR_OFFSET:
+        case DMA_CMAR_OFFSET:
+            /* These can only be written while the channel is disabled. */
+            if(extract32(ch->DMA_CCR, DMA_CCR_EN_BIT, 1)) {
+                qemu_log_mask(LOG_GUEST_ERROR,
+                              "%s: register 0x%x written while channel %d "
+                              "is enabled\n", __FUNCTION__, (int)offset, n + 1);
+                break;
+            }
+            switch((offset - DMA_CHANNEL_OFFSET) % DMA_CHANNEL_SIZE) {
+                case DMA_CNDTR_OFFSET:
+                    ch->DMA_CNDTR = value & 0x0000ffff;
+                    break;
+                case DMA_CPAR_OFFSET:
+                    ch->DMA_CPAR = value;
+                    break;
+                default:
+                    ch->DMA_CMAR = value;
+                    break;
+            }
+            break;
+        default:
+            STM32_BAD_REG(offset, size);
+            break;
+    }
+}
+
+static const MemoryRegionOps stm32_dma_ops = {
+    .read = stm32_dma_read,
+    .write = stm32_dma_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN
+};
+
+static void stm32_dma_reset(DeviceState *dev)
+{
+    Stm32Dma *s = STM32_DMA(dev);
+    Stm32DmaChannel *ch;
+    int i;
+
+    for(i = 0; i < s->num_channels; i++) {
+        ch = &s->channel[i];
+        ch->DMA_CCR = 0;
+        ch->DMA_CNDTR = 0;
+        ch->DMA_CPAR = 0;
+        ch->DMA_CMAR = 0;
+        ch->isr = 0;
+        ch->count = 0;
+        ch->par = 0;
+        ch->mar = 0;
+        ch->resume_ns = 0;
+        stm32_dma_update_irq(ch);
+    }
+    timer_del(s->timer);
+}
+
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static void stm32_dma_init(Object *obj)
+{
+    SysBusDevice *dev = SYS_BUS_DEVICE(obj);
+    Stm32Dma *s = STM32_DMA(dev);
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &stm32_dma_ops, s,
+                          "dma", 0x0400);
+    sysbus_init_mmio(dev, &s->iomem);
+}
+
+static void stm32_dma_realize(DeviceState *dev, Error **errp)
+{
+    Stm32Dma *s = STM32_DMA(dev);
+    int i;
+
+    if(s->num_channels == 0 || s->num_channels > STM32_DMA_MAX_CHANNELS) {
+        error_setg(errp, "stm32-dma: num-channels must be between 1 and %d",
+                   STM32_DMA_MAX_CHANNELS);
+        return;
+    }
+
+    for(i = 0; i < s->num_channels; i++) {
+        sysbus_init_irq(SYS_BUS_DEVICE(dev), &s->channel[i].irq);
+    }
+    qdev_init_gpio_in(dev, stm32_dma_request, s->num_channels);
+
+    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, stm32_dma_timer_expire, s);
+}
+
+static Property stm32_dma_properties[] = {
+    DEFINE_PROP_UINT32("num-channels", Stm32Dma, num_channels,
+                       STM32_DMA_MAX_CHANNELS),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_dma_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = stm32_dma_realize;
+    dc->reset = stm32_dma_reset;
+    dc->props = stm32_dma_properties;
+}
+
+static TypeInfo stm32_dma_info = {
+    .name  = TYPE_STM32_DMA,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32Dma),
+    .instance_init = stm32_dma_init,
+    .class_init = stm32_dma_class_init
+};
+
+static void stm32_dma_register_types(void)
+{
+    type_register_static(&stm32_dma_info);
+}
+
+type_init(stm32_dma_register_types)
@@ -0,0 +1,556 @@
+/*
+ * STM32F2XX DMA controller
+ *
+ * Implementation based on ST Microelectronics "RM0033 Reference Manual"
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/log.h"
+#include "exec/address-spaces.h"
+#include "hw/dma/stm32f2xx_dma.h"
+
+#ifndef STM_DMA_ERR_DEBUG
+#define STM_DMA_ERR_DEBUG 0
+#endif
+
+#define DB_PRINT_L(lvl, fmt, args...) do { \
+    if (STM_DMA_ERR_DEBUG >= lvl) { \
+        qemu_log("%s: " fmt, __func__, ## args); \
+    } \
+} while (0);
+
+#define DB_PRINT(fmt, args...) DB_PRINT_L(1, fmt, ## args)
+
+/* Position of a stream's flags in LISR/HISR and LIFCR/HIFCR */
+static const int stm32f2xx_dma_flag_shift[4] = { 0, 6, 16, 22 };
+
+static void stm32f2xx_dma_update_irq(STM32F2XXDmaStream *st)
+{
+    uint32_t cr = st->dma_sxcr;
+    bool level = ((st->isr & STM_DMA_TCIF) && (cr & STM_DMA_SxCR_TCIE)) ||
+                 ((st->isr & STM_DMA_HTIF) && (cr & STM_DMA_SxCR_HTIE)) ||
+                 ((st->isr & STM_DMA_TEIF) && (cr & STM_DMA_SxCR_TEIE)) ||
+                 ((st->isr & STM_DMA_DMEIF) && (cr & STM_DMA_SxCR_DMEIE)) ||
+                 ((st->isr & STM_DMA_FEIF) &&
+                  (st->dma_sxfcr & STM_DMA_SxFCR_FEIE));
+
+    qemu_set_irq(st->irq, level);
+}
+
+static void stm32f2xx_dma_set_flags(STM32F2XXDmaStream *st, uint32_t flags)
+{
+    st->isr |= flags;
+    stm32f2xx_dma_update_irq(st);
+}
+
+static unsigned stm32f2xx_dma_dir(STM32F2XXDmaStream *st)
+{
+    return extract32(st->dma_sxcr, STM_DMA_SxCR_DIR_SHIFT, 2);
+}
+
+/* Start (or restart) the buffer that CT selects */
+static void stm32f2xx_dma_load(STM32F2XXDmaStream *st)
+{
+    st->cur_par = st->dma_sxpar;
+    st->cur_mar = (st->dma_sxcr & STM_DMA_SxCR_CT) ? st->dma_sxm1ar
+                                                   : st->dma_sxm0ar;
+}
+
+static bool stm32f2xx_dma_stream_ready(STM32F2XXDmaStream *st)
+{
+    unsigned channel = extract32(st->dma_sxcr, STM_DMA_SxCR_CHSEL_SHIFT, 3);
+
+    if (!(st->dma_sxcr & STM_DMA_SxCR_EN) || !st->dma_sxndtr) {
+        return false;
+    }
+    return stm32f2xx_dma_dir(st) == STM_DMA_DIR_M2M ||
+           (st->request & (1 << channel));
+}
+
+/* Account for items that were just transferred */
+static void stm32f2xx_dma_advance(STM32F2XXDmaStream *st, uint32_t items)
+{
+    uint32_t done_before = st->count - st->dma_sxndtr;
+    uint32_t flags = 0;
+
+    st->dma_sxndtr -= items;
+
+    if (done_before < st->count / 2 &&
+        st->count - st->dma_sxndtr >= st->count / 2) {
+        flags |= STM_DMA_HTIF;
+    }
+
+    if (st->dma_sxndtr == 0) {
+        flags |= STM_DMA_TCIF;
+
+        if (st->dma_sxcr & STM_DMA_SxCR_DBM) {
+            /* Double buffer mode is implicitly circular */
+            st->dma_sxcr ^= STM_DMA_SxCR_CT;
+            st->dma_sxndtr = st->count;
+            stm32f2xx_dma_load(st);
+        } else if (st->dma_sxcr & STM_DMA_SxCR_CIRC) {
+            st->dma_sxndtr = st->count;
+            stm32f2xx_dma_load(st);
+        } else {
+            st->dma_sxcr &= ~STM_DMA_SxCR_EN;
+        }
+    }
+
+    if (flags) {
+        stm32f2xx_dma_set_flags(st, flags);
+    }
+}
+
+static void stm32f2xx_dma_error(STM32F2XXDmaStream *st)
+{
+    /* The stream is disabled by hardware on a bus error */
+    st->dma_sxcr &= ~STM_DMA_SxCR_EN;
+    stm32f2xx_dma_set_flags(st, STM_DMA_TEIF);
+}
+
+/*
+ * Move the next item of a stream, or everything that is left of a
+ * memory-to-memory transfer between incrementing buffers.  Items are
+ * PSIZE wide on both sides, which is what direct mode does; the packing
+ * the FIFO allows for a different MSIZE is not modelled.  Returns the
+ * number of items moved.
+ */
+static uint32_t stm32f2xx_dma_transfer(STM32F2XXDmaStream *st)
+{
+    unsigned dir = stm32f2xx_dma_dir(st);
+    unsigned size = 1 << MIN(extract32(st->dma_sxcr,
+                                       STM_DMA_SxCR_PSIZE_SHIFT, 2), 2);
+    bool pinc = st->dma_sxcr & STM_DMA_SxCR_PINC;
+    bool minc = st->dma_sxcr & STM_DMA_SxCR_MINC;
+    uint32_t items = 1;
+    hwaddr src, dst;
+    uint8_t data[4];
+    uint8_t *buf = data;
+    size_t len;
+    MemTxResult res;
+
+    if (dir == STM_DMA_DIR_M2P) {
+        src = st->cur_mar;
+        dst = st->cur_par;
+    } else {
+        src = st->cur_par;
+        dst = st->cur_mar;
+    }
+
+    if (dir == STM_DMA_DIR_M2M && pinc && minc) {
+        items = st->dma_sxndtr;
+    }
+    len = (size_t)items * size;
+    if (items > 1) {
+        buf = g_malloc(len);
+    }
+
+    res = address_space_read(&address_space_memory, src,
+                             MEMTXATTRS_UNSPECIFIED, buf, len);
+    res |= address_space_write(&address_space_memory, dst,
+                               MEMTXATTRS_UNSPECIFIED, buf, len);
+    if (buf != data) {
+        g_free(buf);
+    }
+
+    if (res != MEMTX_OK) {
+        DB_PRINT("Transfer error, source 0x%" HWADDR_PRIx
+                 " destination 0x%" HWADDR_PRIx "\n", src, dst);
+        stm32f2xx_dma_error(st);
+        return 0;
+    }
+
+    if (pinc) {
+        st->cur_par += len;
+    }
+    if (minc) {
+        st->cur_mar += len;
+    }
+    stm32f2xx_dma_advance(st, items);
+    return items;
+}
+
+/*
+ * Serve every stream that is ready, one item per stream in turn.  A run
+ * moves at most one buffer's worth per stream.  Peripherals such as a
+ * continuous ADC or an idle USART transmitter never drop their request,
+ * so circular transfers continue once the virtual time for their own
+ * buffer has passed rather than spinning the main loop.
+ */
+static void stm32f2xx_dma_run(STM32F2XXDmaState *s)
+{
+    uint32_t budget[STM_DMA_NUM_STREAMS];
+    STM32F2XXDmaStream *st;
+    uint32_t items;
+    bool progress;
+    int64_t now;
+    int i;
+
+    if (s->busy) {
+        return;
+    }
+    s->busy = true;
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    for (i = 0; i < STM_DMA_NUM_STREAMS; i++) {
+        st = &s->stream[i];
+        budget[i] = st->resume_ns > now ? 0 : MAX(st->count, 1);
+    }
+
+    do {
+        progress = false;
+        for (i = 0; i < STM_DMA_NUM_STREAMS; i++) {
+            st = &s->stream[i];
+            if (!stm32f2xx_dma_stream_ready(st)) {
+                continue;
+            }
+            if (budget[i] == 0) {
+                if (st->resume_ns <= now) {
+                    st->resume_ns = now +
+                        (int64_t)MAX(st->count, 1) * STM_DMA_ITEM_NS;
+                }
+                timer_mod_anticipate(s->timer, st->resume_ns);
+                continue;
+            }
+            items = stm32f2xx_dma_transfer(st);
+            if (items) {
+                budget[i] -= MIN(budget[i], items);
+                progress = true;
+            }
+        }
+    } while (progress);
+
+    s->busy = false;
+}
+
+static void stm32f2xx_dma_timer_expire(void *opaque)
+{
+    stm32f2xx_dma_run(opaque);
+}
+
+/* Request input n is channel n % 8 of stream n / 8 */
+static void stm32f2xx_dma_request(void *opaque, int n, int level)
+{
+    STM32F2XXDmaState *s = opaque;
+    STM32F2XXDmaStream *st = &s->stream[n / STM_DMA_NUM_CHANNELS];
+    uint32_t bit = 1 << (n % STM_DMA_NUM_CHANNELS);
+
+    if (level) {
+        st->request |= bit;
+        stm32f2xx_dma_run(s);
+    } else {
+        st->request &= ~bit;
+    }
+}
+
+static void stm32f2xx_dma_reset(DeviceState *dev)
+{
+    STM32F2XXDmaState *s = STM32F2XX_DMA(dev);
+    STM32F2XXDmaStream *st;
+    int i;
+
+    for (i = 0; i < STM_DMA_NUM_STREAMS; i++) {
+        st = &s->stream[i];
+        st->dma_sxcr = 0x00000000;
+        st->dma_sxndtr = 0x00000000;
+        st->dma_sxpar = 0x00000000;
+        st->dma_sxm0ar = 0x00000000;
+        st->dma_sxm1ar = 0x00000000;
+        st->dma_sxfcr = STM_DMA_SxFCR_RESET;
+        st->isr = 0;
+        st->count = 0;
+        st->cur_par = 0;
+        st->cur_mar = 0;
+        st->resume_ns = 0;
+        stm32f2xx_dma_update_irq(st);
+    }
+    timer_del(s->timer);
+}
+
+static uint32_t stm32f2xx_dma_isr_read(STM32F2XXDmaState *s, int first)
+{
+    uint32_t value = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        value |= s->stream[first + i].isr << stm32f2xx_dma_flag_shift[i];
+    }
+    return value;
+}
+
+static void stm32f2xx_dma_ifcr_write(STM32F2XXDmaState *s, int first,
+                                     uint32_t value)
+{
+    STM32F2XXDmaStream *st;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        st = &s->stream[first + i];
+        st->isr &= ~((value >> stm32f2xx_dma_flag_shift[i]) & STM_DMA_FLAGS);
+        stm32f2xx_dma_update_irq(st);
+    }
+}
+
+/* Whether any stream may still need the pacing timer */
+static bool stm32f2xx_dma_circular(STM32F2XXDmaState *s)
+{
+    uint32_t cr;
+    int i;
+
+    for (i = 0; i < STM_DMA_NUM_STREAMS; i++) {
+        cr = s->stream[i].dma_sxcr;
+        if ((cr & STM_DMA_SxCR_EN) &&
+            (cr & (STM_DMA_SxCR_CIRC | STM_DMA_SxCR_DBM))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void stm32f2xx_dma_cr_write(STM32F2XXDmaState *s,
+                                   STM32F2XXDmaStream *st, uint32_t value)
+{
+    if (st->dma_sxcr & STM_DMA_SxCR_EN) {
+        /* Only EN can be changed while the stream is enabled */
+        if (!(value & STM_DMA_SxCR_EN)) {
+            st->dma_sxcr &= ~STM_DMA_SxCR_EN;
+            if (st->dma_sxndtr) {
+                /* An interrupted transfer reports completion */
+                stm32f2xx_dma_set_flags(st, STM_DMA_TCIF);
+            }
+            if (!stm32f2xx_dma_circular(s)) {
+                timer_del(s->timer);
+            }
+        }
+        return;
+    }
+
+    st->dma_sxcr = value & STM_DMA_SxCR_MASK;
+
+    if (st->dma_sxcr & STM_DMA_SxCR_EN) {
+        st->count = st->dma_sxndtr;
+        st->resume_ns = 0;
+        stm32f2xx_dma_load(st);
+        DB_PRINT("Stream enabled, CR 0x%x NDTR %u PAR 0x%x M0AR 0x%x\n",
+                 st->dma_sxcr, st->dma_sxndtr, st->dma_sxpar, st->dma_sxm0ar);
+    }
+
+    stm32f2xx_dma_update_irq(st);
+    stm32f2xx_dma_run(s);
+}
+
+/*
+ * NDTR, PAR and the memory address in use are locked while the stream is
+ * enabled.  In double buffer mode software refills the other buffer.
+ */
+static bool stm32f2xx_dma_locked(STM32F2XXDmaStream *st, hwaddr reg)
+{
+    uint32_t cr = st->dma_sxcr;
+
+    if (!(cr & STM_DMA_SxCR_EN)) {
+        return false;
+    }
+    if (cr & STM_DMA_SxCR_DBM) {
+        if (reg == STM_DMA_SxM0AR) {
+            return !(cr & STM_DMA_SxCR_CT);
+        }
+        if (reg == STM_DMA_SxM1AR) {
+            return cr & STM_DMA_SxCR_CT;
+        }
+    }
+    return true;
+}
+
+static uint64_t stm32f2xx_dma_read(void *opaque, hwaddr addr,
+                                   unsigned int size)
+{
+    STM32F2XXDmaState *s = opaque;
+    STM32F2XXDmaStream *st;
+    int n;
+
+    DB_PRINT("Address: 0x%" HWADDR_PRIx "\n", addr);
+
+    switch (addr) {
+    case STM_DMA_LISR:
+        return stm32f2xx_dma_isr_read(s, 0);
+    case STM_DMA_HISR:
+        return stm32f2xx_dma_isr_read(s, 4);
+    case STM_DMA_LIFCR:
+    case STM_DMA_HIFCR:
+        return 0;
+    }
+
+    n = (addr - STM_DMA_STREAM_BASE) / STM_DMA_STREAM_SIZE;
+    if (n >= STM_DMA_NUM_STREAMS) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Bad offset 0x%" HWADDR_PRIx "\n",
+                      __func__, addr);
+        return 0;
+    }
+    st = &s->stream[n];
+
+    switch ((addr - STM_DMA_STREAM_BASE) % STM_DMA_STREAM_SIZE) {
+    case STM_DMA_SxCR:
+        return st->dma_sxcr;
+    case STM_DMA_SxNDTR:
+        return st->dma_sxndtr;
+    case STM_DMA_SxPAR:
+        return st->dma_sxpar;
+    case STM_DMA_SxM0AR:
+        return st->dma_sxm0ar;
+    case STM_DMA_SxM1AR:
+        return st->dma_sxm1ar;
+    default:
+        return st->dma_sxfcr;
+    }
+}
+
+static void stm32f2xx_dma_write(void *opaque, hwaddr addr,
+                                uint64_t val64, unsigned int size)
+{
+    STM32F2XXDmaState *s = opaque;
+    STM32F2XXDmaStream *st;
+    uint32_t value = val64;
+    hwaddr reg;
+    int n;
+
+    DB_PRINT("Address: 0x%" HWADDR_PRIx ", Value: 0x%x\n", addr, value);
+
+    switch (addr) {
+    case STM_DMA_LISR:
+    case STM_DMA_HISR:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Read only register: " \
+                      "0x%" HWADDR_PRIx "\n", __func__, addr);
+        return;
+    case STM_DMA_LIFCR:
+        stm32f2xx_dma_ifcr_write(s, 0, value);
+        return;
+    case STM_DMA_HIFCR:
+        stm32f2xx_dma_ifcr_write(s, 4, value);
+        return;
+    }
+
+    n = (addr - STM_DMA_STREAM_BASE) / STM_DMA_STREAM_SIZE;
+    if (n >= STM_DMA_NUM_STREAMS) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Bad offset 0x%" HWADDR_PRIx "\n",
+                      __func__, addr);
+        return;
+    }
+    st = &s->stream[n];
+    reg = (addr - STM_DMA_STREAM_BASE) % STM_DMA_STREAM_SIZE;
+
+    if (reg == STM_DMA_SxCR) {
+        stm32f2xx_dma_cr_write(s, st, value);
+        return;
+    }
+    if (reg != STM_DMA_SxFCR && stm32f2xx_dma_locked(st, reg)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: 0x%" HWADDR_PRIx " written " \
+                      "while stream %d is enabled\n", __func__, addr, n);
+        return;
+    }
+
+    switch (reg) {
+    case STM_DMA_SxNDTR:
+        st->dma_sxndtr = value & 0xFFFF;
+        break;
+    case STM_DMA_SxPAR:
+        st->dma_sxpar = value;
+        break;
+    case STM_DMA_SxM0AR:
+        st->dma_sxm0ar = value;
+        break;
+    case STM_DMA_SxM1AR:
+        st->dma_sxm1ar = value;
+        break;
+    default:
+        st->dma_sxfcr = (st->dma_sxfcr & ~STM_DMA_SxFCR_MASK) |
+                        (value & STM_DMA_SxFCR_MASK);
+        stm32f2xx_dma_update_irq(st);
+        break;
+    }
+}
+
+static const MemoryRegionOps stm32f2xx_dma_ops = {
+    .read = stm32f2xx_dma_read,
+    .write = stm32f2xx_dma_write,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+static const VMStateDescription vmstate_stm32f2xx_dma_stream = {
+    .name = "stm32f2xx-dma-stream",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(dma_sxcr, STM32F2XXDmaStream),
+        VMSTATE_UINT32(dma_sxndtr, STM32F2XXDmaStream),
+        VMSTATE_UINT32(dma_sxpar, STM32F2XXDmaStream),
+        VMSTATE_UINT32(dma_sxm0ar, STM32F2XXDmaStream),
+        VMSTATE_UINT32(dma_sxm1ar, STM32F2XXDmaStream),
+        VMSTATE_UINT32(dma_sxfcr, STM32F2XXDmaStream),
+        VMSTATE_UINT32(isr, STM32F2XXDmaStream),
+        VMSTATE_UINT32(count, STM32F2XXDmaStream),
+        VMSTATE_UINT32(cur_par, STM32F2XXDmaStream),
+        VMSTATE_UINT32(cur_mar, STM32F2XXDmaStream),
+        VMSTATE_UINT32(request, STM32F2XXDmaStream),
+        VMSTATE_INT64(resume_ns, STM32F2XXDmaStream),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_stm32f2xx_dma = {
+    .name = TYPE_STM32F2XX_DMA,
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(stream, STM32F2XXDmaState, STM_DMA_NUM_STREAMS,
+                             2, vmstate_stm32f2xx_dma_stream,
+                             STM32F2XXDmaStream),
+        VMSTATE_TIMER_PTR(timer, STM32F2XXDmaState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void stm32f2xx_dma_init(Object *obj)
+{
+    STM32F2XXDmaState *s = STM32F2XX_DMA(obj);
+    int i;
+
+    memory_region_init_io(&s->mmio, obj, &stm32f2xx_dma_ops, s,
+                          TYPE_STM32F2XX_DMA, 0x400);
+    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
+
+    for (i = 0; i < STM_DMA_NUM_STREAMS; i++) {
+        sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->stream[i].irq);
+    }
+    qdev_init_gpio_in(DEVICE(obj), stm32f2xx_dma_request,
+                      STM_DMA_NUM_STREAMS * STM_DMA_NUM_CHANNELS);
+
+    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, stm32f2xx_dma_timer_expire, s);
+}
+
+static void stm32f2xx_dma_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->reset = stm32f2xx_dma_reset;
+    dc->vmsd = &vmstate_stm32f2xx_dma;
+}
+
+static const TypeInfo stm32f2xx_dma_info = {
+    .name          = TYPE_STM32F2XX_DMA,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(STM32F2XXDmaState),
+    .instance_init = stm32f2xx_dma_init,
+    .class_init    = stm32f2xx_dma_class_init,
+};
+
+static void stm32f2xx_dma_register_types(void)
+{
+    type_register_static(&stm32f2xx_dma_info);
+}
+
+type_init(stm32f2xx_dma_register_types)
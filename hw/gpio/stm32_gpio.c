@@ -66,8 +66,16 @@ struct Stm32Gpio {
 
     /* IRQs which relay input pin changes to other STM32 peripherals */
     qemu_irq in_irq[STM32_GPIO_PIN_COUNT];
+
+    /* Optional observer of pin level changes */
+    Stm32GpioMonitorFunc *monitor;
+    void *monitor_opaque;
 };
 
+static uint16_t stm32_gpio_pins(Stm32Gpio *s);
+static void stm32_gpio_notify(Stm32Gpio *s, uint16_t old_pins,
+                              unsigned cause);
+
 
 
 /* CALLBACKs */
@@ -80,12 +88,16 @@ static void stm32_gpio_in_trigger(void *opaque, int irq, int level)
     Stm32Gpio *s = opaque;
     unsigned pin = irq;
 
+    uint16_t old_pins = stm32_gpio_pins(s);
+
     assert(pin < STM32_GPIO_PIN_COUNT);
 
     /* Update internal pin state. */
     s->in &= ~(1 << pin);
     s->in |= (level ? 1 : 0) << pin;
 
+    stm32_gpio_notify(s, old_pins, STM32_GPIO_CHANGE_INPUT);
+
     /* Propagate the trigger to the input IRQs. */
     qemu_set_irq(s->in_irq[pin], level);
 }
@@ -106,6 +118,28 @@ static uint8_t stm32_gpio_get_pin_config(Stm32Gpio *s, unsigned pin) {
     return extract64(cr_64, pin * 4, 4);
 }
 
+/* Level of every pin: driven from ODR for outputs, sampled for inputs. */
+static uint16_t stm32_gpio_pins(Stm32Gpio *s)
+{
+    return (s->GPIOx_ODR & s->dir_mask) | (s->in & ~s->dir_mask);
+}
+
+static void stm32_gpio_notify(Stm32Gpio *s, uint16_t old_pins,
+                              unsigned cause)
+{
+    uint16_t pins;
+
+    if(!s->monitor) {
+        return;
+    }
+
+    pins = stm32_gpio_pins(s);
+    if(pins != old_pins) {
+        s->monitor(s->monitor_opaque, STM32_GPIO_INDEX_FROM_PERIPH(s->periph),
+                   cause, pins ^ old_pins, pins, s->dir_mask);
+    }
+}
+
 
 
 
@@ -116,6 +150,7 @@ static uint8_t stm32_gpio_get_pin_config(Stm32Gpio *s, unsigned pin) {
 static void stm32_gpio_update_dir(Stm32Gpio *s, int cr_index)
 {
     unsigned start_pin, pin, pin_dir;
+    uint16_t old_pins = stm32_gpio_pins(s);
 
     assert((cr_index == 0) || (cr_index == 1));
 
@@ -129,6 +164,8 @@ static void stm32_gpio_update_dir(Stm32Gpio *s, int cr_index)
         s->dir_mask &= ~(1 << pin);
         s->dir_mask |= (pin_dir ? 1 : 0) << pin;
     }
+
+    stm32_gpio_notify(s, old_pins, STM32_GPIO_CHANGE_CONFIG);
 }
 
 /* Write the Output Data Register.
@@ -139,6 +176,7 @@ static void stm32_gpio_GPIOx_ODR_write(Stm32Gpio *s, uint32_t new_value)
 {
     uint32_t old_value;
     uint16_t changed, changed_out;
+    uint16_t old_pins = stm32_gpio_pins(s);
     unsigned pin;
 
     old_value = s->GPIOx_ODR;
@@ -153,6 +191,9 @@ static void stm32_gpio_GPIOx_ODR_write(Stm32Gpio *s, uint32_t new_value)
     /* Get changed pins that are outputs - we will not touch input pins */
     changed_out = changed & s->dir_mask;
 
+    /* Report all the pins this write changed as one event */
+    stm32_gpio_notify(s, old_pins, STM32_GPIO_CHANGE_OUTPUT);
+
     if (changed_out) {
         for (pin = 0; pin < STM32_GPIO_PIN_COUNT; pin++) {
             /* If the value of this pin has changed, then update
@@ -272,12 +313,15 @@ static void stm32_gpio_reset(DeviceState *dev)
 {
     int pin;
     Stm32Gpio *s = STM32_GPIO(dev);
+    uint16_t old_pins = stm32_gpio_pins(s);
 
     s->GPIOx_CRy[0] = 0x44444444;
     s->GPIOx_CRy[1] = 0x44444444;
     s->GPIOx_ODR = 0;
     s->dir_mask = 0; /* input = 0, output = 1 */
 
+    stm32_gpio_notify(s, old_pins, STM32_GPIO_CHANGE_CONFIG);
+
     for(pin = 0; pin < STM32_GPIO_PIN_COUNT; pin++) {
         qemu_irq_lower(s->out_irq[pin]);
     }
@@ -301,6 +345,18 @@ uint8_t stm32_gpio_get_mode_bits(Stm32Gpio *s, unsigned pin) {
     return stm32_gpio_get_pin_config(s, pin) & 0x3;
 }
 
+void stm32_gpio_set_monitor(Stm32Gpio *s, Stm32GpioMonitorFunc *func,
+                            void *opaque)
+{
+    s->monitor = func;
+    s->monitor_opaque = opaque;
+
+    if(func) {
+        func(opaque, STM32_GPIO_INDEX_FROM_PERIPH(s->periph),
+             STM32_GPIO_CHANGE_SNAPSHOT, 0, stm32_gpio_pins(s), s->dir_mask);
+    }
+}
+
 
 
 
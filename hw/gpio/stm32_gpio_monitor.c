@@ -0,0 +1,207 @@
+/*
+ * STM32 GPIO monitor
+ *
+ * Publishes the pin level changes of the GPIO ports into a shared ring,
+ * see include/hw/gpio/stm32_gpio_monitor.h for the layout.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "hw/sysbus.h"
+#include "hw/arm/stm32.h"
+#include "hw/gpio/stm32_gpio_monitor.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "avatar/shm.h"
+
+QEMU_BUILD_BUG_ON(sizeof(Stm32GpioMonitorHeader) >
+                  STM32_GPIO_MONITOR_HEADER_SIZE);
+QEMU_BUILD_BUG_ON(sizeof(Stm32GpioMonitorRecord) != 24);
+QEMU_BUILD_BUG_ON(STM32_GPIO_COUNT > STM32_GPIO_MONITOR_MAX_PORTS);
+QEMU_BUILD_BUG_ON(STM32_GPIO_CHANGE_OUTPUT != STM32_GPIO_MONITOR_OUTPUT ||
+                  STM32_GPIO_CHANGE_INPUT != STM32_GPIO_MONITOR_INPUT ||
+                  STM32_GPIO_CHANGE_CONFIG != STM32_GPIO_MONITOR_CONFIG ||
+                  STM32_GPIO_CHANGE_SNAPSHOT != STM32_GPIO_MONITOR_SNAPSHOT);
+
+
+
+/* DEFINITIONS*/
+
+#define STM32_GPIO_MONITOR(obj) \
+    OBJECT_CHECK(Stm32GpioMonitor, (obj), TYPE_STM32_GPIO_MONITOR)
+
+typedef struct Stm32GpioMonitor {
+    /* Inherited */
+    SysBusDevice busdev;
+
+    /* Properties */
+    void *stm32_gpio_prop;
+    char *path;
+    uint32_t nr_records;
+
+    /* Private */
+    Stm32Gpio **stm32_gpio;
+
+    Stm32GpioMonitorHeader *header;
+    Stm32GpioMonitorRecord *records;
+    size_t map_size;
+    uint32_t mask;
+    /* Private copy of header->head, only we move it */
+    uint64_t head;
+} Stm32GpioMonitor;
+
+
+
+
+
+/* HELPER FUNCTIONS */
+
+static void stm32_gpio_monitor_record(void *opaque, unsigned port,
+                                      unsigned cause, uint16_t changed,
+                                      uint16_t pins, uint16_t dir)
+{
+    Stm32GpioMonitor *s = (Stm32GpioMonitor *)opaque;
+    Stm32GpioMonitorRecord *r = &s->records[s->head & s->mask];
+
+    atomic_set(&r->seq, UINT64_MAX);
+    smp_wmb();
+
+    r->time_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    r->port = port;
+    r->cause = cause;
+    r->changed = changed;
+    r->pins = pins;
+    r->dir = dir;
+
+    s->header->ports[port].pins = pins;
+    s->header->ports[port].dir = dir;
+
+    smp_wmb();
+    atomic_set(&r->seq, s->head);
+    s->head++;
+    atomic_store_release(&s->header->head, s->head);
+}
+
+static int stm32_gpio_monitor_open(Stm32GpioMonitor *s)
+{
+    Stm32GpioMonitorHeader *h;
+    uint32_t nr_records = s->nr_records;
+    void *ptr;
+    int fd;
+
+    if(!nr_records) {
+        nr_records = STM32_GPIO_MONITOR_DEFAULT_RECORDS;
+    }
+    if(nr_records > (1U << 24)) {
+        error_report("stm32-gpio-monitor: at most %u records", 1U << 24);
+        return -1;
+    }
+    nr_records = pow2ceil(nr_records);
+    s->map_size = STM32_GPIO_MONITOR_HEADER_SIZE +
+                  (size_t)nr_records * sizeof(Stm32GpioMonitorRecord);
+
+    fd = open(s->path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) {
+        error_report("stm32-gpio-monitor: cannot create '%s': %s",
+                     s->path, strerror(errno));
+        return -1;
+    }
+    if(ftruncate(fd, s->map_size) < 0) {
+        error_report("stm32-gpio-monitor: cannot size '%s': %s",
+                     s->path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    ptr = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(ptr == MAP_FAILED) {
+        error_report("stm32-gpio-monitor: cannot map '%s': %s",
+                     s->path, strerror(errno));
+        return -1;
+    }
+
+    h = ptr;
+    h->version = STM32_GPIO_MONITOR_VERSION;
+    h->record_size = sizeof(Stm32GpioMonitorRecord);
+    h->nr_records = nr_records;
+    h->head = 0;
+    h->nr_ports = STM32_GPIO_COUNT;
+    avatar_shm_publish(&h->magic, STM32_GPIO_MONITOR_MAGIC);
+
+    s->header = h;
+    s->records = ptr + STM32_GPIO_MONITOR_HEADER_SIZE;
+    s->mask = nr_records - 1;
+    s->head = 0;
+    return 0;
+}
+
+
+
+
+
+/* DEVICE INITIALIZATION */
+
+static int stm32_gpio_monitor_init(SysBusDevice *dev)
+{
+    Stm32GpioMonitor *s = STM32_GPIO_MONITOR(dev);
+    int i;
+
+    s->stm32_gpio = (Stm32Gpio **)s->stm32_gpio_prop;
+
+    /* Monitoring is off unless a file is given */
+    if(!s->path) {
+        return 0;
+    }
+
+    if(stm32_gpio_monitor_open(s) < 0) {
+        return -1;
+    }
+    for(i = 0; i < STM32_GPIO_COUNT; i++) {
+        stm32_gpio_set_monitor(s->stm32_gpio[i], stm32_gpio_monitor_record, s);
+    }
+    return 0;
+}
+
+static Property stm32_gpio_monitor_properties[] = {
+    DEFINE_PROP_PTR("stm32_gpio", Stm32GpioMonitor, stm32_gpio_prop),
+    DEFINE_PROP_STRING("path", Stm32GpioMonitor, path),
+    DEFINE_PROP_UINT32("records", Stm32GpioMonitor, nr_records, 0),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void stm32_gpio_monitor_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *k = SYS_BUS_DEVICE_CLASS(klass);
+
+    k->init = stm32_gpio_monitor_init;
+    dc->props = stm32_gpio_monitor_properties;
+}
+
+static TypeInfo stm32_gpio_monitor_info = {
+    .name  = TYPE_STM32_GPIO_MONITOR,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(Stm32GpioMonitor),
+    .class_init = stm32_gpio_monitor_class_init
+};
+
+static void stm32_gpio_monitor_register_types(void)
+{
+    type_register_static(&stm32_gpio_monitor_info);
+}
+
+type_init(stm32_gpio_monitor_register_types)
@@ -0,0 +1,400 @@
+/*
+ * Remote memory: a window of the guest physical address space whose
+ * accesses are forwarded to an avatar peer.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "hw/sysbus.h"
+#include "qemu/bitops.h"
+#include "qemu/log.h"
+#include "avatar/avatar-io.h"
+#include "avatar/io-log.h"
+#include "avatar/mmio-trace.h"
+#include "avatar/mmio-stats.h"
+#include "trace.h"
+
+#define TYPE_REMOTE_MEMORY "remote-memory"
+#define REMOTE_MEMORY(obj) \
+    OBJECT_CHECK(RemoteMemoryState, (obj), TYPE_REMOTE_MEMORY)
+
+/* Largest speculative read-ahead window, in bytes */
+#define REMOTE_MEMORY_MAX_READ_AHEAD 64
+
+typedef struct RemoteMemoryState {
+    /* <private> */
+    SysBusDevice parent_obj;
+
+    /* <public> */
+    MemoryRegion iomem;
+
+    uint32_t size;
+    uint64_t remote_base;
+    char *request_name;
+    char *response_name;
+    char *transport;
+    bool posted_writes;
+    uint32_t read_ahead;
+    char *record;
+    char *replay;
+    bool replay_pc;
+
+    AvatarChannel request;
+    AvatarChannel response;
+    uint64_t next_id;
+
+    /*
+     * Read-ahead cache.  Every cached byte is handed out at most once
+     * (tracked in cache_fresh), so polling the same register always goes
+     * back to the peer, while a sweep over neighbouring registers costs a
+     * single round trip.
+     */
+    hwaddr cache_base;
+    uint32_t cache_len;
+    uint64_t cache_fresh;
+    uint8_t cache[REMOTE_MEMORY_MAX_READ_AHEAD];
+
+    /*
+     * Transaction log.  When replaying, reads are served from the log and
+     * writes are dropped; the peer, if connected at all, only sees reads
+     * the log has no answer for.
+     */
+    AvatarIOLog *log;
+    bool replaying;
+} RemoteMemoryState;
+
+static uint64_t remote_memory_load(const uint8_t *buf, unsigned size)
+{
+    switch (size) {
+    case 1:
+        return ldub_p(buf);
+    case 2:
+        return lduw_he_p(buf);
+    case 4:
+        return ldl_he_p(buf);
+    case 8:
+        return ldq_he_p(buf);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void remote_memory_send(RemoteMemoryState *s, const void *msg,
+                               size_t len)
+{
+    avatar_mmio_stats_forwarded(&s->iomem);
+    avatar_channel_send(&s->request, msg, len);
+}
+
+/*
+ * Wait for the response to request @id.  Responses are delivered in
+ * request order, so anything older is a leftover and can be dropped.
+ */
+static bool remote_memory_wait(RemoteMemoryState *s, uint64_t id,
+                               AvatarIOResponseMessage *res,
+                               void *data, size_t data_len)
+{
+    uint8_t buf[sizeof(AvatarIOResponseMessage) +
+                REMOTE_MEMORY_MAX_READ_AHEAD];
+    int ret;
+
+    do {
+        ret = avatar_channel_receive_wait(&s->response, buf, sizeof(buf));
+        if (ret < (int)sizeof(*res)) {
+            return false;
+        }
+        memcpy(res, buf, sizeof(*res));
+    } while (res->id != id);
+
+    if (!res->success || ret - sizeof(*res) < MIN(res->len, data_len)) {
+        return false;
+    }
+    if (data) {
+        memcpy(data, buf + sizeof(*res), MIN(res->len, data_len));
+    }
+    return true;
+}
+
+static bool remote_memory_cache_read(RemoteMemoryState *s, hwaddr offset,
+                                     unsigned size, uint64_t *value)
+{
+    uint64_t mask;
+
+    if (offset < s->cache_base ||
+        offset + size > s->cache_base + s->cache_len) {
+        return false;
+    }
+
+    mask = MAKE_64BIT_MASK(offset - s->cache_base, size);
+    if ((s->cache_fresh & mask) != mask) {
+        return false;
+    }
+
+    s->cache_fresh &= ~mask;
+    *value = remote_memory_load(&s->cache[offset - s->cache_base], size);
+    return true;
+}
+
+static bool remote_memory_cache_fill(RemoteMemoryState *s, hwaddr offset)
+{
+    struct {
+        AvatarIORequestMessage req;
+        AvatarIOSegment seg;
+    } QEMU_PACKED msg;
+    AvatarIOResponseMessage res;
+    hwaddr base = QEMU_ALIGN_DOWN(offset, s->read_ahead);
+    uint32_t len = MIN(s->read_ahead, s->size - base);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.req.id = s->next_id++;
+    msg.req.flags = AVATAR_IO_BULK;
+    msg.req.nr_segments = 1;
+    msg.seg.hwaddr = s->remote_base + base;
+    msg.seg.len = len;
+
+    s->cache_len = 0;
+    remote_memory_send(s, &msg, sizeof(msg));
+    if (!remote_memory_wait(s, msg.req.id, &res, s->cache, len) ||
+        res.len != len) {
+        return false;
+    }
+
+    s->cache_base = base;
+    s->cache_len = len;
+    s->cache_fresh = MAKE_64BIT_MASK(0, len);
+    return true;
+}
+
+static uint64_t remote_memory_read_peer(RemoteMemoryState *s, hwaddr offset,
+                                        unsigned size)
+{
+    AvatarIORequestMessage req;
+    AvatarIOResponseMessage res;
+    uint64_t value;
+
+    if (!avatar_channel_is_valid(&s->request)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: read at 0x%" HWADDR_PRIx " is not in the log\n",
+                      __func__, offset);
+        return 0;
+    }
+
+    if (remote_memory_cache_read(s, offset, size, &value)) {
+        trace_remote_memory_read_cached(offset, size, value);
+        return value;
+    }
+
+    if (s->read_ahead > size && remote_memory_cache_fill(s, offset) &&
+        remote_memory_cache_read(s, offset, size, &value)) {
+        trace_remote_memory_read(offset, size, value);
+        return value;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.id = s->next_id++;
+    req.hwaddr = s->remote_base + offset;
+    req.size = size;
+
+    remote_memory_send(s, &req, sizeof(req));
+    if (!remote_memory_wait(s, req.id, &res, NULL, 0)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: remote read at 0x%" HWADDR_PRIx " failed\n",
+                      __func__, offset);
+        return 0;
+    }
+
+    trace_remote_memory_read(offset, size, res.value);
+    return res.value;
+}
+
+static uint64_t remote_memory_read(void *opaque, hwaddr offset,
+                                   unsigned size)
+{
+    RemoteMemoryState *s = REMOTE_MEMORY(opaque);
+    bool has_pc = false;
+    uint64_t pc = 0;
+    uint64_t value;
+
+    if (s->log) {
+        has_pc = avatar_mmio_pc(&pc);
+    }
+    if (s->replaying &&
+        avatar_io_log_replay_read(s->log, offset, size, has_pc, pc, &value)) {
+        trace_remote_memory_read_replay(offset, size, value);
+        return value;
+    }
+
+    value = remote_memory_read_peer(s, offset, size);
+    if (s->log && !s->replaying) {
+        avatar_io_log_record(s->log, offset, size, value, false, has_pc, pc);
+    }
+    return value;
+}
+
+static void remote_memory_write(void *opaque, hwaddr offset, uint64_t value,
+                                unsigned size)
+{
+    RemoteMemoryState *s = REMOTE_MEMORY(opaque);
+    AvatarIORequestMessage req;
+    AvatarIOResponseMessage res;
+
+    trace_remote_memory_write(offset, size, value, s->posted_writes);
+
+    if (s->replaying) {
+        return;
+    }
+    if (s->log) {
+        bool has_pc;
+        uint64_t pc = 0;
+
+        has_pc = avatar_mmio_pc(&pc);
+        avatar_io_log_record(s->log, offset, size, value, true, has_pc, pc);
+    }
+
+    /* Anything read ahead may be stale once the device saw a write */
+    s->cache_len = 0;
+
+    memset(&req, 0, sizeof(req));
+    req.id = s->next_id++;
+    req.hwaddr = s->remote_base + offset;
+    req.value = value;
+    req.write = true;
+    req.size = size;
+
+    /*
+     * Posted writes are not waited for.  The request channel is FIFO, so
+     * the peer still applies them before any later read of this device.
+     */
+    if (s->posted_writes) {
+        req.flags = AVATAR_IO_POSTED;
+        remote_memory_send(s, &req, sizeof(req));
+        return;
+    }
+
+    remote_memory_send(s, &req, sizeof(req));
+    if (!remote_memory_wait(s, req.id, &res, NULL, 0)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: remote write at 0x%" HWADDR_PRIx " failed\n",
+                      __func__, offset);
+    }
+}
+
+static const MemoryRegionOps remote_memory_ops = {
+    .read = remote_memory_read,
+    .write = remote_memory_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 8,
+    },
+};
+
+static void remote_memory_realize(DeviceState *dev, Error **errp)
+{
+    RemoteMemoryState *s = REMOTE_MEMORY(dev);
+    AvatarTransportOptions transport = {
+        .type = AVATAR_TRANSPORT_MQ,
+    };
+    Error *local_err = NULL;
+
+    if (s->record && s->replay) {
+        error_setg(errp, "remote-memory: record and replay are exclusive");
+        return;
+    }
+    if (s->replay) {
+        s->log = avatar_io_log_open_replay(s->replay, s->replay_pc,
+                                           &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+        s->replaying = true;
+    } else if (s->record) {
+        s->log = avatar_io_log_open_record(s->record, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
+    /* A replay can run without a peer and fails the reads it misses */
+    if (s->replaying && !s->request_name && !s->response_name) {
+        goto init_mmio;
+    }
+    if (!s->request_name || !s->response_name) {
+        error_setg(errp, "remote-memory: request_mq and response_mq "
+                   "must be set");
+        return;
+    }
+    if (s->transport && !avatar_transport_parse(s->transport,
+                                                &transport.type)) {
+        error_setg(errp, "remote-memory: unknown transport '%s'",
+                   s->transport);
+        return;
+    }
+    if (s->read_ahead && (s->read_ahead > REMOTE_MEMORY_MAX_READ_AHEAD ||
+                          !is_power_of_2(s->read_ahead))) {
+        error_setg(errp, "remote-memory: read_ahead must be a power of two "
+                   "no larger than %d", REMOTE_MEMORY_MAX_READ_AHEAD);
+        return;
+    }
+
+    avatar_channel_open_write(&s->request, &transport, s->request_name,
+                              sizeof(AvatarIORequestMessage) +
+                              sizeof(AvatarIOSegment), &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    avatar_channel_open_read(&s->response, &transport, s->response_name,
+                             sizeof(AvatarIOResponseMessage) +
+                             REMOTE_MEMORY_MAX_READ_AHEAD, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+init_mmio:
+    memory_region_init_io(&s->iomem, OBJECT(s), &remote_memory_ops, s,
+                          TYPE_REMOTE_MEMORY, s->size);
+    sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->iomem);
+}
+
+static Property remote_memory_properties[] = {
+    DEFINE_PROP_UINT32("size", RemoteMemoryState, size, 0x1000),
+    DEFINE_PROP_UINT64("remote_base", RemoteMemoryState, remote_base, 0),
+    DEFINE_PROP_STRING("request_mq", RemoteMemoryState, request_name),
+    DEFINE_PROP_STRING("response_mq", RemoteMemoryState, response_name),
+    DEFINE_PROP_STRING("transport", RemoteMemoryState, transport),
+    DEFINE_PROP_BOOL("posted_writes", RemoteMemoryState, posted_writes, false),
+    DEFINE_PROP_UINT32("read_ahead", RemoteMemoryState, read_ahead, 0),
+    DEFINE_PROP_STRING("record", RemoteMemoryState, record),
+    DEFINE_PROP_STRING("replay", RemoteMemoryState, replay),
+    DEFINE_PROP_BOOL("replay_pc", RemoteMemoryState, replay_pc, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void remote_memory_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = remote_memory_realize;
+    dc->props = remote_memory_properties;
+}
+
+static const TypeInfo remote_memory_info = {
+    .name          = TYPE_REMOTE_MEMORY,
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(RemoteMemoryState),
+    .class_init    = remote_memory_class_init,
+};
+
+static void remote_memory_register_types(void)
+{
+    type_register_static(&remote_memory_info);
+}
+
+type_init(remote_memory_register_types)
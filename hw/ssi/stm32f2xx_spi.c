@@ -39,6 +39,16 @@
 
 #define DB_PRINT(fmt, args...) DB_PRINT_L(1, fmt, ## args)
 
+static void stm32f2xx_spi_update_dma(STM32F2XXSPIState *s)
+{
+    bool enabled = s->spi_cr1 & STM_SPI_CR1_SPE;
+
+    qemu_set_irq(s->dma_rx, enabled && (s->spi_cr2 & STM_SPI_CR2_RXDMAEN) &&
+                 (s->spi_sr & STM_SPI_SR_RXNE));
+    qemu_set_irq(s->dma_tx, enabled && (s->spi_cr2 & STM_SPI_CR2_TXDMAEN) &&
+                 (s->spi_sr & STM_SPI_SR_TXE));
+}
+
 static void stm32f2xx_spi_reset(DeviceState *dev)
 {
     STM32F2XXSPIState *s = STM32F2XX_SPI(dev);
@@ -52,6 +62,8 @@ static void stm32f2xx_spi_reset(DeviceState *dev)
     s->spi_txcrcr = 0x00000000;
     s->spi_i2scfgr = 0x00000000;
     s->spi_i2spr = 0x00000002;
+
+    stm32f2xx_spi_update_dma(s);
 }
 
 static void stm32f2xx_spi_transfer(STM32F2XXSPIState *s)
@@ -75,14 +87,18 @@ static uint64_t stm32f2xx_spi_read(void *opaque, hwaddr addr,
     case STM_SPI_CR1:
         return s->spi_cr1;
     case STM_SPI_CR2:
-        qemu_log_mask(LOG_UNIMP, "%s: Interrupts and DMA are not implemented\n",
+        qemu_log_mask(LOG_UNIMP, "%s: Interrupts are not implemented\n",
                       __func__);
         return s->spi_cr2;
     case STM_SPI_SR:
         return s->spi_sr;
     case STM_SPI_DR:
-        stm32f2xx_spi_transfer(s);
+        /* Only clock in a new frame if the last one was already read */
+        if (!(s->spi_sr & STM_SPI_SR_RXNE)) {
+            stm32f2xx_spi_transfer(s);
+        }
         s->spi_sr &= ~STM_SPI_SR_RXNE;
+        stm32f2xx_spi_update_dma(s);
         return s->spi_dr;
     case STM_SPI_CRCPR:
         qemu_log_mask(LOG_UNIMP, "%s: CRC is not implemented, the registers " \
@@ -123,11 +139,13 @@ static void stm32f2xx_spi_write(void *opaque, hwaddr addr,
     switch (addr) {
     case STM_SPI_CR1:
         s->spi_cr1 = value;
+        stm32f2xx_spi_update_dma(s);
         return;
     case STM_SPI_CR2:
         qemu_log_mask(LOG_UNIMP, "%s: " \
-                      "Interrupts and DMA are not implemented\n", __func__);
+                      "Interrupts are not implemented\n", __func__);
         s->spi_cr2 = value;
+        stm32f2xx_spi_update_dma(s);
         return;
     case STM_SPI_SR:
         /* Read only register, except for clearing the CRCERR bit, which
@@ -137,6 +155,7 @@ static void stm32f2xx_spi_write(void *opaque, hwaddr addr,
     case STM_SPI_DR:
         s->spi_dr = value;
         stm32f2xx_spi_transfer(s);
+        stm32f2xx_spi_update_dma(s);
         return;
     case STM_SPI_CRCPR:
         qemu_log_mask(LOG_UNIMP, "%s: CRC is not implemented\n", __func__);
@@ -197,6 +216,8 @@ static void stm32f2xx_spi_init(Object *obj)
     sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->mmio);
 
     sysbus_init_irq(SYS_BUS_DEVICE(obj), &s->irq);
+    qdev_init_gpio_out_named(dev, &s->dma_rx, "dma-rx", 1);
+    qdev_init_gpio_out_named(dev, &s->dma_tx, "dma-tx", 1);
 
     s->ssi = ssi_create_bus(dev, "ssi");
 }
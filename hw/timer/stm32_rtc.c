@@ -98,7 +98,7 @@ struct Stm32Rtc {
 
 /*Function Called if output freq of RTC change*/
 
-static void stm32_rtc_clk_irq_handler(void *opaque, int n, int level)
+static void stm32_rtc_clk_update(void *opaque, Clk clk)
 {
 
     Stm32Rtc *s=(Stm32Rtc*)opaque;        
@@ -321,7 +321,6 @@ static const MemoryRegionOps stm32_rtc_ops = {
 static int stm32_rtc_init(SysBusDevice *dev)
 {
 
-    qemu_irq *clk_irq;
     Stm32Rtc *s = STM32_Rtc(dev);
     QEMUBH *bh;
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
@@ -335,9 +334,8 @@ static int stm32_rtc_init(SysBusDevice *dev)
     s->ptimer = ptimer_init(bh, PTIMER_POLICY_DEFAULT);
     
     /* Register handlers to handle updates to the RTC's peripheral clock. */
-    clk_irq =
-          qemu_allocate_irqs(stm32_rtc_clk_irq_handler, (void *)s, 1);
-    stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
+    stm32_rcc_add_periph_clk_notifier(s->stm32_rcc, s->periph,
+                                      stm32_rtc_clk_update, s);
     
     stm32_rtc_reset((DeviceState *)s);
 
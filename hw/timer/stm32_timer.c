@@ -157,12 +157,10 @@ static void stm32_timer_set_count(Stm32Timer *s, uint32_t cnt)
     }
 }
 
-static void stm32_timer_clk_irq_handler(void *opaque, int n, int level)
+static void stm32_timer_clk_update(void *opaque, Clk clk)
 {
     Stm32Timer *s = (Stm32Timer *)opaque;
 
-    assert(n == 0);
-
     stm32_timer_freq(s);
 }
 
@@ -428,7 +426,6 @@ static const MemoryRegionOps stm32_timer_ops = {
 static int stm32_timer_init(SysBusDevice *dev)
 {
     QEMUBH *bh;
-    qemu_irq *clk_irq;
     Stm32Timer *s = STM32_TIMER(dev);
 
     s->stm32_rcc = (Stm32Rcc *)s->stm32_rcc_prop;
@@ -441,8 +438,8 @@ static int stm32_timer_init(SysBusDevice *dev)
     sysbus_init_irq(dev, &s->irq);
 
     /* Register handlers to handle updates to the TIM's peripheral clock. */
-    clk_irq = qemu_allocate_irqs(stm32_timer_clk_irq_handler, (void *)s, 1);
-    stm32_rcc_set_periph_clk_irq(s->stm32_rcc, s->periph, clk_irq[0]);
+    stm32_rcc_add_periph_clk_notifier(s->stm32_rcc, s->periph,
+                                      stm32_timer_clk_update, s);
 
     bh = qemu_bh_new(stm32_timer_tick, s);
     s->timer = ptimer_init(bh, PTIMER_POLICY_DEFAULT);
@@ -1,25 +1,70 @@
 #ifndef AVATAR_IO
 #define AVATAR_IO
 
+#include "avatar/channel.h"
+
+/* AvatarIORequestMessage.flags */
+#define AVATAR_IO_BULK      (1 << 0)
+#define AVATAR_IO_POSTED    (1 << 1)    /* write that expects no response */
+
+/* Limits of a single bulk (scatter-gather) request */
+#define AVATAR_IO_MAX_SEGMENTS  256
+#define AVATAR_IO_BULK_MAX_DATA (64 * 1024)
+
+/*
+ * A request is either a single access of @size bytes at @hwaddr, or, when
+ * AVATAR_IO_BULK is set in @flags, a scatter-gather request: the header is
+ * then followed by @nr_segments AvatarIOSegment descriptors and, for writes,
+ * by the data of all segments concatenated in order.  @hwaddr and @value
+ * are unused for bulk requests.
+ *
+ * Writes flagged AVATAR_IO_POSTED are not answered; the sender relies on
+ * the channel being FIFO to order them before any later request.
+ *
+ * @size may be 1, 2, 4 or 8; 0 is accepted as 4 for peers that predate the
+ * field and leave the padding zeroed.
+ */
 struct _AvatarIORequestMessage {
     uint64_t id;
     uint64_t hwaddr;
     uint64_t value;
     bool write;
+    uint8_t size;
+    uint16_t nr_segments;
+    uint32_t flags;
 };
 
+struct _AvatarIOSegment {
+    uint64_t hwaddr;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+/*
+ * For bulk reads the response is followed by @len bytes of data holding
+ * the contents of every segment in request order; @len is 0 otherwise.
+ */
 struct _AvatarIOResponseMessage {
     uint64_t id;
     uint64_t value;
     bool success;
+    uint32_t len;
 };
 
 typedef struct _AvatarIORequestMessage  AvatarIORequestMessage;
+typedef struct _AvatarIOSegment         AvatarIOSegment;
 typedef struct _AvatarIOResponseMessage AvatarIOResponseMessage;
 
-extern QemuAvatarMessageQueue ioRequestMQ;
-extern QemuAvatarMessageQueue ioResponseMQ;
-extern QemuAvatarMessageQueue IrqMQ;
+/* Largest request or response the IO channels have to carry */
+#define AVATAR_IO_MAX_MSG_SIZE                                          \
+    (sizeof(AvatarIORequestMessage) +                                   \
+     AVATAR_IO_MAX_SEGMENTS * sizeof(AvatarIOSegment) +                 \
+     AVATAR_IO_BULK_MAX_DATA)
+
+extern AvatarChannel ioRequestMQ;
+extern AvatarChannel ioResponseMQ;
+extern AvatarChannel IrqMQ;
+extern AvatarChannel IrqInjectMQ;
 
 void avatar_serve_io(void *);
 
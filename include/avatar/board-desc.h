@@ -0,0 +1,72 @@
+#ifndef AVATAR_BOARD_DESC
+#define AVATAR_BOARD_DESC
+
+#include "qapi/qmp/qobject.h"
+
+/*
+ * Compiled board descriptions
+ *
+ * Generated boards can describe hundreds of peripherals, and lexing and
+ * parsing their JSON is a noticeable part of the startup of every
+ * instance in fork-per-test workflows.  A compiled description holds the
+ * same QObject tree in a binary form that is decoded straight from an
+ * mmap of the file, without any lexing or number parsing.
+ *
+ * The file is an AvatarBoardDescHeader followed by the root object.  An
+ * object is a one-byte tag and its payload, little endian:
+ *
+ * - NULL:   nothing
+ * - BOOL:   one byte, 0 or 1
+ * - INT:    int64_t
+ * - FLOAT:  double
+ * - STRING: uint32_t length, the bytes and a terminating NUL
+ * - LIST:   uint32_t count, then count objects
+ * - DICT:   uint32_t count, then count STRING payloads (the keys) each
+ *           followed by an object
+ *
+ * The header records the size and modification time of the JSON the
+ * description was compiled from, so that a cache can be checked against
+ * its source.
+ */
+#define AVATAR_BOARD_DESC_MAGIC     0x44425641  /* "AVBD" */
+#define AVATAR_BOARD_DESC_VERSION   1
+
+typedef struct AvatarBoardDescHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_size;
+    int64_t source_mtime;   /* in ns */
+    uint64_t size;          /* of the encoded root object */
+} AvatarBoardDescHeader;
+
+enum {
+    AVATAR_BOARD_DESC_NULL,
+    AVATAR_BOARD_DESC_BOOL,
+    AVATAR_BOARD_DESC_INT,
+    AVATAR_BOARD_DESC_FLOAT,
+    AVATAR_BOARD_DESC_STRING,
+    AVATAR_BOARD_DESC_LIST,
+    AVATAR_BOARD_DESC_DICT,
+};
+
+/**
+ * avatar_board_desc_load: decode the compiled description at @path.  If
+ * @source is not NULL, the description must have been compiled from it
+ * in its current state.  Returns NULL and sets @errp otherwise.
+ */
+QObject *avatar_board_desc_load(const char *path, const char *source,
+                                Error **errp);
+
+/**
+ * avatar_board_desc_save: compile @obj into @path.  @src is the stat of
+ * the JSON file @obj was parsed from, taken before it was read.  The file
+ * is replaced atomically, so concurrent instances never see a partial
+ * description.
+ */
+void avatar_board_desc_save(const char *path, const struct stat *src,
+                            QObject *obj, Error **errp);
+
+/* Whether @path starts like a compiled description */
+bool avatar_board_desc_probe(const char *path);
+
+#endif
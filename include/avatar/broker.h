@@ -0,0 +1,117 @@
+/*
+ * Avatar broker connection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef AVATAR_BROKER_H
+#define AVATAR_BROKER_H
+
+#include "qemu/event_notifier.h"
+
+/*
+ * With many instances per host, one message queue or ring per channel
+ * and instance runs into the system-wide mqueue limits and leaves the
+ * orchestrator polling hundreds of objects.  In broker mode, each
+ * instance instead opens a single Unix stream socket to the orchestrator
+ * and multiplexes all of its channels over it, so the orchestrator can
+ * serve every instance from one epoll loop.
+ *
+ * The stream is a sequence of frames: an AvatarBrokerFrame header
+ * followed by @len payload bytes, all in host byte order.  QEMU starts
+ * with a HELLO frame and announces each channel it uses with an OPEN
+ * frame, whose @channel number identifies the channel from then on.
+ *
+ * Flow control is credit-based and per channel: a side may only send as
+ * many DATA frames on a channel as the other side has granted, and grants
+ * more with CREDIT frames as it consumes them.  QEMU grants an initial
+ * window of AVATAR_BROKER_WINDOW messages in the OPEN frame of each
+ * channel it reads; the orchestrator grants credits for the channels QEMU
+ * writes whenever it likes, QEMU blocks writers that ran out.
+ */
+#define AVATAR_BROKER_VERSION   1
+#define AVATAR_BROKER_WINDOW    64
+
+enum {
+    AVATAR_BROKER_HELLO,    /* QEMU -> broker, AvatarBrokerHello */
+    AVATAR_BROKER_OPEN,     /* QEMU -> broker, AvatarBrokerOpen */
+    AVATAR_BROKER_DATA,     /* either way, one message */
+    AVATAR_BROKER_CREDIT,   /* either way, uint32_t more messages allowed */
+};
+
+typedef struct AvatarBrokerFrame {
+    uint32_t type;
+    uint32_t channel;
+    uint32_t len;
+    uint32_t reserved;
+} AvatarBrokerFrame;
+
+typedef struct AvatarBrokerHello {
+    uint32_t version;
+    uint32_t pid;
+} AvatarBrokerHello;
+
+/* AvatarBrokerOpen.direction, as seen from QEMU */
+#define AVATAR_BROKER_READ      0
+#define AVATAR_BROKER_WRITE     1
+
+typedef struct AvatarBrokerOpen {
+    uint32_t direction;
+    uint32_t msg_size;
+    uint32_t credits;       /* initial window for channels QEMU reads */
+    uint32_t reserved;
+    char name[];            /* NUL-terminated channel name */
+} AvatarBrokerOpen;
+
+typedef struct AvatarBrokerChannel AvatarBrokerChannel;
+
+/**
+ * avatar_broker_connect: connect this process to the broker listening on
+ * @path.  There is a single connection per process; later calls must
+ * name the same socket, or pass NULL to reuse the connection.
+ */
+bool avatar_broker_connect(const char *path, Error **errp);
+
+/**
+ * avatar_broker_open: announce the channel @name over the connection.
+ * @write is true for channels QEMU sends on.
+ */
+AvatarBrokerChannel *avatar_broker_open(const char *name, bool write,
+                                        size_t msg_size, Error **errp);
+
+/**
+ * avatar_broker_send: send a message, sleeping while the broker has not
+ * granted a credit for it.
+ */
+void avatar_broker_send(AvatarBrokerChannel *c, const void *msg, size_t len);
+
+/**
+ * avatar_broker_receive: dequeue a message without blocking.
+ *
+ * Returns the length of the message copied into @buf, -EAGAIN if none is
+ * pending, or -EMSGSIZE if the next one does not fit in @len bytes and
+ * was discarded.
+ */
+ssize_t avatar_broker_receive(AvatarBrokerChannel *c, void *buf, size_t len);
+
+bool avatar_broker_is_empty(AvatarBrokerChannel *c);
+
+/**
+ * avatar_broker_wait: sleep until a message is pending on @c.
+ */
+void avatar_broker_wait(AvatarBrokerChannel *c);
+
+/**
+ * avatar_broker_set_notifier: set @e whenever a message arrives on @c, so
+ * that the main loop can dispatch it.
+ */
+void avatar_broker_set_notifier(AvatarBrokerChannel *c, EventNotifier *e);
+
+/**
+ * avatar_broker_after_fork: give a child forked by the fork server a
+ * connection of its own, announcing the same channels again.  Messages
+ * queued for the parent are dropped.
+ */
+void avatar_broker_after_fork(void);
+
+#endif
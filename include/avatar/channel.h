@@ -0,0 +1,131 @@
+/*
+ * Avatar message channels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef AVATAR_CHANNEL_H
+#define AVATAR_CHANNEL_H
+
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
+#include "avatar/ring.h"
+#include "avatar/broker.h"
+
+/*
+ * A channel is one direction of the avatar protocol (IO requests, IO
+ * responses or IRQ notifications).  It hides whether messages travel over
+ * a POSIX message queue, over a shared-memory ring or over the process's
+ * broker connection; all transports preserve message boundaries and
+ * ordering.
+ */
+
+typedef enum AvatarTransport {
+    AVATAR_TRANSPORT_MQ,
+    AVATAR_TRANSPORT_RING,
+    AVATAR_TRANSPORT_BROKER,
+} AvatarTransport;
+
+typedef struct AvatarTransportOptions {
+    AvatarTransport type;
+    /* Data area size of each ring for AVATAR_TRANSPORT_RING */
+    size_t ring_size;
+    /*
+     * Broker socket for AVATAR_TRANSPORT_BROKER, NULL to use the
+     * connection the process already has
+     */
+    const char *broker_path;
+} AvatarTransportOptions;
+
+typedef struct AvatarChannel {
+    AvatarTransport type;
+    bool valid;
+    size_t msg_size;
+    QemuAvatarMessageQueue mq;
+    AvatarRing *ring;
+    AvatarBrokerChannel *broker;
+
+    /* Read side of a ring: a helper thread sleeps on the ring for us */
+    IOHandler *fd_read;
+    void *opaque;
+    EventNotifier notifier;
+    QemuEvent drained;
+    QemuThread thread;
+    bool parking;
+
+    QLIST_ENTRY(AvatarChannel) next;
+} AvatarChannel;
+
+/**
+ * avatar_transport_parse: map a configuration string to a transport.
+ *
+ * Accepts "mq", "ring" and "broker".  Returns false for unknown names.
+ */
+bool avatar_transport_parse(const char *name, AvatarTransport *type);
+
+void avatar_channel_open_read(AvatarChannel *ch,
+                              const AvatarTransportOptions *opts,
+                              const char *name, size_t msg_size,
+                              Error **errp);
+void avatar_channel_open_write(AvatarChannel *ch,
+                               const AvatarTransportOptions *opts,
+                               const char *name, size_t msg_size,
+                               Error **errp);
+
+bool avatar_channel_is_valid(AvatarChannel *ch);
+
+/**
+ * avatar_channel_max_msg_size: largest message @ch was opened for.
+ */
+size_t avatar_channel_max_msg_size(AvatarChannel *ch);
+
+void avatar_channel_send(AvatarChannel *ch, const void *msg, size_t len);
+
+/**
+ * avatar_channel_receive: fetch the next message from a read channel.
+ *
+ * Returns the message length, or a negative value if no complete message
+ * of at most @len bytes could be read.  Shared-memory rings and broker
+ * channels report -EAGAIN when they are empty and -EMSGSIZE for a message
+ * that was discarded because it did not fit.
+ */
+int avatar_channel_receive(AvatarChannel *ch, void *buf, size_t len);
+
+/**
+ * avatar_channel_receive_wait: like avatar_channel_receive, but sleep until
+ * a message arrives.  Only for channels without a read handler.
+ */
+int avatar_channel_receive_wait(AvatarChannel *ch, void *buf, size_t len);
+
+/**
+ * avatar_channel_set_read_handler: run @fd_read from the main loop for
+ * every pending message on @ch.  The handler is expected to consume one
+ * message with avatar_channel_receive() per invocation.
+ */
+void avatar_channel_set_read_handler(AvatarChannel *ch, IOHandler *fd_read,
+                                     void *opaque);
+
+/**
+ * avatar_channel_park: stop and join the helper threads of all ring
+ * channels.  Must be called before fork(), since the threads of two
+ * processes must never sleep on the same ring.
+ */
+void avatar_channel_park(void);
+
+/**
+ * avatar_channel_resume: restart the helper threads stopped by
+ * avatar_channel_park, after resynchronizing each ring with whatever
+ * other processes consumed in the meantime.
+ */
+void avatar_channel_resume(void);
+
+/**
+ * avatar_channel_after_fork: make the channels usable again in a child
+ * forked by the fork server.  The parked ring helper threads are resumed
+ * and the child gets a broker connection of its own.
+ */
+void avatar_channel_after_fork(void);
+
+#endif
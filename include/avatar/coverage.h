@@ -0,0 +1,50 @@
+#ifndef AVATAR_COVERAGE
+#define AVATAR_COVERAGE
+
+#include "qemu/fprintf-fn.h"
+
+/*
+ * Coverage instrumentation
+ *
+ * When enabled, every translation block starts with a few inline TCG ops
+ * (see avatar/gen-coverage.h) that update an AFL-compatible hit map:
+ *
+ * - EDGE mode counts transitions between blocks, AFL style:
+ *       map[cur ^ prev]++; prev = cur >> 1;
+ * - BLOCK mode only marks the blocks that ran:
+ *       map[cur] = 1;
+ *
+ * where cur is a hash of the block's guest PC computed at translation
+ * time.  The map is the fuzzer's System V shared memory segment named by
+ * the __AFL_SHM_ID environment variable, or a private buffer otherwise.
+ *
+ * The mode and the map address are baked into the generated code, so
+ * coverage must be configured before the first block is translated.
+ */
+typedef enum AvatarCoverageMode {
+    AVATAR_COVERAGE_OFF,
+    AVATAR_COVERAGE_EDGE,
+    AVATAR_COVERAGE_BLOCK,
+    AVATAR_COVERAGE__MAX,
+} AvatarCoverageMode;
+
+/* "off", "edge" and "block", for qapi_enum_parse() */
+extern const char *const AvatarCoverageMode_lookup[];
+
+#define AVATAR_COVERAGE_MAP_SIZE_POW2   16
+#define AVATAR_COVERAGE_MAP_SIZE        (1 << AVATAR_COVERAGE_MAP_SIZE_POW2)
+
+typedef struct AvatarCoverage {
+    AvatarCoverageMode mode;
+    uint8_t *map;
+    /* Hash of the previous block, shifted, for EDGE mode */
+    uint32_t prev_loc;
+} AvatarCoverage;
+
+extern AvatarCoverage avatar_coverage;
+
+void avatar_coverage_init(AvatarCoverageMode mode, Error **errp);
+
+void avatar_coverage_info(fprintf_function func_fprintf, void *f);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef AVATAR_FORK_SERVER
+#define AVATAR_FORK_SERVER
+
+#include "qom/cpu.h"
+
+/*
+ * Fork server
+ *
+ * The machine boots once, runs up to a trigger and then stops; from there
+ * on the process only forks children on request of a fuzzer, each of
+ * which resumes the guest from that point with copy-on-write RAM, warm
+ * translated code and fully initialized devices.
+ *
+ * The control protocol is AFL's: the fuzzer writes 4 bytes on
+ * AVATAR_FORK_SERVER_FD to request a run, the server answers with the pid
+ * of the child and, once it has terminated, with its wait status, both on
+ * AVATAR_FORK_SERVER_FD + 1.  If these descriptors are not open the
+ * trigger is ignored and the guest simply keeps running.
+ *
+ * The trigger is either a guest PC, implemented with a debug breakpoint
+ * and therefore not usable together with a gdb session, or a write of any
+ * value to a marker register mapped by avatar_fork_server_add_marker().
+ */
+#define AVATAR_FORK_SERVER_FD   198
+
+void avatar_fork_server_init(void);
+
+/**
+ * avatar_fork_server_set_pc: start serving when @cpu reaches @pc.
+ */
+void avatar_fork_server_set_pc(CPUState *cpu, vaddr pc);
+
+/**
+ * avatar_fork_server_add_marker: map a 4-byte marker register at @addr
+ * of @sysmem, writing it starts serving.
+ */
+void avatar_fork_server_add_marker(MemoryRegion *sysmem, hwaddr addr);
+
+#endif
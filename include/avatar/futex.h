@@ -0,0 +1,54 @@
+/*
+ * Cross-process futex helpers for avatar shared memory objects
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef AVATAR_FUTEX_H
+#define AVATAR_FUTEX_H
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include "qemu/atomic.h"
+
+/*
+ * These operate on words in memory shared with other processes, so they
+ * deliberately do not use the FUTEX_PRIVATE_FLAG variants.
+ */
+
+#ifdef __linux__
+static inline void avatar_futex_wait(uint32_t *addr, uint32_t val)
+{
+    while (syscall(__NR_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0)) {
+        switch (errno) {
+        case EWOULDBLOCK:
+            return;
+        case EINTR:
+            break; /* get out of switch and retry */
+        default:
+            abort();
+        }
+    }
+}
+
+static inline void avatar_futex_wake(uint32_t *addr, int n)
+{
+    syscall(__NR_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+#else
+static inline void avatar_futex_wait(uint32_t *addr, uint32_t val)
+{
+    /* No cross-process futex: poll at a coarse interval instead */
+    while (atomic_read(addr) == val) {
+        g_usleep(10);
+    }
+}
+
+static inline void avatar_futex_wake(uint32_t *addr, int n)
+{
+}
+#endif
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef AVATAR_GEN_COVERAGE_H
+#define AVATAR_GEN_COVERAGE_H
+
+#include "avatar/coverage.h"
+
+/*
+ * Emit the coverage update for a block starting at @pc.  Called by the
+ * target translators right after gen_tb_start(), so the update is part of
+ * the block itself and also runs when blocks are chained.
+ */
+static inline void gen_avatar_coverage(uint64_t pc)
+{
+    AvatarCoverage *cov = &avatar_coverage;
+    uint32_t cur_loc;
+    TCGv_ptr addr, ptr;
+    TCGv_i32 val;
+
+    if (cov->mode == AVATAR_COVERAGE_OFF) {
+        return;
+    }
+
+    /* The hash used by AFL's QEMU mode */
+    cur_loc = ((pc >> 4) ^ (pc << 8)) & (AVATAR_COVERAGE_MAP_SIZE - 1);
+
+    val = tcg_temp_new_i32();
+
+    if (cov->mode == AVATAR_COVERAGE_BLOCK) {
+        addr = tcg_const_ptr(&cov->map[cur_loc]);
+        tcg_gen_movi_i32(val, 1);
+        tcg_gen_st8_i32(val, addr, 0);
+    } else {
+        TCGv_i32 prev = tcg_temp_new_i32();
+
+        addr = tcg_temp_new_ptr();
+
+        /* addr = map + (prev ^ cur_loc) */
+        ptr = tcg_const_ptr(&cov->prev_loc);
+        tcg_gen_ld_i32(prev, ptr, 0);
+        tcg_gen_xori_i32(prev, prev, cur_loc);
+        tcg_gen_ext_i32_ptr(addr, prev);
+        tcg_temp_free_i32(prev);
+        tcg_gen_addi_ptr(addr, addr, (uintptr_t)cov->map);
+
+        /* map[...]++ */
+        tcg_gen_ld8u_i32(val, addr, 0);
+        tcg_gen_addi_i32(val, val, 1);
+        tcg_gen_st8_i32(val, addr, 0);
+
+        /* prev_loc = cur_loc >> 1 */
+        tcg_gen_movi_i32(val, cur_loc >> 1);
+        tcg_gen_st_i32(val, ptr, 0);
+        tcg_temp_free_ptr(ptr);
+    }
+
+    tcg_temp_free_ptr(addr);
+    tcg_temp_free_i32(val);
+}
+
+#endif
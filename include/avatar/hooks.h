@@ -0,0 +1,44 @@
+#ifndef AVATAR_HOOKS
+#define AVATAR_HOOKS
+
+#include "qom/cpu.h"
+
+/*
+ * PC hooks
+ *
+ * A hook runs a callback every time the guest is about to execute the
+ * instruction at a given address.  The AArch32 and AArch64 translators
+ * emit a direct helper call in front of hooked instructions (see
+ * gen_avatar_hook() in target-arm/translate.c and translate-a64.c), so a
+ * hit costs a function call instead of a debug exception and a gdbstub
+ * round trip.  Adding or removing a hook
+ * invalidates the translated code of its address.
+ *
+ * Callbacks run in the vCPU thread with the guest state synchronized to
+ * the start of the instruction.  They may change registers; if they
+ * change the PC, execution resumes at the new PC instead.
+ *
+ * Hooks added with QMP count their hits and optionally emit an
+ * AVATAR_HOOK event for each.
+ */
+typedef void AvatarHookFn(CPUState *cpu, uint64_t pc, void *opaque);
+
+/* Number of hooks in place, so the translator can skip the lookup */
+extern int avatar_hook_count;
+
+/**
+ * avatar_hook_add: call @fn(cpu, @pc, @opaque) before the instruction at
+ * @pc executes.  For Thumb code @pc is the address without its low bit.
+ * Returns an id for avatar_hook_remove().
+ */
+int avatar_hook_add(uint64_t pc, AvatarHookFn *fn, void *opaque);
+
+void avatar_hook_remove(int id);
+
+/* Whether the instruction at @pc is hooked, for the translators */
+bool avatar_hook_at(uint64_t pc);
+
+/* Run the hooks of @pc, called by the translated code */
+void avatar_hook_run(CPUState *cpu, uint64_t pc);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef AVATAR_IO_LOG
+#define AVATAR_IO_LOG
+
+/*
+ * Log of forwarded MMIO transactions
+ *
+ * A log recorded during a live session with the peer can later stand in
+ * for it: in replay mode, the n-th read of an address returns the value
+ * of the n-th read of that address in the log.  Optionally the guest PC
+ * of the access is part of the key as well, which keeps replays in sync
+ * when the firmware takes a different path.  Once the recorded reads of a
+ * key are exhausted, the last one is repeated, which is what polled
+ * status registers need.
+ *
+ * The file is an AvatarIOLogHeader followed by fixed-size
+ * AvatarIOLogRecord entries in access order; replay builds a hash index
+ * over them when the log is opened.
+ */
+#define AVATAR_IO_LOG_MAGIC     0x50525641  /* "AVRP" */
+#define AVATAR_IO_LOG_VERSION   1
+
+typedef struct AvatarIOLogHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+} AvatarIOLogHeader;
+
+/* AvatarIOLogRecord.flags */
+#define AVATAR_IO_LOG_WRITE     (1 << 0)
+#define AVATAR_IO_LOG_PC        (1 << 1)    /* @pc is valid */
+
+typedef struct AvatarIOLogRecord {
+    uint64_t addr;
+    uint64_t value;
+    uint64_t pc;
+    uint8_t size;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t reserved2;
+} AvatarIOLogRecord;
+
+typedef struct AvatarIOLog AvatarIOLog;
+
+AvatarIOLog *avatar_io_log_open_record(const char *path, Error **errp);
+
+/**
+ * avatar_io_log_open_replay: load the log at @path for replay; @use_pc
+ * selects whether reads are matched by PC as well as by address.
+ */
+AvatarIOLog *avatar_io_log_open_replay(const char *path, bool use_pc,
+                                       Error **errp);
+
+/**
+ * avatar_io_log_record: append an access to a log opened for recording.
+ * @pc is ignored unless @has_pc.
+ */
+void avatar_io_log_record(AvatarIOLog *log, uint64_t addr, unsigned size,
+                          uint64_t value, bool is_write, bool has_pc,
+                          uint64_t pc);
+
+/**
+ * avatar_io_log_replay_read: look up the value of a read in a replayed
+ * log.  Returns false if the address was never read in the log.
+ */
+bool avatar_io_log_replay_read(AvatarIOLog *log, uint64_t addr,
+                               unsigned size, bool has_pc, uint64_t pc,
+                               uint64_t *value);
+
+#endif
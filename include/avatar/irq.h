@@ -1,9 +1,109 @@
 #ifndef AVATAR_IRQ
 #define AVATAR_IRQ
 
+#include "qemu/fprintf-fn.h"
+#include "avatar/channel.h"
+
 typedef struct {
     uint32_t irq_num;
     uint32_t level;
 } IRQ_MSG;
 
+/* Lines above this number are never forwarded */
+#define AVATAR_IRQ_MAX_LINES 1024
+
+/*
+ * IRQ forwarding
+ *
+ * Level changes of forwarded lines are deduplicated and queued into an
+ * in-process lock-free ring; a dedicated thread drains the ring into the
+ * IRQ channel, so the vCPU never blocks on the peer.  If the ring fills up
+ * the affected lines are marked and their latest level is resent once the
+ * peer catches up, so no final state is ever lost.
+ *
+ * All forwarding entry points must be called with the iothread lock held.
+ */
+
+/**
+ * avatar_irq_forward_init: start forwarding to @ch, with every line
+ * subscribed.
+ */
+void avatar_irq_forward_init(AvatarChannel *ch);
+
+/**
+ * avatar_irq_subscribe: enable or disable forwarding of @line.
+ */
+void avatar_irq_subscribe(unsigned line, bool enable);
+void avatar_irq_subscribe_all(bool enable);
+
+/**
+ * avatar_irq_add_source: declare one more source reporting on @line.
+ *
+ * The level of a line with a single source is only reported when it
+ * changes.  Once a second source is added, every report on the line is
+ * forwarded, as the last level seen need not be that of the reporter.
+ */
+void avatar_irq_add_source(unsigned line);
+
+/**
+ * avatar_irq_forward: report the new @level of @line to the peer.
+ *
+ * This is a no-op if forwarding is not initialized, the line is not
+ * subscribed, or the line has a single source and its level did not
+ * change since the last report.
+ */
+void avatar_irq_forward(unsigned line, int level);
+
+/**
+ * avatar_irq_park: send every queued event and stop the forwarding
+ * thread.  Must be called before fork(), so that parent and child never
+ * send the same events or write the channel at the same time.
+ */
+void avatar_irq_park(void);
+
+/**
+ * avatar_irq_resume: restart the thread stopped by avatar_irq_park.
+ */
+void avatar_irq_resume(void);
+
+/**
+ * avatar_irq_after_fork: recreate the forwarding thread in a child forked
+ * by the fork server, which starts out with an empty queue.
+ */
+void avatar_irq_after_fork(void);
+
+/*
+ * IRQ injection
+ *
+ * The peer raises interrupts in the guest by sending AvatarIrqInjectMessage
+ * on a dedicated channel.  Every message already queued when the main loop
+ * wakes up is delivered in one batch.  @timestamp is the peer's
+ * CLOCK_MONOTONIC time in nanoseconds when the message was sent, or 0; it
+ * is used to account the end-to-end injection latency.
+ */
+
+/* AvatarIrqInjectMessage.mode */
+#define AVATAR_IRQ_INJECT_LEVEL 0   /* drive the interrupt line to @level */
+#define AVATAR_IRQ_INJECT_PEND  1   /* make the interrupt pending once */
+
+typedef struct AvatarIrqInjectMessage {
+    uint32_t irq_num;
+    uint8_t mode;
+    uint8_t level;
+    uint16_t reserved;
+    uint64_t timestamp;
+} AvatarIrqInjectMessage;
+
+typedef void AvatarIrqInjectFunc(void *opaque,
+                                 const AvatarIrqInjectMessage *msg);
+
+/**
+ * avatar_irq_inject_init: deliver messages arriving on @ch through
+ * @deliver, called with the iothread lock held.
+ */
+void avatar_irq_inject_init(AvatarChannel *ch, AvatarIrqInjectFunc *deliver,
+                            void *opaque);
+
+void avatar_irq_info(fprintf_function func_fprintf, void *f);
+
 #endif
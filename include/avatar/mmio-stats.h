@@ -0,0 +1,75 @@
+#ifndef AVATAR_MMIO_STATS
+#define AVATAR_MMIO_STATS
+
+#include "exec/memory.h"
+#include "qemu/fprintf-fn.h"
+
+/*
+ * Per-region MMIO statistics
+ *
+ * Regions with statistics enabled count their reads and writes, both in
+ * total and per range of offsets, and account the time spent in their
+ * callbacks in a power-of-two histogram.  Devices that forward accesses
+ * to the avatar peer report the ones they did forward, and the
+ * configurable machine reports the time spent waiting for the lock of
+ * shared devices, so that remote or contended peripherals stand out.
+ */
+
+/* Offsets are grouped in this many ranges, 4 bytes or larger */
+#define AVATAR_MMIO_STATS_BUCKETS   64
+
+/*
+ * Bucket 0 of the latency histogram counts accesses shorter than
+ * 2^AVATAR_MMIO_STATS_HIST_SHIFT ns, bucket n those shorter than twice
+ * the limit of bucket n - 1; the last bucket has no upper limit.
+ */
+#define AVATAR_MMIO_STATS_HIST      16
+#define AVATAR_MMIO_STATS_HIST_SHIFT 8
+
+struct AvatarMmioStats {
+    MemoryRegion *mr;
+    unsigned bucket_shift;
+
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t forwarded;
+    uint64_t read_ns;
+    uint64_t write_ns;
+    uint64_t max_ns;
+    uint64_t lock_wait_ns;
+    uint64_t bucket_reads[AVATAR_MMIO_STATS_BUCKETS];
+    uint64_t bucket_writes[AVATAR_MMIO_STATS_BUCKETS];
+    uint64_t hist[AVATAR_MMIO_STATS_HIST];
+
+    QLIST_ENTRY(AvatarMmioStats) next;
+};
+
+/**
+ * avatar_mmio_stats_set: start or stop collecting statistics for @mr.
+ * Enabling always starts from zero.
+ */
+void avatar_mmio_stats_set(MemoryRegion *mr, bool enable);
+
+/* Called by the memory dispatch code for regions with statistics */
+void avatar_mmio_stats_account(AvatarMmioStats *stats, hwaddr addr,
+                               bool is_write, int64_t ns);
+
+void avatar_mmio_stats_info(fprintf_function func_fprintf, void *f);
+
+/* Report that the access in progress was forwarded to the peer */
+static inline void avatar_mmio_stats_forwarded(MemoryRegion *mr)
+{
+    if (unlikely(mr->avatar_stats)) {
+        mr->avatar_stats->forwarded++;
+    }
+}
+
+/* Report time spent waiting for the lock of a shared device */
+static inline void avatar_mmio_stats_lock_wait(MemoryRegion *mr, int64_t ns)
+{
+    if (unlikely(mr->avatar_stats)) {
+        mr->avatar_stats->lock_wait_ns += ns;
+    }
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef AVATAR_MMIO_TRACE
+#define AVATAR_MMIO_TRACE
+
+#include "exec/memory.h"
+
+/*
+ * Binary MMIO access trace
+ *
+ * Accesses to the MemoryRegions with tracing enabled are appended as
+ * fixed-size records to a ring in a memory-mapped file, which a consumer
+ * can follow live or read after the fact.  The ring never blocks and
+ * overwrites the oldest records when it is full.
+ *
+ * The file starts with an AvatarMmioTraceHeader, records follow at offset
+ * AVATAR_MMIO_TRACE_HEADER_SIZE.  Record number n (counting from 0) lives
+ * in slot n % nr_records; @head is the number of records written so far.
+ * The producer invalidates a slot's @seq before filling it and stores n
+ * into it afterwards, so a reader that finds a different @seq after
+ * copying the slot knows it was overwritten meanwhile.
+ */
+#define AVATAR_MMIO_TRACE_MAGIC         0x544d5641  /* "AVMT" */
+#define AVATAR_MMIO_TRACE_VERSION       1
+#define AVATAR_MMIO_TRACE_HEADER_SIZE   8192
+#define AVATAR_MMIO_TRACE_MAX_REGIONS   64
+#define AVATAR_MMIO_TRACE_DEFAULT_RECORDS (64 * 1024)
+
+typedef struct AvatarMmioTraceRegion {
+    char name[48];      /* descriptive only, several regions may share it */
+    uint64_t base;
+    uint64_t size;
+} AvatarMmioTraceRegion;
+
+typedef struct AvatarMmioTraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t nr_records;
+    uint64_t head;
+    uint32_t nr_regions;
+    uint32_t reserved;
+    AvatarMmioTraceRegion regions[AVATAR_MMIO_TRACE_MAX_REGIONS];
+} AvatarMmioTraceHeader;
+
+/* AvatarMmioTraceRecord.flags */
+#define AVATAR_MMIO_TRACE_WRITE     (1 << 0)
+#define AVATAR_MMIO_TRACE_PC        (1 << 1)    /* @pc is valid */
+#define AVATAR_MMIO_TRACE_ICOUNT    (1 << 2)    /* @icount is valid */
+
+typedef struct AvatarMmioTraceRecord {
+    uint64_t seq;
+    uint64_t addr;      /* absolute guest physical address */
+    uint64_t value;
+    uint64_t pc;        /* guest pc of the accessing instruction */
+    uint64_t icount;
+    uint16_t region;    /* index into AvatarMmioTraceHeader.regions */
+    uint8_t size;
+    uint8_t flags;
+    uint32_t reserved;
+} AvatarMmioTraceRecord;
+
+/**
+ * avatar_mmio_trace_open: create the trace file @path holding a ring of
+ * @nr_records records (rounded up to a power of two, 0 for the default).
+ */
+void avatar_mmio_trace_open(const char *path, uint32_t nr_records,
+                            Error **errp);
+
+/**
+ * avatar_mmio_trace_set: start or stop tracing the accesses to @mr.
+ */
+void avatar_mmio_trace_set(MemoryRegion *mr, bool enable, Error **errp);
+
+/**
+ * avatar_mmio_pc: find the guest pc of the instruction performing the
+ * current MMIO access.  Returns false for accesses not made by a vCPU.
+ */
+bool avatar_mmio_pc(uint64_t *pc);
+
+/**
+ * avatar_mmio_find_region: look up a MemoryRegion of the system memory
+ * by name, for the monitor commands.
+ */
+MemoryRegion *avatar_mmio_find_region(const char *name);
+
+/* Called by the memory dispatch code for regions with avatar_trace set */
+void avatar_mmio_trace_record(MemoryRegion *mr, hwaddr addr, uint64_t value,
+                              unsigned size, bool is_write);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef AVATAR_POLL
+#define AVATAR_POLL
+
+#include "exec/hwaddr.h"
+#include "qemu/fprintf-fn.h"
+
+/*
+ * Polling-loop fast-forward
+ *
+ * Firmware often spins on a status register until a device becomes
+ * ready, and every iteration of such a loop goes through the MMIO slow
+ * path.  Under icount, the detector watches the MMIO reads of the vCPU:
+ * once the same instruction has read the same value from the same
+ * address AVATAR_POLL_THRESHOLD times in a row, with the same small
+ * number of instructions in between and no MMIO write, the loop is
+ * assumed to be waiting for a device event.  If no interrupt is pending
+ * and the translation blocks making up the loop have no side effects
+ * besides their loads, QEMU_CLOCK_VIRTUAL jumps to its next deadline, so
+ * the timer that will change the register fires right away.
+ *
+ * The loop is found by following the chained jumps from the block doing
+ * the read back to it, over paths whose blocks add up to the observed
+ * number of instructions; a loop that leaves translated code or goes
+ * through any block with stores or helper calls is never skipped.
+ */
+#define AVATAR_POLL_THRESHOLD   16
+#define AVATAR_POLL_MAX_PERIOD  16
+
+extern bool avatar_poll_enabled;
+
+/* Enable the detector; fails unless icount drives the virtual clock */
+void avatar_poll_init(Error **errp);
+
+/* Called by the softmmu slow path for every MMIO access of a vCPU */
+void avatar_poll_mmio_read(CPUState *cpu, hwaddr addr, uint64_t value,
+                           uintptr_t retaddr);
+void avatar_poll_mmio_write(void);
+
+void avatar_poll_info(fprintf_function func_fprintf, void *f);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Avatar shared-memory message ring
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef AVATAR_RING_H
+#define AVATAR_RING_H
+
+#include "qemu/compiler.h"
+
+/*
+ * A single-producer/single-consumer ring of variable-length messages that
+ * lives in a POSIX shared memory object (shm_open), so that an external
+ * peer can exchange avatar messages with QEMU without a system call per
+ * message.  The layout below is the wire format that peers must follow:
+ *
+ * - @head and @tail are free-running 32-bit byte counters; the producer
+ *   only writes @head, the consumer only writes @tail.  The ring is empty
+ *   when they are equal.
+ * - Each message is stored at data[head & (size - 1)] as a host-endian
+ *   uint32_t length followed by the payload, padded to AVATAR_RING_ALIGN.
+ *   A length of AVATAR_RING_WRAP means "skip to the start of the data area".
+ * - A side that runs out of work sets its *_waiting word to 1 and sleeps in
+ *   FUTEX_WAIT on it; the other side clears the word and issues FUTEX_WAKE
+ *   after publishing.  Wakeups therefore only cost a system call when the
+ *   peer is actually idle.
+ */
+
+#define AVATAR_RING_MAGIC   0x52525641 /* "AVRR" */
+#define AVATAR_RING_VERSION 1
+#define AVATAR_RING_ALIGN   8
+#define AVATAR_RING_WRAP    0xffffffffU
+
+#define AVATAR_RING_DEFAULT_SIZE (64 * 1024)
+
+typedef struct AvatarRingShared {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t max_msg_size;
+
+    uint32_t head QEMU_ALIGNED(64);
+    uint32_t producer_waiting;
+
+    uint32_t tail QEMU_ALIGNED(64);
+    uint32_t consumer_waiting;
+
+    uint8_t data[] QEMU_ALIGNED(64);
+} AvatarRingShared;
+
+typedef struct AvatarRing AvatarRing;
+
+/**
+ * avatar_ring_create: create (or re-create) a named shared memory ring.
+ *
+ * @name: POSIX shared memory object name, e.g. "/qemu_in"
+ * @size: requested data area size; rounded up to a power of two
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Any existing object with the same name is unlinked first, mirroring
+ * what qemu_avatar_mq_open_read/write do for message queues.
+ */
+AvatarRing *avatar_ring_create(const char *name, size_t size, Error **errp);
+
+/**
+ * avatar_ring_open: map a ring created by another process, for use by
+ * the peer side.  Fails if @name does not hold an initialized ring yet.
+ */
+AvatarRing *avatar_ring_open(const char *name, Error **errp);
+void avatar_ring_destroy(AvatarRing *ring);
+
+size_t avatar_ring_max_msg_size(AvatarRing *ring);
+bool avatar_ring_is_empty(AvatarRing *ring);
+
+/**
+ * avatar_ring_try_push: enqueue a message without blocking.
+ *
+ * Returns false if there is currently not enough space in the ring.
+ */
+bool avatar_ring_try_push(AvatarRing *ring, const void *msg, size_t len);
+
+/**
+ * avatar_ring_push: enqueue a message, sleeping while the ring is full.
+ */
+void avatar_ring_push(AvatarRing *ring, const void *msg, size_t len);
+
+/**
+ * avatar_ring_pop: dequeue a message without blocking.
+ *
+ * Returns the length of the message copied into @buf, -EAGAIN if the ring
+ * is empty, or -EMSGSIZE if the next message does not fit in @len bytes.
+ * Oversized messages are discarded so that a misbehaving peer cannot wedge
+ * the consumer.
+ */
+ssize_t avatar_ring_pop(AvatarRing *ring, void *buf, size_t len);
+
+/**
+ * avatar_ring_wait: sleep until the ring contains at least one message,
+ * or until avatar_ring_interrupt() is called.
+ */
+void avatar_ring_wait(AvatarRing *ring);
+
+/**
+ * avatar_ring_interrupt: make avatar_ring_wait return without a message,
+ * now and for every later call, until avatar_ring_after_fork().
+ */
+void avatar_ring_interrupt(AvatarRing *ring);
+
+/**
+ * avatar_ring_after_fork: adopt the ring positions published in shared
+ * memory, which may have moved on since this process was forked off or
+ * since a child last consumed from the ring.  Also clears a previous
+ * avatar_ring_interrupt().
+ */
+void avatar_ring_after_fork(AvatarRing *ring);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef AVATAR_SHARED_LOCK
+#define AVATAR_SHARED_LOCK
+
+#include "qemu/fprintf-fn.h"
+
+/*
+ * Locks serializing the accesses to a peripheral shared with an avatar
+ * peer process.
+ *
+ * SEMAPHORE is the historical POSIX named semaphore, kept for peers that
+ * still open it with sem_open().  The other modes live in a POSIX shared
+ * memory object of the same name (see AvatarSharedLockShared), so an
+ * uncontended access costs no system call:
+ *
+ * - MUTEX is a futex-based mutex which spins briefly before sleeping;
+ * - SEQLOCK adds a sequence counter to the mutex: writers still take the
+ *   mutex, but readers never block and instead retry the access if a
+ *   writer ran concurrently.  It is only suitable for devices whose reads
+ *   have no side effects, such as plain register files.
+ */
+typedef enum AvatarSharedLockMode {
+    AVATAR_SHARED_LOCK_SEMAPHORE,
+    AVATAR_SHARED_LOCK_MUTEX,
+    AVATAR_SHARED_LOCK_SEQLOCK,
+    AVATAR_SHARED_LOCK__MAX,
+} AvatarSharedLockMode;
+
+/* "semaphore", "mutex" and "seqlock", for qapi_enum_parse() */
+extern const char *const AvatarSharedLockMode_lookup[];
+
+#define AVATAR_SHARED_LOCK_MAGIC    0x4b4c5641  /* "AVLK" */
+#define AVATAR_SHARED_LOCK_VERSION  1
+
+/* AvatarSharedLockShared.lock */
+#define AVATAR_SHARED_LOCK_FREE         0
+#define AVATAR_SHARED_LOCK_LOCKED       1
+#define AVATAR_SHARED_LOCK_CONTENDED    2   /* locked, maybe with sleepers */
+
+/*
+ * Layout of the shared memory object, which peers map to take part in the
+ * locking protocol.  @lock follows the classic three-state futex mutex: a
+ * peer that fails to move it from FREE to LOCKED sets it to CONTENDED and
+ * sleeps with FUTEX_WAIT; whoever releases a CONTENDED lock stores FREE and
+ * wakes one sleeper with FUTEX_WAKE.  @sequence is odd while a writer holds
+ * the lock in seqlock mode.
+ */
+typedef struct AvatarSharedLockShared {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t lock;
+    uint32_t sequence;
+} AvatarSharedLockShared;
+
+/**
+ * avatar_shared_lock_open: create the lock @name, replacing any stale
+ * object left behind by a previous run.
+ */
+AvatarSharedLock *avatar_shared_lock_open(const char *name,
+                                          AvatarSharedLockMode mode,
+                                          Error **errp);
+
+AvatarSharedLockMode avatar_shared_lock_mode(AvatarSharedLock *lock);
+
+void avatar_shared_lock_acquire(AvatarSharedLock *lock);
+void avatar_shared_lock_release(AvatarSharedLock *lock);
+
+/**
+ * avatar_shared_lock_read_begin: start a lockless read section of a
+ * seqlock, waiting for any writer in progress to finish.
+ *
+ * The read section must be repeated for as long as
+ * avatar_shared_lock_read_retry() returns true.
+ */
+unsigned avatar_shared_lock_read_begin(AvatarSharedLock *lock);
+bool avatar_shared_lock_read_retry(AvatarSharedLock *lock, unsigned start);
+
+/**
+ * avatar_shared_lock_info: print the contention statistics of every lock.
+ */
+void avatar_shared_lock_info(fprintf_function func_fprintf, void *f);
+
+#endif
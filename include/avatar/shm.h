@@ -0,0 +1,33 @@
+/*
+ * Avatar shared-memory object headers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef AVATAR_SHM_H
+#define AVATAR_SHM_H
+
+#include "qemu/atomic.h"
+
+/*
+ * Every object QEMU shares with a peer or a reader process (message
+ * rings, shared device locks, the MMIO trace and the GPIO monitor) starts
+ * with a header whose first word is a magic number.  The creator fills in
+ * the rest of the header first and stores the magic last, with release
+ * semantics.  The other side maps the object, polls the magic with
+ * acquire semantics, and only relies on the header once it matches.
+ */
+
+/* Make the header before @magic visible, then mark the object ready */
+static inline void avatar_shm_publish(uint32_t *magic, uint32_t value)
+{
+    atomic_store_release(magic, value);
+}
+
+/* Whether the object was published with @value by its creator */
+static inline bool avatar_shm_ready(uint32_t *magic, uint32_t value)
+{
+    return atomic_load_acquire(magic) == value;
+}
+
+#endif
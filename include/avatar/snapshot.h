@@ -0,0 +1,33 @@
+#ifndef AVATAR_SNAPSHOT
+#define AVATAR_SNAPSHOT
+
+#include "qemu/fprintf-fn.h"
+#include "exec/hwaddr.h"
+
+/*
+ * In-process snapshots
+ *
+ * A snapshot holds the state of every device (CPUs included) and a copy of
+ * guest RAM.  Restoring it only copies back the RAM pages dirtied since
+ * the snapshot was taken, as tracked by the DIRTY_MEMORY_MIGRATION bitmap,
+ * so a fuzzing harness can reset the machine between inputs without a
+ * fork.  Global dirty logging stays enabled while a snapshot exists, so
+ * snapshots cannot be combined with live migration.
+ *
+ * Besides the QMP commands, the guest can drive snapshots through a
+ * marker register: writing AVATAR_SNAPSHOT_SAVE or AVATAR_SNAPSHOT_RESTORE
+ * takes or restores the snapshot as soon as the current translation block
+ * ends; reading it returns the number of restores so far.
+ */
+#define AVATAR_SNAPSHOT_SAVE    1
+#define AVATAR_SNAPSHOT_RESTORE 2
+
+/**
+ * avatar_snapshot_add_marker: map the 4-byte marker register at @addr of
+ * @sysmem.
+ */
+void avatar_snapshot_add_marker(MemoryRegion *sysmem, hwaddr addr);
+
+void avatar_snapshot_info(fprintf_function func_fprintf, void *f);
+
+#endif
@@ -49,6 +49,12 @@ void restore_state_to_opc(CPUArchState *env, struct TranslationBlock *tb,
 
 void cpu_gen_init(void);
 bool cpu_restore_state(CPUState *cpu, uintptr_t searched_pc);
+/* Like cpu_restore_state, but only look up the guest pc, leaving the CPU
+   state untouched.  */
+bool cpu_get_insn_pc(uintptr_t retaddr, target_ulong *pc);
+/* Longest chain of TBs tb_loop_is_side_effect_free() follows */
+#define TB_LOOP_MAX_DEPTH 8
+bool tb_loop_is_side_effect_free(uintptr_t retaddr, int64_t icount);
 
 void QEMU_NORETURN cpu_loop_exit_noexc(CPUState *cpu);
 void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
@@ -215,6 +221,8 @@ struct TranslationBlock {
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
 
     uint16_t invalid;
+    /* No guest stores and no helper calls */
+    bool side_effect_free;
 
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
@@ -229,9 +229,12 @@ struct MemoryRegion {
 
     //Avatar-specific
     const MemoryRegionOps *real_ops;
-    QemuAvatarSemaphore semaphore;
+    AvatarSharedLock *shared_lock;
     QemuAvatarMessageQueue mq;
     void *real_opaque;
+    bool avatar_trace;
+    uint16_t avatar_trace_id;
+    AvatarMmioStats *avatar_stats;
 };
 
 /**
@@ -593,6 +596,15 @@ struct Object *memory_region_owner(MemoryRegion *mr);
  */
 uint64_t memory_region_size(MemoryRegion *mr);
 
+/**
+ * memory_region_to_absolute_addr: translate an offset within a memory
+ * region into an address in the region's root container.
+ *
+ * @mr: the memory region being queried.
+ * @offset: offset within @mr.
+ */
+hwaddr memory_region_to_absolute_addr(MemoryRegion *mr, hwaddr offset);
+
 /**
  * memory_region_is_ram: check whether a memory region is random access
  *
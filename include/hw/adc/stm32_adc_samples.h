@@ -0,0 +1,35 @@
+/*
+ * STM32 ADC sample source
+ *
+ * Feeds recorded traces to the STM32 ADC models.  A trace is raw
+ * little-endian 16-bit samples, interleaved as frames of one sample per
+ * ADC channel, recorded at a fixed sample rate.  Conversions return the
+ * sample that is current at the virtual time they start.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_STM32_ADC_SAMPLES_H
+#define HW_STM32_ADC_SAMPLES_H
+
+typedef struct STM32ADCSamples STM32ADCSamples;
+
+/*
+ * Open the trace at @path.  Regular files are mapped and loop at their
+ * end; pipes and other streams are read as the guest catches up with
+ * them and hold their last frame while the writer is behind.
+ */
+STM32ADCSamples *stm32_adc_samples_open(const char *path,
+                                        unsigned int channels,
+                                        uint32_t rate, Error **errp);
+void stm32_adc_samples_close(STM32ADCSamples *s);
+
+/*
+ * Return the current sample of @channel, or false if the trace has no
+ * data for it (yet).
+ */
+bool stm32_adc_samples_get(STM32ADCSamples *s, unsigned int channel,
+                           uint16_t *value);
+
+#endif /* HW_STM32_ADC_SAMPLES_H */
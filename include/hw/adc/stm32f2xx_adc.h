@@ -25,6 +25,8 @@
 #ifndef HW_STM32F2XX_ADC_H
 #define HW_STM32F2XX_ADC_H
 
+#include "hw/adc/stm32_adc_samples.h"
+
 #define ADC_SR    0x00
 #define ADC_CR1   0x04
 #define ADC_CR2   0x08
@@ -48,11 +50,14 @@
 
 #define ADC_CR2_ADON    0x01
 #define ADC_CR2_CONT    0x02
+#define ADC_CR2_DMA     0x100
 #define ADC_CR2_ALIGN   0x800
 #define ADC_CR2_SWSTART 0x40000000
 
 #define ADC_CR1_RES 0x3000000
 
+#define ADC_SQR3_SQ1 0x1F
+
 #define ADC_COMMON_ADDRESS 0x100
 
 #define TYPE_STM32F2XX_ADC "stm32f2xx-adc"
@@ -81,7 +86,12 @@ typedef struct {
     uint32_t adc_jdr[4];
     uint32_t adc_dr;
 
+    char *samples_path;
+    uint32_t sample_rate;
+    STM32ADCSamples *samples;
+
     qemu_irq irq;
+    qemu_irq dma;
 } STM32F2XXADCState;
 
 #endif /* HW_STM32F2XX_ADC_H */
@@ -29,6 +29,7 @@
 #include "qemu-common.h"
 #include "hw/sysbus.h"
 #include "qemu/log.h"
+#include "hw/arm/stm32_clktree.h"
 
 void stm32_hw_warn(const char *fmt, ...)
     __attribute__ ((__format__ (__printf__, 1, 2)));
@@ -168,6 +169,10 @@ const char *stm32_periph_name(stm32_periph_t periph);
 
 #define STM32_ADC1_2_IRQ 18
 
+#define STM32_DMA1_CHANNEL1_IRQ 11  /* Channels 1 to 7 are 11 to 17 */
+#define STM32_DMA2_CHANNEL1_IRQ 56  /* Channels 1 to 3 are 56 to 58 */
+#define STM32_DMA2_CHANNEL4_5_IRQ 59
+
 #define STM32_UART1_IRQ 37
 #define STM32_UART2_IRQ 38
 #define STM32_UART3_IRQ 39
@@ -267,6 +272,25 @@ uint8_t stm32_gpio_get_mode_bits(Stm32Gpio *s, unsigned pin);
 #define STM32_GPIO_OUT_ALT_OPEN 3
 uint8_t stm32_gpio_get_config_bits(Stm32Gpio *s, unsigned pin);
 
+/* Why the pins of a port changed level */
+#define STM32_GPIO_CHANGE_OUTPUT 0   /* ODR, BSRR or BRR write */
+#define STM32_GPIO_CHANGE_INPUT 1    /* external stimulus on an input pin */
+#define STM32_GPIO_CHANGE_CONFIG 2   /* CRL or CRH write, or reset */
+#define STM32_GPIO_CHANGE_SNAPSHOT 3 /* monitor installed, nothing changed */
+
+/* Called with the pins that changed level, the level of all pins (driven
+ * from ODR for outputs, sampled for inputs) and the output pin mask.  All
+ * pins changed by one register write are reported together.
+ */
+typedef void Stm32GpioMonitorFunc(void *opaque, unsigned port,
+                                  unsigned cause, uint16_t changed,
+                                  uint16_t pins, uint16_t dir);
+
+/* Installs the port's single monitor, which is called straight away with
+ * STM32_GPIO_CHANGE_SNAPSHOT. */
+void stm32_gpio_set_monitor(Stm32Gpio *s, Stm32GpioMonitorFunc *func,
+                            void *opaque);
+
 
 
 
@@ -284,12 +308,13 @@ typedef struct Stm32Rcc Stm32Rcc;
  */
 void stm32_rcc_check_periph_clk(Stm32Rcc *s, stm32_periph_t periph);
 
-/* Sets the IRQ to be called when the specified peripheral clock changes
- * frequency. */
-void stm32_rcc_set_periph_clk_irq(
+/* Registers a function to be called when the specified peripheral clock
+ * changes frequency. */
+void stm32_rcc_add_periph_clk_notifier(
         Stm32Rcc *s,
         stm32_periph_t periph,
-        qemu_irq periph_irq);
+        ClktreeNotifyFunc *func,
+        void *opaque);
 
 /* Gets the frequency of the specified peripheral clock. */
 uint32_t stm32_rcc_get_periph_freq(
@@ -361,6 +386,13 @@ void stm32_uart_connect(Stm32Uart *s, CharDriverState *chr,
                         uint32_t afio_board_map);
 
 
+/* DMA */
+typedef struct Stm32Dma Stm32Dma;
+
+#define TYPE_STM32_DMA "stm32-dma"
+#define STM32_DMA(obj) OBJECT_CHECK(Stm32Dma, (obj), TYPE_STM32_DMA)
+
+
 /* Timer */
 typedef struct Stm32Timer Stm32Timer;
 
@@ -24,7 +24,7 @@
 
 #include "qemu-common.h"
 
-#define CLKTREE_MAX_IRQ 16
+#define CLKTREE_MAX_USER 16
 #define CLKTREE_MAX_OUTPUT 16
 #define CLKTREE_MAX_INPUT 16
 
@@ -36,6 +36,9 @@
 
 typedef struct Clk *Clk;
 
+/* Called once the output frequency of a clock has changed. */
+typedef void ClktreeNotifyFunc(void *opaque, Clk clk);
+
 /* Check if the clock output is enabled. */
 bool clktree_is_enabled(Clk clk);
 
@@ -46,8 +49,16 @@ bool clktree_is_enabled(Clk clk);
  */
 uint32_t clktree_get_output_freq(Clk clk);
 
-/* Add an IRQ to receive notifications when the clock frequency is updated. */
-void clktree_adduser(Clk clk, qemu_irq user);
+/* Register a function to be called when the clock frequency is updated. */
+void clktree_add_notifier(Clk clk, ClktreeNotifyFunc *func, void *opaque);
+
+/* Group a series of changes to the clock tree.  Frequencies are updated
+ * straight away, but users are only notified by the outermost
+ * clktree_end_update(), once per clock whose frequency differs from the one
+ * they were last told about.  Calls may be nested.
+ */
+void clktree_begin_update(void);
+void clktree_end_update(void);
 
 /* Create a source clock (e.g. oscillator) with the given frequency. */
 Clk clktree_create_src_clk(
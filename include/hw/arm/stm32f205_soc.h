@@ -31,6 +31,7 @@
 #include "hw/adc/stm32f2xx_adc.h"
 #include "hw/or-irq.h"
 #include "hw/ssi/stm32f2xx_spi.h"
+#include "hw/dma/stm32f2xx_dma.h"
 
 #define TYPE_STM32F205_SOC "stm32f205-soc"
 #define STM32F205_SOC(obj) \
@@ -40,6 +41,7 @@
 #define STM_NUM_TIMERS 4
 #define STM_NUM_ADCS 3
 #define STM_NUM_SPIS 3
+#define STM_NUM_DMAS 2
 
 #define FLASH_BASE_ADDRESS 0x08000000
 #define FLASH_SIZE (1024 * 1024)
@@ -59,6 +61,7 @@ typedef struct STM32F205State {
     STM32F2XXTimerState timer[STM_NUM_TIMERS];
     STM32F2XXADCState adc[STM_NUM_ADCS];
     STM32F2XXSPIState spi[STM_NUM_SPIS];
+    STM32F2XXDmaState dma[STM_NUM_DMAS];
 
     qemu_or_irq *adc_irqs;
 } STM32F205State;
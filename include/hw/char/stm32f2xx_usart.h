@@ -48,6 +48,9 @@
 #define USART_CR1_TE  (1 << 3)
 #define USART_CR1_RE  (1 << 2)
 
+#define USART_CR3_DMAT (1 << 7)
+#define USART_CR3_DMAR (1 << 6)
+
 #define TYPE_STM32F2XX_USART "stm32f2xx-usart"
 #define STM32F2XX_USART(obj) \
     OBJECT_CHECK(STM32F2XXUsartState, (obj), TYPE_STM32F2XX_USART)
@@ -69,5 +72,7 @@ typedef struct {
 
     CharBackend chr;
     qemu_irq irq;
+    qemu_irq dma_rx;
+    qemu_irq dma_tx;
 } STM32F2XXUsartState;
 #endif /* HW_STM32F2XX_USART_H */
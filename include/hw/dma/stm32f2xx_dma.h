@@ -0,0 +1,116 @@
+/*
+ * STM32F2XX DMA controller
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_STM32F2XX_DMA_H
+#define HW_STM32F2XX_DMA_H
+
+#include "hw/sysbus.h"
+#include "hw/hw.h"
+#include "qemu/timer.h"
+
+#define STM_DMA_LISR    0x00
+#define STM_DMA_HISR    0x04
+#define STM_DMA_LIFCR   0x08
+#define STM_DMA_HIFCR   0x0C
+
+/* Stream x registers are at STM_DMA_STREAM_BASE + x * STM_DMA_STREAM_SIZE */
+#define STM_DMA_STREAM_BASE 0x10
+#define STM_DMA_STREAM_SIZE 0x18
+#define STM_DMA_SxCR    0x00
+#define STM_DMA_SxNDTR  0x04
+#define STM_DMA_SxPAR   0x08
+#define STM_DMA_SxM0AR  0x0C
+#define STM_DMA_SxM1AR  0x10
+#define STM_DMA_SxFCR   0x14
+
+/* Stream flags, shifted into LISR/HISR by stm32f2xx_dma_flag_shift() */
+#define STM_DMA_FEIF    (1 << 0)
+#define STM_DMA_DMEIF   (1 << 2)
+#define STM_DMA_TEIF    (1 << 3)
+#define STM_DMA_HTIF    (1 << 4)
+#define STM_DMA_TCIF    (1 << 5)
+#define STM_DMA_FLAGS   0x3D
+
+#define STM_DMA_SxCR_EN     (1 << 0)
+#define STM_DMA_SxCR_DMEIE  (1 << 1)
+#define STM_DMA_SxCR_TEIE   (1 << 2)
+#define STM_DMA_SxCR_HTIE   (1 << 3)
+#define STM_DMA_SxCR_TCIE   (1 << 4)
+#define STM_DMA_SxCR_DIR_SHIFT 6
+#define STM_DMA_SxCR_CIRC   (1 << 8)
+#define STM_DMA_SxCR_PINC   (1 << 9)
+#define STM_DMA_SxCR_MINC   (1 << 10)
+#define STM_DMA_SxCR_PSIZE_SHIFT 11
+#define STM_DMA_SxCR_DBM    (1 << 18)
+#define STM_DMA_SxCR_CT     (1 << 19)
+#define STM_DMA_SxCR_CHSEL_SHIFT 25
+#define STM_DMA_SxCR_MASK   0x0FEFFFFF
+
+#define STM_DMA_DIR_P2M 0
+#define STM_DMA_DIR_M2P 1
+#define STM_DMA_DIR_M2M 2
+
+#define STM_DMA_SxFCR_FEIE  (1 << 7)
+#define STM_DMA_SxFCR_MASK  0x87
+#define STM_DMA_SxFCR_RESET 0x21
+
+#define STM_DMA_NUM_STREAMS 8
+#define STM_DMA_NUM_CHANNELS 8
+
+/* Virtual time a circular transfer is charged per item moved */
+#define STM_DMA_ITEM_NS 1000
+
+#define TYPE_STM32F2XX_DMA "stm32f2xx-dma"
+#define STM32F2XX_DMA(obj) \
+    OBJECT_CHECK(STM32F2XXDmaState, (obj), TYPE_STM32F2XX_DMA)
+
+typedef struct {
+    uint32_t dma_sxcr;
+    uint32_t dma_sxndtr;
+    uint32_t dma_sxpar;
+    uint32_t dma_sxm0ar;
+    uint32_t dma_sxm1ar;
+    uint32_t dma_sxfcr;
+
+    /* STM_DMA_* flags of the stream, not shifted */
+    uint32_t isr;
+
+    /* Items programmed when the stream was enabled and current addresses */
+    uint32_t count;
+    uint32_t cur_par;
+    uint32_t cur_mar;
+
+    /* One bit per channel whose request line is high */
+    uint32_t request;
+
+    /*
+     * Virtual time before which a circular transfer that moved a whole
+     * buffer in its last run is not served again
+     */
+    int64_t resume_ns;
+
+    qemu_irq irq;
+} STM32F2XXDmaStream;
+
+typedef struct {
+    /* <private> */
+    SysBusDevice parent_obj;
+
+    /* <public> */
+    MemoryRegion mmio;
+
+    STM32F2XXDmaStream stream[STM_DMA_NUM_STREAMS];
+
+    /* Set while transfers are running, peripherals change their request
+     * lines from inside the accesses the controller makes.
+     */
+    bool busy;
+    /* Armed for the earliest resume_ns of all streams */
+    QEMUTimer *timer;
+} STM32F2XXDmaState;
+
+#endif /* HW_STM32F2XX_DMA_H */
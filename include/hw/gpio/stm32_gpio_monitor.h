@@ -0,0 +1,69 @@
+/*
+ * STM32 GPIO monitor
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef HW_STM32_GPIO_MONITOR_H
+#define HW_STM32_GPIO_MONITOR_H
+
+/*
+ * Pin level changes of the STM32 GPIO ports, for external logic analysers
+ *
+ * Every change of the pin levels of a port is appended as a fixed-size
+ * record to a ring in a memory-mapped file.  All the pins changed by one
+ * ODR, BSRR or BRR write share a single record.  The ring never blocks and
+ * overwrites the oldest records when it is full.
+ *
+ * The file starts with a Stm32GpioMonitorHeader, records follow at offset
+ * STM32_GPIO_MONITOR_HEADER_SIZE.  Record number n (counting from 0)
+ * lives in slot n % nr_records; @head is the number of records written so
+ * far.  The producer invalidates a slot's @seq before filling it and
+ * stores n into it afterwards, so a reader that finds a different @seq
+ * after copying the slot knows it was overwritten meanwhile.
+ *
+ * @ports holds the latest levels of every port, so that a reader joining
+ * late knows the state the following records apply to.
+ */
+#define STM32_GPIO_MONITOR_MAGIC        0x4d475653  /* "SVGM" */
+#define STM32_GPIO_MONITOR_VERSION      1
+#define STM32_GPIO_MONITOR_HEADER_SIZE  4096
+#define STM32_GPIO_MONITOR_MAX_PORTS    16
+#define STM32_GPIO_MONITOR_DEFAULT_RECORDS (64 * 1024)
+
+/* Stm32GpioMonitorRecord.cause, the STM32_GPIO_CHANGE_* values */
+#define STM32_GPIO_MONITOR_OUTPUT       0   /* ODR, BSRR or BRR write */
+#define STM32_GPIO_MONITOR_INPUT        1   /* external stimulus */
+#define STM32_GPIO_MONITOR_CONFIG       2   /* CRL or CRH write, or reset */
+#define STM32_GPIO_MONITOR_SNAPSHOT     3   /* state when monitoring began */
+
+typedef struct Stm32GpioMonitorPort {
+    uint16_t pins;      /* level of each pin */
+    uint16_t dir;       /* output pins */
+    uint32_t reserved;
+} Stm32GpioMonitorPort;
+
+typedef struct Stm32GpioMonitorHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t nr_records;
+    uint64_t head;
+    uint32_t nr_ports;
+    uint32_t reserved;
+    Stm32GpioMonitorPort ports[STM32_GPIO_MONITOR_MAX_PORTS];
+} Stm32GpioMonitorHeader;
+
+typedef struct Stm32GpioMonitorRecord {
+    uint64_t seq;
+    int64_t time_ns;    /* virtual time of the change */
+    uint8_t port;       /* 0 for GPIOA */
+    uint8_t cause;
+    uint16_t changed;   /* pins that changed level */
+    uint16_t pins;      /* level of each pin afterwards */
+    uint16_t dir;       /* output pins */
+} Stm32GpioMonitorRecord;
+
+#define TYPE_STM32_GPIO_MONITOR "stm32-gpio-monitor"
+
+#endif
@@ -58,6 +58,11 @@ qemu_irq qemu_irq_split(qemu_irq irq1, qemu_irq irq2);
  */
 qemu_irq *qemu_irq_proxy(qemu_irq **target, int n);
 
+/* Report level changes of @irq to the avatar peer, using its line number
+ * as the interrupt number.
+ */
+void qemu_irq_set_avatar_forward(qemu_irq irq, bool forward);
+
 /* For internal use in qtest.  Similar to qemu_irq_split, but operating
    on an existing vector of qemu_irq.  */
 void qemu_irq_intercept_in(qemu_irq *gpio_in, qemu_irq_handler handler, int n);
@@ -42,6 +42,10 @@
 #define STM_SPI_CR1_SPE  (1 << 6)
 #define STM_SPI_CR1_MSTR (1 << 2)
 
+#define STM_SPI_CR2_TXDMAEN (1 << 1)
+#define STM_SPI_CR2_RXDMAEN (1 << 0)
+
+#define STM_SPI_SR_TXE    (1 << 1)
 #define STM_SPI_SR_RXNE   1
 
 #define TYPE_STM32F2XX_SPI "stm32f2xx-spi"
@@ -66,6 +70,8 @@ typedef struct {
     uint32_t spi_i2spr;
 
     qemu_irq irq;
+    qemu_irq dma_rx;
+    qemu_irq dma_tx;
     SSIBus *ssi;
 } STM32F2XXSPIState;
 
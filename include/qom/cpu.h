@@ -351,6 +351,7 @@ struct CPUState {
 
     QTAILQ_HEAD(watchpoints_head, CPUWatchpoint) watchpoints;
     CPUWatchpoint *watchpoint_hit;
+    struct CPUWatchpointIndex *watchpoint_index;
 
     void *opaque;
 
@@ -8,8 +8,11 @@ void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
 void cpu_ticks_init(void);
+void qemu_tcg_restart_after_fork(void);
+int64_t qemu_icount_skip_to_deadline(void);
 
 void configure_icount(QemuOpts *opts, Error **errp);
+void icount_enable_idle_skip(Error **errp);
 extern int use_icount;
 extern int icount_align_option;
 
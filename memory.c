@@ -30,6 +30,8 @@
 #include "exec/ram_addr.h"
 #include "sysemu/kvm.h"
 #include "sysemu/sysemu.h"
+#include "avatar/mmio-trace.h"
+#include "avatar/mmio-stats.h"
 
 //#define DEBUG_UNASSIGNED
 
@@ -374,7 +376,7 @@ static void adjust_endianness(MemoryRegion *mr, uint64_t *data, unsigned size)
     }
 }
 
-static hwaddr memory_region_to_absolute_addr(MemoryRegion *mr, hwaddr offset)
+hwaddr memory_region_to_absolute_addr(MemoryRegion *mr, hwaddr offset)
 {
     MemoryRegion *root;
     hwaddr abs_addr = offset;
@@ -1263,6 +1265,8 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
                                         unsigned size,
                                         MemTxAttrs attrs)
 {
+    AvatarMmioStats *stats = mr->avatar_stats;
+    int64_t start = 0;
     MemTxResult r;
 
     if (!memory_region_access_valid(mr, addr, size, false)) {
@@ -1270,7 +1274,17 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
         return MEMTX_DECODE_ERROR;
     }
 
+    if (unlikely(stats)) {
+        start = get_clock();
+    }
     r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
+    if (unlikely(stats)) {
+        avatar_mmio_stats_account(stats, addr, false, get_clock() - start);
+    }
+    if (unlikely(mr->avatar_trace)) {
+        avatar_mmio_trace_record(mr, memory_region_to_absolute_addr(mr, addr),
+                                 *pval, size, false);
+    }
     adjust_endianness(mr, pval, size);
     return r;
 }
@@ -1301,24 +1315,12 @@ static bool memory_region_dispatch_write_eventfds(MemoryRegion *mr,
     return false;
 }
 
-MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
-                                         hwaddr addr,
-                                         uint64_t data,
-                                         unsigned size,
-                                         MemTxAttrs attrs)
+static MemTxResult memory_region_dispatch_write1(MemoryRegion *mr,
+                                                 hwaddr addr,
+                                                 uint64_t data,
+                                                 unsigned size,
+                                                 MemTxAttrs attrs)
 {
-    if (!memory_region_access_valid(mr, addr, size, true)) {
-        unassigned_mem_write(mr, addr, data, size);
-        return MEMTX_DECODE_ERROR;
-    }
-
-    adjust_endianness(mr, &data, size);
-
-    if ((!kvm_eventfds_enabled()) &&
-        memory_region_dispatch_write_eventfds(mr, addr, data, size, attrs)) {
-        return MEMTX_OK;
-    }
-
     if (mr->ops->write) {
         return access_with_adjusted_size(addr, &data, size,
                                          mr->ops->impl.min_access_size,
@@ -1339,6 +1341,43 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
     }
 }
 
+MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
+                                         hwaddr addr,
+                                         uint64_t data,
+                                         unsigned size,
+                                         MemTxAttrs attrs)
+{
+    AvatarMmioStats *stats = mr->avatar_stats;
+    int64_t start = 0;
+    MemTxResult r;
+
+    if (!memory_region_access_valid(mr, addr, size, true)) {
+        unassigned_mem_write(mr, addr, data, size);
+        return MEMTX_DECODE_ERROR;
+    }
+
+    adjust_endianness(mr, &data, size);
+
+    if (unlikely(mr->avatar_trace)) {
+        avatar_mmio_trace_record(mr, memory_region_to_absolute_addr(mr, addr),
+                                 data, size, true);
+    }
+
+    if ((!kvm_eventfds_enabled()) &&
+        memory_region_dispatch_write_eventfds(mr, addr, data, size, attrs)) {
+        return MEMTX_OK;
+    }
+
+    if (unlikely(stats)) {
+        start = get_clock();
+    }
+    r = memory_region_dispatch_write1(mr, addr, data, size, attrs);
+    if (unlikely(stats)) {
+        avatar_mmio_stats_account(stats, addr, true, get_clock() - start);
+    }
+    return r;
+}
+
 void memory_region_init_io(MemoryRegion *mr,
                            Object *owner,
                            const MemoryRegionOps *ops,
@@ -78,6 +78,12 @@
 #include "sysemu/qtest.h"
 #include "qemu/cutils.h"
 #include "qapi/qmp/dispatch.h"
+#include "avatar/irq.h"
+#include "avatar/shared-lock.h"
+#include "avatar/snapshot.h"
+#include "avatar/coverage.h"
+#include "avatar/poll.h"
+#include "avatar/mmio-stats.h"
 
 #if defined(TARGET_S390X)
 #include "hw/s390x/storage-keys.h"
@@ -1532,6 +1538,20 @@ static void hmp_info_mtree(Monitor *mon, const QDict *qdict)
     mtree_info((fprintf_function)monitor_printf, mon);
 }
 
+static void hmp_info_avatar(Monitor *mon, const QDict *qdict)
+{
+    avatar_irq_info((fprintf_function)monitor_printf, mon);
+    avatar_shared_lock_info((fprintf_function)monitor_printf, mon);
+    avatar_snapshot_info((fprintf_function)monitor_printf, mon);
+    avatar_coverage_info((fprintf_function)monitor_printf, mon);
+    avatar_poll_info((fprintf_function)monitor_printf, mon);
+}
+
+static void hmp_info_mmio_stats(Monitor *mon, const QDict *qdict)
+{
+    avatar_mmio_stats_info((fprintf_function)monitor_printf, mon);
+}
+
 static void hmp_info_numa(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -28,6 +28,7 @@
 #include "internals.h"
 #include "qemu/crc32c.h"
 #include "exec/exec-all.h"
+#include "avatar/hooks.h"
 #include "exec/cpu_ldst.h"
 #include "qemu/int128.h"
 #include "tcg.h"
@@ -557,3 +558,19 @@ uint64_t HELPER(paired_cmpxchg64_be)(CPUARMState *env, uint64_t addr,
 
     return !success;
 }
+
+void HELPER(avatar_hook_a64)(CPUARMState *env, uint64_t pc)
+{
+    CPUState *cs = CPU(arm_env_get_cpu(env));
+    uint64_t new_pc;
+
+    avatar_hook_run(cs, pc);
+
+    new_pc = env->pc;
+    if (new_pc != pc) {
+        /* A hook redirected execution, drop the rest of this TB */
+        cpu_restore_state(cs, GETPC());
+        env->pc = new_pc;
+        cpu_loop_exit(cs);
+    }
+}
@@ -22,6 +22,7 @@
 #include "internals.h"
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
+#include "avatar/hooks.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -395,6 +396,22 @@ static inline int check_wfx_trap(CPUARMState *env, bool is_wfe)
     return 0;
 }
 
+void HELPER(avatar_hook)(CPUARMState *env, uint32_t pc)
+{
+    CPUState *cs = CPU(arm_env_get_cpu(env));
+    uint32_t new_pc;
+
+    avatar_hook_run(cs, pc);
+
+    new_pc = env->regs[15];
+    if (new_pc != pc) {
+        /* A hook redirected execution, drop the rest of this TB */
+        cpu_restore_state(cs, GETPC());
+        env->regs[15] = new_pc;
+        cpu_loop_exit(cs);
+    }
+}
+
 void HELPER(wfi)(CPUARMState *env)
 {
     CPUState *cs = CPU(arm_env_get_cpu(env));
@@ -29,6 +29,8 @@
 
 #include "exec/semihost.h"
 #include "exec/gen-icount.h"
+#include "avatar/gen-coverage.h"
+#include "avatar/hooks.h"
 
 #include "exec/helper-proto.h"
 #include "exec/helper-gen.h"
@@ -272,6 +274,16 @@ static void a64_free_cc(DisasCompare64 *c64)
     tcg_temp_free_i64(c64->value);
 }
 
+/* Call the hooks of the instruction at s->pc, see avatar/hooks.h */
+static void gen_avatar_hook(DisasContext *s)
+{
+    TCGv_i64 pc = tcg_const_i64(s->pc);
+
+    gen_a64_set_pc_im(s->pc);
+    gen_helper_avatar_hook_a64(cpu_env, pc);
+    tcg_temp_free_i64(pc);
+}
+
 static void gen_exception_internal(int excp)
 {
     TCGv_i32 tcg_excp = tcg_const_i32(excp);
@@ -11282,6 +11294,7 @@ void gen_intermediate_code_a64(ARMCPU *cpu, TranslationBlock *tb)
     }
 
     gen_tb_start(tb);
+    gen_avatar_coverage(pc_start);
 
     tcg_clear_temp_count();
 
@@ -11314,6 +11327,10 @@ void gen_intermediate_code_a64(ARMCPU *cpu, TranslationBlock *tb)
             }
         }
 
+        if (unlikely(avatar_hook_count) && avatar_hook_at(dc->pc)) {
+            gen_avatar_hook(dc);
+        }
+
         if (num_insns == max_insns && (tb->cflags & CF_LAST_IO)) {
             gen_io_start();
         }
@@ -71,6 +71,8 @@ static TCGv_i32 cpu_F0s, cpu_F1s;
 static TCGv_i64 cpu_F0d, cpu_F1d;
 
 #include "exec/gen-icount.h"
+#include "avatar/gen-coverage.h"
+#include "avatar/hooks.h"
 
 static const char *regnames[] =
     { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
@@ -11588,6 +11590,17 @@ static bool insn_crosses_page(CPUARMState *env, DisasContext *s)
     return false;
 }
 
+/* Call the hooks of the instruction at s->pc, see avatar/hooks.h */
+static void gen_avatar_hook(DisasContext *s)
+{
+    TCGv_i32 pc = tcg_const_i32(s->pc);
+
+    gen_set_condexec(s);
+    gen_set_pc_im(s, s->pc);
+    gen_helper_avatar_hook(cpu_env, pc);
+    tcg_temp_free_i32(pc);
+}
+
 /* generate intermediate code for basic block 'tb'.  */
 void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
 {
@@ -11683,6 +11696,7 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
     }
 
     gen_tb_start(tb);
+    gen_avatar_coverage(pc_start);
 
     tcg_clear_temp_count();
 
@@ -11776,6 +11790,10 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
             }
         }
 
+        if (unlikely(avatar_hook_count) && avatar_hook_at(dc->pc)) {
+            gen_avatar_hook(dc);
+        }
+
         if (num_insns == max_insns && (tb->cflags & CF_LAST_IO)) {
             gen_io_start();
         }
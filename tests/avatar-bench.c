@@ -0,0 +1,640 @@
+/*
+ * Avatar transport benchmark
+ *
+ * Boots the configurable machine with a tiny generated Cortex-M3 firmware
+ * and plays the avatar peer for it, measuring:
+ *
+ * - the round trip of peer requests served by QEMU (ioRequestMQ and
+ *   ioResponseMQ), one at a time and pipelined;
+ * - the round trip of guest MMIO accesses forwarded to the peer by a
+ *   remote-memory device;
+ * - the delay from injecting an interrupt until the guest's handler has
+ *   run and its effect came back to the peer over IrqMQ.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <mqueue.h>
+#include <sys/wait.h>
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "avatar/ring.h"
+#include "avatar/avatar-io.h"
+#include "avatar/irq.h"
+
+/* Guest memory map, must match the code in write_firmware() */
+#define FW_RAM_SIZE     0x100000
+#define FW_CODE         0x100
+#define UART_BASE       0x40000000
+#define UART_IRQ        7
+#define REMOTE_BASE     0x40001000
+#define REMOTE_COUNT    4       /* reads give the length of an MMIO burst */
+#define REMOTE_DONE     8       /* written when the burst is over */
+
+/* Injected interrupts and what their handlers do */
+#define IRQ_DELIVERY    0       /* pulse the UART interrupt line */
+#define IRQ_MMIO        1       /* read REMOTE_BASE REMOTE_COUNT times */
+
+/* Message queues hold 10 messages, keep both directions from filling up */
+#define MQ_MAX_DEPTH    8
+
+#define BUF_SIZE        (AVATAR_IO_MAX_MSG_SIZE + 64)
+
+typedef struct BenchChannel {
+    const char *name;
+    mqd_t mq;
+    long msg_size;
+    AvatarRing *ring;
+} BenchChannel;
+
+static const char *qemu_binary;
+static bool use_ring;
+static unsigned int n_requests = 10000;
+static unsigned int depth = 8;
+static unsigned int n_bursts = 10;
+static unsigned int burst_len = 1000;
+static unsigned int n_irqs = 1000;
+
+static char *tmp_dir;
+static char *fw_path;
+static char *conf_path;
+static pid_t qemu_pid;
+static unsigned long progress;
+
+static BenchChannel io_request, io_response, irq_forward, irq_inject;
+static BenchChannel mmio_request, mmio_response;
+
+static uint8_t rx_buf[BUF_SIZE] QEMU_ALIGNED(8);
+
+static const char commands_string[] =
+    " -q = QEMU binary (default: $QEMU or arm-softmmu/qemu-system-arm)\n"
+    " -t = transport, mq or ring\n"
+    " -n = number of peer requests\n"
+    " -d = peer requests in flight for the throughput test\n"
+    " -b = number of guest MMIO bursts\n"
+    " -l = guest MMIO accesses per burst\n"
+    " -i = number of injected interrupts";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void cleanup(void)
+{
+    BenchChannel *channels[] = {
+        &io_request, &io_response, &irq_forward, &irq_inject,
+        &mmio_request, &mmio_response,
+    };
+    int i;
+
+    if (qemu_pid > 0) {
+        kill(qemu_pid, SIGTERM);
+        waitpid(qemu_pid, NULL, 0);
+        qemu_pid = 0;
+    }
+    for (i = 0; i < ARRAY_SIZE(channels); i++) {
+        if (!channels[i]->name) {
+            continue;
+        }
+        if (use_ring) {
+            shm_unlink(channels[i]->name);
+        } else {
+            mq_unlink(channels[i]->name);
+        }
+    }
+    if (tmp_dir) {
+        unlink(fw_path);
+        unlink(conf_path);
+        rmdir(tmp_dir);
+    }
+}
+
+static void QEMU_NORETURN die(const char *msg)
+{
+    fprintf(stderr, "avatar-bench: %s\n", msg);
+    cleanup();
+    exit(1);
+}
+
+/*
+ * Give up if QEMU exits or stops answering, rather than hanging in a
+ * blocking receive forever.
+ */
+static void *watchdog_func(void *arg)
+{
+    unsigned long last = 0;
+    int idle = 0;
+
+    for (;;) {
+        unsigned long cur = atomic_read(&progress);
+
+        sleep(1);
+        if (waitpid(qemu_pid, NULL, WNOHANG) == qemu_pid) {
+            qemu_pid = 0;
+            die("QEMU exited");
+        }
+        idle = cur == last ? idle + 1 : 0;
+        if (idle == 10) {
+            die("timed out waiting for QEMU");
+        }
+        last = cur;
+    }
+    return NULL;
+}
+
+/*
+ * Cortex-M3 image: a vector table and a few hand-assembled Thumb
+ * instructions.  Reset enables both injected interrupts and the UART
+ * transmit interrupt, then sleeps in WFI; the handlers are described at
+ * IRQ_DELIVERY and IRQ_MMIO.
+ */
+static const uint16_t fw_code[] = {
+    /* reset: 0x100 */
+    0x480a,     /* ldr   r0, =0xe000e100    NVIC_ISER0 */
+    0x2103,     /* movs  r1, #3 */
+    0x6001,     /* str   r1, [r0] */
+    0x480a,     /* ldr   r0, =UART_BASE */
+    0x2120,     /* movs  r1, #0x20          TX interrupt */
+    0x6381,     /* str   r1, [r0, #0x38]    UARTIMSC */
+    0xb662,     /* cpsie i */
+    0xbf30,     /* 1: wfi */
+    0xe7fd,     /* b     1b */
+    /* default handler: 0x112 */
+    0xe7fe,     /* b     . */
+    /* IRQ_DELIVERY handler: 0x114 */
+    0x4806,     /* ldr   r0, =UART_BASE */
+    0x2120,     /* movs  r1, #0x20 */
+    0x6001,     /* str   r1, [r0]           UARTDR, raises the line */
+    0x6441,     /* str   r1, [r0, #0x44]    UARTICR, lowers it */
+    0x4770,     /* bx    lr */
+    /* IRQ_MMIO handler: 0x11e */
+    0x4805,     /* ldr   r0, =REMOTE_BASE */
+    0x6842,     /* ldr   r2, [r0, #REMOTE_COUNT] */
+    0x6801,     /* 1: ldr r1, [r0] */
+    0x3a01,     /* subs  r2, #1 */
+    0xd1fc,     /* bne   1b */
+    0x6082,     /* str   r2, [r0, #REMOTE_DONE] */
+    0x4770,     /* bx    lr */
+};
+
+#define FW_RESET        (FW_CODE + 0x00)
+#define FW_DEFAULT      (FW_CODE + 0x12)
+#define FW_IRQ_DELIVERY (FW_CODE + 0x14)
+#define FW_IRQ_MMIO     (FW_CODE + 0x1e)
+#define FW_LITERALS     (FW_CODE + 0x2c)
+#define FW_SIZE         (FW_LITERALS + 12)
+
+static void write_firmware(const char *path)
+{
+    uint8_t image[0x54 + FW_SIZE];
+    uint8_t *ehdr = image, *phdr = image + 0x34, *fw = image + 0x54;
+    int i;
+
+    memset(image, 0, sizeof(image));
+
+    /* ELF header with a single PT_LOAD segment at address 0 */
+    memcpy(ehdr, "\x7f" "ELF\x01\x01\x01", 7);
+    stw_le_p(ehdr + 16, 2);                 /* ET_EXEC */
+    stw_le_p(ehdr + 18, 40);                /* EM_ARM */
+    stl_le_p(ehdr + 20, 1);
+    stl_le_p(ehdr + 24, FW_RESET | 1);
+    stl_le_p(ehdr + 28, 0x34);
+    stl_le_p(ehdr + 36, 0x05000000);        /* EABI version 5 */
+    stw_le_p(ehdr + 40, 0x34);
+    stw_le_p(ehdr + 42, 0x20);
+    stw_le_p(ehdr + 44, 1);
+    stw_le_p(ehdr + 46, 0x28);
+
+    stl_le_p(phdr + 0, 1);                  /* PT_LOAD */
+    stl_le_p(phdr + 4, 0x54);
+    stl_le_p(phdr + 16, FW_SIZE);
+    stl_le_p(phdr + 20, FW_SIZE);
+    stl_le_p(phdr + 24, 5);                 /* PF_R | PF_X */
+    stl_le_p(phdr + 28, 4);
+
+    /* Vector table */
+    stl_le_p(fw, FW_RAM_SIZE);
+    stl_le_p(fw + 4, FW_RESET | 1);
+    for (i = 2; i < 16; i++) {
+        stl_le_p(fw + i * 4, FW_DEFAULT | 1);
+    }
+    stl_le_p(fw + (16 + IRQ_DELIVERY) * 4, FW_IRQ_DELIVERY | 1);
+    stl_le_p(fw + (16 + IRQ_MMIO) * 4, FW_IRQ_MMIO | 1);
+
+    for (i = 0; i < ARRAY_SIZE(fw_code); i++) {
+        stw_le_p(fw + FW_CODE + i * 2, fw_code[i]);
+    }
+    stl_le_p(fw + FW_LITERALS, 0xe000e100);
+    stl_le_p(fw + FW_LITERALS + 4, UART_BASE);
+    stl_le_p(fw + FW_LITERALS + 8, REMOTE_BASE);
+
+    if (!g_file_set_contents(path, (char *)image, sizeof(image), NULL)) {
+        die("cannot write the firmware");
+    }
+}
+
+static void write_config(const char *path)
+{
+    const char *transport = use_ring ? "ring" : "mq";
+    char *conf;
+
+    conf = g_strdup_printf(
+        "{\n"
+        "  \"cpu_model\": \"cortex-m3\",\n"
+        "  \"kernel\": \"%s\",\n"
+        "  \"ram_size\": %d,\n"
+        "  \"num_irq\": 32,\n"
+        "  \"avatar_transport\": \"%s\",\n"
+        "  \"io_request_mq\": \"%s\",\n"
+        "  \"io_response_mq\": \"%s\",\n"
+        "  \"irq_mq\": \"%s\",\n"
+        "  \"irq_inject_mq\": \"%s\",\n"
+        "  \"devices\": [\n"
+        "    { \"name\": \"uart\", \"qemu_name\": \"pl011\",\n"
+        "      \"bus\": \"sysbus\", \"address\": %d, \"irq\": %d },\n"
+        "    { \"name\": \"remote\", \"qemu_name\": \"remote-memory\",\n"
+        "      \"bus\": \"sysbus\", \"address\": %d,\n"
+        "      \"properties\": [\n"
+        "        { \"type\": \"string\", \"name\": \"request_mq\",\n"
+        "          \"value\": \"%s\" },\n"
+        "        { \"type\": \"string\", \"name\": \"response_mq\",\n"
+        "          \"value\": \"%s\" },\n"
+        "        { \"type\": \"string\", \"name\": \"transport\",\n"
+        "          \"value\": \"%s\" } ] }\n"
+        "  ]\n"
+        "}\n",
+        fw_path, FW_RAM_SIZE, transport,
+        io_request.name, io_response.name, irq_forward.name, irq_inject.name,
+        UART_BASE, UART_IRQ, REMOTE_BASE,
+        mmio_request.name, mmio_response.name, transport);
+
+    if (!g_file_set_contents(path, conf, -1, NULL)) {
+        die("cannot write the machine configuration");
+    }
+    g_free(conf);
+}
+
+static void start_qemu(void)
+{
+    int fd;
+
+    qemu_pid = fork();
+    if (qemu_pid < 0) {
+        die("cannot fork");
+    }
+    if (qemu_pid == 0) {
+        /* The configurable machine is chatty on stdout */
+        fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDOUT_FILENO);
+        execlp(qemu_binary, qemu_binary, "-machine", "configurable",
+               "-kernel", conf_path, "-nodefaults", "-display", "none",
+               "-monitor", "none", "-serial", "none", NULL);
+        fprintf(stderr, "avatar-bench: cannot run %s: %s\n", qemu_binary,
+                strerror(errno));
+        _exit(1);
+    }
+}
+
+/* QEMU creates every channel, wait for each to show up */
+static void channel_open(BenchChannel *ch, bool write)
+{
+    Error *err = NULL;
+    struct mq_attr attr;
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+        if (use_ring) {
+            ch->ring = avatar_ring_open(ch->name, &err);
+            if (ch->ring) {
+                return;
+            }
+            error_free(err);
+            err = NULL;
+        } else {
+            ch->mq = mq_open(ch->name, write ? O_WRONLY : O_RDONLY);
+            if (ch->mq != (mqd_t)-1) {
+                mq_getattr(ch->mq, &attr);
+                ch->msg_size = attr.mq_msgsize;
+                return;
+            }
+        }
+        if (waitpid(qemu_pid, NULL, WNOHANG) == qemu_pid) {
+            qemu_pid = 0;
+            die("QEMU exited during startup");
+        }
+        g_usleep(10000);
+    }
+    die("QEMU did not create its avatar channels");
+}
+
+static void channel_send(BenchChannel *ch, const void *msg, size_t len)
+{
+    if (use_ring) {
+        avatar_ring_push(ch->ring, msg, len);
+    } else if (mq_send(ch->mq, msg, len, 0) < 0) {
+        die("mq_send failed");
+    }
+}
+
+static size_t channel_receive(BenchChannel *ch)
+{
+    ssize_t ret;
+
+    if (use_ring) {
+        while ((ret = avatar_ring_pop(ch->ring, rx_buf, sizeof(rx_buf))) ==
+               -EAGAIN) {
+            avatar_ring_wait(ch->ring);
+        }
+    } else {
+        assert(ch->msg_size <= sizeof(rx_buf));
+        ret = mq_receive(ch->mq, (char *)rx_buf, sizeof(rx_buf), NULL);
+    }
+    if (ret < 0) {
+        die("receive failed");
+    }
+    atomic_inc(&progress);
+    return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *ns, size_t n, double p)
+{
+    return ns[MIN((size_t)(n * p / 100), n - 1)] / 1e3;
+}
+
+static void pr_latency(const char *what, uint64_t *ns, size_t n)
+{
+    uint64_t total = 0;
+    size_t i;
+
+    if (!n) {
+        return;
+    }
+    qsort(ns, n, sizeof(*ns), cmp_u64);
+    for (i = 0; i < n; i++) {
+        total += ns[i];
+    }
+    printf(" %s (us):\n", what);
+    printf("  mean %.2f p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+           total / 1e3 / n, percentile(ns, n, 50), percentile(ns, n, 90),
+           percentile(ns, n, 99), percentile(ns, n, 99.9), ns[n - 1] / 1e3);
+}
+
+static void send_io_read(uint64_t id)
+{
+    AvatarIORequestMessage req = {
+        .id = id,
+        .hwaddr = FW_CODE,
+        .size = 4,
+    };
+
+    channel_send(&io_request, &req, sizeof(req));
+}
+
+static void receive_io_response(uint64_t id)
+{
+    AvatarIOResponseMessage res;
+
+    if (channel_receive(&io_response) < sizeof(res)) {
+        die("short IO response");
+    }
+    memcpy(&res, rx_buf, sizeof(res));
+    if (res.id != id || !res.success) {
+        die("unexpected IO response");
+    }
+}
+
+/* Peer requests served by QEMU's main loop */
+static void bench_io(void)
+{
+    uint64_t *ns = g_new(uint64_t, n_requests);
+    int64_t start;
+    uint64_t sent, done;
+    unsigned int i;
+
+    for (i = 0; i < n_requests; i++) {
+        start = get_clock();
+        send_io_read(i);
+        receive_io_response(i);
+        ns[i] = get_clock() - start;
+    }
+    pr_latency("peer request round trip", ns, n_requests);
+    g_free(ns);
+
+    start = get_clock();
+    for (sent = done = 0; done < n_requests; done++) {
+        while (sent < n_requests && sent - done < depth) {
+            send_io_read(sent++);
+        }
+        receive_io_response(done);
+    }
+    printf(" peer requests, %u in flight: %.0f requests/s\n", depth,
+           n_requests / ((get_clock() - start) / 1e9));
+}
+
+static void inject_irq(uint32_t irq, int64_t timestamp)
+{
+    AvatarIrqInjectMessage msg = {
+        .irq_num = irq,
+        .mode = AVATAR_IRQ_INJECT_PEND,
+        .timestamp = timestamp,
+    };
+
+    channel_send(&irq_inject, &msg, sizeof(msg));
+}
+
+/* Guest MMIO accesses forwarded by the remote-memory device */
+static void bench_mmio(void)
+{
+    uint64_t *ns = g_new(uint64_t, (uint64_t)n_bursts * burst_len);
+    size_t n = 0;
+    int64_t start, total = 0, replied = 0;
+    unsigned int i;
+
+    for (i = 0; i < n_bursts; i++) {
+        bool done = false;
+
+        inject_irq(IRQ_MMIO, 0);
+        start = get_clock();
+        while (!done) {
+            AvatarIORequestMessage req;
+            AvatarIOResponseMessage res = { .success = true };
+            uint64_t offset;
+
+            if (channel_receive(&mmio_request) < sizeof(req)) {
+                die("short MMIO request");
+            }
+            memcpy(&req, rx_buf, sizeof(req));
+            offset = req.hwaddr - REMOTE_BASE;
+
+            if (offset == 0 && !req.write) {
+                /* Time from our last answer to the next access */
+                ns[n++] = get_clock() - replied;
+            } else if (offset == REMOTE_COUNT && !req.write) {
+                res.value = burst_len;
+            } else if (offset == REMOTE_DONE && req.write) {
+                done = true;
+            }
+
+            if (!(req.flags & AVATAR_IO_POSTED)) {
+                res.id = req.id;
+                replied = get_clock();
+                channel_send(&mmio_response, &res, sizeof(res));
+            }
+        }
+        total += get_clock() - start;
+    }
+    pr_latency("guest MMIO round trip", ns, n);
+    printf(" guest MMIO accesses: %.0f accesses/s\n", n / (total / 1e9));
+    g_free(ns);
+}
+
+/* From injection to the guest handler's effect reaching the peer */
+static void bench_irq(void)
+{
+    uint64_t *ns = g_new(uint64_t, n_irqs);
+    unsigned int i;
+
+    for (i = 0; i < n_irqs; i++) {
+        int64_t start = get_clock();
+        IRQ_MSG msg;
+        int edges = 0;
+
+        inject_irq(IRQ_DELIVERY, start);
+        /* The handler pulses the UART line, wait for both edges */
+        while (edges < 2) {
+            if (channel_receive(&irq_forward) < sizeof(msg)) {
+                die("short IRQ message");
+            }
+            memcpy(&msg, rx_buf, sizeof(msg));
+            if (msg.irq_num != UART_IRQ) {
+                continue;
+            }
+            if (msg.level) {
+                ns[i] = get_clock() - start;
+            }
+            edges++;
+        }
+    }
+    pr_latency("interrupt delivery", ns, n_irqs);
+    g_free(ns);
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" QEMU:              %s\n", qemu_binary);
+    printf(" transport:         %s\n", use_ring ? "ring" : "mq");
+    printf(" peer requests:     %u, %u in flight\n", n_requests, depth);
+    printf(" MMIO bursts:       %u of %u accesses\n", n_bursts, burst_len);
+    printf(" interrupts:        %u\n", n_irqs);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    qemu_binary = getenv("QEMU");
+    if (!qemu_binary) {
+        qemu_binary = "arm-softmmu/qemu-system-arm";
+    }
+
+    for (;;) {
+        c = getopt(argc, argv, "hq:t:n:d:b:l:i:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'q':
+            qemu_binary = optarg;
+            break;
+        case 't':
+            if (!strcmp(optarg, "ring")) {
+                use_ring = true;
+            } else if (strcmp(optarg, "mq")) {
+                usage_complete(argv);
+                exit(1);
+            }
+            break;
+        case 'n':
+            n_requests = MAX(atoi(optarg), 1);
+            break;
+        case 'd':
+            depth = MAX(atoi(optarg), 1);
+            break;
+        case 'b':
+            n_bursts = MAX(atoi(optarg), 1);
+            break;
+        case 'l':
+            burst_len = MAX(atoi(optarg), 1);
+            break;
+        case 'i':
+            n_irqs = MAX(atoi(optarg), 1);
+            break;
+        }
+    }
+    if (!use_ring) {
+        depth = MIN(depth, MQ_MAX_DEPTH);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QemuThread watchdog;
+    char dir_template[] = "/tmp/avatar-bench-XXXXXX";
+    pid_t pid = getpid();
+
+    parse_args(argc, argv);
+
+    tmp_dir = mkdtemp(dir_template);
+    if (!tmp_dir) {
+        die("cannot create a temporary directory");
+    }
+    fw_path = g_strdup_printf("%s/firmware.elf", tmp_dir);
+    conf_path = g_strdup_printf("%s/conf.json", tmp_dir);
+
+    /* Unique names, so that we never attach to a stale channel */
+    io_request.name = g_strdup_printf("/avatar-bench-%d-io-req", pid);
+    io_response.name = g_strdup_printf("/avatar-bench-%d-io-res", pid);
+    irq_forward.name = g_strdup_printf("/avatar-bench-%d-irq", pid);
+    irq_inject.name = g_strdup_printf("/avatar-bench-%d-irq-inject", pid);
+    mmio_request.name = g_strdup_printf("/avatar-bench-%d-mmio-req", pid);
+    mmio_response.name = g_strdup_printf("/avatar-bench-%d-mmio-res", pid);
+
+    write_firmware(fw_path);
+    write_config(conf_path);
+    pr_params();
+
+    start_qemu();
+    channel_open(&io_request, true);
+    channel_open(&io_response, false);
+    channel_open(&irq_forward, false);
+    channel_open(&irq_inject, true);
+    channel_open(&mmio_request, false);
+    channel_open(&mmio_response, true);
+    qemu_thread_create(&watchdog, "watchdog", watchdog_func, NULL,
+                       QEMU_THREAD_DETACHED);
+
+    printf("Results:\n");
+    bench_io();
+    bench_mmio();
+    bench_irq();
+
+    cleanup();
+    return 0;
+}
@@ -308,20 +308,15 @@ static int encode_search(TranslationBlock *tb, uint8_t *block)
     return p - block;
 }
 
-/* The cpu state corresponding to 'searched_pc' is restored.
- * Called with tb_lock held.
- */
-static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
-                                     uintptr_t searched_pc)
+/* Reconstruct the insn_start data of the guest instruction whose host code
+   contains @searched_pc.  @data must be seeded with the TB's pc.  Returns
+   the index of the instruction within @tb, or -1 if not found.  */
+static int cpu_search_insn_data(TranslationBlock *tb, uintptr_t searched_pc,
+                                target_ulong *data)
 {
-    target_ulong data[TARGET_INSN_START_WORDS] = { tb->pc };
     uintptr_t host_pc = (uintptr_t)tb->tc_ptr;
-    CPUArchState *env = cpu->env_ptr;
     uint8_t *p = tb->tc_search;
     int i, j, num_insns = tb->icount;
-#ifdef CONFIG_PROFILER
-    int64_t ti = profile_getclock();
-#endif
 
     searched_pc -= GETPC_ADJ;
 
@@ -337,12 +332,30 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
         }
         host_pc += decode_sleb128(&p);
         if (host_pc > searched_pc) {
-            goto found;
+            return i;
         }
     }
     return -1;
+}
+
+/* The cpu state corresponding to 'searched_pc' is restored.
+ * Called with tb_lock held.
+ */
+static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
+                                     uintptr_t searched_pc)
+{
+    target_ulong data[TARGET_INSN_START_WORDS] = { tb->pc };
+    CPUArchState *env = cpu->env_ptr;
+    int i, num_insns = tb->icount;
+#ifdef CONFIG_PROFILER
+    int64_t ti = profile_getclock();
+#endif
+
+    i = cpu_search_insn_data(tb, searched_pc, data);
+    if (i < 0) {
+        return -1;
+    }
 
- found:
     if (tb->cflags & CF_USE_ICOUNT) {
         assert(use_icount);
         /* Reset the cycle counter to the start of the block.  */
@@ -381,6 +394,121 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
     return r;
 }
 
+bool cpu_get_insn_pc(uintptr_t retaddr, target_ulong *pc)
+{
+    TranslationBlock *tb;
+    bool r = false;
+
+    tb_lock();
+    tb = tb_find_pc(retaddr);
+    if (tb) {
+        target_ulong data[TARGET_INSN_START_WORDS] = { tb->pc };
+
+        if (cpu_search_insn_data(tb, retaddr, data) >= 0) {
+            /* The first insn_start word is the pc on every target */
+            *pc = data[0];
+            r = true;
+        }
+    }
+    tb_unlock();
+
+    return r;
+}
+
+/* The TB that jump @n of @tb is chained to, or NULL if it is not chained */
+static TranslationBlock *tb_jmp_dest(TranslationBlock *tb, int n)
+{
+    uintptr_t ptr = tb->jmp_list_next[n];
+    TranslationBlock *tb1;
+
+    /* The list of TBs jumping to the destination ends at the destination */
+    while (ptr) {
+        tb1 = (TranslationBlock *)(ptr & ~3);
+        n = ptr & 3;
+        if (n == 2) {
+            return tb1;
+        }
+        ptr = tb1->jmp_list_next[n];
+    }
+    return NULL;
+}
+
+/*
+ * Walk the chained jumps from @tb, looking for paths back to @start that
+ * execute exactly @icount more guest instructions.  Returns the number of
+ * such paths, or -1 if one of them goes through a TB with side effects.
+ */
+static int tb_loop_paths(TranslationBlock *start, TranslationBlock *tb,
+                         int64_t icount, int depth)
+{
+    TranslationBlock *next;
+    int n, r, paths = 0;
+
+    for (n = 0; n < 2; n++) {
+        if (tb->jmp_reset_offset[n] == TB_JMP_RESET_OFFSET_INVALID) {
+            continue;
+        }
+        next = tb_jmp_dest(tb, n);
+        if (!next || next->icount > icount) {
+            continue;
+        }
+        if (next == start) {
+            paths += next->icount == icount;
+            continue;
+        }
+        if (!depth) {
+            continue;
+        }
+        r = tb_loop_paths(start, next, icount - next->icount, depth - 1);
+        if (r < 0 || (r && !next->side_effect_free)) {
+            return -1;
+        }
+        paths += r;
+    }
+    return paths;
+}
+
+/*
+ * Return true if the loop through the TB containing host address @retaddr
+ * can only affect the world through the guest loads it performs.  The
+ * loop is any path of chained TBs that leads back to that TB after
+ * exactly @icount guest instructions.  There must be at least one, and
+ * none of the TBs on them may store to guest memory or call helpers.
+ */
+bool tb_loop_is_side_effect_free(uintptr_t retaddr, int64_t icount)
+{
+    TranslationBlock *tb;
+    bool r = false;
+
+    tb_lock();
+    tb = tb_find_pc(retaddr);
+    if (tb && tb->side_effect_free) {
+        r = tb_loop_paths(tb, tb, icount, TB_LOOP_MAX_DEPTH) > 0;
+    }
+    tb_unlock();
+
+    return r;
+}
+
+static bool tcg_ops_side_effect_free(TCGContext *s)
+{
+    TCGOp *op;
+    int oi;
+
+    for (oi = s->gen_op_buf[0].next; oi != 0; oi = op->next) {
+        op = &s->gen_op_buf[oi];
+        switch (op->opc) {
+        case INDEX_op_qemu_st_i32:
+        case INDEX_op_qemu_st_i64:
+        case INDEX_op_call:
+            return false;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
 void page_size_init(void)
 {
     /* NOTE: we can always suppose that qemu_host_page_size >=
@@ -1310,6 +1438,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tcg_ctx.cpu = ENV_GET_CPU(env);
     gen_intermediate_code(env, tb);
     tcg_ctx.cpu = NULL;
+    tb->side_effect_free = tcg_ops_side_effect_free(&tcg_ctx);
 
     trace_translate_block(tb, tb->pc, tb->tc_ptr);
 
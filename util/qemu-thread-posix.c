@@ -581,7 +581,8 @@ void qemu_avatar_mq_open_read(QemuAvatarMessageQueue *mq, const char *name, size
     attr.mq_maxmsg = 10;
     attr.mq_curmsgs = 0;
 
-    mqd_t m = mq_open(name, O_CREAT | O_RDONLY, 0666, &attr);
+    /* The read side is driven from the main loop and must never block */
+    mqd_t m = mq_open(name, O_CREAT | O_RDONLY | O_NONBLOCK, 0666, &attr);
 
     if(m == -1)
     {
@@ -635,13 +636,12 @@ int qemu_avatar_mq_receive(QemuAvatarMessageQueue *mq, void *buffer, size_t len)
 #else
     int rc = mq_receive(mq->mq, buffer, len, NULL);
 
-    if(errno != EAGAIN)
-    {
-        return -1;
-    }
-
-    if (rc < 0 && errno != EAGAIN)
+    if (rc < 0)
     {
+        if (errno == EAGAIN)
+        {
+            return -1;
+        }
         error_exit(errno, __func__);
     }
 